@@ -0,0 +1,191 @@
+#ifndef BW_H
+#define BW_H
+
+#include "gfp.h"
+#include "lat_stats.h"
+#include "sq_batch.h"
+
+/*
+ * Bandwidth mode for client/server (-b).
+ *
+ * For each message size from BW_MIN_SIZE to max_size (x2 steps) the client
+ * streams `iters` RDMA writes into the server's advertised rkey, keeping
+ * `depth` of them outstanding. WRs go through the send queue batcher: one
+ * doorbell per `-B` WRs, and only every `-e`-th WR is signaled.
+ * The last write of each size carries an immediate so the server sees one
+ * receive CQE per size; the immediate encodes log2(size) and the message
+ * count so the server can compute its own rates.
+ *
+ * The server advertises either its MW rkey (default) or its MR rkey (-k mr),
+ * which quantifies the responder's window-translation cost when the two
+ * runs are compared.
+ */
+
+#define BW_OPTSTRING "bq:S:n:k:B:e:"
+#define BW_OPTUSAGE "[-b] [-q depth] [-S max_size] [-n iters_per_size] [-k mw|mr] " \
+                    "[-B wrs_per_doorbell] [-e signal_every]"
+#define BW_MIN_SIZE 64
+#define BW_BATCH 16
+#define BW_SIGNAL_EVERY 16
+#define BW_IMM(shift, iters) htonl(((uint32_t)(shift) << 24) | ((iters) & 0xffffff))
+#define BW_IMM_SHIFT(imm) (ntohl(imm) >> 24)
+#define BW_IMM_ITERS(imm) (ntohl(imm) & 0xffffff)
+
+struct bw_opts {
+    int enabled;
+    int depth;
+    size_t max_size;
+    int iters;
+    int use_mr_rkey;
+    int batch;
+    int signal_every;
+};
+
+void bw_opts_init(struct bw_opts *o) {
+    memset(o, 0, sizeof(*o));
+    o->depth = 64;
+    o->max_size = 8 << 20;
+    o->iters = 1000;
+    o->batch = BW_BATCH;
+    o->signal_every = BW_SIGNAL_EVERY;
+}
+
+int parse_bw_opt(struct bw_opts *o, int opt, const char *arg) {
+    switch (opt) {
+    case 'b':
+        o->enabled = 1;
+        return 0;
+    case 'q':
+        o->depth = atoi(arg);
+        return o->depth < 1 || o->depth > MAX_SEND_WR ? -1 : 0;
+    case 'S':
+        o->max_size = strtoull(arg, NULL, 0);
+        return o->max_size < BW_MIN_SIZE ? -1 : 0;
+    case 'n':
+        o->iters = atoi(arg);
+        return o->iters < 1 || o->iters > 0xffffff ? -1 : 0;
+    case 'k':
+        if (!strcmp(arg, "mr"))
+            o->use_mr_rkey = 1;
+        else if (strcmp(arg, "mw"))
+            return -1;
+        return 0;
+    case 'B':
+        o->batch = atoi(arg);
+        return o->batch < 1 || o->batch > SQ_BATCH_MAX ? -1 : 0;
+    case 'e':
+        o->signal_every = atoi(arg);
+        return o->signal_every < 1 ? -1 : 0;
+    }
+    return -1;
+}
+
+// Size of the data buffer each side has to register
+static inline size_t bw_buf_size(const struct bw_opts *o) {
+    return o->enabled && o->max_size > PKTSZ ? o->max_size : PKTSZ;
+}
+
+// Number of receive CQEs (one per message size) the server should expect
+static inline int bw_nsizes(const struct bw_opts *o) {
+    int n = 0;
+    for (size_t size = BW_MIN_SIZE; size <= o->max_size; size *= 2)
+        n++;
+    return n;
+}
+
+static int bw_post_size(struct sq_batch *b, struct ibv_sge *sg, const struct ib_info *server_info,
+                        int shift, int iters) {
+    struct ibv_send_wr wr;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.sg_list = sg;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.wr.rdma.remote_addr = server_info->buf_va;
+    wr.wr.rdma.rkey = server_info->buf_rkey;
+    for (int sent = 0; sent < iters; sent++) {
+        if (sent == iters - 1) {
+            wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+            wr.imm_data = BW_IMM(shift, iters);
+        }
+        if (sq_batch_add(b, &wr))
+            return -1;
+    }
+    // The flush signals the last write of a size, so this drains completely
+    return sq_batch_drain(b);
+}
+
+int run_bw_client(struct ib_res *ib_res, struct ibv_mr *mr, char *buffer,
+                  const struct ib_info *server_info, const struct bw_opts *o) {
+    struct sq_batch b;
+    struct ibv_sge sg;
+    // Never let a full window go by without a signaled WR
+    int signal_every = o->signal_every < o->depth ? o->signal_every : o->depth;
+    int shift = 0;
+
+    while ((1UL << shift) < BW_MIN_SIZE)
+        shift++;
+    if (sq_batch_init(&b, ib_res, ib_res->qp, WRID_CLASS_SEND, o->batch, signal_every,
+                      o->depth))
+        return -1;
+    printf("%10s %10s %10s %14s %8s\n", "size", "iters", "Gb/s", "msgs/s", "cpu");
+    for (size_t size = BW_MIN_SIZE; size <= o->max_size; size *= 2, shift++) {
+        long long start_time, cpu_start, elapsed, cpu;
+
+        sg.addr = (uintptr_t)buffer;
+        sg.length = size;
+        sg.lkey = mr->lkey;
+        start_time = gfp_get_time();
+        cpu_start = cpu_time_ns();
+        if (bw_post_size(&b, &sg, server_info, shift, o->iters)) {
+            fprintf(stderr, "bandwidth run failed at size %zu\n", size);
+            sq_batch_release(&b);
+            return -1;
+        }
+        elapsed = gfp_get_time() - start_time;
+        cpu = cpu_time_ns() - cpu_start;
+        printf("%10zu %10d %10.2f %14.0f %7.1f%%\n", size, o->iters,
+               (double)size * o->iters * 8 / elapsed, o->iters * 1e9 / elapsed,
+               100.0 * cpu / elapsed);
+    }
+    sq_batch_print_stats(stdout, &b);
+    sq_batch_release(&b);
+    return 0;
+}
+
+/*
+ * Responder side: one receive CQE per size marks the end of that size.
+ * The rate is measured between consecutive markers, so the first size
+ * also includes the client's start-up.
+ */
+int run_bw_server(struct ib_res *ib_res, const struct bw_opts *o) {
+    long long prev_time = gfp_get_time();
+    long long cpu_start = cpu_time_ns(), start_time = prev_time;
+    int nsizes = bw_nsizes(o);
+
+    printf("server advertises %s rkey\n", o->use_mr_rkey ? "MR" : "MW");
+    printf("%10s %10s %10s %14s\n", "size", "iters", "Gb/s", "msgs/s");
+    for (int i = 0; i < nsizes; i++) {
+        const struct ibv_wc *wc = &ib_res->cq_eng.last[WRID_CLASS_RECV];
+        long long now, elapsed;
+        size_t size;
+        int iters;
+
+        if (cq_engine_wait(&ib_res->cq_eng, WRID_CLASS_RECV, 1)) {
+            fprintf(stderr, "bandwidth receive failed\n");
+            return -1;
+        }
+        now = gfp_get_time();
+        elapsed = now - prev_time;
+        prev_time = now;
+        size = 1UL << BW_IMM_SHIFT(wc->imm_data);
+        iters = BW_IMM_ITERS(wc->imm_data);
+        printf("%10zu %10d %10.2f %14.0f\n", size, iters,
+               (double)size * iters * 8 / elapsed, iters * 1e9 / elapsed);
+    }
+    printf("server cpu utilization %.1f%%\n",
+           100.0 * (cpu_time_ns() - cpu_start) / (gfp_get_time() - start_time));
+    return 0;
+}
+
+#endif /* BW_H */
@@ -1,98 +1,141 @@
 #include "gfp.h"
+#include "bw.h"
+#include "pingpong.h"
+#include "frag.h"
 
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <server_ip>\n", argv[0]);
-        return -1;
-    }
-
-    char *server_ip = argv[1];
+    char *server_ip;
     struct ib_res ib_res;
     struct ib_info server_info;
-    struct ibv_qp_attr qp_attr;
+    struct wire_region region;
     struct ibv_mr *mr = NULL;
     struct ibv_sge sg;
     struct ibv_send_wr wr, *bad_wr;
-    struct ibv_wc wc;
     char *buffer = NULL;
-    int pagesize = getpagesize();
-    int ret;
+    struct bw_opts bw;
+    struct pp_opts pp;
+    struct frag_opts frag;
+    struct ibv_mw *mw = NULL;
+    size_t buf_size;
+    struct setup_times setup;
+    int fd = -1;
+    int ret, opt;
 
     memset(&server_info, 0, sizeof(struct ib_info));
+    memset(&setup, 0, sizeof(setup));
     memset(&ib_res, 0, sizeof(struct ib_res));
-
-    buffer = (char *)memalign(pagesize, PKTSZ);
-    if (!buffer) {
-        perror("memalign");
-        goto cleanup;
+    bw_opts_init(&bw);
+    pp_opts_init(&pp);
+    frag_opts_init(&frag);
+
+    while ((opt = getopt(argc, argv, IB_OPTSTRING BW_OPTSTRING PP_OPTSTRING FRAG_OPTSTRING)) != -1) {
+        if (parse_ib_opt(&ib_res, opt, optarg) && parse_bw_opt(&bw, opt, optarg) &&
+            parse_pp_opt(&pp, opt, optarg) && parse_frag_opt(&frag, opt, optarg))
+            goto usage;
     }
-    memset(buffer, 0, PKTSZ);
-    usleep(2);
-    memcpy(buffer, "Hello, this is UC infiniband with IBV_WR_RDMA_WRITE_WITH_IMM!", 100);
-    //goto cleanup;
+    if (optind != argc - 1)
+        goto usage;
+    server_ip = argv[optind];
+    buf_size = bw_buf_size(&bw);
+    if (pp_buf_size(&pp) > buf_size)
+        buf_size = pp_buf_size(&pp);
+    if (frag.obj_size > buf_size)
+        buf_size = frag.obj_size;
+
+    // The TCP handshake runs while the verbs resources are set up
+    setup.start = gfp_get_time();
+    fd = hs_connect(server_ip, PORT);
+    if (fd < 0)
+        goto cleanup;
 
+    // The RoCE v2 GID is the one carrying our route to the server
+    ib_res.peer_addr = server_ip;
     ret = prepare_ib_res(&ib_res);
     if (ret) {
         perror("prepare_ib_res failed");
         goto cleanup;
     }
-    mr = ibv_reg_mr(ib_res.pd, buffer, PKTSZ, IBV_ACCESS_LOCAL_WRITE);
+    buffer = topo_alloc(buf_size, ib_res.numa_node);
+    if (!buffer)
+        goto cleanup;
+    memset(buffer, 0, buf_size);
+    memcpy(buffer, "Hello, this is UC infiniband with IBV_WR_RDMA_WRITE_WITH_IMM!", 100);
+    // Ping-pong also receives into this buffer through a window
+    mr = ibv_reg_mr(ib_res.pd, buffer, buf_size, pp.enabled ?
+                    IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_MW_BIND :
+                    IBV_ACCESS_LOCAL_WRITE);
     if (!mr) {
         perror("ibv_reg_mr");
         goto cleanup;
     }
-    // Server and client exchange info
-    ret = exchange_info_client(&ib_res.local_info, server_ip, &server_info, 28515);
-    if (ret) {
-        perror("client exchange info failed\n");
-        goto cleanup;
-    }
-
-    // Modify QP to RTR
-    memset(&qp_attr, 0, sizeof(qp_attr));
-    qp_attr.qp_state = IBV_QPS_RTR;
-    qp_attr.path_mtu = IBV_MTU_4096;
-    /* require peer info: qpn, psn, lid */
-    qp_attr.dest_qp_num	= server_info.qpn;
-    qp_attr.rq_psn = server_info.psn;
-    qp_attr.ah_attr.dlid = server_info.lid;
-    qp_attr.ah_attr.sl = 0;
-    qp_attr.ah_attr.src_path_bits = 0;
-    qp_attr.ah_attr.port_num = 1;
-
-    if (ib_res.gidx > 0) {
-        qp_attr.ah_attr.is_global = 1;
-        qp_attr.ah_attr.grh.hop_limit = 1;
-        qp_attr.ah_attr.grh.dgid = server_info.gid;
-        qp_attr.ah_attr.grh.sgid_index = ib_res.gidx;
-    }
-
-    ret = ibv_modify_qp(ib_res.qp, &qp_attr, IBV_QP_STATE |
-			                                 IBV_QP_AV    |
-			                                 IBV_QP_PATH_MTU |
-			                                 IBV_QP_DEST_QPN |
-			                                 IBV_QP_RQ_PSN);
+    if (pp.enabled) {
+        ret = pp_client_prepare(&ib_res, buffer, &mw, &pp);
+        if (ret) {
+            fprintf(stderr, "ping-pong setup failed\n");
+            goto cleanup;
+        }
+    }
+    setup.res = gfp_get_time();
+
+    ret = hs_connect_finish(fd);
+    if (ret)
+        goto cleanup;
+    setup.tcp = gfp_get_time();
+    // QP info and window descriptors in one round trip
+    if (pp.enabled) {
+        region.addr = (uintptr_t)buffer;
+        region.length = buf_size;
+        region.rkey = ib_res.local_info.buf_rkey;
+        region.access = IBV_ACCESS_REMOTE_WRITE;
+    }
+    ret = hs_exchange(fd, 0, &ib_res.local_info, &region, pp.enabled, &server_info, NULL);
     if (ret) {
-        perror("ibv_modify_qp to RTR\n");
+        fprintf(stderr, "client exchange info failed\n");
         goto cleanup;
     }
+    setup.info = gfp_get_time();
 
-    // Modify QP to RTS
-    memset(&qp_attr, 0, sizeof(qp_attr));
-    qp_attr.qp_state = IBV_QPS_RTS;
-    qp_attr.sq_psn = ib_res.local_info.psn;
-    ret = ibv_modify_qp(ib_res.qp, &qp_attr, IBV_QP_STATE | IBV_QP_SQ_PSN);
+    // Modify QP to RTR and then RTS
+    ret = connect_qp(&ib_res, &server_info);
     if (ret) {
-        perror("ibv_modify_qp to RTS");
+        perror("connect_qp failed");
         goto cleanup;
     }
+    if (pp.enabled) {
+        ret = pp_client_bind(&ib_res, mr, buffer, buf_size, mw);
+        if (ret)
+            goto cleanup;
+    }
+    setup.rts = gfp_get_time();
 
-    sleep(2);
-    // Server and client exchange info FOR MW rkey and buffer addr
-    ret = exchange_info_client(&ib_res.local_info, server_ip, &server_info, 28517);
-    if (ret) {
-        perror("client exchange info failed\n");
+    // The server's receives and window are in place once it says so
+    ret = hs_ready(fd);
+    if (ret)
+        goto cleanup;
+    setup.ready = gfp_get_time();
+    setup_times_print("client", &setup);
+
+    if (bw.enabled) {
+        ret = run_bw_client(&ib_res, mr, buffer, &server_info, &bw);
+        goto cleanup;
+    }
+    if (pp.enabled) {
+        ret = run_pp_client(&ib_res, mr, buffer, &server_info, &pp);
+        goto cleanup;
+    }
+    if (frag.obj_size) {
+        long long start_time, elapsed;
+
+        for (size_t i = 0; i < frag.obj_size; i++)
+            buffer[i] = (char)i;
+        start_time = gfp_get_time();
+        ret = frag_send(&ib_res, mr, buffer, frag.obj_size, server_info.buf_va,
+                        server_info.buf_rkey, 1, frag.chunk_size);
+        elapsed = gfp_get_time() - start_time;
+        if (ret == 0)
+            printf("sent %zu bytes in %u chunks: %.2f Gb/s\n", frag.obj_size,
+                   frag_nchunks(frag.obj_size, frag.chunk_size), frag.obj_size * 8.0 / elapsed);
         goto cleanup;
     }
 
@@ -103,7 +146,7 @@ int main(int argc, char *argv[]) {
     sg.length = 1024;
     sg.lkey = mr->lkey;
 
-    wr.wr_id = 20;
+    wr.wr_id = WRID(WRID_CLASS_SEND, 0);
     wr.sg_list = &sg;
     wr.num_sge = 1;
     wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
@@ -117,25 +160,48 @@ int main(int argc, char *argv[]) {
     //wr.wr.ud.remote_qpn = server_info.qpn;
     //wr.wr.ud.remote_qkey = server_info.qkey;
 
-    ret = ibv_post_send(ib_res.qp, &wr, &bad_wr);
+    ret = ib_post_send(&ib_res, ib_res.qp, &wr, &bad_wr);
     if (ret) {
         perror("ibv_post_send");
         goto cleanup;
     }
 
     // Poll for completion
-    ret = poll_cq(ib_res.cq, &wc);
+    ret = cq_engine_wait(&ib_res.cq_eng, WRID_CLASS_SEND, 1);
     if (ret < 0) {
-        perror("poll cq failed");
+        fprintf(stderr, "poll cq failed\n");
         goto cleanup;
     }
+    printf("time to first write: %.1f us\n", (gfp_get_time() - setup.start) / 1e3);
+
+    if (ib_res.qp_type == IBV_QPT_RC) {
+        // Finish the transfer by revoking the server's window in its HCA
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = WRID(WRID_CLASS_SEND, 1);
+        wr.sg_list = NULL;
+        wr.num_sge = 0;
+        wr.opcode = IBV_WR_SEND_WITH_INV;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        wr.invalidate_rkey = server_info.buf_rkey;
+        ret = ib_post_send(&ib_res, ib_res.qp, &wr, &bad_wr);
+        if (ret) {
+            perror("ibv_post_send");
+            goto cleanup;
+        }
+        ret = cq_engine_wait(&ib_res.cq_eng, WRID_CLASS_SEND, 1);
+        if (ret < 0) {
+            fprintf(stderr, "poll cq failed\n");
+            goto cleanup;
+        }
+    }
 
     // wait for server to invalidate the rkey
-    sleep(2);
+    ret = hs_wait(fd, HS_REVOKED);
+    if (ret)
+        goto cleanup;
 
     // RDMA write with imm. after rkey invalidation
     memset(buffer, 0, PKTSZ);
-    usleep(2);
     memcpy(buffer, "This is message after MW rkey invalidation", 64);
     memset(&sg, 0, sizeof(sg));
     memset(&wr, 0, sizeof(wr));
@@ -144,7 +210,7 @@ int main(int argc, char *argv[]) {
     sg.length = 1024;
     sg.lkey = mr->lkey;
 
-    wr.wr_id = 20;
+    wr.wr_id = WRID(WRID_CLASS_SEND, 0);
     wr.sg_list = &sg;
     wr.num_sge = 1;
     wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
@@ -153,29 +219,34 @@ int main(int argc, char *argv[]) {
     wr.wr.rdma.remote_addr = server_info.buf_va;
     wr.wr.rdma.rkey = server_info.buf_rkey;
 
-    ret = ibv_post_send(ib_res.qp, &wr, &bad_wr);
+    ret = ib_post_send(&ib_res, ib_res.qp, &wr, &bad_wr);
     if (ret) {
         perror("ibv_post_send");
         goto cleanup;
     }
 
     // Poll for completion
-    ret = poll_cq(ib_res.cq, &wc);
+    ret = cq_engine_wait(&ib_res.cq_eng, WRID_CLASS_SEND, 1);
     if (ret < 0) {
-        perror("poll cq failed");
+        fprintf(stderr, "poll cq failed\n");
         goto cleanup;
     }
 
     // Clean up
 cleanup:
-    if (buffer) free(buffer);
+    if (ib_res.cq_eng.ts)
+        cq_ts_report(stdout, &ib_res.ts);
+    if (mw) ibv_dealloc_mw(mw);
     if (mr) ibv_dereg_mr(mr);
+    topo_free(buffer, buf_size);
     //if (ah) ibv_destroy_ah(ah);
-    if (ib_res.qp) ibv_destroy_qp(ib_res.qp);
-    if (ib_res.cq) ibv_destroy_cq(ib_res.cq);
-    if (ib_res.pd) ibv_dealloc_pd(ib_res.pd);
-    if (ib_res.context) ibv_close_device(ib_res.context);
-    if (ib_res.dev_list) ibv_free_device_list(ib_res.dev_list);
+    if (fd >= 0) close(fd);
+    free_ib_res(&ib_res);
 
     return 0;
+
+usage:
+    fprintf(stderr, "Usage: %s %s %s %s %s <server_ip>\n", argv[0], IB_OPTUSAGE, BW_OPTUSAGE,
+            PP_OPTUSAGE, FRAG_OPTUSAGE);
+    return -1;
 }
\ No newline at end of file
@@ -0,0 +1,208 @@
+#include <pthread.h>
+#include "gfp.h"
+#include "lat_stats.h"
+#include "ctrl.h"
+
+/*
+ * Control-plane connection-rate benchmark.
+ *
+ * Opens `conns` peers against the multi-peer control plane, `parallel`
+ * handshakes at a time: all sockets of a wave connect and send their
+ * ib_info first, then every reply is collected, the QP connected and one
+ * write-with-imm sent into the peer's window. Reported are connections/sec
+ * and time to first write (connect() start to the write's send CQE; on UC
+ * that is local completion only).
+ *
+ * Without a server address an in-process server thread with its own
+ * device context serves 127.0.0.1, so one host and one RDMA device are
+ * enough. Given an address, the target must run `server -M <conns>`.
+ */
+
+#define BENCH_MSG_SZ 8
+
+struct conn {
+    int fd;
+    struct ibv_qp *qp;
+    long long t_start;
+};
+
+struct first_write {
+    struct conn *conns;
+    struct lat_stats *st;
+};
+
+static void first_write_cqe(void *arg, const struct ibv_wc *wc) {
+    struct first_write *fw = arg;
+
+    lat_stats_add(fw->st, gfp_get_time() - fw->conns[WRID_IDX(wc->wr_id)].t_start);
+}
+
+static void *server_thread(void *arg) {
+    struct ctrl_server *srv = arg;
+    static int ret;
+
+    ret = ctrl_server_run(srv, srv->max_peers);
+    return &ret;
+}
+
+static int run_wave(struct ib_res *ib_res, struct conn *conns, int first, int n,
+                    const char *server_ip, struct ibv_mr *mr) {
+    for (int i = first; i < first + n; i++) {
+        struct ib_info local = ib_res->local_info;
+
+        conns[i].t_start = gfp_get_time();
+        conns[i].qp = create_qp(ib_res);
+        if (!conns[i].qp)
+            return -1;
+        local.qpn = conns[i].qp->qp_num;
+        conns[i].fd = ctrl_client_start(server_ip, PORT, &local);
+        if (conns[i].fd < 0)
+            return -1;
+    }
+    for (int i = first; i < first + n; i++) {
+        struct ib_info remote;
+
+        if (ctrl_client_finish(conns[i].fd, &remote))
+            return -1;
+        if (connect_peer_qp(ib_res, conns[i].qp, 0, &remote))
+            return -1;
+        // Inline when it fits, so the first write never waits on a DMA read
+        if (post_write_imm(ib_res, conns[i].qp, mr, mr->addr, BENCH_MSG_SZ, remote.buf_va,
+                           remote.buf_rkey, i, WRID(WRID_CLASS_SEND, i), 1))
+            return -1;
+    }
+    return cq_engine_wait(&ib_res->cq_eng, WRID_CLASS_SEND, n);
+}
+
+int main(int argc, char *argv[]) {
+    struct ib_res cfg, ib_res, srv_res;
+    struct ctrl_server srv;
+    struct conn *conns = NULL;
+    struct ibv_mr *mr = NULL;
+    struct lat_stats ttfw;
+    struct lat_summary sum;
+    struct first_write fw;
+    pthread_t tid;
+    const char *server_ip = "127.0.0.1";
+    char *buffer = NULL;
+    int local_server = 1, thread_started = 0;
+    int total = 256, parallel = 32;
+    long long start_time, elapsed;
+    int opt, ret = -1;
+
+    memset(&cfg, 0, sizeof(cfg));
+    memset(&srv, 0, sizeof(srv));
+    srv.listen_fd = srv.epfd = -1;
+    memset(&ttfw, 0, sizeof(ttfw));
+    while ((opt = getopt(argc, argv, "n:P:" IB_OPTSTRING)) != -1) {
+        switch (opt) {
+        case 'n':
+            total = atoi(optarg);
+            break;
+        case 'P':
+            parallel = atoi(optarg);
+            break;
+        default:
+            if (parse_ib_opt(&cfg, opt, optarg) == 0)
+                break;
+            fprintf(stderr, "Usage: %s [-n conns] [-P parallel] %s [server_ip]\n",
+                    argv[0], IB_OPTUSAGE);
+            return -1;
+        }
+    }
+    if (optind < argc) {
+        server_ip = argv[optind];
+        local_server = 0;
+    }
+    // One signaled write per connection of a wave has to fit the send CQ
+    if (total < 1 || parallel < 1 || parallel > MAX_SEND_WR) {
+        fprintf(stderr, "need conns >= 1 and parallel in [1, %d]\n", MAX_SEND_WR);
+        return -1;
+    }
+
+    memcpy(&ib_res, &cfg, sizeof(ib_res));
+    ib_res.srq_depth = 0;
+    memcpy(&srv_res, &cfg, sizeof(srv_res));
+    if (!srv_res.srq_depth)
+        srv_res.srq_depth = SRQ_DEPTH_DEFAULT;
+
+    conns = calloc(total, sizeof(*conns));
+    buffer = memalign(getpagesize(), PKTSZ);
+    if (!conns || !buffer) {
+        perror("malloc");
+        goto cleanup;
+    }
+    memset(buffer, 0, PKTSZ);
+    for (int i = 0; i < total; i++)
+        conns[i].fd = -1;
+    if (lat_stats_init(&ttfw, total))
+        goto cleanup;
+
+    if (local_server) {
+        if (prepare_ib_res(&srv_res))
+            goto cleanup;
+        if (ctrl_server_init(&srv, &srv_res, total, PORT))
+            goto cleanup;
+        if (pthread_create(&tid, NULL, server_thread, &srv)) {
+            perror("pthread_create");
+            goto cleanup;
+        }
+        thread_started = 1;
+    }
+
+    if (prepare_ib_res(&ib_res))
+        goto cleanup;
+    mr = ibv_reg_mr(ib_res.pd, buffer, PKTSZ, IBV_ACCESS_LOCAL_WRITE);
+    if (!mr) {
+        perror("ibv_reg_mr");
+        goto cleanup;
+    }
+    fw.conns = conns;
+    fw.st = &ttfw;
+    cq_engine_register(&ib_res.cq_eng, WRID_CLASS_SEND, first_write_cqe, &fw);
+
+    start_time = gfp_get_time();
+    for (int i = 0; i < total; i += parallel) {
+        int n = total - i < parallel ? total - i : parallel;
+
+        if (run_wave(&ib_res, conns, i, n, server_ip, mr)) {
+            fprintf(stderr, "connection wave at %d failed\n", i);
+            goto cleanup;
+        }
+    }
+    elapsed = gfp_get_time() - start_time;
+
+    printf("%d connections, %d in parallel: %.0f connections/s\n",
+           total, parallel, total * 1e9 / elapsed);
+    lat_stats_summarize(&ttfw, &sum);
+    lat_summary_print(stdout, "time to first write", &sum);
+    ret = 0;
+
+cleanup:
+    // Closing the sockets lets the server tear the peers down and exit
+    for (int i = 0; conns && i < total; i++) {
+        if (conns[i].fd >= 0) close(conns[i].fd);
+        if (conns[i].qp) ibv_destroy_qp(conns[i].qp);
+    }
+    if (thread_started) {
+        int *sret;
+
+        if (ret) {
+            // The server would wait forever for peers that never came
+            pthread_cancel(tid);
+            pthread_join(tid, NULL);
+        } else {
+            pthread_join(tid, (void **)&sret);
+            if (*sret == 0)
+                ctrl_server_report(&srv);
+        }
+    }
+    ctrl_server_destroy(&srv);
+    free_ib_res(&srv_res);
+    lat_stats_free(&ttfw);
+    if (mr) ibv_dereg_mr(mr);
+    free(buffer);
+    free(conns);
+    free_ib_res(&ib_res);
+    return ret;
+}
@@ -0,0 +1,207 @@
+#include "gfp.h"
+#include "lat_stats.h"
+
+/*
+ * Completion engine microbenchmark.
+ *
+ * The QP is connected to itself and kept `depth` deep in small signaled
+ * RDMA writes; every time the engine reaps k CQEs the same k WRs are
+ * reposted as one chain. Reported is completions/sec for each batch size.
+ *
+ * The second phase posts one write at a time (optionally `gap_us` apart)
+ * and waits for it in each cq_mode, reporting latency and the CPU time
+ * burnt per operation.
+ */
+
+#define BENCH_MSG_SZ 8
+
+static void count_cqe(void *arg, const struct ibv_wc *wc) {
+    (*(uint64_t *)arg)++;
+}
+
+static int post_writes(struct ib_res *ib_res, struct ibv_send_wr *wrs, int n) {
+    struct ibv_send_wr *bad_wr;
+
+    if (n == 0)
+        return 0;
+    wrs[n - 1].next = NULL;
+    for (int i = 0; i < n - 1; i++)
+        wrs[i].next = &wrs[i + 1];
+    return ib_post_send(ib_res, ib_res->qp, wrs, &bad_wr);
+}
+
+static int run_modes(struct ib_res *ib_res, struct ibv_send_wr *wr, uint64_t iters, int gap_us) {
+    static const char *names[] = { "poll", "event", "hybrid" };
+    struct ibv_send_wr *bad_wr;
+
+    printf("\n%8s %12s %12s %10s %10s\n", "mode", "avg_lat_ns", "cpu_ns/op", "cpu_util", "sleeps");
+    for (int mode = CQ_MODE_POLL; mode <= CQ_MODE_HYBRID; mode++) {
+        long long lat = 0, wall_start, cpu_start, wall, cpu;
+        uint64_t sleeps = ib_res->cq_eng.sleeps;
+
+        ib_res->cq_eng.mode = mode;
+        wall_start = gfp_get_time();
+        cpu_start = cpu_time_ns();
+        for (uint64_t i = 0; i < iters; i++) {
+            long long t0 = gfp_get_time();
+
+            wr->next = NULL;
+            if (ib_post_send(ib_res, ib_res->qp, wr, &bad_wr)) {
+                perror("ibv_post_send");
+                return -1;
+            }
+            if (cq_engine_wait(&ib_res->cq_eng, WRID_CLASS_SEND, 1))
+                return -1;
+            lat += gfp_get_time() - t0;
+            if (gap_us)
+                usleep(gap_us);
+        }
+        wall = gfp_get_time() - wall_start;
+        cpu = cpu_time_ns() - cpu_start;
+        printf("%8s %12.0f %12.0f %9.1f%% %10lu\n", names[mode],
+               (double)lat / iters, (double)cpu / iters, 100.0 * cpu / wall,
+               (unsigned long)(ib_res->cq_eng.sleeps - sleeps));
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct ib_res ib_res;
+    struct ibv_mr *mr = NULL;
+    struct ibv_sge sg;
+    struct ibv_send_wr *wrs = NULL;
+    char *buffer = NULL;
+    uint64_t total = 1000000;
+    uint64_t handled = 0;
+    uint64_t iters = 100000;
+    int depth = 256;
+    int gap_us = 0;
+    int opt, ret = 0;
+
+    memset(&ib_res, 0, sizeof(struct ib_res));
+    while ((opt = getopt(argc, argv, "n:d:i:g:" IB_OPTSTRING)) != -1) {
+        switch (opt) {
+        case 'n':
+            total = strtoull(optarg, NULL, 0);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'i':
+            iters = strtoull(optarg, NULL, 0);
+            break;
+        case 'g':
+            gap_us = atoi(optarg);
+            break;
+        default:
+            if (parse_ib_opt(&ib_res, opt, optarg) == 0)
+                break;
+            fprintf(stderr, "Usage: %s [-n completions] [-d depth] [-i latency_iters] [-g gap_us] %s\n",
+                    argv[0], IB_OPTUSAGE);
+            return -1;
+        }
+    }
+    // Every mode is measured, so always create the completion channel
+    ib_res.cq_mode = CQ_MODE_HYBRID;
+    if (depth < 1 || depth > 512) {
+        fprintf(stderr, "depth must be in [1, 512]\n");
+        return -1;
+    }
+
+    buffer = memalign(getpagesize(), PKTSZ);
+    if (!buffer) {
+        perror("memalign");
+        return -1;
+    }
+    memset(buffer, 0, PKTSZ);
+
+    ret = prepare_ib_res(&ib_res);
+    if (ret) {
+        perror("prepare_ib_res failed");
+        goto cleanup;
+    }
+    mr = ibv_reg_mr(ib_res.pd, buffer, PKTSZ, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    if (!mr) {
+        perror("ibv_reg_mr");
+        ret = -1;
+        goto cleanup;
+    }
+    // Loopback: the QP's peer is itself
+    ret = connect_qp(&ib_res, &ib_res.local_info);
+    if (ret)
+        goto cleanup;
+
+    wrs = calloc(depth, sizeof(*wrs));
+    if (!wrs) {
+        perror("calloc");
+        ret = -1;
+        goto cleanup;
+    }
+    sg.addr = (uintptr_t)buffer;
+    sg.length = BENCH_MSG_SZ;
+    sg.lkey = mr->lkey;
+    for (int i = 0; i < depth; i++) {
+        wrs[i].wr_id = WRID(WRID_CLASS_SEND, i);
+        wrs[i].sg_list = &sg;
+        wrs[i].num_sge = 1;
+        wrs[i].opcode = IBV_WR_RDMA_WRITE;
+        wrs[i].send_flags = IBV_SEND_SIGNALED;
+        wrs[i].wr.rdma.remote_addr = (uintptr_t)buffer + PKTSZ / 2;
+        wrs[i].wr.rdma.rkey = mr->rkey;
+    }
+    cq_engine_register(&ib_res.cq_eng, WRID_CLASS_SEND, count_cqe, &handled);
+
+    printf("%8s %14s %12s\n", "batch", "completions/s", "ns/cqe");
+    for (int batch = 1; batch <= CQ_BATCH_MAX; batch *= 2) {
+        uint64_t reaped = 0, posted = 0;
+        long long start_time, end_time;
+
+        ib_res.cq_eng.batch = batch;
+        ret = post_writes(&ib_res, wrs, depth);
+        if (ret) {
+            perror("ibv_post_send");
+            goto cleanup;
+        }
+        posted = depth;
+
+        start_time = gfp_get_time();
+        while (reaped < total) {
+            int n = cq_engine_poll(&ib_res.cq_eng);
+            if (n < 0) {
+                ret = -1;
+                goto cleanup;
+            }
+            reaped += n;
+            if (n > 0 && posted < total) {
+                if ((uint64_t)n > total - posted)
+                    n = total - posted;
+                ret = post_writes(&ib_res, wrs, n);
+                if (ret) {
+                    perror("ibv_post_send");
+                    goto cleanup;
+                }
+                posted += n;
+            }
+        }
+        end_time = gfp_get_time();
+        if (ib_res.cq_eng.failed[WRID_CLASS_SEND]) {
+            fprintf(stderr, "%lu completions failed\n",
+                    (unsigned long)ib_res.cq_eng.failed[WRID_CLASS_SEND]);
+            ret = -1;
+            goto cleanup;
+        }
+        printf("%8d %14.0f %12.1f\n", batch,
+               reaped * 1e9 / (end_time - start_time),
+               (double)(end_time - start_time) / reaped);
+    }
+
+    ib_res.cq_eng.batch = CQ_BATCH_DEFAULT;
+    ret = run_modes(&ib_res, &wrs[0], iters, gap_us);
+
+cleanup:
+    free(wrs);
+    if (mr) ibv_dereg_mr(mr);
+    free(buffer);
+    free_ib_res(&ib_res);
+    return ret;
+}
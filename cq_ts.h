@@ -0,0 +1,270 @@
+#ifndef CQ_TS_H
+#define CQ_TS_H
+
+#include <stdint.h>
+#include <infiniband/verbs.h>
+#include "lat_stats.h"
+
+/*
+ * Completion timing.
+ *
+ * With `-T` every signaled send posted through the gfp.h helpers on the
+ * main QP is stamped (host CLOCK_MONOTONIC, just before the doorbell) and
+ * queued; send CQEs of that QP come back in posting order and pop the
+ * queue. How the gap is split depends on the provider:
+ *
+ *   NIC clock - the CQ is created with IBV_WC_EX_WITH_COMPLETION_TIMESTAMP.
+ *               Raw ticks are mapped onto CLOCK_MONOTONIC through paired
+ *               ibv_query_rt_values_ex()/clock_gettime() samples, the tick
+ *               rate re-measured every CQ_TS_RECAL_NS. Each CQE yields
+ *                 nic  = CQE timestamp - post      (doorbell, wire, HCA)
+ *                 host = reap time - CQE timestamp (CQE waiting to be polled)
+ *               Receive CQEs have no local post and only yield `host`.
+ *   software  - the device reports no clock: `sw` = reap time - post, the
+ *               same number gfp_get_time() brackets gave before.
+ *
+ * Samples are kept per work completion opcode. Posts made with plain
+ * ibv_post_send() bypass the queue, so code that mixes them into the
+ * main QP's signaled sends gets mismatched pairs.
+ */
+
+#define CQ_TS_FIFO 1024                 /* power of two >= MAX_SEND_WR */
+#define CQ_TS_SAMPLES (1 << 16)         /* per opcode and component */
+#define CQ_TS_RECAL_NS 1000000000LL
+#define CQ_TS_CAL_TRIES 8
+
+enum cq_ts_op {
+    CQ_TS_OP_SEND = 0,
+    CQ_TS_OP_RDMA_WRITE,
+    CQ_TS_OP_RDMA_READ,
+    CQ_TS_OP_COMP_SWAP,
+    CQ_TS_OP_FETCH_ADD,
+    CQ_TS_OP_BIND_MW,
+    CQ_TS_OP_LOCAL_INV,
+    CQ_TS_OP_TSO,
+    CQ_TS_OP_RECV,
+    CQ_TS_OP_RECV_RDMA_IMM,
+    CQ_TS_OP_OTHER,
+    CQ_TS_NOPS,
+};
+
+struct cq_ts {
+    struct ibv_context *context;
+    int hw;                     /* CQEs carry NIC timestamps */
+    uint32_t qpn;               /* QP whose sends are timed */
+    /* NIC clock: ns = t0 + ((ticks - c0) & mask) * ns_per_tick */
+    uint64_t mask;
+    uint64_t khz;
+    double ns_per_tick;
+    uint64_t c0;
+    long long t0;
+    long long cal_err;          /* half the widest bracket of the last calibration */
+    /* post times of signaled sends not completed yet */
+    long long post[CQ_TS_FIFO];
+    uint32_t head;
+    uint32_t tail;
+    uint64_t untimed;           /* send CQEs with no recorded post */
+    uint64_t clamped;           /* NIC stamps that fell outside [post, reap] */
+    struct lat_stats nic[CQ_TS_NOPS];
+    struct lat_stats host[CQ_TS_NOPS];
+    struct lat_stats sw[CQ_TS_NOPS];
+};
+
+static inline long long cq_ts_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * One (ticks, ns) pair: the NIC clock read between two host clock reads,
+ * keeping the tightest of CQ_TS_CAL_TRIES brackets. Returns the bracket
+ * width, or -1 if the provider cannot read its clock.
+ */
+static long long cq_ts_sample(struct cq_ts *ts, uint64_t *ticks, long long *ns) {
+    long long best = -1;
+
+    for (int i = 0; i < CQ_TS_CAL_TRIES; i++) {
+        struct ibv_values_ex v = { .comp_mask = IBV_VALUES_MASK_RAW_CLOCK };
+        long long before = cq_ts_now(), after;
+
+        if (ibv_query_rt_values_ex(ts->context, &v) || !(v.comp_mask & IBV_VALUES_MASK_RAW_CLOCK))
+            return -1;
+        after = cq_ts_now();
+        if (best < 0 || after - before < best) {
+            best = after - before;
+            // Providers return the raw cycle count in the timespec
+            *ticks = (uint64_t)v.raw_clock.tv_sec * 1000000000ULL + v.raw_clock.tv_nsec;
+            *ns = before + best / 2;
+        }
+    }
+    return best;
+}
+
+/*
+ * Probe the device clock. Returns 1 if completions can be stamped by the
+ * NIC, 0 if only software timing is available; the caller then creates
+ * the CQ with or without IBV_WC_EX_WITH_COMPLETION_TIMESTAMP.
+ */
+int cq_ts_init(struct cq_ts *ts, struct ibv_context *context) {
+    struct ibv_device_attr_ex attr;
+    long long width;
+
+    memset(ts, 0, sizeof(*ts));
+    ts->context = context;
+    memset(&attr, 0, sizeof(attr));
+    if (ibv_query_device_ex(context, NULL, &attr) || !attr.completion_timestamp_mask ||
+        !attr.hca_core_clock) {
+        fprintf(stderr, "no NIC completion clock, timing completions in software\n");
+        return 0;
+    }
+    ts->mask = attr.completion_timestamp_mask;
+    ts->khz = attr.hca_core_clock;
+    ts->ns_per_tick = 1e6 / ts->khz;
+    width = cq_ts_sample(ts, &ts->c0, &ts->t0);
+    if (width < 0) {
+        fprintf(stderr, "NIC clock unreadable, timing completions in software\n");
+        return 0;
+    }
+    ts->cal_err = width / 2;
+    ts->hw = 1;
+    return 1;
+}
+
+void cq_ts_free(struct cq_ts *ts) {
+    for (int i = 0; i < CQ_TS_NOPS; i++) {
+        lat_stats_free(&ts->nic[i]);
+        lat_stats_free(&ts->host[i]);
+        lat_stats_free(&ts->sw[i]);
+    }
+    ts->hw = 0;
+}
+
+/*
+ * Re-anchor the tick to ns mapping at a fresh sample and take the tick
+ * rate from the interval since the previous one, which absorbs the drift
+ * between the NIC oscillator and the host clock.
+ */
+static void cq_ts_recalibrate(struct cq_ts *ts) {
+    uint64_t ticks, dticks;
+    long long ns, width = cq_ts_sample(ts, &ticks, &ns);
+
+    if (width < 0)
+        return;
+    dticks = (ticks - ts->c0) & ts->mask;
+    if (dticks && ns > ts->t0)
+        ts->ns_per_tick = (double)(ns - ts->t0) / dticks;
+    ts->c0 = ticks;
+    ts->t0 = ns;
+    ts->cal_err = width / 2;
+}
+
+// Raw completion timestamp to CLOCK_MONOTONIC ns, ticks may lie either side of c0
+static inline long long cq_ts_to_ns(const struct cq_ts *ts, uint64_t ticks) {
+    uint64_t ahead = (ticks - ts->c0) & ts->mask;
+
+    if (ahead > ts->mask >> 1)
+        return ts->t0 - (long long)(((ts->c0 - ticks) & ts->mask) * ts->ns_per_tick);
+    return ts->t0 + (long long)(ahead * ts->ns_per_tick);
+}
+
+static inline int cq_ts_op_index(enum ibv_wc_opcode op) {
+    if (op <= IBV_WC_TSO)
+        return op;
+    if (op == IBV_WC_RECV)
+        return CQ_TS_OP_RECV;
+    if (op == IBV_WC_RECV_RDMA_WITH_IMM)
+        return CQ_TS_OP_RECV_RDMA_IMM;
+    return CQ_TS_OP_OTHER;
+}
+
+static const char *cq_ts_op_str(int op) {
+    static const char *names[CQ_TS_NOPS] = {
+        "send", "rdma_write", "rdma_read", "comp_swap", "fetch_add", "bind_mw",
+        "local_inv", "tso", "recv", "recv_rdma_imm", "other",
+    };
+    return names[op];
+}
+
+static inline void cq_ts_add(struct lat_stats *st, long long ns) {
+    // Allocated on first use: most opcodes never show up
+    if (!st->samples && lat_stats_init(st, CQ_TS_SAMPLES))
+        return;
+    lat_stats_add(st, ns);
+}
+
+// `nsignaled` signaled sends were posted on `qpn` at host time `t`
+static inline void cq_ts_post(struct cq_ts *ts, uint32_t qpn, long long t, int nsignaled) {
+    if (qpn != ts->qpn)
+        return;
+    while (nsignaled-- > 0 && ts->tail - ts->head < CQ_TS_FIFO)
+        ts->post[ts->tail++ & (CQ_TS_FIFO - 1)] = t;
+}
+
+/*
+ * Account one reaped CQE. `ticks` is its raw NIC timestamp (ignored
+ * without one) and `now` the host time the poll returned.
+ */
+static inline void cq_ts_complete(struct cq_ts *ts, const struct ibv_wc *wc, int is_recv,
+                                  uint64_t ticks, long long now) {
+    long long post = -1, hw;
+    int op;
+
+    if (!is_recv && wc->qp_num == ts->qpn) {
+        if (ts->head != ts->tail)
+            post = ts->post[ts->head++ & (CQ_TS_FIFO - 1)];
+        else
+            ts->untimed++;
+    }
+    // Flushed and failed CQEs still pop their post, but carry no opcode
+    if (wc->status != IBV_WC_SUCCESS)
+        return;
+    op = cq_ts_op_index(wc->opcode);
+    if (!ts->hw) {
+        if (post >= 0)
+            cq_ts_add(&ts->sw[op], now - post);
+        return;
+    }
+    if (now - ts->t0 > CQ_TS_RECAL_NS)
+        cq_ts_recalibrate(ts);
+    hw = cq_ts_to_ns(ts, ticks);
+    // Calibration error can put the stamp a little outside the bracket
+    if (hw > now || (post >= 0 && hw < post)) {
+        ts->clamped++;
+        hw = hw > now ? now : post;
+    }
+    if (post >= 0)
+        cq_ts_add(&ts->nic[op], hw - post);
+    if (is_recv || post >= 0)
+        cq_ts_add(&ts->host[op], now - hw);
+}
+
+static void cq_ts_report_one(FILE *out, int op, const char *part, struct lat_stats *st) {
+    struct lat_summary sum;
+    char label[32];
+
+    if (!st->n)
+        return;
+    lat_stats_summarize(st, &sum);
+    snprintf(label, sizeof(label), "%s %s", cq_ts_op_str(op), part);
+    lat_summary_print(out, label, &sum);
+    lat_summary_print_hist(out, &sum);
+}
+
+void cq_ts_report(FILE *out, struct cq_ts *ts) {
+    if (ts->hw)
+        fprintf(out, "completion timing: NIC clock %.3f MHz, %.3f ns/tick, calibration +-%lld ns\n",
+                ts->khz / 1e3, ts->ns_per_tick, ts->cal_err);
+    else
+        fprintf(out, "completion timing: software clock (post to reap)\n");
+    for (int op = 0; op < CQ_TS_NOPS; op++) {
+        cq_ts_report_one(out, op, "nic", &ts->nic[op]);
+        cq_ts_report_one(out, op, "host", &ts->host[op]);
+        cq_ts_report_one(out, op, "sw", &ts->sw[op]);
+    }
+    if (ts->untimed || ts->clamped)
+        fprintf(out, "completion timing: %lu CQEs without a recorded post, %lu stamps clamped\n",
+                (unsigned long)ts->untimed, (unsigned long)ts->clamped);
+}
+
+#endif /* CQ_TS_H */
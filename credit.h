@@ -0,0 +1,311 @@
+#ifndef CREDIT_H
+#define CREDIT_H
+
+#include "gfp.h"
+#include "sq_batch.h"
+
+/*
+ * Credit-based flow control for a write-with-imm stream.
+ *
+ * UC drops a write-with-imm that finds no receive WR posted, so a sender
+ * that outruns its receiver loses data silently. Here the receiver owns
+ * `nslots` slots of `slot_size` bytes in its window, with one receive WR
+ * per slot. Message k goes to slot k % nslots and carries k in its
+ * immediate. The sender starts with nslots credits and spends one per
+ * message.
+ *
+ * The application releases messages in arrival order once it is done
+ * with them. The receiver reposts their receives and, once `grant_every`
+ * slots have been freed since the last grant, tells the sender how many
+ * messages it may have sent in total: nslots past the immediate of the
+ * newest released message, since every slot up to and including that
+ * message's is free again. The grant is a zero-length write-with-imm
+ * whose immediate is that limit; a reply the receiver sends anyway can
+ * carry it instead (credit_rx_piggyback()). The sender starts at a limit
+ * of nslots and its credit is limit - sent (mod 2^32), so a grant lost on
+ * the wire is repaired by the next one.
+ *
+ * A message lost on the wire shows up as a gap in the immediates and its
+ * slot is freed along with the next message released after it. Only if
+ * every message in flight is lost does the stream stall: that needs a
+ * timeout and resend, which this layer does not do.
+ *
+ * Both ends have to agree on nslots and grant_every. The sender keeps
+ * nslots / grant_every + 2 receives posted for grants.
+ */
+
+#define CREDIT_GRANT_DEPTH 64       /* grants in the receiver's SQ before it waits */
+
+struct credit_tx {
+    struct ib_res *ib_res;
+    struct ibv_qp *qp;
+    struct sq_batch sq;
+    struct ibv_mr *mr;
+    uint64_t remote_addr;
+    uint32_t rkey;
+    uint32_t nslots;
+    size_t slot_size;
+    uint32_t sent;
+    uint32_t granted;           /* messages that may have been sent in total */
+    int unlimited;              /* ignore credits, to measure what they prevent */
+    int starved;
+    uint64_t stalls;
+    uint64_t grants;
+};
+
+struct credit_rx {
+    struct ib_res *ib_res;
+    struct ibv_qp *qp;
+    char *slots;
+    uint32_t nslots;
+    size_t slot_size;
+    uint32_t grant_every;
+    uint64_t grant_addr;
+    uint32_t grant_rkey;
+    uint32_t next;              /* immediate expected next */
+    uint32_t released;          /* cumulative slots freed */
+    uint32_t granted;           /* `released` as of the last grant */
+    /* arrived messages not released yet, a ring of nslots entries */
+    uint32_t *seqs;
+    uint32_t *lens;
+    uint64_t arrived;
+    uint64_t consumed;
+    uint64_t lost;
+    uint64_t overruns;
+    uint64_t grants;
+    uint64_t grant_base;
+};
+
+static inline uint32_t credit_grant_recvs(uint32_t nslots, uint32_t grant_every) {
+    return nslots / grant_every + 2;
+}
+
+/*
+ * Sender on `qp`, writing from `mr` into the receiver's nslots x slot_size
+ * window at remote_addr/rkey; WRs go through a send queue batcher
+ * (WRID_CLASS_SEND). The receiver must have its receives posted first.
+ */
+int credit_tx_init(struct credit_tx *tx, struct ib_res *ib_res, struct ibv_qp *qp,
+                   struct ibv_mr *mr, uint64_t remote_addr, uint32_t rkey, uint32_t nslots,
+                   size_t slot_size, uint32_t grant_every, int batch, int signal_every) {
+    memset(tx, 0, sizeof(*tx));
+    if (nslots < 1 || grant_every < 1 || grant_every > nslots) {
+        fprintf(stderr, "credit: need 1 <= grant_every <= nslots\n");
+        return -1;
+    }
+    tx->ib_res = ib_res;
+    tx->qp = qp;
+    tx->mr = mr;
+    tx->remote_addr = remote_addr;
+    tx->rkey = rkey;
+    tx->nslots = nslots;
+    tx->slot_size = slot_size;
+    tx->granted = nslots;
+    if (sq_batch_init(&tx->sq, ib_res, qp, WRID_CLASS_SEND, batch, signal_every, MAX_SEND_WR))
+        return -1;
+    return post_zero_recvs_qp(ib_res, qp, credit_grant_recvs(nslots, grant_every));
+}
+
+void credit_tx_release(struct credit_tx *tx) {
+    sq_batch_release(&tx->sq);
+}
+
+static inline uint32_t credit_tx_avail(const struct credit_tx *tx) {
+    return tx->granted - tx->sent;
+}
+
+// RECV CQE on the sender's QP: a grant
+void credit_tx_on_recv(struct credit_tx *tx, const struct ibv_wc *wc) {
+    uint32_t g;
+
+    if (wc->status != IBV_WC_SUCCESS || !(wc->wc_flags & IBV_WC_WITH_IMM))
+        return;
+    g = ntohl(wc->imm_data);
+    // Cumulative: only ever move forward, a reordered or stale grant is ignored
+    if ((int32_t)(g - tx->granted) > 0)
+        tx->granted = g;
+    tx->grants++;
+    post_zero_recvs_qp(tx->ib_res, tx->qp, 1);
+}
+
+/*
+ * Queue one message of `len` <= slot_size bytes at `buf` (inside tx->mr,
+ * or anywhere if it fits inline). Returns 1 if queued, 0 if out of
+ * credits (everything queued has been flushed to the wire so the
+ * receiver can free slots), -1 on error.
+ */
+int credit_tx_post(struct credit_tx *tx, const void *buf, size_t len) {
+    struct ibv_send_wr wr;
+    struct ibv_sge sg;
+    uint32_t slot;
+
+    if (len > tx->slot_size) {
+        fprintf(stderr, "credit: %zu byte message exceeds %zu byte slots\n", len, tx->slot_size);
+        return -1;
+    }
+    if (!tx->unlimited && credit_tx_avail(tx) == 0) {
+        tx->stalls += !tx->starved;
+        tx->starved = 1;
+        return sq_batch_flush(&tx->sq) ? -1 : 0;
+    }
+    tx->starved = 0;
+    slot = tx->sent % tx->nslots;
+    sg.addr = (uintptr_t)buf;
+    sg.length = len;
+    sg.lkey = tx->mr->lkey;
+    memset(&wr, 0, sizeof(wr));
+    wr.sg_list = &sg;
+    wr.num_sge = len ? 1 : 0;
+    wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+    wr.imm_data = htonl(tx->sent);
+    wr.send_flags = len && len <= tx->ib_res->max_inline ? IBV_SEND_INLINE : 0;
+    wr.wr.rdma.remote_addr = tx->remote_addr + (uint64_t)slot * tx->slot_size;
+    wr.wr.rdma.rkey = tx->rkey;
+    if (sq_batch_add(&tx->sq, &wr))
+        return -1;
+    tx->sent++;
+    return 1;
+}
+
+// Blocking send: waits for grants while out of credits
+int credit_tx_send(struct credit_tx *tx, const void *buf, size_t len) {
+    int ret;
+
+    while ((ret = credit_tx_post(tx, buf, len)) == 0)
+        if (cq_engine_wait(&tx->ib_res->cq_eng, WRID_CLASS_RECV, 1))
+            return -1;
+    return ret < 0 ? -1 : 0;
+}
+
+// Push out anything queued and wait until the send queue is empty
+int credit_tx_drain(struct credit_tx *tx) {
+    return sq_batch_drain(&tx->sq);
+}
+
+/*
+ * Receiver on `qp` over nslots x slot_size bytes at `slots`; grants are
+ * written (zero length) to grant_addr/grant_rkey on the sender. Posts one
+ * receive per slot. With an SRQ ring the slots must fit below its
+ * refill watermark, or a burst can find the ring empty.
+ */
+int credit_rx_init(struct credit_rx *rx, struct ib_res *ib_res, struct ibv_qp *qp, char *slots,
+                   uint32_t nslots, size_t slot_size, uint32_t grant_every, uint64_t grant_addr,
+                   uint32_t grant_rkey) {
+    memset(rx, 0, sizeof(*rx));
+    if (nslots < 1 || grant_every < 1 || grant_every > nslots) {
+        fprintf(stderr, "credit: need 1 <= grant_every <= nslots\n");
+        return -1;
+    }
+    if (ib_res->srq.srq ? nslots > ib_res->srq.watermark : nslots > MAX_RECV_WR) {
+        fprintf(stderr, "credit: %u slots exceed the %u receives that stay posted\n", nslots,
+                ib_res->srq.srq ? ib_res->srq.watermark : MAX_RECV_WR);
+        return -1;
+    }
+    rx->seqs = malloc(nslots * sizeof(*rx->seqs));
+    rx->lens = malloc(nslots * sizeof(*rx->lens));
+    if (!rx->seqs || !rx->lens) {
+        perror("malloc");
+        return -1;
+    }
+    rx->ib_res = ib_res;
+    rx->qp = qp;
+    rx->slots = slots;
+    rx->nslots = nslots;
+    rx->slot_size = slot_size;
+    rx->grant_every = grant_every;
+    rx->grant_addr = grant_addr;
+    rx->grant_rkey = grant_rkey;
+    rx->grant_base = ib_res->cq_eng.done[WRID_CLASS_CREDIT] + ib_res->cq_eng.failed[WRID_CLASS_CREDIT];
+    return post_zero_recvs_qp(ib_res, qp, nslots);
+}
+
+void credit_rx_free(struct credit_rx *rx) {
+    free(rx->seqs);
+    free(rx->lens);
+    rx->seqs = NULL;
+    rx->lens = NULL;
+}
+
+// RECV CQE on the receiver's QP: a message landed in its slot
+void credit_rx_on_recv(struct credit_rx *rx, const struct ibv_wc *wc) {
+    uint32_t seq;
+
+    if (wc->status != IBV_WC_SUCCESS || !(wc->wc_flags & IBV_WC_WITH_IMM))
+        return;
+    seq = ntohl(wc->imm_data);
+    // UC never reorders: a jump means the messages in between were dropped
+    if ((int32_t)(seq - rx->next) > 0)
+        rx->lost += seq - rx->next;
+    rx->next = seq + 1;
+    rx->arrived++;
+    // Only a sender ignoring its credits gets here: the slot was overwritten
+    if (rx->arrived - 1 - rx->consumed >= rx->nslots) {
+        rx->overruns++;
+        rx->arrived--;
+        return;
+    }
+    rx->seqs[(rx->arrived - 1) % rx->nslots] = seq;
+    rx->lens[(rx->arrived - 1) % rx->nslots] = wc->byte_len;
+}
+
+// Messages that arrived and are not released yet
+static inline uint32_t credit_rx_pending(const struct credit_rx *rx) {
+    return rx->arrived - rx->consumed;
+}
+
+// The i-th pending message and its length
+static inline char *credit_rx_slot(const struct credit_rx *rx, uint32_t i, uint32_t *len) {
+    uint32_t entry = (rx->consumed + i) % rx->nslots;
+
+    *len = rx->lens[entry];
+    return rx->slots + (size_t)(rx->seqs[entry] % rx->nslots) * rx->slot_size;
+}
+
+// The sender may have sent nslots more messages than have been released
+static inline uint32_t credit_rx_limit(const struct credit_rx *rx) {
+    return rx->released + rx->nslots;
+}
+
+// Grant everything released so far
+int credit_rx_grant(struct credit_rx *rx) {
+    struct cq_engine *eng = &rx->ib_res->cq_eng;
+
+    // Grants are signaled; keep a bounded number of them in the send queue
+    while (rx->grants - (eng->done[WRID_CLASS_CREDIT] + eng->failed[WRID_CLASS_CREDIT] -
+                         rx->grant_base) >= CREDIT_GRANT_DEPTH)
+        if (cq_engine_wait(eng, WRID_CLASS_CREDIT, 1))
+            return -1;
+    if (post_write_imm(rx->ib_res, rx->qp, NULL, NULL, 0, rx->grant_addr, rx->grant_rkey,
+                       credit_rx_limit(rx), WRID(WRID_CLASS_CREDIT, 0), 1))
+        return -1;
+    rx->granted = rx->released;
+    rx->grants++;
+    return 0;
+}
+
+/*
+ * Immediate for a reply the receiver sends to the sender anyway: it grants
+ * everything released so far and spares a standalone grant.
+ */
+static inline uint32_t credit_rx_piggyback(struct credit_rx *rx) {
+    rx->granted = rx->released;
+    return credit_rx_limit(rx);
+}
+
+// The application is done with the oldest `n` pending messages
+int credit_rx_release(struct credit_rx *rx, uint32_t n) {
+    if (n > credit_rx_pending(rx))
+        n = credit_rx_pending(rx);
+    if (n == 0)
+        return 0;
+    rx->consumed += n;
+    // Frees this message's slot and those of any lost ones before it
+    rx->released = rx->seqs[(rx->consumed - 1) % rx->nslots] + 1;
+    if (post_zero_recvs_qp(rx->ib_res, rx->qp, n))
+        return -1;
+    if (rx->released - rx->granted >= rx->grant_every)
+        return credit_rx_grant(rx);
+    return 0;
+}
+
+#endif /* CREDIT_H */
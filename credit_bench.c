@@ -0,0 +1,272 @@
+#include "gfp.h"
+#include "lat_stats.h"
+#include "sq_batch.h"
+#include "credit.h"
+
+/*
+ * Credit flow control benchmark.
+ *
+ * Two UC QPs on one device are connected to each other: A streams `-n`
+ * write-with-imm messages of `-l` bytes into B's `-w` slots, B hands them
+ * to an application that consumes at most `-r` messages per second and
+ * grants credits back every `-g` released slots. Each mode runs on its own
+ * freshly opened device context (-f picks just one):
+ *
+ *   credit - the sender waits for grants when it runs out of credits;
+ *   none   - the sender ignores them, as every stream in the tree did so
+ *            far, and whatever finds no receive posted is dropped.
+ *
+ * Reported are messages delivered and lost, delivered msgs/s and MB/s, and
+ * how often the sender stalled on credits. The loop is single threaded: B's
+ * consumption is paced by the clock, not by a second core.
+ *
+ * Receives are posted on each QP's own RQ so grants and data cannot take
+ * each other's receive WRs; -R is ignored.
+ */
+
+#define BENCH_IDLE_NS 100000000LL     /* no arrival for this long ends a run */
+
+enum bench_mode {
+    BENCH_CREDIT = 0,
+    BENCH_NONE,
+};
+
+static const char *bench_mode_str(int mode) {
+    return mode == BENCH_NONE ? "none" : "credit";
+}
+
+struct bench_cfg {
+    uint64_t msgs;
+    uint32_t len;
+    uint32_t nslots;
+    uint32_t grant_every;
+    uint64_t rate;              /* receiver consumption in msgs/s, 0: unlimited */
+    int batch;
+    int signal_every;
+};
+
+struct bench {
+    struct credit_tx tx;
+    struct credit_rx rx;
+    long long last_arrival;
+    uint64_t checksum;
+};
+
+// Receives of both QPs land in the RECV class; the QP tells grant from data
+static void bench_recv(void *arg, const struct ibv_wc *wc) {
+    struct bench *b = arg;
+
+    if (wc->qp_num == b->tx.qp->qp_num) {
+        credit_tx_on_recv(&b->tx, wc);
+    } else {
+        credit_rx_on_recv(&b->rx, wc);
+        b->last_arrival = gfp_get_time();
+    }
+}
+
+// The application side of B: look at what it may consume by now and release it
+static int bench_consume(struct bench *b, const struct bench_cfg *cfg, long long elapsed) {
+    uint32_t n = credit_rx_pending(&b->rx), len;
+
+    if (cfg->rate) {
+        uint64_t allowed = (uint64_t)((double)elapsed * cfg->rate / 1e9);
+
+        if (allowed <= b->rx.consumed)
+            return 0;
+        if (allowed - b->rx.consumed < n)
+            n = allowed - b->rx.consumed;
+    }
+    for (uint32_t i = 0; i < n; i++)
+        b->checksum += (uint8_t)credit_rx_slot(&b->rx, i, &len)[0] + len;
+    return credit_rx_release(&b->rx, n);
+}
+
+static int run_stream(struct ib_res *ib_res, struct bench *b, const struct bench_cfg *cfg,
+                      const char *src) {
+    struct cq_engine *eng = &ib_res->cq_eng;
+    long long start_time = gfp_get_time(), now, elapsed;
+    int flushed = 0;
+
+    b->last_arrival = start_time;
+    for (;;) {
+        now = gfp_get_time();
+        if (bench_consume(b, cfg, now - start_time))
+            return -1;
+        while (b->tx.sent < cfg->msgs) {
+            int ret = credit_tx_post(&b->tx, src, cfg->len);
+
+            if (ret < 0)
+                return -1;
+            if (ret == 0)
+                break;
+        }
+        if (b->tx.sent == cfg->msgs && !flushed) {
+            if (sq_batch_flush(&b->tx.sq))
+                return -1;
+            flushed = 1;
+        }
+        if (cq_engine_poll(eng) < 0 || eng->failed[WRID_CLASS_SEND] ||
+            eng->failed[WRID_CLASS_CREDIT])
+            return -1;
+        if (credit_rx_pending(&b->rx))
+            continue;
+        // Everything arrived, or the rest was lost and nothing more is coming
+        if (b->rx.next == cfg->msgs && b->tx.sent == cfg->msgs)
+            break;
+        if (now - b->last_arrival > BENCH_IDLE_NS) {
+            if (b->tx.sent < cfg->msgs)
+                fprintf(stderr, "stream stalled after %u messages\n", b->tx.sent);
+            // Credits exist so that nothing is dropped: a stall is a failure
+            if (!b->tx.unlimited && b->tx.sent < cfg->msgs)
+                return -1;
+            break;
+        }
+    }
+    elapsed = b->last_arrival - start_time;
+    if (elapsed <= 0)
+        elapsed = 1;
+    if (credit_tx_drain(&b->tx))
+        return -1;
+    printf("%-7s %10u %10lu %10lu %10lu %12.0f %10.1f %8lu %8lu\n", bench_mode_str(b->tx.unlimited),
+           b->tx.sent, (unsigned long)b->rx.consumed, (unsigned long)(b->tx.sent - b->rx.consumed),
+           (unsigned long)b->rx.overruns, b->rx.consumed * 1e9 / elapsed,
+           b->rx.consumed * (double)cfg->len * 1e3 / elapsed, (unsigned long)b->tx.stalls,
+           (unsigned long)b->tx.grants);
+    return 0;
+}
+
+static int run_mode(const struct ib_res *res_cfg, const struct bench_cfg *cfg, int mode) {
+    struct ib_res ib_res = *res_cfg;
+    size_t size = cfg->len + (size_t)cfg->nslots * cfg->len;
+    struct ibv_mr *mr = NULL;
+    struct ibv_qp *qp_b = NULL;
+    struct bench b;
+    char *buffer, *slots;
+    int ret = -1;
+
+    memset(&b, 0, sizeof(b));
+    buffer = memalign(getpagesize(), size);
+    if (!buffer) {
+        perror("memalign");
+        return -1;
+    }
+    memset(buffer, 0xa5, size);
+    slots = buffer + cfg->len;
+    if (prepare_ib_res(&ib_res)) {
+        perror("prepare_ib_res failed");
+        goto cleanup;
+    }
+    mr = ibv_reg_mr(ib_res.pd, buffer, size, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    if (!mr) {
+        perror("ibv_reg_mr");
+        goto cleanup;
+    }
+    qp_b = create_qp(&ib_res);
+    if (!qp_b)
+        goto cleanup;
+    if (connect_qp_pair(&ib_res, ib_res.qp, &ib_res, qp_b))
+        goto cleanup;
+
+    cq_engine_register(&ib_res.cq_eng, WRID_CLASS_RECV, bench_recv, &b);
+    if (credit_rx_init(&b.rx, &ib_res, qp_b, slots, cfg->nslots, cfg->len, cfg->grant_every,
+                       (uintptr_t)buffer, mr->rkey) ||
+        credit_tx_init(&b.tx, &ib_res, ib_res.qp, mr, (uintptr_t)slots, mr->rkey, cfg->nslots,
+                       cfg->len, cfg->grant_every, cfg->batch, cfg->signal_every))
+        goto cleanup;
+    b.tx.unlimited = mode == BENCH_NONE;
+    ret = run_stream(&ib_res, &b, cfg, buffer);
+
+cleanup:
+    credit_tx_release(&b.tx);
+    credit_rx_free(&b.rx);
+    if (qp_b) ibv_destroy_qp(qp_b);
+    if (mr) ibv_dereg_mr(mr);
+    free(buffer);
+    free_ib_res(&ib_res);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    struct ib_res res_cfg;
+    struct bench_cfg cfg = {
+        .msgs = 200000,
+        .len = 64,
+        .nslots = 128,
+        .rate = 200000,
+        .batch = 16,
+        .signal_every = 16,
+    };
+    int only_mode = -1;
+    int opt;
+
+    memset(&res_cfg, 0, sizeof(res_cfg));
+    while ((opt = getopt(argc, argv, "n:l:w:g:r:B:e:f:" IB_OPTSTRING)) != -1) {
+        switch (opt) {
+        case 'n':
+            cfg.msgs = strtoull(optarg, NULL, 0);
+            break;
+        case 'l':
+            cfg.len = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            cfg.nslots = strtoul(optarg, NULL, 0);
+            break;
+        case 'g':
+            cfg.grant_every = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            cfg.rate = strtoull(optarg, NULL, 0);
+            break;
+        case 'B':
+            cfg.batch = atoi(optarg);
+            break;
+        case 'e':
+            cfg.signal_every = atoi(optarg);
+            break;
+        case 'f':
+            if (strcmp(optarg, "credit") == 0)
+                only_mode = BENCH_CREDIT;
+            else if (strcmp(optarg, "none") == 0)
+                only_mode = BENCH_NONE;
+            else
+                goto usage;
+            break;
+        default:
+            if (parse_ib_opt(&res_cfg, opt, optarg))
+                goto usage;
+        }
+    }
+    if (!cfg.grant_every)
+        cfg.grant_every = cfg.nslots / 4 ? cfg.nslots / 4 : 1;
+    // Immediates count messages in 32 bits; B's slots and A's grant receives share the CQ
+    if (cfg.msgs < 1 || cfg.msgs > UINT32_MAX || cfg.len < 1 || cfg.nslots < 1 ||
+        cfg.nslots > MAX_RECV_WR / 2) {
+        fprintf(stderr, "need 1 <= msgs < 2^32, len >= 1 and slots in [1, %d]\n", MAX_RECV_WR / 2);
+        return -1;
+    }
+    res_cfg.srq_depth = 0;
+
+    printf("%lu messages of %u B into %u slots, grant every %u, ", (unsigned long)cfg.msgs,
+           cfg.len, cfg.nslots, cfg.grant_every);
+    if (cfg.rate)
+        printf("receiver consumes %lu msgs/s\n", (unsigned long)cfg.rate);
+    else
+        printf("receiver unthrottled\n");
+    printf("%-7s %10s %10s %10s %10s %12s %10s %8s %8s\n", "mode", "sent", "delivered", "lost",
+           "overruns", "msgs/s", "MB/s", "stalls", "grants");
+    for (int mode = BENCH_CREDIT; mode <= BENCH_NONE; mode++) {
+        if (only_mode >= 0 && mode != only_mode)
+            continue;
+        if (run_mode(&res_cfg, &cfg, mode)) {
+            fprintf(stderr, "%s run failed\n", bench_mode_str(mode));
+            return -1;
+        }
+    }
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: %s [-n msgs] [-l msg_len] [-w slots] [-g grant_every] "
+            "[-r recv_msgs_per_sec] [-B wrs_per_doorbell] [-e signal_every] [-f credit|none] %s\n",
+            argv[0], IB_OPTUSAGE);
+    return -1;
+}
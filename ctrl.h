@@ -0,0 +1,539 @@
+#ifndef CTRL_H
+#define CTRL_H
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "gfp.h"
+#include "lat_stats.h"
+
+/*
+ * Multi-peer control plane for the server (-M max_peers).
+ *
+ * One non-blocking listener accepts peers through epoll. A peer sends a
+ * wire.h INFO message; the server creates a QP for it on the shared PD, CQ
+ * and SRQ, connects it and posts a bind of a type 2 window over the peer's
+ * own slot of one registered buffer. When the bind completes (a
+ * WRID_CLASS_CTRL CQE carrying the slot index) the server replies with an
+ * INFO message of its own (the peer QP's qpn and the slot as its one
+ * region). Handshakes advance independently as their sockets and binds
+ * become ready, so hundreds can be in flight at once.
+ *
+ * The TCP connection lives as long as the peer; EOF tears down its QP and
+ * window. Receive CQEs come off the shared SRQ and are attributed to
+ * peers by qp_num.
+ */
+
+#define CTRL_OPTSTRING "M:"
+#define CTRL_OPTUSAGE "[-M max_peers]"
+#define CTRL_BACKLOG 1024
+#define CTRL_SLOT_SIZE PKTSZ
+#define CTRL_QPN_BUCKETS 1024
+#define CTRL_MAX_EVENTS 64
+/* largest INFO a peer may send: a few regions, peers do not expose many */
+#define CTRL_MSG_MAX (WIRE_HDR_SIZE + WIRE_INFO_FIXED + 16 * WIRE_REGION_SIZE)
+/* epoll tokens above any slot index */
+#define CTRL_EV_LISTEN (1ULL << 32)
+#define CTRL_EV_CQ (2ULL << 32)
+#define CTRL_EV_ASYNC (3ULL << 32)
+
+struct ctrl_opts {
+    int max_peers;
+};
+
+void ctrl_opts_init(struct ctrl_opts *o) {
+    memset(o, 0, sizeof(*o));
+}
+
+int parse_ctrl_opt(struct ctrl_opts *o, int opt, const char *arg) {
+    switch (opt) {
+    case 'M':
+        o->max_peers = atoi(arg);
+        return o->max_peers < 1 ? -1 : 0;
+    }
+    return -1;
+}
+
+enum ctrl_peer_state {
+    CTRL_PEER_FREE = 0,
+    CTRL_PEER_RECV_INFO,
+    CTRL_PEER_BINDING,
+    CTRL_PEER_SEND_INFO,
+    CTRL_PEER_CONNECTED,
+};
+
+struct ctrl_peer {
+    int fd;
+    int state;
+    struct ibv_qp *qp;
+    struct ibv_mw *mw;
+    uint32_t bind_rkey;         /* rkey of the bind in flight */
+    struct ib_info local;
+    struct ib_info remote;
+    uint8_t msg[CTRL_MSG_MAX];
+    size_t msg_len;             /* bytes to move in the current state */
+    size_t io_done;
+    uint64_t writes;
+    long long t_accept;
+    long long t_first_write;
+    struct ctrl_peer *next_by_qpn;
+};
+
+struct ctrl_server {
+    struct ib_res *ib_res;
+    int listen_fd;
+    int epfd;
+    char *buf;
+    struct ibv_mr *mr;
+    int max_peers;
+    int active;
+    int accepted;
+    int refused;
+    int closed;
+    uint64_t writes;
+    uint64_t stray;
+    struct ctrl_peer *peers;
+    int *free_slots;
+    int nfree;
+    struct ctrl_peer *by_qpn[CTRL_QPN_BUCKETS];
+    struct lat_stats setup;         /* accept -> reply sent */
+    struct lat_stats first_write;   /* accept -> first write-with-imm */
+};
+
+static struct ctrl_peer **ctrl_qpn_bucket(struct ctrl_server *srv, uint32_t qpn) {
+    return &srv->by_qpn[qpn % CTRL_QPN_BUCKETS];
+}
+
+static struct ctrl_peer *ctrl_peer_by_qpn(struct ctrl_server *srv, uint32_t qpn) {
+    struct ctrl_peer *p = *ctrl_qpn_bucket(srv, qpn);
+
+    while (p && p->qp->qp_num != qpn)
+        p = p->next_by_qpn;
+    return p;
+}
+
+static void ctrl_recv_cqe(void *arg, const struct ibv_wc *wc) {
+    struct ctrl_server *srv = arg;
+    struct ctrl_peer *p = ctrl_peer_by_qpn(srv, wc->qp_num);
+
+    if (!p || wc->status != IBV_WC_SUCCESS) {
+        srv->stray++;
+        return;
+    }
+    if (p->writes++ == 0) {
+        p->t_first_write = gfp_get_time();
+        lat_stats_add(&srv->first_write, p->t_first_write - p->t_accept);
+    }
+    srv->writes++;
+}
+
+static void ctrl_bind_cqe(void *arg, const struct ibv_wc *wc);
+
+static int ctrl_epoll(struct ctrl_server *srv, int op, int fd, uint32_t events, uint64_t token) {
+    struct epoll_event ev = { .events = events, .data.u64 = token };
+
+    if (epoll_ctl(srv->epfd, op, fd, &ev)) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Set up the listener on `port` and the slot buffer. The ib_res must
+ * have an SRQ ring: peer QPs get no receive queue of their own.
+ */
+int ctrl_server_init(struct ctrl_server *srv, struct ib_res *ib_res, int max_peers, in_port_t port) {
+    struct sockaddr_in addr;
+    int option = 1;
+
+    memset(srv, 0, sizeof(*srv));
+    srv->ib_res = ib_res;
+    srv->listen_fd = -1;
+    srv->epfd = -1;
+    srv->max_peers = max_peers;
+    if (!ib_res->srq.srq) {
+        fprintf(stderr, "multi-peer control plane needs an SRQ (-R > 0)\n");
+        return -1;
+    }
+
+    srv->buf = memalign(getpagesize(), (size_t)max_peers * CTRL_SLOT_SIZE);
+    srv->peers = calloc(max_peers, sizeof(*srv->peers));
+    srv->free_slots = malloc(max_peers * sizeof(*srv->free_slots));
+    if (!srv->buf || !srv->peers || !srv->free_slots) {
+        perror("malloc");
+        return -1;
+    }
+    memset(srv->buf, 0, (size_t)max_peers * CTRL_SLOT_SIZE);
+    // Hand out low slots first
+    for (int i = 0; i < max_peers; i++)
+        srv->free_slots[i] = max_peers - 1 - i;
+    srv->nfree = max_peers;
+    srv->mr = ibv_reg_mr(ib_res->pd, srv->buf, (size_t)max_peers * CTRL_SLOT_SIZE,
+                         IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_MW_BIND);
+    if (!srv->mr) {
+        perror("ibv_reg_mr");
+        return -1;
+    }
+    if (lat_stats_init(&srv->setup, max_peers) || lat_stats_init(&srv->first_write, max_peers))
+        return -1;
+
+    srv->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (srv->listen_fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(srv->listen_fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(srv->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        return -1;
+    }
+    if (listen(srv->listen_fd, CTRL_BACKLOG) < 0) {
+        perror("listen");
+        return -1;
+    }
+
+    srv->epfd = epoll_create1(0);
+    if (srv->epfd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    if (ctrl_epoll(srv, EPOLL_CTL_ADD, srv->listen_fd, EPOLLIN, CTRL_EV_LISTEN))
+        return -1;
+    if (cq_engine_fd(&ib_res->cq_eng) >= 0 &&
+        ctrl_epoll(srv, EPOLL_CTL_ADD, cq_engine_fd(&ib_res->cq_eng), EPOLLIN, CTRL_EV_CQ))
+        return -1;
+    if (ctrl_epoll(srv, EPOLL_CTL_ADD, srq_ring_fd(&ib_res->srq), EPOLLIN, CTRL_EV_ASYNC))
+        return -1;
+    cq_engine_register(&ib_res->cq_eng, WRID_CLASS_RECV, ctrl_recv_cqe, srv);
+    cq_engine_register(&ib_res->cq_eng, WRID_CLASS_CTRL, ctrl_bind_cqe, srv);
+    return 0;
+}
+
+static void ctrl_peer_close(struct ctrl_server *srv, struct ctrl_peer *p) {
+    struct ctrl_peer **pp;
+
+    epoll_ctl(srv->epfd, EPOLL_CTL_DEL, p->fd, NULL);
+    close(p->fd);
+    if (p->qp) {
+        for (pp = ctrl_qpn_bucket(srv, p->qp->qp_num); *pp; pp = &(*pp)->next_by_qpn) {
+            if (*pp == p) {
+                *pp = p->next_by_qpn;
+                break;
+            }
+        }
+    }
+    if (p->mw) ibv_dealloc_mw(p->mw);
+    if (p->qp) ibv_destroy_qp(p->qp);
+    memset(p, 0, sizeof(*p));
+    srv->free_slots[srv->nfree++] = p - srv->peers;
+    srv->active--;
+    srv->closed++;
+}
+
+static void ctrl_accept(struct ctrl_server *srv) {
+    while (1) {
+        struct ctrl_peer *p;
+        int fd, one = 1;
+
+        fd = accept(srv->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("accept");
+            return;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        if (srv->nfree == 0) {
+            srv->refused++;
+            close(fd);
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        p = &srv->peers[srv->free_slots[--srv->nfree]];
+        p->fd = fd;
+        p->state = CTRL_PEER_RECV_INFO;
+        p->msg_len = WIRE_HDR_SIZE;
+        p->t_accept = gfp_get_time();
+        srv->active++;
+        srv->accepted++;
+        if (ctrl_epoll(srv, EPOLL_CTL_ADD, fd, EPOLLIN, p - srv->peers))
+            ctrl_peer_close(srv, p);
+    }
+}
+
+// Everything the peer needs is known once its ib_info is in
+static int ctrl_peer_setup(struct ctrl_server *srv, struct ctrl_peer *p) {
+    struct ib_res *ib_res = srv->ib_res;
+    char *slot = srv->buf + (size_t)(p - srv->peers) * CTRL_SLOT_SIZE;
+    struct ibv_mw_bind_info bind_info = {
+        .mr = srv->mr,
+        .addr = (uintptr_t)slot,
+        .length = CTRL_SLOT_SIZE,
+        .mw_access_flags = IBV_ACCESS_REMOTE_WRITE,
+    };
+    struct ctrl_peer **bucket;
+
+    p->qp = create_qp(ib_res);
+    if (!p->qp)
+        return -1;
+    bucket = ctrl_qpn_bucket(srv, p->qp->qp_num);
+    p->next_by_qpn = *bucket;
+    *bucket = p;
+    if (connect_peer_qp(ib_res, p->qp, 0, &p->remote))
+        return -1;
+    p->mw = ibv_alloc_mw(ib_res->pd, IBV_MW_TYPE_2);
+    if (!p->mw) {
+        perror("ibv_alloc_mw");
+        return -1;
+    }
+    // The reply goes out from ctrl_bind_cqe(); other peers carry on meanwhile
+    p->bind_rkey = mw_next_rkey(p->mw);
+    return post_bind_mw(ib_res, p->qp, p->mw, p->bind_rkey, &bind_info,
+                        WRID(WRID_CLASS_CTRL, p - srv->peers), 1);
+}
+
+// The window is bound: encode the reply
+static void ctrl_peer_reply(struct ctrl_server *srv, struct ctrl_peer *p) {
+    char *slot = srv->buf + (size_t)(p - srv->peers) * CTRL_SLOT_SIZE;
+    struct wire_region region;
+    struct wire_info w;
+
+    p->local = srv->ib_res->local_info;
+    p->local.qpn = p->qp->qp_num;
+    p->local.psn = 0;
+    p->local.buf_va = (uintptr_t)slot;
+    p->local.buf_rkey = p->mw->rkey;
+    ib_info_to_wire(&p->local, &w);
+    region.addr = (uintptr_t)slot;
+    region.length = CTRL_SLOT_SIZE;
+    region.rkey = p->mw->rkey;
+    region.access = IBV_ACCESS_REMOTE_WRITE;
+    w.regions = &region;
+    w.nregions = 1;
+    p->msg_len = wire_encode_info(&w, p->msg);
+    p->io_done = 0;
+}
+
+/*
+ * Advance one peer's handshake as far as its socket allows. Returns -1 if
+ * the peer is gone or broken and has to be closed.
+ */
+static int ctrl_peer_io(struct ctrl_server *srv, struct ctrl_peer *p) {
+    struct wire_info w;
+    ssize_t n;
+
+    switch (p->state) {
+    case CTRL_PEER_RECV_INFO:
+        // Header first, it says how much body follows
+        while (p->io_done < p->msg_len) {
+            n = recv(p->fd, p->msg + p->io_done, p->msg_len - p->io_done, 0);
+            if (n == 0)
+                return -1;
+            if (n < 0)
+                return errno == EAGAIN || errno == EINTR ? 0 : -1;
+            p->io_done += n;
+            if (p->io_done == WIRE_HDR_SIZE && p->msg_len == WIRE_HDR_SIZE) {
+                long len = wire_decode_hdr(p->msg, WIRE_MSG_INFO);
+
+                if (len < 0 || len > CTRL_MSG_MAX - WIRE_HDR_SIZE)
+                    return -1;
+                p->msg_len += len;
+            }
+        }
+        if (wire_decode_info(p->msg + WIRE_HDR_SIZE, p->msg_len - WIRE_HDR_SIZE, &w))
+            return -1;
+        ib_info_from_wire(&w, &p->remote);
+        wire_info_free(&w);
+        if (ctrl_peer_setup(srv, p))
+            return -1;
+        p->state = CTRL_PEER_BINDING;
+        return 0;
+    case CTRL_PEER_SEND_INFO:
+        while (p->io_done < p->msg_len) {
+            n = send(p->fd, p->msg + p->io_done, p->msg_len - p->io_done, MSG_NOSIGNAL);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR))
+                return ctrl_epoll(srv, EPOLL_CTL_MOD, p->fd, EPOLLOUT, p - srv->peers);
+            if (n < 0)
+                return -1;
+            p->io_done += n;
+        }
+        p->state = CTRL_PEER_CONNECTED;
+        lat_stats_add(&srv->setup, gfp_get_time() - p->t_accept);
+        return ctrl_epoll(srv, EPOLL_CTL_MOD, p->fd, EPOLLIN, p - srv->peers);
+    case CTRL_PEER_BINDING:
+    case CTRL_PEER_CONNECTED: {
+        char scratch[64];
+
+        // Nothing is expected after the INFO; EOF means the peer left
+        while ((n = recv(p->fd, scratch, sizeof(scratch), 0)) > 0)
+            ;
+        if (n == 0 || (errno != EAGAIN && errno != EINTR))
+            return -1;
+        return 0;
+    }
+    }
+    return -1;
+}
+
+/*
+ * A peer's bind completed. The slot may have been closed and reused since
+ * the bind was posted, so the CQE only counts if it came from that peer's
+ * current QP.
+ */
+static void ctrl_bind_cqe(void *arg, const struct ibv_wc *wc) {
+    struct ctrl_server *srv = arg;
+    uint64_t idx = WRID_IDX(wc->wr_id);
+    struct ctrl_peer *p = idx < (uint64_t)srv->max_peers ? &srv->peers[idx] : NULL;
+
+    if (!p || p->state != CTRL_PEER_BINDING || p->qp->qp_num != wc->qp_num) {
+        srv->stray++;
+        return;
+    }
+    if (wc->status != IBV_WC_SUCCESS) {
+        ctrl_peer_close(srv, p);
+        return;
+    }
+    p->mw->rkey = p->bind_rkey;
+    ctrl_peer_reply(srv, p);
+    p->state = CTRL_PEER_SEND_INFO;
+    if (ctrl_peer_io(srv, p))
+        ctrl_peer_close(srv, p);
+}
+
+/*
+ * Serve until `total` peers have connected and every one of them has
+ * disconnected again. Completions are reaped between epoll rounds; with a
+ * completion channel the CQ is re-armed before each wait so a CQE never
+ * sits unnoticed.
+ */
+int ctrl_server_run(struct ctrl_server *srv, int total) {
+    struct cq_engine *eng = &srv->ib_res->cq_eng;
+    struct epoll_event events[CTRL_MAX_EVENTS];
+    int has_channel = cq_engine_fd(eng) >= 0;
+
+    while (srv->accepted < total || srv->active > 0) {
+        int n;
+
+        if (has_channel && cq_engine_arm(eng))
+            return -1;
+        while ((n = cq_engine_poll(eng)) > 0)
+            ;
+        if (n < 0)
+            return -1;
+        n = epoll_wait(srv->epfd, events, CTRL_MAX_EVENTS, has_channel ? -1 : 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            uint64_t token = events[i].data.u64;
+
+            if (token == CTRL_EV_LISTEN) {
+                ctrl_accept(srv);
+            } else if (token == CTRL_EV_CQ) {
+                if (cq_engine_get_event(eng) < 0)
+                    return -1;
+            } else if (token == CTRL_EV_ASYNC) {
+                if (srq_ring_handle_async(&srv->ib_res->srq) < 0)
+                    return -1;
+            } else {
+                struct ctrl_peer *p = &srv->peers[token];
+
+                if (p->state != CTRL_PEER_FREE && ctrl_peer_io(srv, p))
+                    ctrl_peer_close(srv, p);
+            }
+        }
+    }
+    return 0;
+}
+
+void ctrl_server_report(struct ctrl_server *srv) {
+    struct lat_summary sum;
+
+    printf("control plane: %d peers accepted, %d refused, %lu writes, %lu unattributed CQEs\n",
+           srv->accepted, srv->refused, (unsigned long)srv->writes, (unsigned long)srv->stray);
+    lat_stats_summarize(&srv->setup, &sum);
+    lat_summary_print(stdout, "accept->connected", &sum);
+    lat_stats_summarize(&srv->first_write, &sum);
+    lat_summary_print(stdout, "accept->first write", &sum);
+}
+
+void ctrl_server_destroy(struct ctrl_server *srv) {
+    for (int i = 0; srv->peers && i < srv->max_peers; i++)
+        if (srv->peers[i].state != CTRL_PEER_FREE)
+            ctrl_peer_close(srv, &srv->peers[i]);
+    if (srv->ib_res) {
+        cq_engine_register(&srv->ib_res->cq_eng, WRID_CLASS_RECV, NULL, NULL);
+        cq_engine_register(&srv->ib_res->cq_eng, WRID_CLASS_CTRL, NULL, NULL);
+    }
+    if (srv->epfd >= 0) close(srv->epfd);
+    if (srv->listen_fd >= 0) close(srv->listen_fd);
+    if (srv->mr) ibv_dereg_mr(srv->mr);
+    lat_stats_free(&srv->setup);
+    lat_stats_free(&srv->first_write);
+    free(srv->buf);
+    free(srv->peers);
+    free(srv->free_slots);
+    memset(srv, 0, sizeof(*srv));
+    srv->listen_fd = -1;
+    srv->epfd = -1;
+}
+
+/*
+ * Client side, blocking: connect to the control plane and send our
+ * ib_info for `qp`. Returns the socket, which must stay open for as long
+ * as the QP is in use, or -1.
+ */
+int ctrl_client_start(const char *server_ip, in_port_t port, const struct ib_info *local) {
+    struct sockaddr_in addr;
+    struct wire_info w;
+    int fd, one = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, server_ip, &addr.sin_addr) <= 0) {
+        perror("inet_pton");
+        close(fd);
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+    ib_info_to_wire(local, &w);
+    if (wire_send_info(fd, &w)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Wait for the server's reply on a socket from ctrl_client_start()
+int ctrl_client_finish(int fd, struct ib_info *remote) {
+    struct wire_info w;
+
+    if (wire_recv_info(fd, &w)) {
+        fprintf(stderr, "control plane reply failed\n");
+        return -1;
+    }
+    ib_info_from_wire(&w, remote);
+    wire_info_free(&w);
+    return 0;
+}
+
+#endif /* CTRL_H */
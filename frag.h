@@ -0,0 +1,271 @@
+#ifndef FRAG_H
+#define FRAG_H
+
+#include "gfp.h"
+
+/*
+ * Large-object transfer over UC write-with-imm.
+ *
+ * An object is cut into chunk_size pieces (default PKTSZ, one MTU) described
+ * by struct fragment_info, and every piece is written to the same offset in
+ * the remote window as a WRITE_WITH_IMM whose immediate is
+ * (xfer_id << 16 | chunk_id). Chunks are posted as WR chains with one
+ * signaled WR per chain. The sender keeps at most FRAG_RECV_DEPTH chunks
+ * in its send queue, the receives the receiver starts out with. That is
+ * only a heuristic that keeps bursts to the size of the RQ: a UC send CQE
+ * says the chunk left, not that a receive took it or was reposted, so a
+ * sender faster than the receiver's reposting can still overrun the RQ.
+ * Chunks lost that way show up as missing like any other loss.
+ *
+ * The receiver marks arrivals in a bitmap and reports the object complete
+ * only when every bit is set. UC drops silently, but it never reorders on
+ * one QP: once the last chunk has arrived, any clear bit is a lost chunk.
+ * If the last chunk itself is lost, an idle timeout catches it.
+ */
+
+#define FRAG_OPTSTRING "x:C:"
+#define FRAG_OPTUSAGE "[-x object_size] [-C chunk_size]"
+#define FRAG_MAX_CHUNKS 65536
+#define FRAG_CHAIN_MAX 32
+#define FRAG_RECV_DEPTH 256         /* receives the receiver posts, and the send window */
+#define FRAG_IDLE_TIMEOUT_NS 200000000LL
+#define FRAG_IMM(xfer, chunk) htonl(((uint32_t)(xfer) << 16) | (uint16_t)(chunk))
+#define FRAG_IMM_XFER(imm) (ntohl(imm) >> 16)
+#define FRAG_IMM_CHUNK(imm) (ntohl(imm) & 0xffff)
+
+struct frag_opts {
+    size_t obj_size;
+    size_t chunk_size;
+};
+
+void frag_opts_init(struct frag_opts *o) {
+    memset(o, 0, sizeof(*o));
+    o->chunk_size = PKTSZ;
+}
+
+int parse_frag_opt(struct frag_opts *o, int opt, const char *arg) {
+    switch (opt) {
+    case 'x':
+        o->obj_size = strtoull(arg, NULL, 0);
+        return o->obj_size == 0 ? -1 : 0;
+    case 'C':
+        o->chunk_size = strtoull(arg, NULL, 0);
+        return o->chunk_size == 0 ? -1 : 0;
+    }
+    return -1;
+}
+
+static inline uint32_t frag_nchunks(size_t len, size_t chunk_size) {
+    return (len + chunk_size - 1) / chunk_size;
+}
+
+/*
+ * Describe `buf` as chunks. Returns the chunk count, or -1 if the object
+ * needs more than FRAG_MAX_CHUNKS chunks.
+ */
+int frag_split(char *buf, size_t len, size_t chunk_size, struct fragment_info *frags) {
+    uint32_t n = frag_nchunks(len, chunk_size);
+
+    if (n > FRAG_MAX_CHUNKS) {
+        fprintf(stderr, "object of %zu bytes needs %u chunks, max %d\n", len, n, FRAG_MAX_CHUNKS);
+        return -1;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        frags[i].frag_ptr = buf + (size_t)i * chunk_size;
+        frags[i].chunk_id = i;
+    }
+    return n;
+}
+
+struct frag_tx {
+    uint64_t posted;
+    uint64_t retired;
+};
+
+static void frag_tx_retire(void *arg, const struct ibv_wc *wc) {
+    struct frag_tx *tx = arg;
+
+    tx->retired += WRID_IDX(wc->wr_id);
+}
+
+/*
+ * Write `len` bytes of `buf` (inside `mr`) to remote_addr/rkey as transfer
+ * `xfer_id`. Returns once every chunk has left the send queue.
+ */
+int frag_send(struct ib_res *ib_res, struct ibv_mr *mr, char *buf, size_t len,
+              uint64_t remote_addr, uint32_t rkey, uint16_t xfer_id, size_t chunk_size) {
+    struct cq_engine *eng = &ib_res->cq_eng;
+    struct ibv_send_wr wrs[FRAG_CHAIN_MAX], *bad_wr;
+    struct ibv_sge sges[FRAG_CHAIN_MAX];
+    struct fragment_info *frags;
+    struct frag_tx tx = { 0 };
+    int nchunks, ret = -1;
+
+    frags = malloc(sizeof(*frags) * frag_nchunks(len, chunk_size));
+    if (!frags) {
+        perror("malloc");
+        return -1;
+    }
+    nchunks = frag_split(buf, len, chunk_size, frags);
+    if (nchunks < 0)
+        goto cleanup;
+
+    cq_engine_register(eng, WRID_CLASS_SEND, frag_tx_retire, &tx);
+    for (int i = 0; i < nchunks; ) {
+        int n = nchunks - i < FRAG_CHAIN_MAX ? nchunks - i : FRAG_CHAIN_MAX;
+
+        while (tx.posted - tx.retired + n > FRAG_RECV_DEPTH) {
+            if (cq_engine_poll(eng) < 0 || eng->failed[WRID_CLASS_SEND])
+                goto cleanup;
+        }
+        for (int k = 0; k < n; k++) {
+            struct fragment_info *f = &frags[i + k];
+            size_t off = f->frag_ptr - buf;
+
+            sges[k].addr = (uintptr_t)f->frag_ptr;
+            sges[k].length = len - off < chunk_size ? len - off : chunk_size;
+            sges[k].lkey = mr->lkey;
+            memset(&wrs[k], 0, sizeof(wrs[k]));
+            wrs[k].sg_list = &sges[k];
+            wrs[k].num_sge = 1;
+            wrs[k].opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+            wrs[k].imm_data = FRAG_IMM(xfer_id, f->chunk_id);
+            wrs[k].wr.rdma.remote_addr = remote_addr + off;
+            wrs[k].wr.rdma.rkey = rkey;
+            wrs[k].next = k + 1 < n ? &wrs[k + 1] : NULL;
+        }
+        // One CQE per chain retires the whole chain
+        wrs[n - 1].wr_id = WRID(WRID_CLASS_SEND, n);
+        wrs[n - 1].send_flags = IBV_SEND_SIGNALED;
+        if (ib_post_send(ib_res, ib_res->qp, wrs, &bad_wr)) {
+            perror("ibv_post_send");
+            goto cleanup;
+        }
+        tx.posted += n;
+        i += n;
+    }
+    while (tx.retired < tx.posted) {
+        if (cq_engine_poll(eng) < 0 || eng->failed[WRID_CLASS_SEND])
+            goto cleanup;
+    }
+    ret = 0;
+
+cleanup:
+    cq_engine_register(eng, WRID_CLASS_SEND, NULL, NULL);
+    free(frags);
+    return ret;
+}
+
+struct frag_rx {
+    uint16_t xfer_id;
+    uint32_t nchunks;
+    uint32_t received;
+    uint32_t duplicates;
+    uint32_t foreign;
+    int last_seen;
+    int to_repost;
+    long long last_arrival;
+    uint64_t *bitmap;
+};
+
+int frag_rx_init(struct frag_rx *rx, uint16_t xfer_id, size_t len, size_t chunk_size) {
+    memset(rx, 0, sizeof(*rx));
+    rx->xfer_id = xfer_id;
+    rx->nchunks = frag_nchunks(len, chunk_size);
+    if (rx->nchunks > FRAG_MAX_CHUNKS) {
+        fprintf(stderr, "object of %zu bytes needs %u chunks, max %d\n", len, rx->nchunks, FRAG_MAX_CHUNKS);
+        return -1;
+    }
+    rx->bitmap = calloc((rx->nchunks + 63) / 64, sizeof(uint64_t));
+    if (!rx->bitmap) {
+        perror("calloc");
+        return -1;
+    }
+    return 0;
+}
+
+void frag_rx_free(struct frag_rx *rx) {
+    free(rx->bitmap);
+    rx->bitmap = NULL;
+}
+
+static inline int frag_rx_complete(const struct frag_rx *rx) {
+    return rx->received == rx->nchunks;
+}
+
+static void frag_rx_cqe(void *arg, const struct ibv_wc *wc) {
+    struct frag_rx *rx = arg;
+    uint32_t chunk;
+
+    rx->to_repost++;
+    if (wc->status != IBV_WC_SUCCESS)
+        return;
+    chunk = FRAG_IMM_CHUNK(wc->imm_data);
+    if (FRAG_IMM_XFER(wc->imm_data) != rx->xfer_id || chunk >= rx->nchunks) {
+        rx->foreign++;
+        return;
+    }
+    if (rx->bitmap[chunk / 64] & (1ULL << (chunk % 64))) {
+        rx->duplicates++;
+        return;
+    }
+    rx->bitmap[chunk / 64] |= 1ULL << (chunk % 64);
+    rx->received++;
+    if (chunk == rx->nchunks - 1)
+        rx->last_seen = 1;
+}
+
+// Fill `missing` with up to `max` chunk ids that have not arrived; returns the total missing
+uint32_t frag_rx_missing(const struct frag_rx *rx, uint16_t *missing, uint32_t max) {
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < rx->nchunks; i++) {
+        if (!(rx->bitmap[i / 64] & (1ULL << (i % 64)))) {
+            if (n < max)
+                missing[n] = i;
+            n++;
+        }
+    }
+    return n;
+}
+
+/*
+ * Wait for transfer rx->xfer_id, replenishing receive WRs as chunks
+ * arrive. The caller must have FRAG_RECV_DEPTH receives posted, or an
+ * SRQ ring attached.
+ * Returns 0 when the object is whole, 1 if chunks were lost (see
+ * frag_rx_missing()), -1 on error.
+ */
+int frag_recv(struct ib_res *ib_res, struct frag_rx *rx, long long idle_timeout_ns) {
+    struct cq_engine *eng = &ib_res->cq_eng;
+    int ret = -1;
+
+    cq_engine_register(eng, WRID_CLASS_RECV, frag_rx_cqe, rx);
+    rx->last_arrival = gfp_get_time();
+    while (!frag_rx_complete(rx)) {
+        int n = cq_engine_poll(eng);
+
+        if (n < 0)
+            goto out;
+        if (rx->to_repost) {
+            if (post_zero_recvs(ib_res, rx->to_repost))
+                goto out;
+            rx->to_repost = 0;
+            rx->last_arrival = gfp_get_time();
+        } else if (n == 0 && gfp_get_time() - rx->last_arrival > idle_timeout_ns) {
+            ret = 1;
+            goto out;
+        }
+        // In-order UC delivery: the last chunk with holes before it means loss
+        if (rx->last_seen && !frag_rx_complete(rx)) {
+            ret = 1;
+            goto out;
+        }
+    }
+    ret = 0;
+out:
+    cq_engine_register(eng, WRID_CLASS_RECV, NULL, NULL);
+    return ret;
+}
+
+#endif /* FRAG_H */
@@ -1,16 +1,95 @@
+#ifndef GFP_H
+#define GFP_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <malloc.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <infiniband/verbs.h>
+#include "cq_ts.h"
+#include "metrics.h"
+#include "topo.h"
+#include "wire.h"
 
 
 #define PORT 28515
 #define PKTSZ 4096
 #define GRH_HEADER 40
 #define NPOSTRECV 32768
+#define MAX_SEND_WR 512
+#define MAX_RECV_WR 512
+#define MAX_SEND_SGE 2
+#define INLINE_DEFAULT 256      /* inline bytes asked for when ib_res.max_inline is 0 */
+
+/* RC connection parameters, only applied when ib_res.qp_type is IBV_QPT_RC */
+#define RC_TIMEOUT 14           /* 4.096us * 2^14 ~= 67ms local ACK timeout */
+#define RC_RETRY_CNT 7
+#define RC_RNR_RETRY 7          /* 7 = retry forever */
+#define RC_MIN_RNR_TIMER 12     /* 0.64ms */
+#define RC_MAX_RD_ATOMIC 1
+
+/*
+ * wr_id layout: the top byte selects the completion class (and so the
+ * handler the CQ engine dispatches to), the low 56 bits are free for the
+ * caller, e.g. a buffer index.
+ */
+#define WRID_CLASS_SHIFT 56
+#define WRID(cls, idx) (((uint64_t)(cls) << WRID_CLASS_SHIFT) | (uint64_t)(idx))
+#define WRID_CLASS(wr_id) ((unsigned)((wr_id) >> WRID_CLASS_SHIFT) & (WRID_MAX_CLASS - 1))
+#define WRID_IDX(wr_id) ((wr_id) & ((1ULL << WRID_CLASS_SHIFT) - 1))
+#define WRID_MAX_CLASS 16
+
+enum wrid_class {
+    WRID_CLASS_MISC = 0,
+    WRID_CLASS_RECV,
+    WRID_CLASS_SEND,
+    WRID_CLASS_BIND,
+    WRID_CLASS_INV,
+    WRID_CLASS_MW_POOL,
+    WRID_CLASS_CREDIT,
+    WRID_CLASS_ACK,
+    WRID_CLASS_ROTATE,
+    WRID_CLASS_CTRL,
+};
+
+#define CQ_BATCH_MAX 64
+#define CQ_BATCH_DEFAULT 16
+#define CQ_SPIN_NS_DEFAULT 20000
+#define CQ_EVENTS_ACK_BATCH 64
+
+#define SRQ_DEPTH_DEFAULT 4096
+#define SRQ_REPOST_BATCH 64
+
+/*
+ * How cq_engine_wait() waits for a CQE:
+ * POLL spins on the CQ, EVENT arms the CQ and sleeps on the completion
+ * channel, HYBRID spins for spin_ns and then falls back to EVENT.
+ */
+enum cq_mode {
+    CQ_MODE_POLL = 0,
+    CQ_MODE_EVENT,
+    CQ_MODE_HYBRID,
+};
+
+/*
+ * Verbs used on the data path. LEGACY posts struct ibv_send_wr chains with
+ * ibv_post_send() and polls with ibv_poll_cq(). EX creates the QPs with
+ * ibv_create_qp_ex() and posts through ibv_wr_start()/ibv_wr_*()/
+ * ibv_wr_complete(), and the CQ with ibv_create_cq_ex(), polled with
+ * ibv_start_poll()/ibv_next_poll().
+ */
+enum post_api {
+    POST_API_LEGACY = 0,
+    POST_API_EX,
+};
 
 struct ib_info {
     uint16_t lid;
@@ -22,17 +101,87 @@ struct ib_info {
     uint32_t buf_rkey; 
 };
 
+typedef void (*cqe_handler_t)(void *arg, const struct ibv_wc *wc);
+
+/*
+ * Receive ring on a shared receive queue. Every WR is a zero-SGE receive:
+ * write-with-imm and zero-length sends only need a WR to complete against.
+ * The CQ engine reports each reaped RECV-class CQE through
+ * srq_ring_consumed(); once fewer than `watermark` WRs are left the ring is
+ * topped up again in chains of SRQ_REPOST_BATCH, one doorbell per chain.
+ * The SRQ limit is armed lower, at `limit`, as a backstop for a consumer
+ * that is asleep or slow to reap: it shows up on the async event fd.
+ */
+struct srq_ring {
+    struct ibv_context *context;
+    struct ibv_srq *srq;
+    uint32_t depth;
+    uint32_t watermark;
+    uint32_t limit;
+    uint32_t posted;
+    int limit_armed;
+    uint64_t refills;
+    uint64_t limit_events;
+    struct ibv_recv_wr wrs[SRQ_REPOST_BATCH];
+};
+
+/*
+ * Drains up to `batch` CQEs per ibv_poll_cq and dispatches each one by
+ * wr_id class. Successful completions only bump counters and call the
+ * registered handler; failed ones are reported once on stderr.
+ */
+struct cq_engine {
+    struct ibv_cq *cq;
+    struct ibv_cq_ex *cq_ex;    /* set when the CQ was made with ibv_create_cq_ex() */
+    struct ibv_comp_channel *channel;
+    struct srq_ring *srq;
+    int batch;
+    int mode;
+    long long spin_ns;
+    unsigned events_unacked;
+    uint64_t sleeps;
+    cqe_handler_t handler[WRID_MAX_CLASS];
+    void *handler_arg[WRID_MAX_CLASS];
+    uint64_t done[WRID_MAX_CLASS];
+    uint64_t failed[WRID_MAX_CLASS];
+    struct ibv_wc last[WRID_MAX_CLASS];
+    struct ibv_wc wc[CQ_BATCH_MAX];
+    struct cq_ts *ts;           /* completion timing, NULL when off */
+    uint64_t wc_ts[CQ_BATCH_MAX];   /* raw NIC timestamps of wc[] when ts->hw */
+    struct metrics_block *metrics;  /* exported counters, NULL when off */
+};
+
 struct ib_res {
     struct ibv_device **dev_list;
     struct ibv_device *ib_dev;
     struct ibv_context *context;
     struct ibv_pd *pd;
     struct ibv_cq *cq;
+    struct ibv_cq_ex *cq_ex;
     struct ibv_qp *qp;
     struct ibv_mw *mw;
+    struct srq_ring srq;
+    struct cq_engine cq_eng;
     int gidx;
     int port;
+    uint8_t link_layer;
     struct ib_info local_info;
+    int numa_node;              /* the device's node, TOPO_NODE_ANY if unknown */
+    /* device/transport/completion config, set by the caller before prepare_ib_res() */
+    const char *dev_name;       /* NULL: a device on the caller's NUMA node */
+    int gidx_set;               /* gidx given (-G); otherwise picked for peer_addr */
+    const char *peer_addr;      /* peer's IP address, if known before prepare_ib_res() */
+    enum ibv_qp_type qp_type;
+    uint32_t max_inline;        /* requested (0: INLINE_DEFAULT); updated to what the QP got */
+    int cq_mode;
+    long long cq_spin_ns;
+    uint16_t cq_mod_count;
+    uint16_t cq_mod_period;
+    uint32_t srq_depth;         /* 0: receives go to the QP's own RQ */
+    int post_api;
+    int time_cqes;              /* time completions, on the NIC clock if there is one */
+    struct cq_ts ts;
+    const char *metrics_name;   /* shared memory segment to count into (-E), NULL: off */
 };
 
 
@@ -42,6 +191,8 @@ struct fragment_info {
 };
 
 
+
+
 static inline long long gfp_get_time(void)
 {
     struct timespec time;
@@ -54,19 +205,646 @@ static inline long long gfp_get_time(void)
 }
 
 
+/*
+ * Post `n` receives as chains of up to SRQ_REPOST_BATCH WRs. The chain
+ * in ring->wrs is linked once in srq_ring_create() and only cut here.
+ */
+static int srq_ring_post(struct srq_ring *ring, uint32_t n) {
+    struct ibv_recv_wr *bad_wr;
+
+    while (n) {
+        uint32_t k = n < SRQ_REPOST_BATCH ? n : SRQ_REPOST_BATCH;
+        int ret;
+
+        ring->wrs[k - 1].next = NULL;
+        ret = ibv_post_srq_recv(ring->srq, ring->wrs, &bad_wr);
+        if (k < SRQ_REPOST_BATCH)
+            ring->wrs[k - 1].next = &ring->wrs[k];
+        if (ret) {
+            fprintf(stderr, "ibv_post_srq_recv failed: %d\n", ret);
+            return -1;
+        }
+        ring->posted += k;
+        n -= k;
+    }
+    return 0;
+}
+
+// The limit event is one-shot; re-arm it every time the ring is full again
+static int srq_ring_arm_limit(struct srq_ring *ring) {
+    struct ibv_srq_attr attr = { .srq_limit = ring->limit };
+    int ret;
+
+    if (ring->limit_armed || !ring->limit)
+        return 0;
+    ret = ibv_modify_srq(ring->srq, &attr, IBV_SRQ_LIMIT);
+    if (ret) {
+        // Optional on some providers; the CQE-driven refill still works
+        fprintf(stderr, "ibv_modify_srq limit unsupported (%d), ignored\n", ret);
+        ring->limit = 0;
+        return 0;
+    }
+    ring->limit_armed = 1;
+    return 0;
+}
+
+int srq_ring_refill(struct srq_ring *ring) {
+    if (ring->posted >= ring->watermark)
+        return 0;
+    ring->refills++;
+    if (srq_ring_post(ring, ring->depth - ring->posted))
+        return -1;
+    return srq_ring_arm_limit(ring);
+}
+
+static inline int srq_ring_consumed(struct srq_ring *ring, uint32_t n) {
+    ring->posted -= n < ring->posted ? n : ring->posted;
+    return ring->posted < ring->watermark ? srq_ring_refill(ring) : 0;
+}
+
+int srq_ring_create(struct srq_ring *ring, struct ibv_context *context, struct ibv_pd *pd,
+                    uint32_t depth) {
+    struct ibv_srq_init_attr attr;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&attr, 0, sizeof(attr));
+    attr.attr.max_wr = depth;
+    attr.attr.max_sge = 1;
+    ring->srq = ibv_create_srq(pd, &attr);
+    if (!ring->srq) {
+        perror("ibv_create_srq");
+        return -1;
+    }
+    ring->context = context;
+    // The provider may round the depth up
+    ring->depth = attr.attr.max_wr > depth ? depth : attr.attr.max_wr;
+    ring->watermark = ring->depth / 2 ? ring->depth / 2 : 1;
+    ring->limit = ring->depth / 8;
+    for (int i = 0; i < SRQ_REPOST_BATCH; i++) {
+        ring->wrs[i].wr_id = WRID(WRID_CLASS_RECV, 0);
+        ring->wrs[i].sg_list = NULL;
+        ring->wrs[i].num_sge = 0;
+        ring->wrs[i].next = i + 1 < SRQ_REPOST_BATCH ? &ring->wrs[i + 1] : NULL;
+    }
+    // Limit events arrive on the async fd, which is only ever polled
+    fcntl(context->async_fd, F_SETFL, fcntl(context->async_fd, F_GETFL) | O_NONBLOCK);
+    if (srq_ring_post(ring, ring->depth))
+        return -1;
+    return srq_ring_arm_limit(ring);
+}
+
+void srq_ring_destroy(struct srq_ring *ring) {
+    if (ring->srq) ibv_destroy_srq(ring->srq);
+    ring->srq = NULL;
+}
+
+// Async event fd for poll/epoll integration; pair with srq_ring_handle_async()
+int srq_ring_fd(struct srq_ring *ring) {
+    return ring->srq ? ring->context->async_fd : -1;
+}
+
+/*
+ * Drain pending async events. An SRQ limit event tops the ring up as far
+ * as the reaped CQEs allow; the caller's next CQ poll does the rest.
+ * Returns the number of events consumed, or -1.
+ */
+int srq_ring_handle_async(struct srq_ring *ring) {
+    struct ibv_async_event ev;
+    int n = 0;
+
+    while (ibv_get_async_event(ring->context, &ev) == 0) {
+        if (ev.event_type == IBV_EVENT_SRQ_LIMIT_REACHED && ev.element.srq == ring->srq) {
+            ring->limit_events++;
+            ring->limit_armed = 0;
+        } else {
+            fprintf(stderr, "async event: %s\n", ibv_event_type_str(ev.event_type));
+        }
+        ibv_ack_async_event(&ev);
+        n++;
+    }
+    if (errno != EAGAIN) {
+        perror("ibv_get_async_event");
+        return -1;
+    }
+    if (n && !ring->limit_armed) {
+        if (ring->posted < ring->depth && srq_ring_post(ring, ring->depth - ring->posted))
+            return -1;
+        ring->refills++;
+        if (srq_ring_arm_limit(ring))
+            return -1;
+    }
+    return n;
+}
+
+void cq_engine_init(struct cq_engine *eng, struct ibv_cq *cq, int batch) {
+    memset(eng, 0, sizeof(*eng));
+    eng->cq = cq;
+    eng->channel = cq->channel;
+    if (batch < 1)
+        batch = 1;
+    eng->batch = batch > CQ_BATCH_MAX ? CQ_BATCH_MAX : batch;
+    eng->mode = CQ_MODE_POLL;
+    eng->spin_ns = CQ_SPIN_NS_DEFAULT;
+}
+
+/*
+ * Completion channel fd for epoll/poll integration; -1 if the CQ was
+ * created without a channel. Call cq_engine_arm() before waiting on it
+ * and cq_engine_handle_event() when it becomes readable.
+ */
+int cq_engine_fd(struct cq_engine *eng) {
+    return eng->channel ? eng->channel->fd : -1;
+}
+
+int cq_engine_arm(struct cq_engine *eng) {
+    int ret = ibv_req_notify_cq(eng->cq, 0);
+    if (ret)
+        fprintf(stderr, "ibv_req_notify_cq failed: %d\n", ret);
+    return ret;
+}
+
+/*
+ * Consume a pending notification from the (non-blocking) channel.
+ * Returns 1 if an event was consumed, 0 if none was pending, -1 on error.
+ * Acks are batched since ibv_ack_cq_events takes a lock.
+ */
+int cq_engine_get_event(struct cq_engine *eng) {
+    struct ibv_cq *ev_cq;
+    void *ev_ctx;
+
+    if (ibv_get_cq_event(eng->channel, &ev_cq, &ev_ctx)) {
+        if (errno == EAGAIN)
+            return 0;
+        perror("ibv_get_cq_event");
+        return -1;
+    }
+    if (++eng->events_unacked >= CQ_EVENTS_ACK_BATCH) {
+        ibv_ack_cq_events(eng->cq, eng->events_unacked);
+        eng->events_unacked = 0;
+    }
+    return 1;
+}
+
+void cq_engine_ack_events(struct cq_engine *eng) {
+    if (eng->events_unacked) {
+        ibv_ack_cq_events(eng->cq, eng->events_unacked);
+        eng->events_unacked = 0;
+    }
+}
+
+void cq_engine_register(struct cq_engine *eng, unsigned cls, cqe_handler_t handler, void *arg) {
+    eng->handler[cls & (WRID_MAX_CLASS - 1)] = handler;
+    eng->handler_arg[cls & (WRID_MAX_CLASS - 1)] = arg;
+}
+
+/*
+ * Extended CQ: read up to eng->batch CQEs in one ibv_start_poll() /
+ * ibv_end_poll() section and copy the fields the handlers use into
+ * eng->wc, so dispatch is the same for both CQ flavours.
+ */
+static inline int cq_engine_read_ex(struct cq_engine *eng) {
+    struct ibv_cq_ex *cq = eng->cq_ex;
+    struct ibv_poll_cq_attr attr = { 0 };
+    int n = 0, ret;
+
+    ret = ibv_start_poll(cq, &attr);
+    if (ret == ENOENT)
+        return 0;
+    if (ret) {
+        fprintf(stderr, "ibv_start_poll failed: %d\n", ret);
+        return -1;
+    }
+    do {
+        struct ibv_wc *wc = &eng->wc[n++];
+
+        wc->wr_id = cq->wr_id;
+        wc->status = cq->status;
+        wc->vendor_err = ibv_wc_read_vendor_err(cq);
+        wc->qp_num = ibv_wc_read_qp_num(cq);
+        // The remaining fields are only defined for successful completions
+        if (cq->status == IBV_WC_SUCCESS) {
+            wc->opcode = ibv_wc_read_opcode(cq);
+            wc->byte_len = ibv_wc_read_byte_len(cq);
+            wc->wc_flags = ibv_wc_read_wc_flags(cq);
+            // imm_data and invalidated_rkey share a union in struct ibv_wc
+            if (wc->wc_flags & IBV_WC_WITH_INV)
+                wc->invalidated_rkey = ibv_wc_read_invalidated_rkey(cq);
+            else
+                wc->imm_data = wc->wc_flags & IBV_WC_WITH_IMM ? ibv_wc_read_imm_data(cq) : 0;
+        } else {
+            wc->opcode = 0;
+            wc->byte_len = 0;
+            wc->wc_flags = 0;
+            wc->imm_data = 0;
+        }
+        if (eng->ts && eng->ts->hw)
+            eng->wc_ts[n - 1] = ibv_wc_read_completion_ts(cq);
+    } while (n < eng->batch && (ret = ibv_next_poll(cq)) == 0);
+    ibv_end_poll(cq);
+    if (ret && ret != ENOENT) {
+        fprintf(stderr, "ibv_next_poll failed: %d\n", ret);
+        return -1;
+    }
+    return n;
+}
+
+/*
+ * Poll the CQ once. Returns the number of CQEs consumed (0 if empty), or
+ * -1 if polling itself failed.
+ */
+static inline int cq_engine_poll(struct cq_engine *eng) {
+    int n = eng->cq_ex ? cq_engine_read_ex(eng) : ibv_poll_cq(eng->cq, eng->batch, eng->wc);
+    uint32_t nrecv = 0;
+    long long now = 0;
+
+    if (n < 0) {
+        fprintf(stderr, "CQ poll failed: %d\n", n);
+        return -1;
+    }
+    if (n && eng->ts)
+        now = cq_ts_now();
+    for (int i = 0; i < n; i++) {
+        struct ibv_wc *wc = &eng->wc[i];
+        unsigned cls = WRID_CLASS(wc->wr_id);
+
+        if (wc->status == IBV_WC_SUCCESS) {
+            eng->done[cls]++;
+        } else {
+            eng->failed[cls]++;
+            fprintf(stderr, "CQE error: wr_id %#lx class %u opcode %d: %s (vendor_err %#x)\n",
+                    (unsigned long)wc->wr_id, cls, wc->opcode,
+                    ibv_wc_status_str(wc->status), wc->vendor_err);
+        }
+        eng->last[cls] = *wc;
+        if (eng->ts)
+            cq_ts_complete(eng->ts, wc, cls == WRID_CLASS_RECV, eng->wc_ts[i], now);
+        if (eng->metrics)
+            metrics_cqe(eng->metrics, wc, cls == WRID_CLASS_RECV, !!eng->srq);
+        if (eng->handler[cls])
+            eng->handler[cls](eng->handler_arg[cls], wc);
+        // Flushed receives consume their WR too
+        nrecv += cls == WRID_CLASS_RECV;
+    }
+    if (nrecv && eng->srq && srq_ring_consumed(eng->srq, nrecv))
+        return -1;
+    if (eng->metrics)
+        metrics_polled(eng->metrics, n, eng->srq ? &eng->srq->posted : NULL);
+    return n;
+}
+
+/*
+ * Channel fd became readable: consume the event, re-arm and drain the CQ.
+ * Returns the number of CQEs dispatched or -1.
+ */
+int cq_engine_handle_event(struct cq_engine *eng) {
+    int n, total = 0;
+
+    if (cq_engine_get_event(eng) < 0)
+        return -1;
+    if (cq_engine_arm(eng))
+        return -1;
+    while ((n = cq_engine_poll(eng)) > 0)
+        total += n;
+    return n < 0 ? -1 : total;
+}
+
+/*
+ * Arm the CQ and sleep on the channel until it fires. The CQ is polled
+ * once after arming so a CQE that raced with the arm is not missed.
+ * With an SRQ attached its limit event also wakes the sleeper.
+ * Returns the number of CQEs reaped by that poll, 0 after a wakeup, or -1.
+ */
+static int cq_engine_sleep(struct cq_engine *eng) {
+    struct pollfd pfd[2];
+    int nfds = 1;
+    int n, ret;
+
+    if (cq_engine_arm(eng))
+        return -1;
+    n = cq_engine_poll(eng);
+    if (n != 0)
+        return n;
+
+    pfd[0].fd = eng->channel->fd;
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+    if (eng->srq) {
+        pfd[1].fd = srq_ring_fd(eng->srq);
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+        nfds = 2;
+    }
+    do {
+        ret = poll(pfd, nfds, -1);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        perror("poll");
+        return -1;
+    }
+    eng->sleeps++;
+    if (nfds == 2 && (pfd[1].revents & POLLIN) && srq_ring_handle_async(eng->srq) < 0)
+        return -1;
+    if (!(pfd[0].revents & POLLIN))
+        return 0;
+    return cq_engine_get_event(eng) < 0 ? -1 : 0;
+}
+
+/*
+ * Wait until `count` more completions of class `cls` have been reaped,
+ * spinning, sleeping or both depending on eng->mode. Completions of other
+ * classes seen meanwhile are dispatched as usual.
+ * Returns 0, or -1 if any of the awaited completions failed.
+ */
+int cq_engine_wait(struct cq_engine *eng, unsigned cls, uint64_t count) {
+    uint64_t failed = eng->failed[cls];
+    uint64_t target = eng->done[cls] + failed + count;
+    int mode = eng->channel ? eng->mode : CQ_MODE_POLL;
+    long long spin_end = 0;
+
+    if (mode == CQ_MODE_HYBRID)
+        spin_end = gfp_get_time() + eng->spin_ns;
+
+    while (eng->done[cls] + eng->failed[cls] < target) {
+        int n = cq_engine_poll(eng);
+        if (n < 0)
+            return -1;
+        if (n > 0 || mode == CQ_MODE_POLL)
+            continue;
+        if (mode == CQ_MODE_HYBRID && gfp_get_time() < spin_end)
+            continue;
+        if (cq_engine_sleep(eng) < 0)
+            return -1;
+        if (mode == CQ_MODE_HYBRID)
+            spin_end = gfp_get_time() + eng->spin_ns;
+    }
+    return eng->failed[cls] == failed ? 0 : -1;
+}
+
+int parse_cq_mode(const char *s) {
+    if (!strcmp(s, "poll"))
+        return CQ_MODE_POLL;
+    if (!strcmp(s, "event"))
+        return CQ_MODE_EVENT;
+    if (!strcmp(s, "hybrid"))
+        return CQ_MODE_HYBRID;
+    return -1;
+}
+
+int parse_post_api(const char *s) {
+    if (!strcmp(s, "legacy"))
+        return POST_API_LEGACY;
+    if (!strcmp(s, "ex"))
+        return POST_API_EX;
+    return -1;
+}
+
+static inline const char *post_api_str(int api) {
+    return api == POST_API_EX ? "ex" : "legacy";
+}
+
+/*
+ * Command line options shared by every tool that calls prepare_ib_res().
+ * Callers append IB_OPTSTRING to their own getopt string and hand unknown
+ * options to parse_ib_opt().
+ */
+#define IB_OPTSTRING "D:G:t:m:s:c:p:R:I:V:TE:"
+#define IB_OPTUSAGE "[-D ib_dev] [-G gid_index] [-t uc|rc] [-m poll|event|hybrid] " \
+                    "[-s spin_ns] [-c cq_mod_count] [-p cq_mod_period_us] [-R srq_depth] " \
+                    "[-I max_inline] [-V legacy|ex] [-T] [-E shm_name]"
+
+int parse_ib_opt(struct ib_res *ib_res, int opt, const char *arg) {
+    switch (opt) {
+    case 'D':
+        ib_res->dev_name = arg;
+        return 0;
+    case 'G':
+        ib_res->gidx = atoi(arg);
+        ib_res->gidx_set = 1;
+        return 0;
+    case 't':
+        if (!strcmp(arg, "uc"))
+            ib_res->qp_type = IBV_QPT_UC;
+        else if (!strcmp(arg, "rc"))
+            ib_res->qp_type = IBV_QPT_RC;
+        else
+            return -1;
+        return 0;
+    case 'm':
+        ib_res->cq_mode = parse_cq_mode(arg);
+        return ib_res->cq_mode < 0 ? -1 : 0;
+    case 's':
+        ib_res->cq_spin_ns = atoll(arg);
+        return 0;
+    case 'c':
+        ib_res->cq_mod_count = atoi(arg);
+        return 0;
+    case 'p':
+        ib_res->cq_mod_period = atoi(arg);
+        return 0;
+    case 'R':
+        ib_res->srq_depth = strtoul(arg, NULL, 0);
+        return 0;
+    case 'I':
+        ib_res->max_inline = strtoul(arg, NULL, 0);
+        return 0;
+    case 'V':
+        ib_res->post_api = parse_post_api(arg);
+        return ib_res->post_api < 0 ? -1 : 0;
+    case 'T':
+        ib_res->time_cqes = 1;
+        return 0;
+    case 'E':
+        ib_res->metrics_name = arg;
+        return 0;
+    }
+    return -1;
+}
+
 void my_exit(const char *message) {
 	fprintf(stderr,"Error: %s. Exiting.\n",message);
 	exit(EXIT_FAILURE);
 }
 
-int prepare_ib_res(struct ib_res *ib_res) {
+void free_ib_res(struct ib_res *ib_res) {
+    if (ib_res->qp) ibv_destroy_qp(ib_res->qp);
+    srq_ring_destroy(&ib_res->srq);
+    if (ib_res->cq) {
+        cq_engine_ack_events(&ib_res->cq_eng);
+        // Also destroys an extended CQ, ib_res->cq is its ibv_cq view
+        ibv_destroy_cq(ib_res->cq);
+    }
+    if (ib_res->cq_eng.channel) ibv_destroy_comp_channel(ib_res->cq_eng.channel);
+    if (ib_res->pd) ibv_dealloc_pd(ib_res->pd);
+    if (ib_res->context) ibv_close_device(ib_res->context);
+    if (ib_res->dev_list) ibv_free_device_list(ib_res->dev_list);
+    cq_ts_free(&ib_res->ts);
+    if (ib_res->cq_eng.metrics) metrics_block_put(ib_res->cq_eng.metrics);
+    ib_res->cq_eng.ts = NULL;
+    ib_res->cq_eng.metrics = NULL;
+    ib_res->qp = NULL;
+    ib_res->cq = NULL;
+    ib_res->cq_ex = NULL;
+    ib_res->cq_eng.channel = NULL;
+    ib_res->pd = NULL;
+    ib_res->context = NULL;
+    ib_res->dev_list = NULL;
+}
+
+/*
+ * ibv_create_qp() through the extended API, enabling every opcode the
+ * tree posts, so the QP can be driven with ibv_wr_*(). Updates attr->cap
+ * like ibv_create_qp() does.
+ */
+static struct ibv_qp *create_qp_ex(struct ib_res *ib_res, struct ibv_qp_init_attr *attr) {
+    struct ibv_qp_init_attr_ex attr_ex;
+    struct ibv_qp *qp;
+
+    memset(&attr_ex, 0, sizeof(attr_ex));
+    attr_ex.send_cq = attr->send_cq;
+    attr_ex.recv_cq = attr->recv_cq;
+    attr_ex.srq = attr->srq;
+    attr_ex.cap = attr->cap;
+    attr_ex.qp_type = attr->qp_type;
+    attr_ex.comp_mask = IBV_QP_INIT_ATTR_PD | IBV_QP_INIT_ATTR_SEND_OPS_FLAGS;
+    attr_ex.pd = ib_res->pd;
+    attr_ex.send_ops_flags = IBV_QP_EX_WITH_RDMA_WRITE | IBV_QP_EX_WITH_RDMA_WRITE_WITH_IMM |
+                             IBV_QP_EX_WITH_SEND | IBV_QP_EX_WITH_SEND_WITH_IMM |
+                             IBV_QP_EX_WITH_LOCAL_INV | IBV_QP_EX_WITH_BIND_MW;
+    // Remote invalidation needs a reliable connection
+    if (attr->qp_type == IBV_QPT_RC)
+        attr_ex.send_ops_flags |= IBV_QP_EX_WITH_SEND_WITH_INV;
+    qp = ibv_create_qp_ex(ib_res->context, &attr_ex);
+    if (qp)
+        attr->cap = attr_ex.cap;
+    return qp;
+}
+
+/*
+ * Create a QP of ib_res->qp_type on the shared PD, CQ and SRQ (if any)
+ * and move it to INIT. prepare_ib_res() makes ib_res->qp this way; callers
+ * serving several peers make one per peer. The inline capacity is
+ * negotiated down from ib_res->max_inline until the provider accepts it,
+ * and ib_res->max_inline then holds what the QP got, so later QPs ask for
+ * that directly. Returns NULL on failure.
+ */
+struct ibv_qp *create_qp(struct ib_res *ib_res) {
     struct ibv_qp_init_attr qp_init_attr;
+    struct ibv_qp_attr qp_attr;
+    struct ibv_qp *qp;
+    uint32_t want = ib_res->max_inline ? ib_res->max_inline : INLINE_DEFAULT;
+
+    while (1) {
+        memset(&qp_init_attr, 0, sizeof(qp_init_attr));
+        qp_init_attr.send_cq = ib_res->cq;
+        qp_init_attr.recv_cq = ib_res->cq;
+        qp_init_attr.cap.max_send_wr = MAX_SEND_WR;
+        qp_init_attr.cap.max_recv_wr = MAX_RECV_WR;
+        qp_init_attr.cap.max_send_sge = MAX_SEND_SGE;
+        qp_init_attr.cap.max_recv_sge = 2;
+        qp_init_attr.cap.max_inline_data = want;
+        if (ib_res->srq.srq) {
+            qp_init_attr.srq = ib_res->srq.srq;
+            qp_init_attr.cap.max_recv_wr = 0;
+            qp_init_attr.cap.max_recv_sge = 0;
+        }
+        qp_init_attr.qp_type = ib_res->qp_type ? ib_res->qp_type : IBV_QPT_UC;
+
+        qp = ib_res->post_api == POST_API_EX ? create_qp_ex(ib_res, &qp_init_attr) :
+             ibv_create_qp(ib_res->pd, &qp_init_attr);
+        /*
+         * No device attribute reports the inline limit: back off until the
+         * provider accepts. Other failures (no extended QPs, an unsupported
+         * send_ops_flags) do not come and go with the inline size.
+         */
+        if (qp || want == 0 || (errno != EINVAL && errno != ENOMEM))
+            break;
+        want /= 2;
+    }
+    if (!qp) {
+        perror(ib_res->post_api == POST_API_EX ? "ibv_create_qp_ex" : "ibv_create_qp");
+        return NULL;
+    }
+    // The provider may round the inline size up; senders go by what the QP got
+    if (ib_res->max_inline && qp_init_attr.cap.max_inline_data < ib_res->max_inline)
+        fprintf(stderr, "inline data capped to %u bytes\n", qp_init_attr.cap.max_inline_data);
+    ib_res->max_inline = qp_init_attr.cap.max_inline_data;
+
+    // Modify QP to INIT
+    memset(&qp_attr, 0, sizeof(qp_attr));
+    qp_attr.qp_state = IBV_QPS_INIT;
+    qp_attr.pkey_index = 0;
+    qp_attr.port_num = ib_res->port;
+    qp_attr.qp_access_flags |= IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_LOCAL_WRITE;
+
+    // UD
+    // ret = ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_QKEY);
+    // UC and RC
+    if (ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS)) {
+        perror("ibv_modify_qp to INIT");
+        ibv_destroy_qp(qp);
+        return NULL;
+    }
+    // Idle QPs show up in the counters too
+    if (ib_res->cq_eng.metrics)
+        metrics_qp_slot(ib_res->cq_eng.metrics, qp->qp_num);
+    return qp;
+}
+
+/*
+ * Count the CQ engine and QPs of `ib_res` in the segment named by
+ * ib_res->metrics_name, if any. Each CQ engine needs its own block, so
+ * one made after prepare_ib_res() attaches itself again.
+ */
+void ib_metrics_attach(struct ib_res *ib_res) {
+    if (ib_res->metrics_name)
+        ib_res->cq_eng.metrics = metrics_block_get(ib_res->metrics_name,
+                                                   ibv_get_device_name(ib_res->ib_dev),
+                                                   ib_res->port);
+}
+
+// Extended CQ with the fields cq_engine_read_ex() copies, plus `wc_flags`
+static struct ibv_cq_ex *create_cq_ex(struct ib_res *ib_res, int cqe,
+                                      struct ibv_comp_channel *channel, uint64_t wc_flags) {
+    struct ibv_cq_init_attr_ex cq_attr = {
+        .cqe = cqe,
+        .channel = channel,
+        .wc_flags = IBV_WC_EX_WITH_BYTE_LEN | IBV_WC_EX_WITH_IMM | IBV_WC_EX_WITH_QP_NUM | wc_flags,
+    };
+
+    return ibv_create_cq_ex(ib_res->context, &cq_attr);
+}
+
+/*
+ * The first device with an active port on the calling thread's NUMA node,
+ * else the first with an active port at all, else the first one.
+ */
+static struct ibv_device *pick_device(struct ibv_device **dev_list, int num_devices) {
+    int node = topo_thread_node();
+    struct ibv_device *any = NULL;
+
+    for (int i = 0; i < num_devices; i++) {
+        struct ibv_context *context = ibv_open_device(dev_list[i]);
+        int port = context ? topo_active_port(context) : 0;
+
+        if (context)
+            ibv_close_device(context);
+        if (!port)
+            continue;
+        if (node == TOPO_NODE_ANY || topo_dev_node(dev_list[i]) == node)
+            return dev_list[i];
+        if (!any)
+            any = dev_list[i];
+    }
+    return any ? any : dev_list[0];
+}
+
+int prepare_ib_res(struct ib_res *ib_res) {
+    struct ibv_comp_channel *channel = NULL;
     struct ibv_port_attr port_attr;
     int num_devices = 0;
-    char gid[33];
+    int cqe = MAX_SEND_WR + MAX_RECV_WR;
+    char gid[INET6_ADDRSTRLEN];
     int ret = 0;
-    ib_res->gidx = 0;
-    ib_res->port = 1;
 
     ib_res->dev_list = ibv_get_device_list(&num_devices);
     if (!ib_res->dev_list) {
@@ -81,8 +859,21 @@ int prepare_ib_res(struct ib_res *ib_res) {
         goto cleanup;
     }
 
-    // Use the first device found
-    ib_res->ib_dev = ib_res->dev_list[0];
+    // Use the requested device, or the nearest one with a link
+    ib_res->ib_dev = ib_res->dev_name ? NULL : pick_device(ib_res->dev_list, num_devices);
+    if (ib_res->dev_name) {
+        for (int i = 0; i < num_devices; i++) {
+            if (!strcmp(ibv_get_device_name(ib_res->dev_list[i]), ib_res->dev_name)) {
+                ib_res->ib_dev = ib_res->dev_list[i];
+                break;
+            }
+        }
+        if (!ib_res->ib_dev) {
+            fprintf(stderr, "InfiniBand device %s not found\n", ib_res->dev_name);
+            ret = -1;
+            goto cleanup;
+        }
+    }
     // Get device context
     ib_res->context = ibv_open_device(ib_res->ib_dev);
     if (!ib_res->context) {
@@ -90,6 +881,11 @@ int prepare_ib_res(struct ib_res *ib_res) {
         ret = -1;
         goto cleanup;
     }
+    ib_res->numa_node = topo_dev_node(ib_res->ib_dev);
+    if (!ib_res->port)
+        ib_res->port = topo_active_port(ib_res->context);
+    if (!ib_res->port)
+        ib_res->port = 1;
 
     // Allocate Protection Domain (PD)
     ib_res->pd = ibv_alloc_pd(ib_res->context);
@@ -99,44 +895,94 @@ int prepare_ib_res(struct ib_res *ib_res) {
         goto cleanup;
     }
 
-    ib_res->cq = ibv_create_cq(ib_res->context, 512, NULL, NULL, 0);
-    if (!ib_res->cq) {
-        perror("ibv_create_cq");
-        ret = -1;
-        goto cleanup;
+    if (ib_res->cq_mode != CQ_MODE_POLL) {
+        channel = ibv_create_comp_channel(ib_res->context);
+        if (!channel) {
+            perror("ibv_create_comp_channel");
+            ret = -1;
+            goto cleanup;
+        }
+        // Never block inside ibv_get_cq_event; waiting is done on the fd
+        fcntl(channel->fd, F_SETFL, fcntl(channel->fd, F_GETFL) | O_NONBLOCK);
     }
 
-    // Create Queue Pair (QP)
-    memset(&qp_init_attr, 0, sizeof(qp_init_attr));
-    qp_init_attr.send_cq = ib_res->cq;
-    qp_init_attr.recv_cq = ib_res->cq;
-    qp_init_attr.cap.max_send_wr = 512;
-    qp_init_attr.cap.max_recv_wr = 512;
-    qp_init_attr.cap.max_send_sge = 2;
-    qp_init_attr.cap.max_recv_sge = 2;
-    qp_init_attr.qp_type = IBV_QPT_UC;
+    // Every posted receive may complete before it is reaped, so size the CQ for them
+    if (ib_res->srq_depth) {
+        struct ibv_device_attr dev_attr;
 
-    ib_res->qp = ibv_create_qp(ib_res->pd, &qp_init_attr);
-    if (!ib_res->qp) {
-        perror("ibv_create_qp");
+        ret = ibv_query_device(ib_res->context, &dev_attr);
+        if (ret) {
+            perror("ibv_query_device");
+            if (channel) ibv_destroy_comp_channel(channel);
+            goto cleanup;
+        }
+        if (ib_res->srq_depth > (uint32_t)dev_attr.max_srq_wr) {
+            fprintf(stderr, "srq depth %u capped to %d\n", ib_res->srq_depth, dev_attr.max_srq_wr);
+            ib_res->srq_depth = dev_attr.max_srq_wr;
+        }
+        cqe = MAX_SEND_WR + ib_res->srq_depth;
+        if (cqe > dev_attr.max_cqe)
+            cqe = dev_attr.max_cqe;
+    }
+    // NIC timestamps need an extended CQ whatever the posting backend
+    if (ib_res->time_cqes && cq_ts_init(&ib_res->ts, ib_res->context)) {
+        ib_res->cq_ex = create_cq_ex(ib_res, cqe, channel, IBV_WC_EX_WITH_COMPLETION_TIMESTAMP);
+        if (!ib_res->cq_ex) {
+            fprintf(stderr, "completion timestamps unsupported, timing completions in software\n");
+            ib_res->ts.hw = 0;
+        }
+    }
+    if (!ib_res->cq_ex && ib_res->post_api == POST_API_EX)
+        ib_res->cq_ex = create_cq_ex(ib_res, cqe, channel, 0);
+    if (ib_res->cq_ex)
+        ib_res->cq = ibv_cq_ex_to_cq(ib_res->cq_ex);
+    else if (ib_res->post_api != POST_API_EX)
+        ib_res->cq = ibv_create_cq(ib_res->context, cqe, NULL, channel, 0);
+    if (!ib_res->cq) {
+        perror(ib_res->post_api == POST_API_EX ? "ibv_create_cq_ex" : "ibv_create_cq");
+        if (channel) ibv_destroy_comp_channel(channel);
         ret = -1;
         goto cleanup;
     }
+    cq_engine_init(&ib_res->cq_eng, ib_res->cq, CQ_BATCH_DEFAULT);
+    ib_res->cq_eng.cq_ex = ib_res->cq_ex;
+    ib_res->cq_eng.mode = ib_res->cq_mode;
+    if (ib_res->time_cqes)
+        ib_res->cq_eng.ts = &ib_res->ts;
+    ib_metrics_attach(ib_res);
+    if (ib_res->cq_spin_ns > 0)
+        ib_res->cq_eng.spin_ns = ib_res->cq_spin_ns;
 
-    // Modify QP to INIT
-    struct ibv_qp_attr qp_attr;
-    memset(&qp_attr, 0, sizeof(qp_attr));
-    qp_attr.qp_state = IBV_QPS_INIT;
-    qp_attr.pkey_index = 0;
-    qp_attr.port_num = ib_res->port;
-    qp_attr.qp_access_flags |= IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_LOCAL_WRITE;
+    // CQ moderation: coalesce completion events, only matters with a channel
+    if (ib_res->cq_mod_count || ib_res->cq_mod_period) {
+        struct ibv_modify_cq_attr cq_attr = {
+            .attr_mask = IBV_CQ_ATTR_MODERATE,
+            .moderate = {
+                .cq_count = ib_res->cq_mod_count,
+                .cq_period = ib_res->cq_mod_period,
+            },
+        };
+        ret = ibv_modify_cq(ib_res->cq, &cq_attr);
+        if (ret) {
+            // Not every provider supports moderation; run without it
+            fprintf(stderr, "ibv_modify_cq moderation unsupported (%d), ignored\n", ret);
+            ret = 0;
+        }
+    }
 
-    // UD
-    // ret = ibv_modify_qp(qp, &qp_attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_QKEY);
-    // UC
-    ret = ibv_modify_qp(ib_res->qp, &qp_attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS);
-    if (ret)  {
-        perror("ibv_modify_qp to INIT\n");
+    if (ib_res->srq_depth) {
+        ret = srq_ring_create(&ib_res->srq, ib_res->context, ib_res->pd, ib_res->srq_depth);
+        if (ret)
+            goto cleanup;
+        ib_res->srq_depth = ib_res->srq.depth;
+        ib_res->cq_eng.srq = &ib_res->srq;
+    }
+
+    if (!ib_res->qp_type)
+        ib_res->qp_type = IBV_QPT_UC;
+    ib_res->qp = create_qp(ib_res);
+    if (!ib_res->qp) {
+        ret = -1;
         goto cleanup;
     }
 
@@ -147,17 +993,32 @@ int prepare_ib_res(struct ib_res *ib_res) {
         perror("ibv_query_port");
         goto cleanup;
     }
+    if (!ib_res->gidx_set && port_attr.link_layer == IBV_LINK_LAYER_ETHERNET) {
+        int gidx = topo_roce_v2_gid(ib_res->context, ib_res->port, port_attr.gid_tbl_len,
+                                    ib_res->peer_addr);
+
+        if (gidx >= 0)
+            ib_res->gidx = gidx;
+        else
+            fprintf(stderr, "no RoCE v2 GID on %s port %d, using GID index %d\n",
+                    ibv_get_device_name(ib_res->ib_dev), ib_res->port, ib_res->gidx);
+    }
     ret = ibv_query_gid(ib_res->context, ib_res->port, ib_res->gidx, &ib_res->local_info.gid);
     if (ret) {
 	    perror("ibv_query_gid");
 	    goto cleanup;
     }
     ib_res->local_info.lid = port_attr.lid;
+    ib_res->link_layer = port_attr.link_layer;
     ib_res->local_info.qpn = ib_res->qp->qp_num;
+    ib_res->ts.qpn = ib_res->qp->qp_num;
     ib_res->local_info.psn = 0;
-    ib_res->local_info.qkey = qp_attr.qkey;
+    ib_res->local_info.qkey = 0;
 
     inet_ntop(AF_INET6, &ib_res->local_info.gid, gid, sizeof gid);
+    printf("device %s port %d gid index %d, NUMA node %d (caller on %d)\n",
+           ibv_get_device_name(ib_res->ib_dev), ib_res->port, ib_res->gidx, ib_res->numa_node,
+           topo_thread_node());
     printf("local lid: %d, qpn: %d, psn: %d, qkey: %#010x, gid %s\n", 
            ib_res->local_info.lid, ib_res->local_info.qpn, ib_res->local_info.psn,
            ib_res->local_info.qkey, gid);
@@ -165,80 +1026,390 @@ int prepare_ib_res(struct ib_res *ib_res) {
     return ret;
 
 cleanup:
-    if (ib_res->qp) ibv_destroy_qp(ib_res->qp);
-    if (ib_res->cq) ibv_destroy_cq(ib_res->cq);
-    if (ib_res->pd) ibv_dealloc_pd(ib_res->pd);
-    if (ib_res->context) ibv_close_device(ib_res->context);
-    if (ib_res->dev_list) ibv_free_device_list(ib_res->dev_list);
+    free_ib_res(ib_res);
     return ret;
 }
 
-int poll_cq(struct ibv_cq *cq, struct ibv_wc *wc) {
-    int ret = 0;
+/*
+ * Post a legacy WR chain through the extended API, one ibv_wr_start() /
+ * ibv_wr_complete() pair per chain, for callers that build WR chains. It
+ * covers the opcodes create_qp_ex() enables. As with ibv_wr_complete(),
+ * either the whole chain is posted or none of it, so *bad_wr is the head.
+ */
+static int post_send_ex(struct ibv_qp_ex *qpx, struct ibv_send_wr *wr, struct ibv_send_wr **bad_wr) {
+    struct ibv_send_wr *head = wr;
+    int ret;
 
-    memset(wc, 0, sizeof(struct ibv_wc));
-    while (1) {
-        ret = ibv_poll_cq(cq, 1, wc);
-        if (ret < 0) {
-            perror("ibv_poll_cq");
-        } else if (ret == 1) {
-            if (wc->status == IBV_WC_SUCCESS) {
-                if (wc->wr_id == 100) {
-                    printf("Read a CQE for bind MW\n");
-		            break;
-                } else if (wc->wr_id == 200) {
-                    printf("Read a CEQ for invalidate MW rkey\n");
-                    break;
-                } else if (wc->wr_id == 10 || wc->wr_id == 11) {
-                    printf("Received imm %d\n", ntohl(wc->imm_data));
-		            break;
-                } else if (wc->wr_id == 20) {
-                    printf("Pkt sent successfully\n");
-                    break;
-                } else {
-                    printf("Unkown CQE\n");
-                    break;
-                }
-            } else {
-                fprintf(stderr, "Failed to send/receive message: %s\n", ibv_wc_status_str(wc->status));
+    ibv_wr_start(qpx);
+    for (; wr; wr = wr->next) {
+        qpx->wr_id = wr->wr_id;
+        qpx->wr_flags = wr->send_flags;
+        switch (wr->opcode) {
+        case IBV_WR_RDMA_WRITE:
+            ibv_wr_rdma_write(qpx, wr->wr.rdma.rkey, wr->wr.rdma.remote_addr);
+            break;
+        case IBV_WR_RDMA_WRITE_WITH_IMM:
+            ibv_wr_rdma_write_imm(qpx, wr->wr.rdma.rkey, wr->wr.rdma.remote_addr, wr->imm_data);
+            break;
+        case IBV_WR_SEND:
+            ibv_wr_send(qpx);
+            break;
+        case IBV_WR_SEND_WITH_IMM:
+            ibv_wr_send_imm(qpx, wr->imm_data);
+            break;
+        case IBV_WR_SEND_WITH_INV:
+            ibv_wr_send_inv(qpx, wr->invalidate_rkey);
+            break;
+        case IBV_WR_LOCAL_INV:
+            ibv_wr_local_inv(qpx, wr->invalidate_rkey);
+            continue;
+        case IBV_WR_BIND_MW:
+            ibv_wr_bind_mw(qpx, wr->bind_mw.mw, wr->bind_mw.rkey, &wr->bind_mw.bind_info);
+            continue;
+        default:
+            ibv_wr_abort(qpx);
+            *bad_wr = head;
+            return EINVAL;
+        }
+        if ((wr->send_flags & IBV_SEND_INLINE) && wr->num_sge) {
+            struct ibv_data_buf bufs[MAX_SEND_SGE];
+            int n = wr->num_sge < MAX_SEND_SGE ? wr->num_sge : MAX_SEND_SGE;
+
+            for (int i = 0; i < n; i++) {
+                bufs[i].addr = (void *)(uintptr_t)wr->sg_list[i].addr;
+                bufs[i].length = wr->sg_list[i].length;
             }
+            ibv_wr_set_inline_data_list(qpx, n, bufs);
+        } else {
+            ibv_wr_set_sge_list(qpx, wr->num_sge, wr->sg_list);
         }
     }
+    ret = ibv_wr_complete(qpx);
+    if (ret)
+        *bad_wr = head;
     return ret;
 }
 
-int bind_mw_rkey(struct ib_res *ib_res, struct ibv_mw *mw, uint8_t mw_type, struct ibv_mw_bind_info *bind_info) {
-    struct ibv_send_wr swr, *sbad_wr;
-    struct ibv_wc wc;
-    int wrid = 100;
+/*
+ * Completion timing hooks for the posting helpers: take the stamp before
+ * ringing the doorbell, so a NIC timestamp can never precede it, and
+ * record it once the post went through.
+ */
+static inline long long ib_post_stamp(const struct ib_res *ib_res) {
+    return ib_res->cq_eng.ts ? cq_ts_now() : 0;
+}
+
+static inline void ib_post_timed(struct ib_res *ib_res, struct ibv_qp *qp, long long t,
+                                 int nsignaled) {
+    if (ib_res->cq_eng.ts)
+        cq_ts_post(ib_res->cq_eng.ts, qp->qp_num, t, nsignaled);
+}
+
+// ibv_post_send() on `qp` with whichever backend ib_res->post_api selects
+static inline int ib_post_send(struct ib_res *ib_res, struct ibv_qp *qp, struct ibv_send_wr *wr,
+                               struct ibv_send_wr **bad_wr) {
+    long long t = ib_post_stamp(ib_res);
+    int ret, nsignaled = 0;
+
+    if (ib_res->post_api == POST_API_EX)
+        ret = post_send_ex(ibv_qp_to_qp_ex(qp), wr, bad_wr);
+    else
+        ret = ibv_post_send(qp, wr, bad_wr);
+    if (ret)
+        return ret;
+    if (ib_res->cq_eng.metrics)
+        metrics_post_chain(ib_res->cq_eng.metrics, qp->qp_num, wr);
+    if (!ib_res->cq_eng.ts)
+        return 0;
+    for (; wr; wr = wr->next)
+        nsignaled += !!(wr->send_flags & IBV_SEND_SIGNALED);
+    ib_post_timed(ib_res, qp, t, nsignaled);
+    return 0;
+}
+
+/*
+ * Zero-SGE receives on `qp` for write-with-imm and zero-length sends. With
+ * an SRQ ring the engine replenishes receives itself, so this is a no-op.
+ */
+int post_zero_recvs_qp(struct ib_res *ib_res, struct ibv_qp *qp, int n) {
+    struct ibv_recv_wr rwr, *rbad_wr;
+
+    if (ib_res->srq.srq)
+        return 0;
+    memset(&rwr, 0, sizeof(rwr));
+    rwr.wr_id = WRID(WRID_CLASS_RECV, 0);
+    rwr.sg_list = NULL;
+    rwr.num_sge = 0;
+    for (int i = 0; i < n; i++) {
+        if (ibv_post_recv(qp, &rwr, &rbad_wr)) {
+            perror("ibv_post_recv");
+            return -1;
+        }
+    }
+    if (ib_res->cq_eng.metrics)
+        metrics_post_recvs(ib_res->cq_eng.metrics, qp->qp_num, n);
+    return 0;
+}
+
+// The same on the QP made by prepare_ib_res()
+int post_zero_recvs(struct ib_res *ib_res, int n) {
+    return post_zero_recvs_qp(ib_res, ib_res->qp, n);
+}
+
+/*
+ * Write-with-imm `len` bytes of `buf` to remote_addr/rkey through `qp`.
+ * A payload that fits the QP's inline capacity is copied into the WQE by
+ * ibv_post_send() itself: `buf` may then be unregistered stack or heap
+ * memory, `mr` may be NULL and `buf` is reusable on return. Larger payloads
+ * are DMA-read by the HCA and `mr` must cover `buf`. Returns 0 or -1.
+ */
+int post_write_imm(struct ib_res *ib_res, struct ibv_qp *qp, struct ibv_mr *mr, const void *buf,
+                   size_t len, uint64_t remote_addr, uint32_t rkey, uint32_t imm, uint64_t wr_id,
+                   int signaled) {
+    struct ibv_send_wr wr, *bad_wr;
+    struct ibv_sge sg;
+    int inline_ok = len <= ib_res->max_inline;
+    long long t = ib_post_stamp(ib_res);
+
+    if (!inline_ok && !mr) {
+        fprintf(stderr, "%zu byte payload exceeds inline limit %u and is not registered\n",
+                len, ib_res->max_inline);
+        return -1;
+    }
+    if (ib_res->post_api == POST_API_EX) {
+        struct ibv_qp_ex *qpx = ibv_qp_to_qp_ex(qp);
+        int ret;
+
+        ibv_wr_start(qpx);
+        qpx->wr_id = wr_id;
+        qpx->wr_flags = (signaled ? IBV_SEND_SIGNALED : 0) | (inline_ok && len ? IBV_SEND_INLINE : 0);
+        ibv_wr_rdma_write_imm(qpx, rkey, remote_addr, htonl(imm));
+        if (inline_ok)
+            ibv_wr_set_inline_data(qpx, (void *)buf, len);
+        else
+            ibv_wr_set_sge(qpx, mr->lkey, (uintptr_t)buf, len);
+        ret = ibv_wr_complete(qpx);
+        if (ret) {
+            fprintf(stderr, "ibv_wr_complete failed: %s\n", strerror(ret));
+            return -1;
+        }
+        ib_post_timed(ib_res, qp, t, !!signaled);
+        if (ib_res->cq_eng.metrics)
+            metrics_post(ib_res->cq_eng.metrics, qp->qp_num, IBV_WR_RDMA_WRITE_WITH_IMM, len,
+                         signaled);
+        return 0;
+    }
+    sg.addr = (uintptr_t)buf;
+    sg.length = len;
+    sg.lkey = inline_ok ? 0 : mr->lkey;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = wr_id;
+    wr.sg_list = &sg;
+    wr.num_sge = len ? 1 : 0;
+    wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+    wr.imm_data = htonl(imm);
+    wr.send_flags = (signaled ? IBV_SEND_SIGNALED : 0) | (inline_ok && len ? IBV_SEND_INLINE : 0);
+    wr.wr.rdma.remote_addr = remote_addr;
+    wr.wr.rdma.rkey = rkey;
+    if (ibv_post_send(qp, &wr, &bad_wr)) {
+        perror("ibv_post_send");
+        return -1;
+    }
+    ib_post_timed(ib_res, qp, t, !!signaled);
+    if (ib_res->cq_eng.metrics)
+        metrics_post(ib_res->cq_eng.metrics, qp->qp_num, IBV_WR_RDMA_WRITE_WITH_IMM, len, signaled);
+    return 0;
+}
+
+/*
+ * Move `qp` from INIT to RTS against the given peer, starting its send
+ * PSNs at `psn`.
+ */
+int connect_peer_qp(struct ib_res *ib_res, struct ibv_qp *qp, uint32_t psn,
+                    const struct ib_info *remote_info) {
+    struct ibv_qp_attr qp_attr;
+    int mask, ret;
+
+    // Modify QP to RTR
+    memset(&qp_attr, 0, sizeof(qp_attr));
+    qp_attr.qp_state = IBV_QPS_RTR;
+    qp_attr.path_mtu = IBV_MTU_4096;
+    /* require peer info: qpn, psn, lid */
+    qp_attr.dest_qp_num = remote_info->qpn;
+    qp_attr.rq_psn = remote_info->psn;
+    qp_attr.ah_attr.dlid = remote_info->lid;
+    qp_attr.ah_attr.sl = 0;
+    qp_attr.ah_attr.is_global = 0;
+    qp_attr.ah_attr.src_path_bits = 0;
+    qp_attr.ah_attr.port_num = ib_res->port;
+
+    // RoCE (including rxe) has no LIDs, so it always needs a GRH, as does a LID-less peer
+    if (ib_res->gidx > 0 || ib_res->link_layer == IBV_LINK_LAYER_ETHERNET || !remote_info->lid) {
+        qp_attr.ah_attr.is_global = 1;
+        qp_attr.ah_attr.grh.hop_limit = 1;
+        qp_attr.ah_attr.grh.dgid = remote_info->gid;
+        qp_attr.ah_attr.grh.sgid_index = ib_res->gidx;
+    }
+    mask = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN;
+    if (ib_res->qp_type == IBV_QPT_RC) {
+        // Responder resources for incoming RDMA reads/atomics and the RNR NAK delay
+        qp_attr.max_dest_rd_atomic = RC_MAX_RD_ATOMIC;
+        qp_attr.min_rnr_timer = RC_MIN_RNR_TIMER;
+        mask |= IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER;
+    }
+    ret = ibv_modify_qp(qp, &qp_attr, mask);
+    if (ret) {
+        perror("ibv_modify_qp to RTR");
+        return ret;
+    }
+
+    // Modify QP to RTS
+    memset(&qp_attr, 0, sizeof(qp_attr));
+    qp_attr.qp_state = IBV_QPS_RTS;
+    qp_attr.sq_psn = psn;
+    mask = IBV_QP_STATE | IBV_QP_SQ_PSN;
+    if (ib_res->qp_type == IBV_QPT_RC) {
+        qp_attr.timeout = RC_TIMEOUT;
+        qp_attr.retry_cnt = RC_RETRY_CNT;
+        qp_attr.rnr_retry = RC_RNR_RETRY;
+        qp_attr.max_rd_atomic = RC_MAX_RD_ATOMIC;
+        mask |= IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY | IBV_QP_MAX_QP_RD_ATOMIC;
+    }
+    ret = ibv_modify_qp(qp, &qp_attr, mask);
+    if (ret) {
+        perror("ibv_modify_qp to RTS");
+        return ret;
+    }
+    return 0;
+}
+
+// Connect the QP made by prepare_ib_res()
+int connect_qp(struct ib_res *ib_res, struct ib_info *remote_info) {
+    return connect_peer_qp(ib_res, ib_res->qp, ib_res->local_info.psn, remote_info);
+}
+
+/*
+ * Loopback: connect `qp_a` of `ra` and `qp_b` of `rb` to each other. The
+ * two ib_res may be the same one.
+ */
+int connect_qp_pair(struct ib_res *ra, struct ibv_qp *qp_a, struct ib_res *rb, struct ibv_qp *qp_b) {
+    struct ib_info info_a = ra->local_info, info_b = rb->local_info;
+
+    info_a.qpn = qp_a->qp_num;
+    info_b.qpn = qp_b->qp_num;
+    if (connect_peer_qp(ra, qp_a, info_a.psn, &info_b) ||
+        connect_peer_qp(rb, qp_b, info_b.psn, &info_a))
+        return -1;
+    return 0;
+}
+
+// Post a LOCAL_INV of `rkey` on `qp` (WRID_CLASS_INV); the caller waits for it if signaled
+int post_local_inv(struct ib_res *ib_res, struct ibv_qp *qp, uint32_t rkey, uint64_t wr_id,
+                   int signaled) {
+    struct ibv_send_wr wr, *bad_wr;
+    long long t = ib_post_stamp(ib_res);
+    int ret;
+
+    if (ib_res->post_api == POST_API_EX) {
+        struct ibv_qp_ex *qpx = ibv_qp_to_qp_ex(qp);
+
+        ibv_wr_start(qpx);
+        qpx->wr_id = wr_id;
+        qpx->wr_flags = signaled ? IBV_SEND_SIGNALED : 0;
+        ibv_wr_local_inv(qpx, rkey);
+        ret = ibv_wr_complete(qpx);
+    } else {
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = wr_id;
+        wr.opcode = IBV_WR_LOCAL_INV;
+        wr.send_flags = signaled ? IBV_SEND_SIGNALED : 0;
+        wr.invalidate_rkey = rkey;
+        ret = ibv_post_send(qp, &wr, &bad_wr);
+    }
+    if (ret) {
+        fprintf(stderr, "posting LOCAL_INV failed: %s\n", strerror(ret));
+        return -1;
+    }
+    ib_post_timed(ib_res, qp, t, !!signaled);
+    if (ib_res->cq_eng.metrics)
+        metrics_post(ib_res->cq_eng.metrics, qp->qp_num, IBV_WR_LOCAL_INV, 0, signaled);
+    return 0;
+}
+
+/*
+ * The rkey the next bind of `mw` installs. Peers can be sent it before
+ * the bind is posted: bind_mw_rkey_qp() steps a type 2 key the same way.
+ */
+static inline uint32_t mw_next_rkey(const struct ibv_mw *mw) {
+    return ibv_inc_rkey(mw->rkey);
+}
+
+/*
+ * Post a bind of type 2 window `mw` to `bind_info` under `rkey` on `qp`
+ * without waiting for it. mw->rkey is left alone: the caller installs
+ * `rkey` once the bind has completed.
+ */
+int post_bind_mw(struct ib_res *ib_res, struct ibv_qp *qp, struct ibv_mw *mw, uint32_t rkey,
+                 const struct ibv_mw_bind_info *bind_info, uint64_t wr_id, int signaled) {
+    struct ibv_send_wr wr, *bad_wr;
+    long long t = ib_post_stamp(ib_res);
+    int ret;
+
+    if (ib_res->post_api == POST_API_EX) {
+        struct ibv_qp_ex *qpx = ibv_qp_to_qp_ex(qp);
+
+        // No WR struct: the bind is written straight into the send queue
+        ibv_wr_start(qpx);
+        qpx->wr_id = wr_id;
+        qpx->wr_flags = signaled ? IBV_SEND_SIGNALED : 0;
+        ibv_wr_bind_mw(qpx, mw, rkey, bind_info);
+        ret = ibv_wr_complete(qpx);
+        if (ret) {
+            fprintf(stderr, "ibv_wr_complete failed: %s\n", strerror(ret));
+            return -1;
+        }
+    } else {
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = wr_id;
+        wr.opcode = IBV_WR_BIND_MW;
+        wr.send_flags = signaled ? IBV_SEND_SIGNALED : 0;
+        wr.bind_mw.mw = mw;
+        wr.bind_mw.rkey = rkey;
+        wr.bind_mw.bind_info = *bind_info;
+        ret = ibv_post_send(qp, &wr, &bad_wr);
+        if (ret) {
+            fprintf(stderr, "posting BIND_MW failed: %s\n", strerror(ret));
+            return -1;
+        }
+    }
+    ib_post_timed(ib_res, qp, t, !!signaled);
+    if (ib_res->cq_eng.metrics)
+        metrics_post(ib_res->cq_eng.metrics, qp->qp_num, IBV_WR_BIND_MW, 0, signaled);
+    return 0;
+}
+
+/*
+ * Bind `mw` through `qp` and wait for the bind to complete. A type 2
+ * window is then only reachable through that QP.
+ */
+int bind_mw_rkey_qp(struct ib_res *ib_res, struct ibv_qp *qp, struct ibv_mw *mw, uint8_t mw_type,
+                    struct ibv_mw_bind_info *bind_info) {
+    uint64_t wrid = WRID(WRID_CLASS_BIND, 0);
+    /*
+     * after ibv_alloc_mw, mw has an initial rkey
+     * we need to assign a new key to bind_mw.rkey,
+     * then update mw'rkey with assigned rkey if getting successful CQE after post_send.
+     * Only the low tag byte is ours to change, so step it with ibv_inc_rkey.
+     */
+    uint32_t new_rkey = mw_next_rkey(mw);
+    long long t = ib_post_stamp(ib_res);
     int ret = 0;
 
 
     if (mw_type == IBV_MW_TYPE_2) {
-    	memset(&swr, 0, sizeof(swr));
-    	swr.wr_id = wrid;
-    	swr.sg_list = NULL;
-    	swr.num_sge = 0;
-    	swr.opcode = IBV_WR_BIND_MW;
-    	swr.send_flags = IBV_SEND_SIGNALED;
-    	swr.bind_mw.mw = mw;
-        /*
-         * after ibv_alloc_mw, mw has an initial rkey
-         * we need to assign a new key to bind_mw.rkey,
-         * then update mw'rkey with assigned rkey if getting successful CQE after post_send
-         */
-        swr.bind_mw.rkey = 264270;
-    	swr.bind_mw.bind_info.mr = bind_info->mr;
-    	swr.bind_mw.bind_info.addr = (uintptr_t)(bind_info->addr);
-    	swr.bind_mw.bind_info.length = bind_info->length;
-    	swr.bind_mw.bind_info.mw_access_flags = bind_info->mw_access_flags;
-    	ret = ibv_post_send(ib_res->qp, &swr, &sbad_wr);
-    	if (ret) {
-    	    perror("ibv_post_send error");
-    	    goto cleanup;
-    	}
-        // update with the newly assigned rkey
-        mw->rkey = swr.bind_mw.rkey;
+        ret = post_bind_mw(ib_res, qp, mw, new_rkey, bind_info, wrid, 1);
+        if (ret)
+            goto cleanup;
     } else {
     	struct ibv_mw_bind mw_bind = {
     	        .wr_id = wrid,
@@ -248,23 +1419,33 @@ int bind_mw_rkey(struct ib_res *ib_res, struct ibv_mw *mw, uint8_t mw_type, stru
     		    .bind_info.length = bind_info->length,
     		    .bind_info.mw_access_flags = bind_info->mw_access_flags
     	};
-    	ret = ibv_bind_mw(ib_res->qp, mw, &mw_bind);
+    	ret = ibv_bind_mw(qp, mw, &mw_bind);
     	if (ret) {
     	    perror("ibv_bind_mw");
     	    goto cleanup;
     	}
+        ib_post_timed(ib_res, qp, t, 1);
+        if (ib_res->cq_eng.metrics)
+            metrics_post(ib_res->cq_eng.metrics, qp->qp_num, IBV_WR_BIND_MW, 0, 1);
     }
-    ret = poll_cq(ib_res->cq, &wc);
+    ret = cq_engine_wait(&ib_res->cq_eng, WRID_CLASS_BIND, 1);
     if (ret < 0) {
-        perror("poll cq failed");
+        fprintf(stderr, "bind MW completion failed\n");
         goto cleanup;
     }
+    // update with the newly assigned rkey
+    if (mw_type == IBV_MW_TYPE_2)
+        mw->rkey = new_rkey;
     return 0;
 
 cleanup:
     return ret;
 }
 
+int bind_mw_rkey(struct ib_res *ib_res, struct ibv_mw *mw, uint8_t mw_type, struct ibv_mw_bind_info *bind_info) {
+    return bind_mw_rkey_qp(ib_res, ib_res->qp, mw, mw_type, bind_info);
+}
+
 int invalidate_mw_rkey(struct ib_res *ib_res, struct ibv_mw *mw, uint8_t mw_type, struct ibv_mr *mr) {
     int ret = 0;
     long long start_time, end_time;
@@ -285,23 +1466,13 @@ int invalidate_mw_rkey(struct ib_res *ib_res, struct ibv_mw *mw, uint8_t mw_type
         }
         printf("Invalidated Type 1 MW's rkey\n");
     } else {
-        struct ibv_wc wc;
-        struct ibv_send_wr inv_wr = { 0 };
-	    struct ibv_send_wr *bad_inv_wr = NULL;
-        inv_wr.wr_id = 200;
-        inv_wr.opcode = IBV_WR_LOCAL_INV;
-	    inv_wr.next = NULL;
-	    inv_wr.send_flags = IBV_SEND_SIGNALED;
-	    inv_wr.invalidate_rkey = mw->rkey;
-        ret = ibv_post_send(ib_res->qp, &inv_wr, &bad_inv_wr);
-        if (ret) {
-            perror("ibv_post_send error");
+        ret = post_local_inv(ib_res, ib_res->qp, mw->rkey, WRID(WRID_CLASS_INV, 0), 1);
+        if (ret)
             goto cleanup;
-        }
-        printf("Invalidated Type 1 MW's rkey\n");
-        ret = poll_cq(ib_res->cq, &wc);
+        printf("Invalidated Type 2 MW's rkey\n");
+        ret = cq_engine_wait(&ib_res->cq_eng, WRID_CLASS_INV, 1);
         if (ret < 0) {
-            perror("poll cq failed");
+            fprintf(stderr, "invalidate MW completion failed\n");
             goto cleanup;
         }
     }
@@ -312,127 +1483,211 @@ cleanup:
 }
 
 
-int exchange_info_server(struct ib_info *local_info, struct ib_info *client_info, in_port_t port) {
-    int sock, client_sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
-    int ret = 0;
-    char gid[33];
-
-    // Create socket for connection
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("socket");
-        ret = 1;
-        goto cleanup;
-    }
-    int option = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+/*
+ * Single-peer connection setup (server.c / client.c).
+ *
+ * Each side sends its ib_info (QP, PSN, GID) with the descriptors of the
+ * windows it exposes (see wire.h) as soon as it has them and only then
+ * reads the peer's, so both directions are in flight together and the
+ * exchange costs one round trip. A type 2 window can only be bound once
+ * its QP is connected, so the rkey sent is the one the bind is going to
+ * install (mw_next_rkey()). After connecting and binding each side sends
+ * HS_READY and waits for the peer's: once it is in, the peer's receives
+ * are posted and its window is live. The socket stays open for later
+ * notifications such as HS_REVOKED.
+ */
+#define HS_READY 'R'
+#define HS_REVOKED 'X'
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
+// Phases of a setup, in CLOCK_MONOTONIC ns; 0 if a side skips one
+struct setup_times {
+    long long start;
+    long long res;          /* prepare_ib_res() and registrations done */
+    long long tcp;          /* control connection established */
+    long long info;         /* peer's ib_info in */
+    long long rts;          /* QP connected, windows bound */
+    long long ready;        /* peer's HS_READY in */
+};
 
-    if (bind(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("bind");
-        ret = 1;
-        goto cleanup;
-    }
+// Wire form of an ib_info, without regions
+void ib_info_to_wire(const struct ib_info *ib, struct wire_info *w) {
+    memset(w, 0, sizeof(*w));
+    w->lid = ib->lid;
+    w->qpn = ib->qpn;
+    w->psn = ib->psn;
+    w->qkey = ib->qkey;
+    memcpy(w->gid, ib->gid.raw, sizeof(w->gid));
+}
 
-    if (listen(sock, 1) < 0) {
-        perror("listen");
-        ret = 1;
-        goto cleanup;
+// The first region, if any, becomes buf_va/buf_rkey
+void ib_info_from_wire(const struct wire_info *w, struct ib_info *ib) {
+    memset(ib, 0, sizeof(*ib));
+    ib->lid = w->lid;
+    ib->qpn = w->qpn;
+    ib->psn = w->psn;
+    ib->qkey = w->qkey;
+    memcpy(ib->gid.raw, w->gid, sizeof(ib->gid.raw));
+    if (w->nregions) {
+        ib->buf_va = w->regions[0].addr;
+        ib->buf_rkey = w->regions[0].rkey;
     }
-    //printf("server now is listening\n");
+}
 
-    client_sock = accept(sock, (struct sockaddr *)&client_addr, &client_addr_len);
-    if (client_sock < 0) {
-        perror("accept");
-        ret = 1;
-        goto cleanup;
-    }
-    //printf("server accepted a client\n");
+// Listener for one peer; open it before preparing resources so the peer's SYN is answered early
+int hs_listen(in_port_t port) {
+    struct sockaddr_in addr;
+    int fd, option = 1;
 
-    // Send local QP information
-    if (send(client_sock, local_info, sizeof(*local_info), 0) != sizeof(*local_info)) {
-        perror("send");
-        ret = 1;
-        goto cleanup;
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
     }
-    //printf("server sent out local QP info\n");
-
-    // Receive remote QP information
-    if (recv(client_sock, client_info, sizeof(*client_info), 0) != sizeof(*client_info)) {
-        perror("recv");
-        ret = 1;
-        goto cleanup;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        perror("bind/listen");
+        close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    inet_ntop(AF_INET6, &client_info->gid, gid, sizeof gid);
-    printf("Info exchange: Server received remote QP info, %d, %d, %d, %#010x, %s\n",
-            client_info->lid, client_info->qpn, client_info->psn, client_info->qkey, gid);
+// Accept one peer and close the listener
+int hs_accept(int listen_fd) {
+    int fd, one = 1;
 
-cleanup:
-    close(client_sock);
-    close(sock);
-    return ret;
+    do {
+        fd = accept(listen_fd, NULL, NULL);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0)
+        perror("accept");
+    else
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    close(listen_fd);
+    return fd;
 }
 
-int exchange_info_client(struct ib_info *local_info, char *server_ip, struct ib_info *server_info, in_port_t port) {
-
-    int sock;
-    struct sockaddr_in server_addr;
-    int ret = 0;
-    char gid[33];
+/*
+ * Start a non-blocking connect to the server so the TCP handshake runs
+ * while the caller prepares its verbs resources; hs_connect_finish()
+ * completes it. Returns the socket or -1.
+ */
+int hs_connect(const char *server_ip, in_port_t port) {
+    struct sockaddr_in addr;
+    int fd, one = 1;
 
-    // Establish socket connection to exchange QP information
-    sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, server_ip, &addr.sin_addr) <= 0) {
+        fprintf(stderr, "bad server address %s\n", server_ip);
+        return -1;
+    }
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
         perror("socket");
-        ret = 1;
-        goto cleanup;
+        return -1;
     }
-    int option = 1;
-    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
-
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) <= 0) {
-        perror("inet_pton");
-        ret = 1;
-        goto cleanup;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        perror("connect");
+        close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("connect");
-        ret = 1;
-        goto cleanup;
+// Wait for the connect from hs_connect() and switch the socket back to blocking
+int hs_connect_finish(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    socklen_t len = sizeof(int);
+    int err = 0, ret;
+
+    do {
+        ret = poll(&pfd, 1, -1);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+        perror("poll/getsockopt");
+        return -1;
+    }
+    if (err) {
+        fprintf(stderr, "connect: %s\n", strerror(err));
+        return -1;
     }
-    //printf("client connected to server\n");
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    return 0;
+}
 
-    // Send local QP information
-    if (send(sock, local_info, sizeof(*local_info), 0) != sizeof(*local_info)) {
-        perror("send");
-        ret = 1;
-        goto cleanup;
+/*
+ * Send our QP info and `n` region descriptors and read the peer's, in one
+ * round trip. The connecting side sends first and the accepting side
+ * (`accepted`) reads first: if both sent first, messages larger than the
+ * socket buffers would leave both ends blocked in send(). The peer's first
+ * region lands in remote->buf_va/buf_rkey. If `peer` is not NULL it
+ * receives the peer's whole message (free it with wire_info_free()).
+ */
+int hs_exchange(int fd, int accepted, const struct ib_info *local,
+                const struct wire_region *regions, uint32_t n, struct ib_info *remote,
+                struct wire_info *peer) {
+    struct wire_info w, mine;
+    char gid[INET6_ADDRSTRLEN];
+
+    ib_info_to_wire(local, &mine);
+    mine.regions = (struct wire_region *)regions;
+    mine.nregions = n;
+    if (accepted ? wire_recv_info(fd, &w) || wire_send_info(fd, &mine)
+                 : wire_send_info(fd, &mine) || wire_recv_info(fd, &w)) {
+        if (accepted)
+            wire_info_free(&w);
+        return -1;
     }
-    //printf("client sent out local QP info\n");
+    ib_info_from_wire(&w, remote);
+    inet_ntop(AF_INET6, &remote->gid, gid, sizeof gid);
+    printf("peer: lid %d, qpn %d, psn %d, gid %s, %u regions, first buf %#lx rkey %#x\n",
+           remote->lid, remote->qpn, remote->psn, gid, w.nregions,
+           (unsigned long)remote->buf_va, remote->buf_rkey);
+    if (peer)
+        *peer = w;
+    else
+        wire_info_free(&w);
+    return 0;
+}
 
-    // Receive remote QP information
-    if (recv(sock, server_info, sizeof(*server_info), 0) != sizeof(*server_info)) {
-        perror("recv");
-        ret = 1;
-        goto cleanup;
+int hs_notify(int fd, char tag) {
+    return wire_send_all(fd, &tag, 1);
+}
+
+// Block until the peer sends `tag`; anything else is a protocol error
+int hs_wait(int fd, char tag) {
+    char got;
+
+    if (wire_recv_all(fd, &got, 1))
+        return -1;
+    if (got != tag) {
+        fprintf(stderr, "expected notification '%c', got '%c'\n", tag, got);
+        return -1;
     }
-    inet_ntop(AF_INET6, &server_info->gid, gid, sizeof gid);
-    printf("Info exchange: Client received server QP info, %d, %d, %d, %#010x, %s; mr info, rkey: %d, buf %ld\n",
-        server_info->lid, server_info->qpn, server_info->psn, server_info->qkey, gid,
-        server_info->buf_rkey, server_info->buf_va);
-cleanup:
-    close(sock);
-    return ret;
+    return 0;
+}
+
+// Both sides are connected and bound; returns once the peer says the same
+int hs_ready(int fd) {
+    return hs_notify(fd, HS_READY) || hs_wait(fd, HS_READY) ? -1 : 0;
+}
+
+void setup_times_print(const char *who, const struct setup_times *t) {
+    const char *names[] = { "resources", "tcp", "info", "rts", "ready" };
+    long long marks[] = { t->res, t->tcp, t->info, t->rts, t->ready };
+
+    printf("%s setup:", who);
+    for (int i = 0; i < 5; i++)
+        if (marks[i])
+            printf(" %s +%.1f us", names[i], (marks[i] - t->start) / 1e3);
+    printf("\n");
 }
 
+#endif /* GFP_H */
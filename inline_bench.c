@@ -0,0 +1,154 @@
+#include "gfp.h"
+#include "lat_stats.h"
+
+/*
+ * Inline-data benchmark: write-with-imm latency across the QP's inline
+ * cutoff.
+ *
+ * The QP is connected to itself, so each write lands in this process and
+ * its receive CQE marks delivery. For every payload size two paths are
+ * timed from post to receive CQE:
+ *   dma  - the payload sits in a registered buffer and the HCA DMA-reads it;
+ *   auto - post_write_imm() from an unregistered heap buffer, which goes
+ *          inline up to the cutoff and past it falls back to the
+ *          registered buffer.
+ *
+ * Sizes are powers of two from 8 B to 4x the cutoff, plus the cutoff
+ * itself and one byte past it.
+ */
+
+#define BENCH_MIN_SIZE 8
+#define BENCH_MAX_SIZES 32
+
+static int cmp_size(const void *a, const void *b) {
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Sorted, de-duplicated list of sizes around `cutoff`, capped at `max`
+static int bench_sizes(size_t *sizes, size_t cutoff, size_t max) {
+    size_t top = cutoff ? cutoff * 4 : 1024;
+    int n = 0, k = 0;
+
+    for (size_t size = BENCH_MIN_SIZE; size <= top && n < BENCH_MAX_SIZES - 2; size *= 2)
+        sizes[n++] = size;
+    if (cutoff >= BENCH_MIN_SIZE) {
+        sizes[n++] = cutoff;
+        sizes[n++] = cutoff + 1;
+    }
+    qsort(sizes, n, sizeof(*sizes), cmp_size);
+    for (int i = 0; i < n; i++)
+        if (sizes[i] <= max && (k == 0 || sizes[k - 1] != sizes[i]))
+            sizes[k++] = sizes[i];
+    return k;
+}
+
+static int timed_write(struct ib_res *ib_res, struct ibv_mr *mr, const void *buf, size_t len,
+                       uint64_t remote_addr, uint32_t rkey, struct lat_stats *st) {
+    long long t0;
+
+    if (post_zero_recvs(ib_res, 1))
+        return -1;
+    t0 = gfp_get_time();
+    if (post_write_imm(ib_res, ib_res->qp, mr, buf, len, remote_addr, rkey, len,
+                       WRID(WRID_CLASS_SEND, 1), 1))
+        return -1;
+    if (cq_engine_wait(&ib_res->cq_eng, WRID_CLASS_RECV, 1))
+        return -1;
+    lat_stats_add(st, gfp_get_time() - t0);
+    return cq_engine_wait(&ib_res->cq_eng, WRID_CLASS_SEND, 1);
+}
+
+int main(int argc, char *argv[]) {
+    struct ib_res ib_res;
+    struct ibv_mr *mr = NULL;
+    struct lat_stats st;
+    struct lat_summary sum;
+    size_t sizes[BENCH_MAX_SIZES];
+    char *buffer = NULL, *heap = NULL;
+    uint32_t cutoff;
+    int iters = 10000, nsizes;
+    int opt, ret = -1;
+
+    memset(&ib_res, 0, sizeof(struct ib_res));
+    memset(&st, 0, sizeof(st));
+    while ((opt = getopt(argc, argv, "n:" IB_OPTSTRING)) != -1) {
+        switch (opt) {
+        case 'n':
+            iters = atoi(optarg);
+            break;
+        default:
+            if (parse_ib_opt(&ib_res, opt, optarg) == 0)
+                break;
+            fprintf(stderr, "Usage: %s [-n iters_per_size] %s\n", argv[0], IB_OPTUSAGE);
+            return -1;
+        }
+    }
+    if (iters < 1) {
+        fprintf(stderr, "iterations must be positive\n");
+        return -1;
+    }
+    // Receives are posted one per write on the QP itself
+    ib_res.srq_depth = 0;
+
+    // Source in the first half, destination window in the second
+    buffer = memalign(getpagesize(), 2 * PKTSZ);
+    heap = malloc(PKTSZ);
+    if (!buffer || !heap) {
+        perror("malloc");
+        goto cleanup;
+    }
+    memset(buffer, 0xab, 2 * PKTSZ);
+    memset(heap, 0xcd, PKTSZ);
+    if (lat_stats_init(&st, iters))
+        goto cleanup;
+    if (prepare_ib_res(&ib_res)) {
+        perror("prepare_ib_res failed");
+        goto cleanup;
+    }
+    mr = ibv_reg_mr(ib_res.pd, buffer, 2 * PKTSZ, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    if (!mr) {
+        perror("ibv_reg_mr");
+        goto cleanup;
+    }
+    // Loopback: the QP's peer is itself
+    if (connect_qp(&ib_res, &ib_res.local_info))
+        goto cleanup;
+
+    cutoff = ib_res.max_inline;
+    nsizes = bench_sizes(sizes, cutoff, PKTSZ);
+    printf("negotiated inline capacity: %u bytes\n", cutoff);
+    for (int i = 0; i < nsizes; i++) {
+        size_t size = sizes[i];
+        uint64_t dst = (uintptr_t)buffer + PKTSZ;
+        char label[32];
+
+        // post_write_imm() goes by ib_res->max_inline, so 0 forces the DMA path
+        ib_res.max_inline = 0;
+        for (int k = 0; k < iters; k++)
+            if (timed_write(&ib_res, mr, buffer, size, dst, mr->rkey, &st))
+                goto cleanup;
+        ib_res.max_inline = cutoff;
+        lat_stats_summarize(&st, &sum);
+        snprintf(label, sizeof(label), "%6zu B dma", size);
+        lat_summary_print(stdout, label, &sum);
+        lat_stats_reset(&st);
+
+        for (int k = 0; k < iters; k++)
+            if (timed_write(&ib_res, mr, size <= cutoff ? heap : buffer, size, dst, mr->rkey, &st))
+                goto cleanup;
+        lat_stats_summarize(&st, &sum);
+        snprintf(label, sizeof(label), "%6zu B auto (%s)", size, size <= cutoff ? "inline" : "dma");
+        lat_summary_print(stdout, label, &sum);
+        lat_stats_reset(&st);
+    }
+    ret = 0;
+
+cleanup:
+    if (mr) ibv_dereg_mr(mr);
+    free(buffer);
+    free(heap);
+    lat_stats_free(&st);
+    free_ib_res(&ib_res);
+    return ret;
+}
@@ -0,0 +1,158 @@
+#ifndef LAT_STATS_H
+#define LAT_STATS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Latency sample collector for the benchmarks. Samples are kept raw so
+ * percentiles are exact; a log2(ns) histogram is produced alongside.
+ */
+
+#define LAT_HIST_BUCKETS 40
+
+struct lat_stats {
+    long long *samples;
+    size_t n;
+    size_t cap;
+};
+
+struct lat_summary {
+    size_t n;
+    long long min;
+    long long p50;
+    long long p99;
+    long long p999;
+    long long max;
+    double avg;
+    /* hist[i] counts samples in [2^i, 2^(i+1)) ns, hist[0] also holds 0 */
+    size_t hist[LAT_HIST_BUCKETS];
+};
+
+int lat_stats_init(struct lat_stats *st, size_t cap) {
+    st->samples = malloc(cap * sizeof(*st->samples));
+    st->n = 0;
+    st->cap = st->samples ? cap : 0;
+    if (!st->samples) {
+        perror("malloc");
+        return -1;
+    }
+    return 0;
+}
+
+void lat_stats_free(struct lat_stats *st) {
+    free(st->samples);
+    memset(st, 0, sizeof(*st));
+}
+
+static inline void lat_stats_reset(struct lat_stats *st) {
+    st->n = 0;
+}
+
+// Samples past the capacity are dropped rather than reallocating mid-run
+static inline void lat_stats_add(struct lat_stats *st, long long ns) {
+    if (st->n < st->cap)
+        st->samples[st->n++] = ns;
+}
+
+static int lat_cmp(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Nearest-rank percentile over sorted samples, p in [0, 100]: rank ceil(p/100 * n)
+static long long lat_percentile(const long long *sorted, size_t n, double p) {
+    // p * n first keeps whole ranks exact; ceil() by hand spares libm
+    double x = p * n / 100.0;
+    size_t rank = (size_t)x;
+
+    if (rank < x)
+        rank++;
+    if (rank < 1)
+        rank = 1;
+    if (rank > n)
+        rank = n;
+    return sorted[rank - 1];
+}
+
+// Sorts the samples in place
+void lat_stats_summarize(struct lat_stats *st, struct lat_summary *sum) {
+    double total = 0;
+
+    memset(sum, 0, sizeof(*sum));
+    sum->n = st->n;
+    if (st->n == 0)
+        return;
+    qsort(st->samples, st->n, sizeof(*st->samples), lat_cmp);
+    for (size_t i = 0; i < st->n; i++) {
+        long long v = st->samples[i];
+        int b = 0;
+
+        total += v;
+        while (b < LAT_HIST_BUCKETS - 1 && v >= (2LL << b))
+            b++;
+        sum->hist[b]++;
+    }
+    sum->min = st->samples[0];
+    sum->max = st->samples[st->n - 1];
+    sum->avg = total / st->n;
+    sum->p50 = lat_percentile(st->samples, st->n, 50);
+    sum->p99 = lat_percentile(st->samples, st->n, 99);
+    sum->p999 = lat_percentile(st->samples, st->n, 99.9);
+}
+
+// Emit the summary as JSON object members (no surrounding braces)
+void lat_summary_json(FILE *out, const struct lat_summary *sum) {
+    int last = 0;
+
+    fprintf(out, "\"n\": %zu, \"min_ns\": %lld, \"p50_ns\": %lld, \"p99_ns\": %lld, "
+            "\"p999_ns\": %lld, \"max_ns\": %lld, \"avg_ns\": %.1f, \"hist_log2_ns\": [",
+            sum->n, sum->min, sum->p50, sum->p99, sum->p999, sum->max, sum->avg);
+    for (int i = 0; i < LAT_HIST_BUCKETS; i++)
+        if (sum->hist[i])
+            last = i;
+    for (int i = 0; i <= last; i++)
+        fprintf(out, "%s%zu", i ? ", " : "", sum->hist[i]);
+    fprintf(out, "]");
+}
+
+void lat_summary_print(FILE *out, const char *label, const struct lat_summary *sum) {
+    fprintf(out, "%-24s n=%zu min=%lld p50=%lld p99=%lld p99.9=%lld max=%lld avg=%.1f ns\n",
+            label, sum->n, sum->min, sum->p50, sum->p99, sum->p999, sum->max, sum->avg);
+}
+
+// One line per log2 bucket from the first to the last non-empty one
+void lat_summary_print_hist(FILE *out, const struct lat_summary *sum) {
+    int first = -1, last = 0;
+    size_t peak = 0;
+
+    for (int i = 0; i < LAT_HIST_BUCKETS; i++) {
+        if (!sum->hist[i])
+            continue;
+        if (first < 0)
+            first = i;
+        last = i;
+        if (sum->hist[i] > peak)
+            peak = sum->hist[i];
+    }
+    for (int i = first; first >= 0 && i <= last; i++) {
+        int bar = (int)(sum->hist[i] * 40 / peak);
+
+        fprintf(out, "  [%12lld, %12lld) ns %10zu %.*s\n", i ? 1LL << i : 0LL, 2LL << i,
+                sum->hist[i], bar, "########################################");
+    }
+}
+
+/*
+ * Process CPU time, for utilisation = cpu delta / wall delta. Counts all
+ * threads, so a busy-polling thread shows up as 100% per core.
+ */
+static inline long long cpu_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#endif /* LAT_STATS_H */
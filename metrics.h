@@ -0,0 +1,536 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <infiniband/verbs.h>
+
+/*
+ * Per-QP and per-CQ counters in shared memory.
+ *
+ * With `-E <name>` the process maps the POSIX shared memory segment
+ * <name> (e.g. /mwuc) and every CQ engine takes one metrics_block of it.
+ * A block belongs to the thread that drives that engine, so it is updated
+ * with plain stores on cache lines no other thread writes; each QP slot
+ * has its own lines too. An external reader (metrics_dump) maps the
+ * segment read-only and samples it. 64-bit counters are written whole,
+ * so a sample may be a WR or two behind but is never torn.
+ *
+ * Counted are WRs posted through the gfp.h helpers, by opcode; bytes sent
+ * by RDMA writes; CQEs per QP and direction; failed CQEs by status; empty
+ * and productive CQ polls; and SQ/RQ occupancy with high-water marks. A
+ * signaled send retires itself and the unsignaled WRs posted before it,
+ * so each signaled post queues its retire count and send CQEs pop it.
+ * Posts made with plain ibv_post_send() are not seen, so their CQEs pop
+ * the wrong entry: don't mix them into a QP whose occupancy matters.
+ *
+ * A block goes back to the segment with metrics_block_put() when its CQ
+ * engine is torn down, and the next CQ engine that needs one reuses it,
+ * starting from zero under a new generation number.
+ *
+ * The segment is unlinked when the process exits.
+ */
+
+#define METRICS_MAGIC 0x6d777563u           /* "mwuc" */
+#define METRICS_VERSION 2
+#define METRICS_MAX_BLOCKS 64
+#define METRICS_MAX_QPS 16                  /* per block */
+#define METRICS_NOPS (IBV_WR_TSO + 2)       /* ibv_wr_opcode, the last one is "other" */
+#define METRICS_NSTATUS 24                  /* ibv_wc_status, the last one is "other" */
+#define METRICS_SQ_FIFO 1024                /* power of two >= MAX_SEND_WR */
+#define METRICS_DEV_NAME 64
+
+enum metrics_block_state {
+    METRICS_BLOCK_FREE = 0,
+    METRICS_BLOCK_USED,
+    METRICS_BLOCK_SETUP,                /* taken, not filled in yet */
+};
+
+struct metrics_qp {
+    uint32_t qpn;
+    uint32_t retire_head;
+    uint32_t retire_tail;
+    uint32_t unsignaled;                /* posted since the last signaled WR */
+    uint64_t posted[METRICS_NOPS];
+    uint64_t doorbells;
+    uint64_t bytes_written;
+    uint64_t send_cqes;
+    uint64_t recv_cqes;
+    uint64_t remote_invs;               /* receives that invalidated a local rkey */
+    uint64_t untracked;                 /* send CQEs with no queued retire count */
+    uint64_t sq_level;
+    uint64_t sq_hwm;
+    uint64_t rq_level;
+    uint64_t rq_hwm;
+    uint16_t retire[METRICS_SQ_FIFO];
+} __attribute__((aligned(64)));
+
+struct metrics_block {
+    uint32_t used;                      /* enum metrics_block_state */
+    /* written once by the owner when the block is taken */
+    uint32_t gen;                       /* times the block has been taken */
+    uint32_t port;
+    int32_t tid;
+    uint32_t nqps;
+    char dev[METRICS_DEV_NAME];
+    /* CQ, on its own line */
+    uint64_t polls_empty __attribute__((aligned(64)));
+    uint64_t polls_productive;
+    uint64_t cqes;
+    uint64_t srq_level;
+    uint64_t srq_hwm;
+    uint64_t untracked_qps;             /* posts and CQEs of QPs past METRICS_MAX_QPS */
+    uint64_t errors[METRICS_NSTATUS];
+    struct metrics_qp qps[METRICS_MAX_QPS];
+} __attribute__((aligned(64)));
+
+struct metrics_seg {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;
+    uint32_t max_blocks;
+    int32_t pid;
+    uint32_t nblocks;                   /* blocks ever taken, free ones included */
+    struct metrics_block blocks[METRICS_MAX_BLOCKS] __attribute__((aligned(64)));
+};
+
+static struct metrics_seg *metrics_seg_mapped;
+static char metrics_seg_name[NAME_MAX];
+
+static inline void metrics_hwm(uint64_t *hwm, uint64_t level) {
+    if (level > *hwm)
+        *hwm = level;
+}
+
+static void metrics_unlink(void) {
+    shm_unlink(metrics_seg_name);
+}
+
+/*
+ * Create and map segment `name`, once per process; threads that race
+ * here share whichever mapping won. Returns NULL on failure.
+ */
+struct metrics_seg *metrics_seg_create(const char *name) {
+    struct metrics_seg *seg = __atomic_load_n(&metrics_seg_mapped, __ATOMIC_ACQUIRE);
+    struct metrics_seg *expected = NULL;
+    int fd;
+
+    if (seg)
+        return seg;
+    fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        perror("shm_open");
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(*seg))) {
+        perror("ftruncate");
+        close(fd);
+        return NULL;
+    }
+    seg = mmap(NULL, sizeof(*seg), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    if (!__atomic_compare_exchange_n(&metrics_seg_mapped, &expected, seg, 0, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+        munmap(seg, sizeof(*seg));
+        return expected;
+    }
+    // A segment left over from an earlier run with the same name starts over
+    memset(seg, 0, sizeof(*seg));
+    seg->block_size = sizeof(struct metrics_block);
+    seg->max_blocks = METRICS_MAX_BLOCKS;
+    seg->pid = getpid();
+    seg->version = METRICS_VERSION;
+    __atomic_store_n(&seg->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+    snprintf(metrics_seg_name, sizeof(metrics_seg_name), "%s", name);
+    atexit(metrics_unlink);
+    return seg;
+}
+
+/*
+ * Take a free block of segment `name` for the calling thread's CQ on port
+ * `port` of device `dev`. Returns NULL (counting off) when none is left.
+ */
+struct metrics_block *metrics_block_get(const char *name, const char *dev, int port) {
+    struct metrics_seg *seg = metrics_seg_create(name);
+    struct metrics_block *m = NULL;
+    uint32_t i, n;
+
+    if (!seg)
+        return NULL;
+    for (i = 0; i < METRICS_MAX_BLOCKS; i++) {
+        uint32_t expected = METRICS_BLOCK_FREE;
+
+        if (__atomic_compare_exchange_n(&seg->blocks[i].used, &expected, METRICS_BLOCK_SETUP, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            m = &seg->blocks[i];
+            break;
+        }
+    }
+    if (!m) {
+        fprintf(stderr, "metrics: all %d blocks taken, not counting this CQ\n", METRICS_MAX_BLOCKS);
+        return NULL;
+    }
+    // A reused block starts over; `used` stays SETUP so nobody else takes it
+    memset((char *)m + offsetof(struct metrics_block, port), 0,
+           sizeof(*m) - offsetof(struct metrics_block, port));
+    m->gen++;
+    m->port = port;
+    m->tid = syscall(SYS_gettid);
+    snprintf(m->dev, sizeof(m->dev), "%s", dev);
+    n = __atomic_load_n(&seg->nblocks, __ATOMIC_ACQUIRE);
+    while (n < i + 1 && !__atomic_compare_exchange_n(&seg->nblocks, &n, i + 1, 0, __ATOMIC_ACQ_REL,
+                                                     __ATOMIC_ACQUIRE))
+        ;
+    __atomic_store_n(&m->used, METRICS_BLOCK_USED, __ATOMIC_RELEASE);
+    return m;
+}
+
+// Give `m` back once its CQ engine is gone; readers stop showing it
+void metrics_block_put(struct metrics_block *m) {
+    __atomic_store_n(&m->used, METRICS_BLOCK_FREE, __ATOMIC_RELEASE);
+}
+
+// Slot of `qpn`, taken on first use; NULL once the block is full
+static inline struct metrics_qp *metrics_qp_slot(struct metrics_block *m, uint32_t qpn) {
+    struct metrics_qp *q;
+
+    for (uint32_t i = 0; i < m->nqps; i++)
+        if (m->qps[i].qpn == qpn)
+            return &m->qps[i];
+    if (m->nqps == METRICS_MAX_QPS) {
+        m->untracked_qps++;
+        return NULL;
+    }
+    q = &m->qps[m->nqps];
+    q->qpn = qpn;
+    __atomic_store_n(&m->nqps, m->nqps + 1, __ATOMIC_RELEASE);
+    return q;
+}
+
+static inline void metrics_post_one(struct metrics_qp *q, int opcode, uint64_t len, int signaled) {
+    q->posted[opcode >= 0 && opcode < METRICS_NOPS - 1 ? opcode : METRICS_NOPS - 1]++;
+    if (opcode == IBV_WR_RDMA_WRITE || opcode == IBV_WR_RDMA_WRITE_WITH_IMM)
+        q->bytes_written += len;
+    q->sq_level++;
+    if (!signaled) {
+        q->unsignaled++;
+    } else {
+        if (q->retire_tail - q->retire_head < METRICS_SQ_FIFO)
+            q->retire[q->retire_tail++ & (METRICS_SQ_FIFO - 1)] = q->unsignaled + 1;
+        q->unsignaled = 0;
+    }
+    metrics_hwm(&q->sq_hwm, q->sq_level);
+}
+
+// One WR of `opcode` posted on `qpn` by a single-WR helper, one doorbell
+static inline void metrics_post(struct metrics_block *m, uint32_t qpn, int opcode, uint64_t len,
+                                int signaled) {
+    struct metrics_qp *q = metrics_qp_slot(m, qpn);
+
+    if (!q)
+        return;
+    q->doorbells++;
+    metrics_post_one(q, opcode, len, signaled);
+}
+
+// A WR chain posted on `qpn` with one doorbell
+static inline void metrics_post_chain(struct metrics_block *m, uint32_t qpn,
+                                      const struct ibv_send_wr *wr) {
+    struct metrics_qp *q = metrics_qp_slot(m, qpn);
+
+    if (!q)
+        return;
+    q->doorbells++;
+    for (; wr; wr = wr->next) {
+        uint64_t len = 0;
+
+        for (int i = 0; i < wr->num_sge; i++)
+            len += wr->sg_list[i].length;
+        metrics_post_one(q, wr->opcode, len, !!(wr->send_flags & IBV_SEND_SIGNALED));
+    }
+}
+
+static inline void metrics_post_recvs(struct metrics_block *m, uint32_t qpn, int n) {
+    struct metrics_qp *q = metrics_qp_slot(m, qpn);
+
+    if (!q)
+        return;
+    q->rq_level += n;
+    metrics_hwm(&q->rq_hwm, q->rq_level);
+}
+
+// One CQ poll returned `n` CQEs; `srq_level` is the SRQ's receive count, if there is one
+static inline void metrics_polled(struct metrics_block *m, int n, const uint32_t *srq_level) {
+    if (!n) {
+        m->polls_empty++;
+        return;
+    }
+    m->polls_productive++;
+    m->cqes += n;
+    if (srq_level) {
+        m->srq_level = *srq_level;
+        metrics_hwm(&m->srq_hwm, m->srq_level);
+    }
+}
+
+/*
+ * Account one reaped CQE. Failed CQEs carry no opcode, so the caller
+ * tells receives apart by wr_id class; `srq` says receives come from an
+ * SRQ rather than the QP's own RQ.
+ */
+static inline void metrics_cqe(struct metrics_block *m, const struct ibv_wc *wc, int is_recv,
+                               int srq) {
+    struct metrics_qp *q = metrics_qp_slot(m, wc->qp_num);
+    uint64_t retired;
+
+    if (wc->status != IBV_WC_SUCCESS)
+        m->errors[wc->status < METRICS_NSTATUS - 1 ? wc->status : METRICS_NSTATUS - 1]++;
+    if (!q)
+        return;
+    if (is_recv) {
+        q->recv_cqes++;
+        q->remote_invs += wc->status == IBV_WC_SUCCESS && (wc->wc_flags & IBV_WC_WITH_INV);
+        if (!srq && q->rq_level)
+            q->rq_level--;
+        return;
+    }
+    q->send_cqes++;
+    if (q->retire_head == q->retire_tail) {
+        q->untracked++;
+        return;
+    }
+    retired = q->retire[q->retire_head++ & (METRICS_SQ_FIFO - 1)];
+    q->sq_level -= retired < q->sq_level ? retired : q->sq_level;
+}
+
+static const char *metrics_op_str(int op) {
+    static const char *names[METRICS_NOPS] = {
+        "rdma_write", "rdma_write_imm", "send", "send_imm", "rdma_read", "comp_swap",
+        "fetch_add", "local_inv", "bind_mw", "send_inv", "tso", "other",
+    };
+    return names[op];
+}
+
+/*
+ * Map segment `name` read-only for sampling. Returns NULL if it does not
+ * exist or was written by an incompatible build.
+ */
+const struct metrics_seg *metrics_seg_open(const char *name) {
+    struct metrics_seg *seg;
+    int fd = shm_open(name, O_RDONLY, 0);
+
+    if (fd < 0) {
+        perror("shm_open");
+        return NULL;
+    }
+    seg = mmap(NULL, sizeof(*seg), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (seg == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    if (__atomic_load_n(&seg->magic, __ATOMIC_ACQUIRE) != METRICS_MAGIC ||
+        seg->version != METRICS_VERSION || seg->block_size != sizeof(struct metrics_block) ||
+        seg->max_blocks != METRICS_MAX_BLOCKS) {
+        fprintf(stderr, "%s is not a version %d metrics segment\n", name, METRICS_VERSION);
+        munmap(seg, sizeof(*seg));
+        return NULL;
+    }
+    return seg;
+}
+
+static inline uint64_t metrics_read(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static inline uint32_t metrics_nblocks(const struct metrics_seg *seg) {
+    uint32_t n = __atomic_load_n(&seg->nblocks, __ATOMIC_ACQUIRE);
+
+    return n < METRICS_MAX_BLOCKS ? n : METRICS_MAX_BLOCKS;
+}
+
+// Every numeric file in `dir` as a `metric` sample of dev/port
+static void metrics_prom_sysfs(FILE *out, const char *metric, const char *dir, const char *dev,
+                               uint32_t port) {
+    char path[PATH_MAX];
+    struct dirent *e;
+    DIR *d = opendir(dir);
+
+    if (!d)
+        return;
+    while ((e = readdir(d))) {
+        unsigned long long v;
+        FILE *f;
+        int ok;
+
+        if (e->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        f = fopen(path, "r");
+        if (!f)
+            continue;
+        ok = fscanf(f, "%llu", &v) == 1;
+        fclose(f);
+        if (ok)
+            fprintf(out, "%s{device=\"%s\",port=\"%u\",counter=\"%s\"} %llu\n", metric, dev, port,
+                    e->d_name, v);
+    }
+    closedir(d);
+}
+
+// Per-QP families: the exposition format wants each one in a single group
+static const struct metrics_prom_field {
+    const char *name;
+    const char *type;
+    const char *queue;
+    size_t off;
+} metrics_prom_qp_fields[] = {
+    { "mwuc_doorbells_total", "counter", NULL, offsetof(struct metrics_qp, doorbells) },
+    { "mwuc_bytes_written_total", "counter", NULL, offsetof(struct metrics_qp, bytes_written) },
+    { "mwuc_cqes_total", "counter", "sq", offsetof(struct metrics_qp, send_cqes) },
+    { "mwuc_cqes_total", NULL, "rq", offsetof(struct metrics_qp, recv_cqes) },
+    { "mwuc_remote_invalidations_total", "counter", NULL, offsetof(struct metrics_qp, remote_invs) },
+    { "mwuc_queue_depth", "gauge", "sq", offsetof(struct metrics_qp, sq_level) },
+    { "mwuc_queue_depth", NULL, "rq", offsetof(struct metrics_qp, rq_level) },
+    { "mwuc_queue_depth_max", "gauge", "sq", offsetof(struct metrics_qp, sq_hwm) },
+    { "mwuc_queue_depth_max", NULL, "rq", offsetof(struct metrics_qp, rq_hwm) },
+};
+
+static inline int metrics_block_used(const struct metrics_block *m) {
+    return __atomic_load_n(&m->used, __ATOMIC_ACQUIRE) == METRICS_BLOCK_USED;
+}
+
+static void metrics_prom_labels(char *buf, size_t len, const struct metrics_seg *seg,
+                                const struct metrics_block *m) {
+    snprintf(buf, len, "pid=\"%d\",tid=\"%d\",device=\"%s\",port=\"%u\"", seg->pid, m->tid,
+             m->dev, m->port);
+}
+
+/*
+ * Prometheus text exposition of `seg`. Port counters are read from
+ * /sys/class/infiniband/<dev>/ports/<port>/{counters,hw_counters}, once per
+ * device and port.
+ */
+void metrics_prom_write(FILE *out, const struct metrics_seg *seg) {
+    uint32_t nblocks = metrics_nblocks(seg);
+    char lbl[160], dir[PATH_MAX];
+
+    fprintf(out, "# TYPE mwuc_wr_posted_total counter\n");
+    for (uint32_t b = 0; b < nblocks; b++) {
+        const struct metrics_block *m = &seg->blocks[b];
+        uint32_t nqps = __atomic_load_n(&m->nqps, __ATOMIC_ACQUIRE);
+
+        if (!metrics_block_used(m))
+            continue;
+        metrics_prom_labels(lbl, sizeof(lbl), seg, m);
+        for (uint32_t i = 0; i < nqps; i++)
+            for (int op = 0; op < METRICS_NOPS; op++)
+                if (metrics_read(&m->qps[i].posted[op]))
+                    fprintf(out, "mwuc_wr_posted_total{%s,qpn=\"%u\",opcode=\"%s\"} %lu\n", lbl,
+                            m->qps[i].qpn, metrics_op_str(op),
+                            (unsigned long)metrics_read(&m->qps[i].posted[op]));
+    }
+    for (size_t f = 0; f < sizeof(metrics_prom_qp_fields) / sizeof(metrics_prom_qp_fields[0]); f++) {
+        const struct metrics_prom_field *fld = &metrics_prom_qp_fields[f];
+
+        if (fld->type)
+            fprintf(out, "# TYPE %s %s\n", fld->name, fld->type);
+        for (uint32_t b = 0; b < nblocks; b++) {
+            const struct metrics_block *m = &seg->blocks[b];
+            uint32_t nqps = __atomic_load_n(&m->nqps, __ATOMIC_ACQUIRE);
+
+            if (!metrics_block_used(m))
+                continue;
+            metrics_prom_labels(lbl, sizeof(lbl), seg, m);
+            for (uint32_t i = 0; i < nqps; i++) {
+                const uint64_t *v = (const uint64_t *)((const char *)&m->qps[i] + fld->off);
+
+                fprintf(out, "%s{%s,qpn=\"%u\"%s%s%s} %lu\n", fld->name, lbl, m->qps[i].qpn,
+                        fld->queue ? ",queue=\"" : "", fld->queue ? fld->queue : "",
+                        fld->queue ? "\"" : "", (unsigned long)metrics_read(v));
+            }
+        }
+    }
+
+    fprintf(out, "# TYPE mwuc_cq_polls_total counter\n");
+    for (uint32_t b = 0; b < nblocks; b++) {
+        const struct metrics_block *m = &seg->blocks[b];
+
+        if (!metrics_block_used(m))
+            continue;
+        metrics_prom_labels(lbl, sizeof(lbl), seg, m);
+        fprintf(out, "mwuc_cq_polls_total{%s,result=\"empty\"} %lu\n", lbl,
+                (unsigned long)metrics_read(&m->polls_empty));
+        fprintf(out, "mwuc_cq_polls_total{%s,result=\"productive\"} %lu\n", lbl,
+                (unsigned long)metrics_read(&m->polls_productive));
+    }
+    fprintf(out, "# TYPE mwuc_cqe_errors_total counter\n");
+    for (uint32_t b = 0; b < nblocks; b++) {
+        const struct metrics_block *m = &seg->blocks[b];
+
+        if (!metrics_block_used(m))
+            continue;
+        metrics_prom_labels(lbl, sizeof(lbl), seg, m);
+        for (int st = 1; st < METRICS_NSTATUS; st++)
+            if (metrics_read(&m->errors[st]))
+                fprintf(out, "mwuc_cqe_errors_total{%s,status=\"%s\"} %lu\n", lbl,
+                        st < METRICS_NSTATUS - 1 ? ibv_wc_status_str(st) : "other",
+                        (unsigned long)metrics_read(&m->errors[st]));
+    }
+    fprintf(out, "# TYPE mwuc_srq_depth gauge\n");
+    for (uint32_t b = 0; b < nblocks; b++) {
+        const struct metrics_block *m = &seg->blocks[b];
+
+        if (!metrics_block_used(m) || !metrics_read(&m->srq_hwm))
+            continue;
+        metrics_prom_labels(lbl, sizeof(lbl), seg, m);
+        fprintf(out, "mwuc_srq_depth{%s} %lu\n", lbl, (unsigned long)metrics_read(&m->srq_level));
+    }
+    fprintf(out, "# TYPE mwuc_srq_depth_max gauge\n");
+    for (uint32_t b = 0; b < nblocks; b++) {
+        const struct metrics_block *m = &seg->blocks[b];
+
+        if (!metrics_block_used(m) || !metrics_read(&m->srq_hwm))
+            continue;
+        metrics_prom_labels(lbl, sizeof(lbl), seg, m);
+        fprintf(out, "mwuc_srq_depth_max{%s} %lu\n", lbl, (unsigned long)metrics_read(&m->srq_hwm));
+    }
+
+    fprintf(out, "# TYPE mwuc_port_counter untyped\n");
+    for (int hw = 0; hw < 2; hw++) {
+        if (hw)
+            fprintf(out, "# TYPE mwuc_port_hw_counter untyped\n");
+        for (uint32_t b = 0; b < nblocks; b++) {
+            const struct metrics_block *m = &seg->blocks[b];
+            int seen = 0;
+
+            if (!metrics_block_used(m))
+                continue;
+            for (uint32_t k = 0; k < b && !seen; k++)
+                seen = metrics_block_used(&seg->blocks[k]) && seg->blocks[k].port == m->port &&
+                       !strcmp(seg->blocks[k].dev, m->dev);
+            if (seen)
+                continue;
+            snprintf(dir, sizeof(dir), "/sys/class/infiniband/%s/ports/%u/%s", m->dev, m->port,
+                     hw ? "hw_counters" : "counters");
+            metrics_prom_sysfs(out, hw ? "mwuc_port_hw_counter" : "mwuc_port_counter", dir,
+                               m->dev, m->port);
+        }
+    }
+}
+
+#endif /* METRICS_H */
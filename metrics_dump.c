@@ -0,0 +1,134 @@
+#include <time.h>
+#include <getopt.h>
+#include "metrics.h"
+
+/*
+ * Sample the counters a process exports with `-E <name>`.
+ *
+ * By default one line per QP every `-i` ms, with rates over the interval:
+ * WRs and doorbells per second, MB/s written, send and receive CQEs per
+ * second, and the SQ/RQ occupancy and high-water marks. Each CQ gets a
+ * line with its productive/empty poll split and failed CQEs. `-c` stops
+ * after that many samples.
+ *
+ * With `-p`, the segment is printed once in Prometheus text format,
+ * together with the port counters from sysfs, e.g. for node_exporter's
+ * textfile collector.
+ */
+
+static inline long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint64_t qp_posted(const struct metrics_qp *q) {
+    uint64_t n = 0;
+
+    for (int op = 0; op < METRICS_NOPS; op++)
+        n += metrics_read(&q->posted[op]);
+    return n;
+}
+
+static uint64_t block_errors(const struct metrics_block *m) {
+    uint64_t n = 0;
+
+    for (int s = 1; s < METRICS_NSTATUS; s++)
+        n += metrics_read(&m->errors[s]);
+    return n;
+}
+
+static void print_sample(const struct metrics_seg *seg, const struct metrics_seg *prev, double secs) {
+    static const struct metrics_block zero;
+    uint32_t nblocks = metrics_nblocks(seg);
+
+    for (uint32_t b = 0; b < nblocks; b++) {
+        const struct metrics_block *m = &seg->blocks[b], *pm = &prev->blocks[b];
+        uint64_t polls, ppolls;
+        uint32_t nqps;
+
+        if (!metrics_block_used(m))
+            continue;
+        // Taken again since the last sample: its counters started over
+        if (pm->gen != __atomic_load_n(&m->gen, __ATOMIC_RELAXED))
+            pm = &zero;
+        polls = metrics_read(&m->polls_empty) + metrics_read(&m->polls_productive);
+        ppolls = pm->polls_empty + pm->polls_productive;
+        printf("cq  %-10s %2u tid %-7d %10.0f polls/s %5.1f%% productive %8.0f cqes/s %6lu errors\n",
+               m->dev, m->port, m->tid, (polls - ppolls) / secs,
+               polls > ppolls ? 100.0 * (metrics_read(&m->polls_productive) -
+                                         pm->polls_productive) / (polls - ppolls) : 0.0,
+               (metrics_read(&m->cqes) - pm->cqes) / secs, (unsigned long)block_errors(m));
+        nqps = __atomic_load_n(&m->nqps, __ATOMIC_ACQUIRE);
+        for (uint32_t i = 0; i < nqps; i++) {
+            const struct metrics_qp *q = &m->qps[i], *pq = &pm->qps[i];
+
+            printf("  qp %-6u %10.0f wr/s %9.0f db/s %9.1f MB/s %9.0f scqe/s %9.0f rcqe/s "
+                   "sq %lu/%lu rq %lu/%lu\n", q->qpn, (qp_posted(q) - qp_posted(pq)) / secs,
+                   (metrics_read(&q->doorbells) - pq->doorbells) / secs,
+                   (metrics_read(&q->bytes_written) - pq->bytes_written) / secs / 1e6,
+                   (metrics_read(&q->send_cqes) - pq->send_cqes) / secs,
+                   (metrics_read(&q->recv_cqes) - pq->recv_cqes) / secs,
+                   (unsigned long)metrics_read(&q->sq_level), (unsigned long)metrics_read(&q->sq_hwm),
+                   (unsigned long)metrics_read(&q->rq_level), (unsigned long)metrics_read(&q->rq_hwm));
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const struct metrics_seg *seg;
+    struct metrics_seg *prev;
+    long long interval_ms = 1000, last, now;
+    long count = 0;
+    int prom = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:c:p")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval_ms = strtoll(optarg, NULL, 0);
+            break;
+        case 'c':
+            count = strtol(optarg, NULL, 0);
+            break;
+        case 'p':
+            prom = 1;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind != argc - 1 || interval_ms <= 0)
+        goto usage;
+    seg = metrics_seg_open(argv[optind]);
+    if (!seg)
+        return -1;
+    if (prom) {
+        metrics_prom_write(stdout, seg);
+        return 0;
+    }
+
+    // The previous sample, copied whole so deltas need no per-field bookkeeping
+    prev = calloc(1, sizeof(*prev));
+    if (!prev) {
+        perror("calloc");
+        return -1;
+    }
+    memcpy(prev, seg, sizeof(*prev));
+    last = now_ns();
+    for (long n = 0; !count || n < count; n++) {
+        usleep(interval_ms * 1000);
+        now = now_ns();
+        printf("--- pid %d, %u blocks\n", seg->pid, metrics_nblocks(seg));
+        print_sample(seg, prev, (now - last) / 1e9);
+        fflush(stdout);
+        memcpy(prev, seg, sizeof(*prev));
+        last = now;
+    }
+    free(prev);
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: %s [-i interval_ms] [-c samples] [-p] shm_name\n", argv[0]);
+    return -1;
+}
@@ -0,0 +1,283 @@
+#ifndef MT_H
+#define MT_H
+
+#include <pthread.h>
+#include <sched.h>
+#include "gfp.h"
+
+/*
+ * Multi-threaded data path. Needs _GNU_SOURCE for CPU affinity.
+ *
+ * Every worker thread is pinned to one core and owns everything on its
+ * hot path: a CQ with its own cq_engine, `nqps` QPs and a buffer that it
+ * touches and registers itself after pinning, so the pages come from its
+ * own node. Only the device context and PD are shared, and only during
+ * setup; no lock is taken once the workers are running.
+ *
+ * A worker keeps a private copy of the shared ib_res whose cq/cq_eng are
+ * its own, so create_qp(), connect_peer_qp() and the CQ engine work on it
+ * unchanged. The copy never goes to free_ib_res().
+ *
+ * The data path is loopback: each QP is connected to itself and streams
+ * RDMA writes from the first half of the worker's buffer into the second.
+ * Writes are posted as chains of up to MT_CHAIN WRs with the last one
+ * signaled; its wr_id carries the QP index and the chain length.
+ */
+
+#define MT_CHAIN 16
+#define MT_MAX_QPS 64
+#define MT_WRID(qp, n) WRID(WRID_CLASS_SEND, ((uint64_t)(qp) << 16) | (n))
+#define MT_WRID_QP(wr_id) (WRID_IDX(wr_id) >> 16)
+#define MT_WRID_N(wr_id) (WRID_IDX(wr_id) & 0xffff)
+
+struct mt_qp {
+    struct ibv_qp *qp;
+    uint64_t posted;
+    uint64_t retired;
+};
+
+struct mt_run;
+
+struct mt_worker {
+    int id;
+    int cpu;
+    struct mt_run *run;
+    pthread_t tid;
+    struct ib_res res;
+    struct mt_qp qps[MT_MAX_QPS];
+    char *buf;
+    struct ibv_mr *mr;
+    uint64_t msgs;
+    long long elapsed;
+    int ret;
+} __attribute__((aligned(64)));
+
+// Read-only once the workers start, apart from the start gate
+struct mt_run {
+    struct ib_res *shared;
+    int nworkers;
+    int nqps;
+    int depth;
+    size_t msg_size;
+    uint64_t iters;
+    int ready;
+    int failed;
+    struct mt_worker *workers;
+};
+
+static void mt_retire(void *arg, const struct ibv_wc *wc) {
+    struct mt_worker *w = arg;
+
+    w->qps[MT_WRID_QP(wc->wr_id)].retired += MT_WRID_N(wc->wr_id);
+}
+
+static int mt_pin(int cpu) {
+    cpu_set_t set;
+    int ret;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret)
+        fprintf(stderr, "pinning to cpu %d failed: %s\n", cpu, strerror(ret));
+    return ret;
+}
+
+static int mt_worker_setup(struct mt_worker *w) {
+    struct mt_run *run = w->run;
+    size_t buf_size = 2 * run->msg_size;
+    struct ibv_cq *cq;
+
+    w->buf = memalign(getpagesize(), buf_size);
+    if (!w->buf) {
+        perror("memalign");
+        return -1;
+    }
+    // First touch after pinning places the pages on this core's node
+    memset(w->buf, 0, buf_size);
+    w->mr = ibv_reg_mr(run->shared->pd, w->buf, buf_size,
+                       IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    if (!w->mr) {
+        perror("ibv_reg_mr");
+        return -1;
+    }
+
+    // One CQE per chain at most, and never more than `depth` WRs per QP
+    cq = ibv_create_cq(run->shared->context, run->nqps * run->depth, NULL, NULL, 0);
+    if (!cq) {
+        perror("ibv_create_cq");
+        return -1;
+    }
+    w->res = *run->shared;
+    memset(&w->res.srq, 0, sizeof(w->res.srq));
+    w->res.qp = NULL;
+    w->res.cq = cq;
+    w->res.cq_ex = NULL;
+    cq_engine_init(&w->res.cq_eng, cq, CQ_BATCH_MAX);
+    ib_metrics_attach(&w->res);
+    cq_engine_register(&w->res.cq_eng, WRID_CLASS_SEND, mt_retire, w);
+
+    for (int i = 0; i < run->nqps; i++) {
+        struct ib_info self = run->shared->local_info;
+
+        w->qps[i].qp = create_qp(&w->res);
+        if (!w->qps[i].qp)
+            return -1;
+        self.qpn = w->qps[i].qp->qp_num;
+        if (connect_peer_qp(&w->res, w->qps[i].qp, self.psn, &self))
+            return -1;
+    }
+    return 0;
+}
+
+// Post one chain on `q`, as long as its send queue has room
+static int mt_post_chain(struct mt_worker *w, int qi, struct ibv_sge *sg, uint64_t *left) {
+    struct mt_run *run = w->run;
+    struct mt_qp *q = &w->qps[qi];
+    struct ibv_send_wr wrs[MT_CHAIN], *bad_wr;
+    uint64_t room = run->depth - (q->posted - q->retired);
+    int n = MT_CHAIN;
+
+    if (room < (uint64_t)n)
+        n = room;
+    if (*left < (uint64_t)n)
+        n = *left;
+    if (n == 0)
+        return 0;
+    for (int k = 0; k < n; k++) {
+        memset(&wrs[k], 0, sizeof(wrs[k]));
+        wrs[k].sg_list = sg;
+        wrs[k].num_sge = 1;
+        wrs[k].opcode = IBV_WR_RDMA_WRITE;
+        wrs[k].wr.rdma.remote_addr = (uintptr_t)w->buf + run->msg_size;
+        wrs[k].wr.rdma.rkey = w->mr->rkey;
+        wrs[k].next = k + 1 < n ? &wrs[k + 1] : NULL;
+    }
+    wrs[n - 1].wr_id = MT_WRID(qi, n);
+    wrs[n - 1].send_flags = IBV_SEND_SIGNALED;
+    if (ib_post_send(&w->res, q->qp, wrs, &bad_wr)) {
+        perror("ibv_post_send");
+        return -1;
+    }
+    q->posted += n;
+    *left -= n;
+    return 0;
+}
+
+static int mt_worker_loop(struct mt_worker *w) {
+    struct mt_run *run = w->run;
+    struct cq_engine *eng = &w->res.cq_eng;
+    uint64_t left = run->iters;
+    struct ibv_sge sg;
+    int done;
+
+    sg.addr = (uintptr_t)w->buf;
+    sg.length = run->msg_size;
+    sg.lkey = w->mr->lkey;
+    do {
+        for (int i = 0; i < run->nqps; i++)
+            if (mt_post_chain(w, i, &sg, &left))
+                return -1;
+        if (cq_engine_poll(eng) < 0 || eng->failed[WRID_CLASS_SEND])
+            return -1;
+        done = left == 0;
+        for (int i = 0; done && i < run->nqps; i++)
+            done = w->qps[i].retired == w->qps[i].posted;
+    } while (!done);
+    w->msgs = run->iters;
+    return 0;
+}
+
+static void *mt_worker_main(void *arg) {
+    struct mt_worker *w = arg;
+    struct mt_run *run = w->run;
+    long long start;
+
+    mt_pin(w->cpu);
+    w->ret = mt_worker_setup(w);
+    if (w->ret)
+        __atomic_store_n(&run->failed, 1, __ATOMIC_RELEASE);
+    /*
+     * Start every worker's clock together, and only if all of them are
+     * ready. A spin gate rather than a barrier, so that a worker that was
+     * never created (failed = 1) releases the others too.
+     */
+    __atomic_add_fetch(&run->ready, 1, __ATOMIC_ACQ_REL);
+    while (__atomic_load_n(&run->ready, __ATOMIC_ACQUIRE) < run->nworkers &&
+           !__atomic_load_n(&run->failed, __ATOMIC_ACQUIRE))
+        sched_yield();
+    if (__atomic_load_n(&run->failed, __ATOMIC_ACQUIRE))
+        return NULL;
+    start = gfp_get_time();
+    w->ret = mt_worker_loop(w);
+    w->elapsed = gfp_get_time() - start;
+    return NULL;
+}
+
+// Release the worker's verbs objects and buffer; its results stay readable
+static void mt_worker_destroy(struct mt_worker *w) {
+    for (int i = 0; i < MT_MAX_QPS; i++) {
+        if (w->qps[i].qp) ibv_destroy_qp(w->qps[i].qp);
+        w->qps[i].qp = NULL;
+    }
+    if (w->res.cq) ibv_destroy_cq(w->res.cq);
+    if (w->res.cq_eng.metrics) metrics_block_put(w->res.cq_eng.metrics);
+    if (w->mr) ibv_dereg_mr(w->mr);
+    free(w->buf);
+    w->res.cq_eng.metrics = NULL;
+    w->res.cq = NULL;
+    w->mr = NULL;
+    w->buf = NULL;
+}
+
+/*
+ * Run `nworkers` workers pinned to cpus[0..nworkers-1], each pushing
+ * `iters` writes of `msg_size` over `nqps` QPs kept `depth` deep.
+ * Fills `workers` with per-worker results; returns 0 or -1.
+ */
+int mt_run_workers(struct ib_res *shared, struct mt_worker *workers, const int *cpus, int nworkers,
+                   int nqps, int depth, size_t msg_size, uint64_t iters) {
+    struct mt_run run;
+    int started = 0, ret = 0;
+
+    if (nqps < 1 || nqps > MT_MAX_QPS || depth < 1 || depth > MAX_SEND_WR) {
+        fprintf(stderr, "need 1..%d QPs per worker and depth 1..%d\n", MT_MAX_QPS, MAX_SEND_WR);
+        return -1;
+    }
+    memset(&run, 0, sizeof(run));
+    run.shared = shared;
+    run.nworkers = nworkers;
+    run.nqps = nqps;
+    run.depth = depth;
+    run.msg_size = msg_size;
+    run.iters = iters;
+    run.workers = workers;
+    memset(workers, 0, nworkers * sizeof(*workers));
+
+    for (; started < nworkers; started++) {
+        workers[started].id = started;
+        workers[started].cpu = cpus[started];
+        workers[started].run = &run;
+        if (pthread_create(&workers[started].tid, NULL, mt_worker_main, &workers[started])) {
+            perror("pthread_create");
+            break;
+        }
+    }
+    // A worker that never started would leave the others stuck at the gate
+    if (started < nworkers) {
+        __atomic_store_n(&run.failed, 1, __ATOMIC_RELEASE);
+        ret = -1;
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].tid, NULL);
+        if (workers[i].ret)
+            ret = -1;
+    }
+    if (run.failed)
+        ret = -1;
+    for (int i = 0; i < started; i++)
+        mt_worker_destroy(&workers[i]);
+    return ret;
+}
+
+#endif /* MT_H */
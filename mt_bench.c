@@ -0,0 +1,119 @@
+#define _GNU_SOURCE
+#include "gfp.h"
+#include "mt.h"
+
+/*
+ * Data path scaling benchmark.
+ *
+ * Runs the multi-threaded loopback data path with 1, 2, 4, ... workers up
+ * to the number of cores this process may run on (or -w), each worker
+ * pinned to its own core with `-Q` QPs of its own. Reported is aggregate
+ * messages/sec (total writes over the slowest worker's time), the
+ * per-worker rate and the scaling efficiency against one worker.
+ */
+
+static int allowed_cpus(int *cpus, int max) {
+    cpu_set_t set;
+    int n = 0;
+
+    if (sched_getaffinity(0, sizeof(set), &set)) {
+        perror("sched_getaffinity");
+        return -1;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++)
+        if (CPU_ISSET(cpu, &set))
+            cpus[n++] = cpu;
+    return n;
+}
+
+// 1, 2, 4, ... and finally the maximum itself if it is not a power of two
+static int next_workers(int n, int max) {
+    return n < max && n * 2 > max ? max : n * 2;
+}
+
+int main(int argc, char *argv[]) {
+    struct ib_res ib_res;
+    struct mt_worker *workers = NULL;
+    int cpus[CPU_SETSIZE];
+    int ncpus, max_workers = 0;
+    int nqps = 1, depth = 128;
+    size_t msg_size = 64;
+    uint64_t iters = 1000000;
+    double base_rate = 0;
+    int opt, ret = -1;
+
+    memset(&ib_res, 0, sizeof(struct ib_res));
+    while ((opt = getopt(argc, argv, "w:Q:d:S:n:" IB_OPTSTRING)) != -1) {
+        switch (opt) {
+        case 'w':
+            max_workers = atoi(optarg);
+            break;
+        case 'Q':
+            nqps = atoi(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'S':
+            msg_size = strtoull(optarg, NULL, 0);
+            break;
+        case 'n':
+            iters = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            if (parse_ib_opt(&ib_res, opt, optarg) == 0)
+                break;
+            fprintf(stderr, "Usage: %s [-w max_workers] [-Q qps_per_worker] [-d depth] "
+                    "[-S msg_size] [-n writes_per_worker] %s\n", argv[0], IB_OPTUSAGE);
+            return -1;
+        }
+    }
+    // Workers poll their own CQs; the shared one is never waited on
+    ib_res.cq_mode = CQ_MODE_POLL;
+    ncpus = allowed_cpus(cpus, CPU_SETSIZE);
+    if (ncpus < 1)
+        return -1;
+    if (max_workers < 1 || max_workers > ncpus)
+        max_workers = ncpus;
+    if (msg_size < 1 || iters < 1) {
+        fprintf(stderr, "message size and writes per worker must be positive\n");
+        return -1;
+    }
+
+    workers = memalign(64, max_workers * sizeof(*workers));
+    if (!workers) {
+        perror("memalign");
+        return -1;
+    }
+    if (prepare_ib_res(&ib_res)) {
+        perror("prepare_ib_res failed");
+        goto cleanup;
+    }
+
+    printf("%d QP(s)/worker, depth %d, %zu B writes, %lu writes/worker\n",
+           nqps, depth, msg_size, (unsigned long)iters);
+    printf("%8s %14s %14s %10s %10s\n", "workers", "msgs/s", "msgs/s/worker", "Gb/s", "scaling");
+    for (int n = 1; n <= max_workers; n = next_workers(n, max_workers)) {
+        long long slowest = 0;
+        double rate;
+
+        if (mt_run_workers(&ib_res, workers, cpus, n, nqps, depth, msg_size, iters)) {
+            fprintf(stderr, "run with %d workers failed\n", n);
+            goto cleanup;
+        }
+        for (int i = 0; i < n; i++)
+            if (workers[i].elapsed > slowest)
+                slowest = workers[i].elapsed;
+        rate = (double)n * iters * 1e9 / slowest;
+        if (n == 1)
+            base_rate = rate;
+        printf("%8d %14.0f %14.0f %10.2f %9.0f%%\n", n, rate, rate / n,
+               rate * msg_size * 8 / 1e9, 100.0 * rate / (base_rate * n));
+    }
+    ret = 0;
+
+cleanup:
+    free(workers);
+    free_ib_res(&ib_res);
+    return ret;
+}
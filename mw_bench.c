@@ -0,0 +1,277 @@
+#include "gfp.h"
+#include "lat_stats.h"
+#include "mw_pool.h"
+
+/*
+ * Memory window / memory region verb latency benchmark.
+ *
+ * For every window size from 4 KiB up to -S bytes (x4 steps) it times
+ * alloc_mw, dealloc_mw, reg_mr, dereg_mr, type 1 bind, type 2 bind,
+ * LOCAL_INV and the amortised per-window cost of pipelined mw_pool
+ * bind+invalidate, each after -w untimed warm-up iterations. Results are
+ * written as JSON (stdout or -o file); a one-line summary per op goes to
+ * stderr. Runs on any device, including Soft-RoCE (see scripts/rxe_setup.sh).
+ */
+
+#define MW_BENCH_MIN_SIZE 4096
+#define MW_BENCH_POOL 64
+
+struct mw_bench {
+    struct ib_res ib_res;
+    struct ibv_mr *mr;
+    char *buffer;
+    size_t max_size;
+    int iters;
+    int warmup;
+    struct lat_stats st;
+    FILE *out;
+    int nresults;
+};
+
+static void emit(struct mw_bench *b, struct lat_stats *st, const char *op, size_t size) {
+    struct lat_summary sum;
+
+    lat_stats_summarize(st, &sum);
+    fprintf(b->out, "%s\n    {\"op\": \"%s\", \"size\": %zu, ", b->nresults++ ? "," : "", op, size);
+    lat_summary_json(b->out, &sum);
+    fprintf(b->out, "}");
+    fprintf(stderr, "%-14s %10zu ", op, size);
+    lat_summary_print(stderr, "", &sum);
+    lat_stats_reset(st);
+}
+
+static int bench_alloc_dealloc(struct mw_bench *b) {
+    struct lat_stats dealloc;
+
+    if (lat_stats_init(&dealloc, b->iters))
+        return -1;
+    for (int i = 0; i < b->warmup + b->iters; i++) {
+        long long t0, t1, t2;
+        struct ibv_mw *mw;
+
+        t0 = gfp_get_time();
+        mw = ibv_alloc_mw(b->ib_res.pd, IBV_MW_TYPE_2);
+        t1 = gfp_get_time();
+        if (!mw) {
+            perror("ibv_alloc_mw");
+            lat_stats_free(&dealloc);
+            return -1;
+        }
+        ibv_dealloc_mw(mw);
+        t2 = gfp_get_time();
+        if (i >= b->warmup) {
+            lat_stats_add(&b->st, t1 - t0);
+            lat_stats_add(&dealloc, t2 - t1);
+        }
+    }
+    emit(b, &b->st, "alloc_mw", 0);
+    emit(b, &dealloc, "dealloc_mw", 0);
+    lat_stats_free(&dealloc);
+    return 0;
+}
+
+static int bench_reg_dereg(struct mw_bench *b, size_t size) {
+    struct lat_stats dereg;
+
+    if (lat_stats_init(&dereg, b->iters))
+        return -1;
+    for (int i = 0; i < b->warmup + b->iters; i++) {
+        long long t0, t1, t2;
+        struct ibv_mr *mr;
+
+        t0 = gfp_get_time();
+        mr = ibv_reg_mr(b->ib_res.pd, b->buffer, size,
+                        IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_MW_BIND);
+        t1 = gfp_get_time();
+        if (!mr) {
+            perror("ibv_reg_mr");
+            lat_stats_free(&dereg);
+            return -1;
+        }
+        ibv_dereg_mr(mr);
+        t2 = gfp_get_time();
+        if (i >= b->warmup) {
+            lat_stats_add(&b->st, t1 - t0);
+            lat_stats_add(&dereg, t2 - t1);
+        }
+    }
+    emit(b, &b->st, "reg_mr", size);
+    emit(b, &dereg, "dereg_mr", size);
+    lat_stats_free(&dereg);
+    return 0;
+}
+
+static int bench_bind(struct mw_bench *b, size_t size, uint8_t type) {
+    struct ibv_mw_bind_info bind_info = {
+        .mr = b->mr,
+        .addr = (uintptr_t)b->buffer,
+        .length = size,
+        .mw_access_flags = IBV_ACCESS_REMOTE_WRITE,
+    };
+    struct lat_stats inv;
+    struct ibv_mw *mw = NULL;
+    int ret = -1;
+
+    if (lat_stats_init(&inv, b->iters))
+        return -1;
+    mw = ibv_alloc_mw(b->ib_res.pd, type);
+    if (!mw) {
+        perror("ibv_alloc_mw");
+        goto cleanup;
+    }
+    for (int i = 0; i < b->warmup + b->iters; i++) {
+        long long t0, t1, t2 = 0;
+
+        t0 = gfp_get_time();
+        if (bind_mw_rkey(&b->ib_res, mw, type, &bind_info))
+            goto cleanup;
+        t1 = gfp_get_time();
+        if (type == IBV_MW_TYPE_2) {
+            // A bound type 2 window must be invalidated before rebinding
+            if (post_local_inv(&b->ib_res, b->ib_res.qp, mw->rkey, WRID(WRID_CLASS_INV, 0), 1))
+                goto cleanup;
+            if (cq_engine_wait(&b->ib_res.cq_eng, WRID_CLASS_INV, 1))
+                goto cleanup;
+            t2 = gfp_get_time();
+        }
+        if (i >= b->warmup) {
+            lat_stats_add(&b->st, t1 - t0);
+            if (type == IBV_MW_TYPE_2)
+                lat_stats_add(&inv, t2 - t1);
+        }
+    }
+    emit(b, &b->st, type == IBV_MW_TYPE_1 ? "bind_type1" : "bind_type2", size);
+    if (type == IBV_MW_TYPE_2)
+        emit(b, &inv, "local_inv", size);
+    ret = 0;
+
+cleanup:
+    if (mw) ibv_dealloc_mw(mw);
+    lat_stats_free(&inv);
+    return ret;
+}
+
+// Amortised cost per window of a chained bind + invalidate round
+static int bench_pool(struct mw_bench *b, size_t size) {
+    struct ibv_mw_bind_info infos[MW_BENCH_POOL];
+    int idx[MW_BENCH_POOL];
+    struct mw_pool pool;
+    int ret = -1;
+
+    if (mw_pool_create(&pool, &b->ib_res, b->mr, IBV_MW_TYPE_2, MW_BENCH_POOL, 16))
+        return -1;
+    for (int k = 0; k < MW_BENCH_POOL; k++) {
+        infos[k].mr = b->mr;
+        infos[k].addr = (uintptr_t)b->buffer;
+        infos[k].length = size;
+        infos[k].mw_access_flags = IBV_ACCESS_REMOTE_WRITE;
+    }
+    for (int i = 0; i < b->warmup + b->iters; i++) {
+        long long t0 = gfp_get_time();
+
+        if (mw_pool_bind(&pool, infos, MW_BENCH_POOL, idx) ||
+            mw_pool_invalidate(&pool, idx, MW_BENCH_POOL) ||
+            mw_pool_drain(&pool))
+            goto cleanup;
+        if (i >= b->warmup)
+            lat_stats_add(&b->st, (gfp_get_time() - t0) / MW_BENCH_POOL);
+    }
+    emit(b, &b->st, "pool_bind_inv", size);
+    ret = 0;
+
+cleanup:
+    mw_pool_destroy(&pool);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    struct mw_bench b;
+    const char *out_path = NULL;
+    int opt, ret = -1;
+
+    memset(&b, 0, sizeof(b));
+    b.max_size = 64 << 20;
+    b.iters = 10000;
+    b.warmup = 1000;
+    b.out = stdout;
+    while ((opt = getopt(argc, argv, "n:w:S:o:" IB_OPTSTRING)) != -1) {
+        switch (opt) {
+        case 'n':
+            b.iters = atoi(optarg);
+            break;
+        case 'w':
+            b.warmup = atoi(optarg);
+            break;
+        case 'S':
+            b.max_size = strtoull(optarg, NULL, 0);
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        default:
+            if (parse_ib_opt(&b.ib_res, opt, optarg) == 0)
+                break;
+            fprintf(stderr, "Usage: %s [-n iters] [-w warmup] [-S max_size] [-o out.json] %s\n",
+                    argv[0], IB_OPTUSAGE);
+            return -1;
+        }
+    }
+    if (b.max_size < MW_BENCH_MIN_SIZE)
+        b.max_size = MW_BENCH_MIN_SIZE;
+
+    if (lat_stats_init(&b.st, b.iters))
+        return -1;
+    b.buffer = memalign(getpagesize(), b.max_size);
+    if (!b.buffer) {
+        perror("memalign");
+        goto cleanup;
+    }
+    memset(b.buffer, 0, b.max_size);
+    if (out_path) {
+        b.out = fopen(out_path, "w");
+        if (!b.out) {
+            perror("fopen");
+            b.out = stdout;
+            goto cleanup;
+        }
+    }
+
+    if (prepare_ib_res(&b.ib_res)) {
+        perror("prepare_ib_res failed");
+        goto cleanup;
+    }
+    b.mr = ibv_reg_mr(b.ib_res.pd, b.buffer, b.max_size,
+                      IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_MW_BIND);
+    if (!b.mr) {
+        perror("ibv_reg_mr");
+        goto cleanup;
+    }
+    // Binds are posted on the send queue, which needs an RTS QP
+    if (connect_qp(&b.ib_res, &b.ib_res.local_info))
+        goto cleanup;
+
+    fprintf(b.out, "{\n  \"bench\": \"mw_bench\",\n  \"device\": \"%s\",\n  \"transport\": \"%s\",\n"
+            "  \"iters\": %d,\n  \"warmup\": %d,\n  \"results\": [",
+            ibv_get_device_name(b.ib_res.ib_dev), b.ib_res.qp_type == IBV_QPT_RC ? "rc" : "uc",
+            b.iters, b.warmup);
+    if (bench_alloc_dealloc(&b))
+        goto finish;
+    for (size_t size = MW_BENCH_MIN_SIZE; size <= b.max_size; size *= 4) {
+        if (bench_reg_dereg(&b, size) ||
+            bench_bind(&b, size, IBV_MW_TYPE_1) ||
+            bench_bind(&b, size, IBV_MW_TYPE_2) ||
+            bench_pool(&b, size))
+            goto finish;
+    }
+    ret = 0;
+finish:
+    fprintf(b.out, "\n  ],\n  \"ok\": %s\n}\n", ret ? "false" : "true");
+
+cleanup:
+    if (b.out != stdout) fclose(b.out);
+    if (b.mr) ibv_dereg_mr(b.mr);
+    free_ib_res(&b.ib_res);
+    free(b.buffer);
+    lat_stats_free(&b.st);
+    return ret;
+}
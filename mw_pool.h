@@ -0,0 +1,358 @@
+#ifndef MW_POOL_H
+#define MW_POOL_H
+
+#include "gfp.h"
+
+/*
+ * Pre-allocated pool of memory windows.
+ *
+ * All windows are allocated up front with ibv_alloc_mw. Binds and
+ * invalidations are posted as WR chains (one doorbell per chain) and only
+ * every `signal_every`-th WR, plus the last WR of each call, is signaled.
+ * A signaled CQE retires every WR posted before it, so many bind/invalidate
+ * operations can be in flight at once while the send queue never overflows.
+ * signal_every is capped so that a full send queue always holds a signaled
+ * WR to wait for.
+ *
+ * Type 2 rkeys are stepped with ibv_inc_rkey on every bind. The new rkey is
+ * stored in the window right away; advertise it to a peer only once
+ * mw_pool_drain() (or a later signaled completion) has confirmed the bind.
+ */
+
+#define MW_POOL_CHAIN_MAX 64
+
+struct mw_pool {
+    struct ib_res *ib_res;
+    struct ibv_mr *mr;
+    uint8_t type;
+    int size;
+    int signal_every;
+    struct ibv_mw **mws;
+    int *free_idx;
+    int nfree;
+    int inflight;
+    int unsignaled;
+    uint64_t failed;
+    struct ibv_send_wr wrs[MW_POOL_CHAIN_MAX];
+};
+
+static void mw_pool_cqe(void *arg, const struct ibv_wc *wc) {
+    struct mw_pool *pool = arg;
+
+    if (wc->status != IBV_WC_SUCCESS)
+        pool->failed++;
+    pool->inflight -= WRID_IDX(wc->wr_id);
+}
+
+/*
+ * Allocate `size` windows of `type` over `mr` (which must have been
+ * registered with IBV_ACCESS_MW_BIND). All windows start out unbound.
+ * signal_every is clamped to [1, MAX_SEND_WR - MW_POOL_CHAIN_MAX].
+ */
+int mw_pool_create(struct mw_pool *pool, struct ib_res *ib_res, struct ibv_mr *mr,
+                   uint8_t type, int size, int signal_every) {
+    memset(pool, 0, sizeof(*pool));
+    pool->ib_res = ib_res;
+    pool->mr = mr;
+    pool->type = type;
+    // Reserving room for a chain must never wait on WRs none of which is signaled
+    if (signal_every > MAX_SEND_WR - MW_POOL_CHAIN_MAX)
+        signal_every = MAX_SEND_WR - MW_POOL_CHAIN_MAX;
+    pool->signal_every = signal_every < 1 ? 1 : signal_every;
+
+    pool->mws = calloc(size, sizeof(*pool->mws));
+    pool->free_idx = calloc(size, sizeof(*pool->free_idx));
+    if (!pool->mws || !pool->free_idx) {
+        perror("calloc");
+        goto cleanup;
+    }
+    for (int i = 0; i < size; i++) {
+        pool->mws[i] = ibv_alloc_mw(ib_res->pd, type);
+        if (!pool->mws[i]) {
+            perror("ibv_alloc_mw");
+            goto cleanup;
+        }
+        pool->size++;
+    }
+    // Hand out low indices first
+    for (int i = 0; i < size; i++)
+        pool->free_idx[i] = size - 1 - i;
+    pool->nfree = size;
+
+    cq_engine_register(&ib_res->cq_eng, WRID_CLASS_MW_POOL, mw_pool_cqe, pool);
+    return 0;
+
+cleanup:
+    for (int i = 0; i < pool->size; i++)
+        ibv_dealloc_mw(pool->mws[i]);
+    free(pool->mws);
+    free(pool->free_idx);
+    memset(pool, 0, sizeof(*pool));
+    return -1;
+}
+
+void mw_pool_destroy(struct mw_pool *pool) {
+    if (pool->ib_res)
+        cq_engine_register(&pool->ib_res->cq_eng, WRID_CLASS_MW_POOL, NULL, NULL);
+    for (int i = 0; i < pool->size; i++)
+        ibv_dealloc_mw(pool->mws[i]);
+    free(pool->mws);
+    free(pool->free_idx);
+    memset(pool, 0, sizeof(*pool));
+}
+
+static inline struct ibv_mw *mw_pool_mw(struct mw_pool *pool, int idx) {
+    return pool->mws[idx];
+}
+
+/*
+ * Fill in signaling for the next WR: every signal_every-th one, and the
+ * last WR of a call, carries the count of WRs its CQE retires.
+ */
+static inline void mw_pool_signal(struct mw_pool *pool, int last,
+                                  uint64_t *wr_id, unsigned *send_flags) {
+    pool->unsignaled++;
+    if (last || pool->unsignaled >= pool->signal_every) {
+        *wr_id = WRID(WRID_CLASS_MW_POOL, pool->unsignaled);
+        *send_flags = IBV_SEND_SIGNALED;
+        pool->unsignaled = 0;
+    } else {
+        *wr_id = WRID(WRID_CLASS_MW_POOL, 0);
+        *send_flags = 0;
+    }
+}
+
+// Reap completions until `n` more WRs fit in the send queue
+static int mw_pool_reserve(struct mw_pool *pool, int n) {
+    while (pool->inflight + n > MAX_SEND_WR) {
+        if (cq_engine_poll(&pool->ib_res->cq_eng) < 0 || pool->failed)
+            return -1;
+    }
+    pool->inflight += n;
+    return 0;
+}
+
+// ibv_bind_mw() for type 1 windows, counted like the chained WRs
+static int mw_pool_bind_type1(struct mw_pool *pool, struct ibv_mw *mw, struct ibv_mw_bind *mw_bind) {
+    struct ib_res *ib_res = pool->ib_res;
+    long long t = ib_post_stamp(ib_res);
+    int signaled = !!(mw_bind->send_flags & IBV_SEND_SIGNALED);
+    int ret = ibv_bind_mw(ib_res->qp, mw, mw_bind);
+
+    if (ret)
+        return ret;
+    ib_post_timed(ib_res, ib_res->qp, t, signaled);
+    if (ib_res->cq_eng.metrics)
+        metrics_post(ib_res->cq_eng.metrics, ib_res->qp->qp_num, IBV_WR_BIND_MW, 0, signaled);
+    return 0;
+}
+
+// Post pool->wrs[0..n) as one chain; `posted` gets how many made it
+static int mw_pool_post_chain(struct mw_pool *pool, int n, int *posted) {
+    struct ibv_send_wr *bad_wr = NULL;
+    int ret;
+
+    for (int i = 0; i < n - 1; i++)
+        pool->wrs[i].next = &pool->wrs[i + 1];
+    pool->wrs[n - 1].next = NULL;
+    ret = ib_post_send(pool->ib_res, pool->ib_res->qp, pool->wrs, &bad_wr);
+    *posted = n;
+    if (ret) {
+        errno = ret;
+        perror("ibv_post_send");
+        *posted = bad_wr ? bad_wr - pool->wrs : 0;
+    }
+    return ret;
+}
+
+/*
+ * Only `posted` of a chunk of `chunk` WRs went out, the last signaled one
+ * among them at `last_signaled` (-1 if none). The WRs that never went out
+ * give their send queue room back. Posted WRs behind the last signaled one,
+ * and the `carried` unsignaled ones posted before the chunk if there is
+ * none, wait for a CQE that will not come: stop counting them too.
+ */
+static void mw_pool_abort_chunk(struct mw_pool *pool, int carried, int chunk, int posted,
+                                int last_signaled) {
+    int orphans = last_signaled >= 0 ? posted - 1 - last_signaled : carried + posted;
+
+    pool->inflight -= chunk - posted + orphans;
+    pool->unsignaled = 0;
+}
+
+// Index of the last signaled WR in pool->wrs[0..n), or -1
+static int mw_pool_last_signaled(const struct mw_pool *pool, int n) {
+    while (--n >= 0 && !(pool->wrs[n].send_flags & IBV_SEND_SIGNALED))
+        ;
+    return n;
+}
+
+/*
+ * A bind call failed after `posted` of the `chunk` windows at idx[done..]
+ * went out. The rest go back to the free list; they and every window not
+ * reached yet read -1 in idx[].
+ */
+static void mw_pool_unbind_rest(struct mw_pool *pool, int *idx, int done, int chunk, int posted,
+                                int n) {
+    for (int k = chunk - 1; k >= posted; k--) {
+        pool->free_idx[pool->nfree++] = idx[done + k];
+        idx[done + k] = -1;
+    }
+    for (int k = done + chunk; k < n; k++)
+        idx[k] = -1;
+}
+
+/*
+ * Take `n` free windows and bind window k to infos[k]. The chosen pool
+ * indices are returned in idx[]. Returns 0, or -1 if the pool ran dry or
+ * posting failed. On failure, windows whose bind was posted keep their
+ * index in idx[] and are the caller's to invalidate; the rest are back in
+ * the pool and read -1.
+ */
+int mw_pool_bind(struct mw_pool *pool, const struct ibv_mw_bind_info *infos, int n, int *idx) {
+    if (n > pool->nfree) {
+        fprintf(stderr, "mw_pool: %d windows requested, %d free\n", n, pool->nfree);
+        return -1;
+    }
+
+    for (int done = 0; done < n; ) {
+        int chunk = n - done > MW_POOL_CHAIN_MAX ? MW_POOL_CHAIN_MAX : n - done;
+        int carried = pool->unsignaled, last_signaled = -1, posted;
+
+        if (mw_pool_reserve(pool, chunk)) {
+            mw_pool_unbind_rest(pool, idx, done, 0, 0, n);
+            return -1;
+        }
+        // Take the whole chunk first so a failure can hand back what was not posted
+        for (int k = 0; k < chunk; k++)
+            idx[done + k] = pool->free_idx[--pool->nfree];
+        for (int k = 0; k < chunk; k++) {
+            int i = idx[done + k];
+            struct ibv_mw *mw = pool->mws[i];
+            int last = done + k == n - 1;
+
+            if (pool->type == IBV_MW_TYPE_2) {
+                struct ibv_send_wr *wr = &pool->wrs[k];
+
+                memset(wr, 0, sizeof(*wr));
+                mw_pool_signal(pool, last, &wr->wr_id, &wr->send_flags);
+                wr->opcode = IBV_WR_BIND_MW;
+                wr->bind_mw.mw = mw;
+                wr->bind_mw.rkey = ibv_inc_rkey(mw->rkey);
+                wr->bind_mw.bind_info = infos[done + k];
+            } else {
+                /*
+                 * Type 1 binds only exist as ibv_bind_mw(), one WR and
+                 * one doorbell per call; the provider steps the rkey.
+                 */
+                struct ibv_mw_bind mw_bind = { .bind_info = infos[done + k] };
+                unsigned flags;
+                int ret;
+
+                mw_pool_signal(pool, last, &mw_bind.wr_id, &flags);
+                mw_bind.send_flags = flags;
+                ret = mw_pool_bind_type1(pool, mw, &mw_bind);
+                if (ret) {
+                    errno = ret;
+                    perror("ibv_bind_mw");
+                    mw_pool_abort_chunk(pool, carried, chunk, k, last_signaled);
+                    mw_pool_unbind_rest(pool, idx, done, chunk, k, n);
+                    return -1;
+                }
+                if (flags & IBV_SEND_SIGNALED)
+                    last_signaled = k;
+            }
+        }
+        if (pool->type == IBV_MW_TYPE_2) {
+            int ret = mw_pool_post_chain(pool, chunk, &posted);
+
+            // The new rkey only holds for binds that went out
+            for (int k = 0; k < posted; k++)
+                pool->mws[idx[done + k]]->rkey = pool->wrs[k].bind_mw.rkey;
+            if (ret) {
+                mw_pool_abort_chunk(pool, carried, chunk, posted,
+                                    mw_pool_last_signaled(pool, posted));
+                mw_pool_unbind_rest(pool, idx, done, chunk, posted, n);
+                return -1;
+            }
+        }
+        done += chunk;
+    }
+    return 0;
+}
+
+/*
+ * Revoke the windows at idx[0..n) and return them to the free list. Type 2
+ * windows are invalidated with chained IBV_WR_LOCAL_INV, type 1 windows by
+ * a zero-length rebind. A window may be rebound right away: WRs on the
+ * send queue execute in order. On failure, windows whose revocation was
+ * not posted stay bound and out of the pool.
+ */
+int mw_pool_invalidate(struct mw_pool *pool, const int *idx, int n) {
+    for (int done = 0; done < n; ) {
+        int chunk = n - done > MW_POOL_CHAIN_MAX ? MW_POOL_CHAIN_MAX : n - done;
+        int carried = pool->unsignaled, last_signaled = -1, posted;
+
+        if (mw_pool_reserve(pool, chunk))
+            return -1;
+        for (int k = 0; k < chunk; k++) {
+            struct ibv_mw *mw = pool->mws[idx[done + k]];
+            int last = done + k == n - 1;
+
+            if (pool->type == IBV_MW_TYPE_2) {
+                struct ibv_send_wr *wr = &pool->wrs[k];
+
+                memset(wr, 0, sizeof(*wr));
+                mw_pool_signal(pool, last, &wr->wr_id, &wr->send_flags);
+                wr->opcode = IBV_WR_LOCAL_INV;
+                wr->invalidate_rkey = mw->rkey;
+            } else {
+                struct ibv_mw_bind mw_bind = {
+                    .bind_info.mr = pool->mr,
+                    .bind_info.addr = (uintptr_t)pool->mr->addr,
+                    .bind_info.length = 0,
+                    .bind_info.mw_access_flags = IBV_ACCESS_REMOTE_WRITE,
+                };
+                unsigned flags;
+                int ret;
+
+                mw_pool_signal(pool, last, &mw_bind.wr_id, &flags);
+                mw_bind.send_flags = flags;
+                ret = mw_pool_bind_type1(pool, mw, &mw_bind);
+                if (ret) {
+                    errno = ret;
+                    perror("ibv_bind_mw");
+                    mw_pool_abort_chunk(pool, carried, chunk, k, last_signaled);
+                    return -1;
+                }
+                if (flags & IBV_SEND_SIGNALED)
+                    last_signaled = k;
+                pool->free_idx[pool->nfree++] = idx[done + k];
+            }
+        }
+        if (pool->type == IBV_MW_TYPE_2) {
+            int ret = mw_pool_post_chain(pool, chunk, &posted);
+
+            for (int k = 0; k < posted; k++)
+                pool->free_idx[pool->nfree++] = idx[done + k];
+            if (ret) {
+                mw_pool_abort_chunk(pool, carried, chunk, posted,
+                                    mw_pool_last_signaled(pool, posted));
+                return -1;
+            }
+        }
+        done += chunk;
+    }
+    return 0;
+}
+
+// Wait until every posted bind/invalidate has completed. Returns -1 on failure.
+int mw_pool_drain(struct mw_pool *pool) {
+    while (pool->inflight > 0 && !pool->failed) {
+        if (cq_engine_poll(&pool->ib_res->cq_eng) < 0)
+            return -1;
+    }
+    return pool->failed ? -1 : 0;
+}
+
+#endif /* MW_POOL_H */
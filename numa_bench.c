@@ -0,0 +1,158 @@
+#define _GNU_SOURCE
+#include "gfp.h"
+#include "mt.h"
+
+/*
+ * Local vs. remote socket throughput.
+ *
+ * Runs the multi-threaded loopback data path once per NUMA node this
+ * process may run on, with `-w` workers pinned to cores of that node. A
+ * worker touches and registers its buffer after pinning, so thread and
+ * memory both sit on the node under test, and every DMA and doorbell of a
+ * remote node crosses the socket interconnect. Rates are reported against
+ * the run on the device's own node.
+ */
+
+#define BENCH_MAX_NODES 64
+
+struct bench_node {
+    int node;
+    int ncpus;
+    int cpus[CPU_SETSIZE];
+};
+
+// Group the allowed CPUs by node, found by running on each of them
+static int group_cpus(struct bench_node *nodes, int max) {
+    cpu_set_t allowed, one;
+    int n = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        perror("sched_getaffinity");
+        return -1;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        int node, k;
+
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        if (sched_setaffinity(0, sizeof(one), &one))
+            continue;
+        node = topo_thread_node();
+        for (k = 0; k < n && nodes[k].node != node; k++)
+            ;
+        if (k == n) {
+            if (n == max)
+                continue;
+            nodes[n].node = node;
+            nodes[n++].ncpus = 0;
+        }
+        nodes[k].cpus[nodes[k].ncpus++] = cpu;
+    }
+    sched_setaffinity(0, sizeof(allowed), &allowed);
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    struct ib_res ib_res;
+    struct mt_worker *workers = NULL;
+    struct bench_node *nodes;
+    int nnodes, nworkers = 1;
+    int nqps = 1, depth = 128;
+    size_t msg_size = 4096;
+    uint64_t iters = 1000000;
+    double local_rate = 0, *rates;
+    int opt, ret = -1;
+
+    memset(&ib_res, 0, sizeof(struct ib_res));
+    while ((opt = getopt(argc, argv, "w:Q:d:S:n:" IB_OPTSTRING)) != -1) {
+        switch (opt) {
+        case 'w':
+            nworkers = atoi(optarg);
+            break;
+        case 'Q':
+            nqps = atoi(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'S':
+            msg_size = strtoull(optarg, NULL, 0);
+            break;
+        case 'n':
+            iters = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            if (parse_ib_opt(&ib_res, opt, optarg) == 0)
+                break;
+            fprintf(stderr, "Usage: %s [-w workers_per_node] [-Q qps_per_worker] [-d depth] "
+                    "[-S msg_size] [-n writes_per_worker] %s\n", argv[0], IB_OPTUSAGE);
+            return -1;
+        }
+    }
+    // Workers poll their own CQs; the shared one is never waited on
+    ib_res.cq_mode = CQ_MODE_POLL;
+    if (nworkers < 1 || msg_size < 1 || iters < 1) {
+        fprintf(stderr, "workers, message size and writes per worker must be positive\n");
+        return -1;
+    }
+    nodes = calloc(BENCH_MAX_NODES, sizeof(*nodes));
+    rates = calloc(BENCH_MAX_NODES, sizeof(*rates));
+    workers = memalign(64, nworkers * sizeof(*workers));
+    if (!nodes || !rates || !workers) {
+        perror("alloc");
+        goto cleanup;
+    }
+    nnodes = group_cpus(nodes, BENCH_MAX_NODES);
+    if (nnodes < 1)
+        goto cleanup;
+    if (nnodes == 1)
+        fprintf(stderr, "only one NUMA node available, nothing to compare\n");
+    if (prepare_ib_res(&ib_res)) {
+        perror("prepare_ib_res failed");
+        goto cleanup;
+    }
+
+    printf("%s on node %d; %d worker(s)/node, %d QP(s)/worker, depth %d, %zu B writes\n",
+           ibv_get_device_name(ib_res.ib_dev), ib_res.numa_node, nworkers, nqps, depth, msg_size);
+    for (int i = 0; i < nnodes; i++) {
+        long long slowest = 0;
+
+        if (nodes[i].ncpus < nworkers) {
+            fprintf(stderr, "node %d: %d cpus for %d workers, skipped\n", nodes[i].node,
+                    nodes[i].ncpus, nworkers);
+            continue;
+        }
+        if (mt_run_workers(&ib_res, workers, nodes[i].cpus, nworkers, nqps, depth, msg_size,
+                           iters)) {
+            fprintf(stderr, "run on node %d failed\n", nodes[i].node);
+            goto cleanup;
+        }
+        for (int k = 0; k < nworkers; k++)
+            if (workers[k].elapsed > slowest)
+                slowest = workers[k].elapsed;
+        rates[i] = (double)nworkers * iters * 1e9 / slowest;
+        if (nodes[i].node == ib_res.numa_node)
+            local_rate = rates[i];
+    }
+    printf("%6s %8s %14s %10s %10s\n", "node", "", "msgs/s", "Gb/s", "vs_local");
+    for (int i = 0; i < nnodes; i++) {
+        if (!rates[i])
+            continue;
+        printf("%6d %8s %14.0f %10.2f", nodes[i].node,
+               nodes[i].node == ib_res.numa_node ? "local" : "remote", rates[i],
+               rates[i] * msg_size * 8 / 1e9);
+        if (local_rate > 0)
+            printf(" %9.0f%%", 100.0 * rates[i] / local_rate);
+        printf("\n");
+    }
+    ret = 0;
+
+cleanup:
+    free(nodes);
+    free(rates);
+    free(workers);
+    free_ib_res(&ib_res);
+    return ret;
+}
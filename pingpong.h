@@ -0,0 +1,385 @@
+#ifndef PINGPONG_H
+#define PINGPONG_H
+
+#include "gfp.h"
+#include "lat_stats.h"
+#include "ring.h"
+
+/*
+ * Ping-pong latency mode for client/server (-l).
+ *
+ * The client writes-with-imm `size` bytes into the server's window; the
+ * server answers with a write-with-imm of the same length into the window
+ * the client advertised. The client records RTT/2 per iteration and prints
+ * percentiles per payload size (8 B to -L bytes, x2 steps).
+ *
+ * -i sends payloads that fit in the QP's negotiated inline capacity with
+ * IBV_SEND_INLINE (set on both sides). -F makes the server invalidate and
+ * rebind its type 2 window to a fresh rkey before every pong; the pong's
+ * immediate carries the new rkey, which the client uses for the next ping.
+ * Completion mode (busy-poll vs event) comes from the shared -m option.
+ *
+ * -r carries pings and pongs as ring.h records instead: plain RDMA writes
+ * into a ring at the start of the peer's window. The consumer polls ring
+ * memory, with no receive WR and no receive CQE. Each buffer is laid out as
+ *
+ *   rx ring (pp_ring_size) | ring control (RING_CTRL_SIZE) | tx staging ring
+ *
+ * The peer writes into our rx ring and publishes its consumer head into the
+ * first word of our control block. Records inline whenever they fit (-i is
+ * implied), the receive side always spins, and -F is not supported.
+ */
+
+#define PP_OPTSTRING "liFrL:N:"
+#define PP_OPTUSAGE "[-l] [-i] [-F] [-r] [-L max_size] [-N iters_per_size]"
+#define PP_MIN_SIZE 8
+#define PP_WARMUP 100
+#define PP_RECV_DEPTH 64
+#define PP_IMM_DONE 0xffffffffu
+#define PP_RING_RECS 4              /* max-size records the ring holds */
+
+struct pp_opts {
+    int enabled;
+    int inline_send;
+    int fresh_mw;
+    int ring;
+    size_t max_size;
+    int iters;
+};
+
+void pp_opts_init(struct pp_opts *o) {
+    memset(o, 0, sizeof(*o));
+    o->max_size = PKTSZ;
+    o->iters = 10000;
+}
+
+int parse_pp_opt(struct pp_opts *o, int opt, const char *arg) {
+    switch (opt) {
+    case 'l':
+        o->enabled = 1;
+        return 0;
+    case 'i':
+        o->inline_send = 1;
+        return 0;
+    case 'F':
+        o->fresh_mw = 1;
+        return 0;
+    case 'r':
+        o->ring = 1;
+        return 0;
+    case 'L':
+        o->max_size = strtoull(arg, NULL, 0);
+        return o->max_size < PP_MIN_SIZE ? -1 : 0;
+    case 'N':
+        o->iters = atoi(arg);
+        return o->iters < 1 ? -1 : 0;
+    }
+    return -1;
+}
+
+static inline size_t pp_ring_size(const struct pp_opts *o) {
+    return ring_size_for(o->max_size, PP_RING_RECS);
+}
+
+static inline size_t pp_buf_size(const struct pp_opts *o) {
+    size_t size = o->enabled && o->max_size > PKTSZ ? o->max_size : PKTSZ;
+
+    if (o->enabled && o->ring && 2 * pp_ring_size(o) + RING_CTRL_SIZE > size)
+        size = 2 * pp_ring_size(o) + RING_CTRL_SIZE;
+    return size;
+}
+
+/*
+ * Producer into the peer's ring at `peer_va` and consumer of ours, both
+ * laid out in `buffer` as described above.
+ */
+static int pp_ring_init(struct ib_res *ib_res, struct ibv_mr *mr, char *buffer, uint64_t peer_va,
+                        uint32_t peer_rkey, const struct pp_opts *o, struct ring_tx *tx,
+                        struct ring_rx *rx) {
+    size_t size = pp_ring_size(o);
+    uint64_t *ctrl = (uint64_t *)(buffer + size);
+
+    if (o->fresh_mw) {
+        fprintf(stderr, "ping-pong: -F needs write-with-imm pongs, not -r\n");
+        return -1;
+    }
+    if (ring_tx_init(tx, ib_res, ib_res->qp, mr, buffer + size + RING_CTRL_SIZE, &ctrl[0], peer_va,
+                     peer_rkey, size, WRID_CLASS_SEND))
+        return -1;
+    return ring_rx_init(rx, ib_res, ib_res->qp, mr, buffer, &ctrl[1], peer_va + size, peer_rkey,
+                        size, size / PP_RING_RECS);
+}
+
+static void pp_fill_write(struct ibv_send_wr *wr, struct ibv_sge *sg, struct ibv_mr *mr,
+                          char *buf, size_t len, uint64_t remote_addr, uint32_t rkey,
+                          uint32_t imm, int use_inline) {
+    sg->addr = (uintptr_t)buf;
+    sg->length = len;
+    sg->lkey = mr->lkey;
+    memset(wr, 0, sizeof(*wr));
+    wr->wr_id = WRID(WRID_CLASS_SEND, 0);
+    wr->sg_list = sg;
+    wr->num_sge = len ? 1 : 0;
+    wr->opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+    wr->imm_data = htonl(imm);
+    wr->send_flags = IBV_SEND_SIGNALED | (use_inline ? IBV_SEND_INLINE : 0);
+    wr->wr.rdma.remote_addr = remote_addr;
+    wr->wr.rdma.rkey = rkey;
+}
+
+/*
+ * Client prologue, run before the handshake: allocate the window over the
+ * client buffer for the pongs, advertise the rkey its bind will install
+ * in local_info and pre-post the receive ring (or zero the record ring).
+ */
+int pp_client_prepare(struct ib_res *ib_res, char *buffer, struct ibv_mw **mw,
+                      const struct pp_opts *o) {
+    *mw = ibv_alloc_mw(ib_res->pd, IBV_MW_TYPE_2);
+    if (!*mw) {
+        perror("ibv_alloc_mw");
+        return -1;
+    }
+    ib_res->local_info.buf_va = (uintptr_t)buffer;
+    ib_res->local_info.buf_rkey = mw_next_rkey(*mw);
+    if (o->ring) {
+        memset(buffer, 0, pp_ring_size(o) + RING_CTRL_SIZE);
+        return 0;
+    }
+    return post_zero_recvs(ib_res, PP_RECV_DEPTH);
+}
+
+// Once connect_qp() is done: bind the window advertised by pp_client_prepare()
+int pp_client_bind(struct ib_res *ib_res, struct ibv_mr *mr, char *buffer, size_t len,
+                   struct ibv_mw *mw) {
+    struct ibv_mw_bind_info bind_info = {
+        .mr = mr,
+        .addr = (uintptr_t)buffer,
+        .length = len,
+        .mw_access_flags = IBV_ACCESS_REMOTE_WRITE,
+    };
+
+    if (bind_mw_rkey(ib_res, mw, IBV_MW_TYPE_2, &bind_info))
+        return -1;
+    if (mw->rkey != ib_res->local_info.buf_rkey) {
+        fprintf(stderr, "window bound to rkey %#x, advertised %#x\n", mw->rkey,
+                ib_res->local_info.buf_rkey);
+        return -1;
+    }
+    return 0;
+}
+
+static int run_pp_ring_client(struct ib_res *ib_res, struct ibv_mr *mr, char *buffer,
+                              const struct ib_info *server_info, const struct pp_opts *o) {
+    struct ring_tx tx;
+    struct ring_rx rx;
+    struct lat_stats st;
+    struct lat_summary sum;
+    char *payload = calloc(1, o->max_size);
+    int ret = -1;
+
+    if (!payload || lat_stats_init(&st, o->iters)) {
+        perror("calloc");
+        free(payload);
+        return -1;
+    }
+    if (pp_ring_init(ib_res, mr, buffer, server_info->buf_va, server_info->buf_rkey, o, &tx, &rx))
+        goto cleanup;
+    printf("ping-pong: ring records in a %zu byte ring, busy-poll on memory\n", tx.size);
+    printf("%8s %7s (half-RTT ns)\n", "size", "inline");
+    for (size_t size = PP_MIN_SIZE; size <= o->max_size; size *= 2) {
+        int use_inline = ring_rec_size(size) <= ib_res->max_inline;
+        char label[32];
+
+        for (int i = 0; i < PP_WARMUP + o->iters; i++) {
+            long long t0 = gfp_get_time();
+            uint32_t len;
+
+            if (ring_tx_send(&tx, payload, size))
+                goto cleanup;
+            while (!ring_rx_peek(&rx, &len))
+                ;
+            if (i >= PP_WARMUP)
+                lat_stats_add(&st, (gfp_get_time() - t0) / 2);
+            if (ring_rx_release(&rx, len))
+                goto cleanup;
+        }
+        lat_stats_summarize(&st, &sum);
+        snprintf(label, sizeof(label), "%8zu %7s", size, use_inline ? "yes" : "no");
+        lat_summary_print(stdout, label, &sum);
+        lat_stats_reset(&st);
+    }
+    // An empty record tells the server we are done
+    if (ring_tx_send(&tx, payload, 0) || ring_tx_drain(&tx))
+        goto cleanup;
+    ret = 0;
+
+cleanup:
+    lat_stats_free(&st);
+    free(payload);
+    return ret;
+}
+
+int run_pp_client(struct ib_res *ib_res, struct ibv_mr *mr, char *buffer,
+                  const struct ib_info *server_info, const struct pp_opts *o) {
+    struct cq_engine *eng = &ib_res->cq_eng;
+    const struct ibv_wc *rwc = &eng->last[WRID_CLASS_RECV];
+    uint32_t rkey = server_info->buf_rkey;
+    struct ibv_send_wr wr, *bad_wr;
+    struct ibv_sge sg;
+    struct lat_stats st;
+    struct lat_summary sum;
+    uint64_t send_base = eng->done[WRID_CLASS_SEND] + eng->failed[WRID_CLASS_SEND];
+    uint32_t seq = 0;
+    int ret = -1;
+
+    if (o->ring)
+        return run_pp_ring_client(ib_res, mr, buffer, server_info, o);
+    if (lat_stats_init(&st, o->iters))
+        return -1;
+    printf("ping-pong: %s, %s completions, %s window per iteration\n",
+           o->inline_send ? "inline where possible" : "no inline",
+           ib_res->cq_mode == CQ_MODE_POLL ? "busy-poll" :
+           ib_res->cq_mode == CQ_MODE_EVENT ? "event" : "hybrid",
+           o->fresh_mw ? "fresh" : "same");
+    printf("%8s %7s (half-RTT ns)\n", "size", "inline");
+    for (size_t size = PP_MIN_SIZE; size <= o->max_size; size *= 2) {
+        int use_inline = o->inline_send && size <= ib_res->max_inline;
+        char label[32];
+
+        for (int i = 0; i < PP_WARMUP + o->iters; i++) {
+            long long t0 = gfp_get_time();
+
+            pp_fill_write(&wr, &sg, mr, buffer, size, server_info->buf_va, rkey, seq++, use_inline);
+            if (ib_post_send(ib_res, ib_res->qp, &wr, &bad_wr)) {
+                perror("ibv_post_send");
+                goto cleanup;
+            }
+            if (cq_engine_wait(eng, WRID_CLASS_RECV, 1))
+                goto cleanup;
+            if (i >= PP_WARMUP)
+                lat_stats_add(&st, (gfp_get_time() - t0) / 2);
+            if (o->fresh_mw)
+                rkey = ntohl(rwc->imm_data);
+            if (post_zero_recvs(ib_res, 1))
+                goto cleanup;
+        }
+        lat_stats_summarize(&st, &sum);
+        snprintf(label, sizeof(label), "%8zu %7s", size, use_inline ? "yes" : "no");
+        lat_summary_print(stdout, label, &sum);
+        lat_stats_reset(&st);
+    }
+
+    // Tell the server we are done
+    pp_fill_write(&wr, &sg, mr, buffer, 0, server_info->buf_va, rkey, PP_IMM_DONE, 0);
+    if (ib_post_send(ib_res, ib_res->qp, &wr, &bad_wr)) {
+        perror("ibv_post_send");
+        goto cleanup;
+    }
+    seq++;
+    // Every ping was signaled; make sure all of them, and the goodbye, completed
+    while (eng->done[WRID_CLASS_SEND] + eng->failed[WRID_CLASS_SEND] - send_base < seq) {
+        if (cq_engine_poll(eng) < 0)
+            goto cleanup;
+    }
+    ret = eng->failed[WRID_CLASS_SEND] ? -1 : 0;
+
+cleanup:
+    lat_stats_free(&st);
+    return ret;
+}
+
+// Echo every record back into the client's ring until an empty one arrives
+static int run_pp_ring_server(struct ib_res *ib_res, struct ibv_mr *mr, char *buffer,
+                              const struct ib_info *client_info, const struct pp_opts *o) {
+    struct ring_tx tx;
+    struct ring_rx rx;
+    uint64_t pongs = 0;
+
+    if (pp_ring_init(ib_res, mr, buffer, client_info->buf_va, client_info->buf_rkey, o, &tx, &rx))
+        return -1;
+    while (1) {
+        uint32_t len;
+        char *ping;
+
+        while (!(ping = ring_rx_peek(&rx, &len)))
+            ;
+        if (len == 0)
+            break;
+        // The pong is staged before the ping's slot is released
+        if (ring_tx_send(&tx, ping, len) || ring_rx_release(&rx, len))
+            return -1;
+        pongs++;
+    }
+    if (ring_rx_release(&rx, 0) || ring_tx_drain(&tx))
+        return -1;
+    printf("ping-pong: answered %lu pings from the ring, %lu head updates, %lu full waits\n",
+           (unsigned long)pongs, (unsigned long)rx.publishes, (unsigned long)tx.full_spins);
+    return 0;
+}
+
+/*
+ * Echo every ping back into the client's window until the client sends
+ * PP_IMM_DONE. With fresh_mw the window is invalidated and rebound in the
+ * same WR chain as the pong, so the new rkey is live before the pong lands.
+ */
+int run_pp_server(struct ib_res *ib_res, struct ibv_mr *mr, char *buffer, struct ibv_mw *mw,
+                  const struct ib_info *client_info, const struct pp_opts *o) {
+    struct cq_engine *eng = &ib_res->cq_eng;
+    const struct ibv_wc *rwc = &eng->last[WRID_CLASS_RECV];
+    struct ibv_send_wr inv_wr, bind_wr, wr, *bad_wr;
+    struct ibv_sge sg;
+    uint64_t pongs = 0;
+
+    if (o->ring)
+        return run_pp_ring_server(ib_res, mr, buffer, client_info, o);
+    while (1) {
+        uint32_t imm;
+        size_t len;
+
+        if (cq_engine_wait(eng, WRID_CLASS_RECV, 1))
+            return -1;
+        imm = ntohl(rwc->imm_data);
+        if (imm == PP_IMM_DONE)
+            break;
+        len = rwc->byte_len;
+        if (post_zero_recvs(ib_res, 1))
+            return -1;
+
+        pp_fill_write(&wr, &sg, mr, buffer, len, client_info->buf_va, client_info->buf_rkey,
+                      imm, o->inline_send && len <= ib_res->max_inline);
+        if (o->fresh_mw) {
+            memset(&inv_wr, 0, sizeof(inv_wr));
+            inv_wr.wr_id = WRID(WRID_CLASS_INV, 0);
+            inv_wr.opcode = IBV_WR_LOCAL_INV;
+            inv_wr.invalidate_rkey = mw->rkey;
+            inv_wr.next = &bind_wr;
+
+            memset(&bind_wr, 0, sizeof(bind_wr));
+            bind_wr.wr_id = WRID(WRID_CLASS_BIND, 0);
+            bind_wr.opcode = IBV_WR_BIND_MW;
+            bind_wr.bind_mw.mw = mw;
+            bind_wr.bind_mw.rkey = ibv_inc_rkey(mw->rkey);
+            bind_wr.bind_mw.bind_info.mr = mr;
+            bind_wr.bind_mw.bind_info.addr = (uintptr_t)buffer;
+            bind_wr.bind_mw.bind_info.length = mr->length;
+            bind_wr.bind_mw.bind_info.mw_access_flags = IBV_ACCESS_REMOTE_WRITE;
+            bind_wr.next = &wr;
+            mw->rkey = bind_wr.bind_mw.rkey;
+            wr.imm_data = htonl(mw->rkey);
+        }
+        if (ib_post_send(ib_res, ib_res->qp, o->fresh_mw ? &inv_wr : &wr, &bad_wr)) {
+            perror("ibv_post_send");
+            return -1;
+        }
+        pongs++;
+        // Keep the send queue from filling up with unreaped pongs
+        while (pongs - eng->done[WRID_CLASS_SEND] - eng->failed[WRID_CLASS_SEND] > MAX_SEND_WR / 4) {
+            if (cq_engine_poll(eng) < 0 || eng->failed[WRID_CLASS_SEND])
+                return -1;
+        }
+    }
+    printf("ping-pong: answered %lu pings\n", (unsigned long)pongs);
+    return 0;
+}
+
+#endif /* PINGPONG_H */
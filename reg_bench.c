@@ -0,0 +1,180 @@
+#include "gfp.h"
+#include "lat_stats.h"
+#include "reg_cache.h"
+
+/*
+ * Registration cache benchmark.
+ *
+ * `nbufs` application buffers are reused in random order, the way a sender
+ * re-sends from the same buffers. Each operation acquires an MR for one
+ * buffer and releases it again: with ibv_reg_mr/ibv_dereg_mr every time
+ * ("direct"), and through the registration cache ("cached").
+ *
+ * -P caps the bytes the cache may keep pinned, so a cap below
+ * nbufs * size forces LRU evictions. -f frees and reallocates a random
+ * buffer every N operations, which exercises the invalidation hook.
+ */
+
+#define REG_ACCESS (IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE)
+
+static char *alloc_buf(size_t size) {
+    char *buf = memalign(getpagesize(), size);
+
+    if (buf)
+        memset(buf, 0, size);
+    return buf;
+}
+
+static int run_direct(struct ib_res *ib_res, char **bufs, int nbufs, size_t size, int iters,
+                      struct lat_stats *acq, struct lat_stats *rel) {
+    unsigned seed = 1;
+
+    for (int i = 0; i < iters; i++) {
+        char *buf = bufs[rand_r(&seed) % nbufs];
+        long long t0 = gfp_get_time(), t1;
+        struct ibv_mr *mr = ibv_reg_mr(ib_res->pd, buf, size, REG_ACCESS);
+
+        t1 = gfp_get_time();
+        if (!mr) {
+            perror("ibv_reg_mr");
+            return -1;
+        }
+        lat_stats_add(acq, t1 - t0);
+        if (ibv_dereg_mr(mr)) {
+            perror("ibv_dereg_mr");
+            return -1;
+        }
+        lat_stats_add(rel, gfp_get_time() - t1);
+    }
+    return 0;
+}
+
+static int run_cached(struct reg_cache *cache, char **bufs, int nbufs, size_t size, int iters,
+                      int free_every, struct lat_stats *acq, struct lat_stats *rel) {
+    unsigned seed = 1;
+
+    for (int i = 0; i < iters; i++) {
+        int b = rand_r(&seed) % nbufs;
+        long long t0 = gfp_get_time(), t1;
+        struct reg_entry *e = reg_cache_get(cache, bufs[b], size, REG_ACCESS);
+
+        t1 = gfp_get_time();
+        if (!e)
+            return -1;
+        lat_stats_add(acq, t1 - t0);
+        reg_cache_put(cache, e);
+        lat_stats_add(rel, gfp_get_time() - t1);
+
+        if (free_every && (i + 1) % free_every == 0) {
+            b = rand_r(&seed) % nbufs;
+            reg_cache_free(cache, bufs[b], size);
+            bufs[b] = alloc_buf(size);
+            if (!bufs[b]) {
+                perror("memalign");
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct ib_res ib_res;
+    struct reg_cache cache;
+    struct lat_stats acq, rel;
+    struct lat_summary sum;
+    char **bufs = NULL;
+    int nbufs = 64, iters = 100000, free_every = 0;
+    size_t size = 64 << 10;
+    size_t max_pinned = 0;
+    int cache_ready = 0;
+    int opt, ret = -1;
+
+    memset(&ib_res, 0, sizeof(struct ib_res));
+    memset(&acq, 0, sizeof(acq));
+    memset(&rel, 0, sizeof(rel));
+    while ((opt = getopt(argc, argv, "n:b:S:P:f:" IB_OPTSTRING)) != -1) {
+        switch (opt) {
+        case 'n':
+            iters = atoi(optarg);
+            break;
+        case 'b':
+            nbufs = atoi(optarg);
+            break;
+        case 'S':
+            size = strtoull(optarg, NULL, 0);
+            break;
+        case 'P':
+            max_pinned = strtoull(optarg, NULL, 0);
+            break;
+        case 'f':
+            free_every = atoi(optarg);
+            break;
+        default:
+            if (parse_ib_opt(&ib_res, opt, optarg) == 0)
+                break;
+            fprintf(stderr, "Usage: %s [-n ops] [-b nbufs] [-S buf_size] [-P max_pinned_bytes] "
+                    "[-f free_every] %s\n", argv[0], IB_OPTUSAGE);
+            return -1;
+        }
+    }
+    if (iters < 1 || nbufs < 1 || size < 1) {
+        fprintf(stderr, "ops, buffers and buffer size must be positive\n");
+        return -1;
+    }
+    // Default: every (page-aligned) buffer fits, so only first touches miss
+    if (!max_pinned)
+        max_pinned = (size_t)nbufs * ((size + getpagesize() - 1) & ~((size_t)getpagesize() - 1));
+
+    bufs = calloc(nbufs, sizeof(*bufs));
+    if (!bufs) {
+        perror("calloc");
+        return -1;
+    }
+    for (int i = 0; i < nbufs; i++) {
+        bufs[i] = alloc_buf(size);
+        if (!bufs[i]) {
+            perror("memalign");
+            goto cleanup;
+        }
+    }
+    if (lat_stats_init(&acq, iters) || lat_stats_init(&rel, iters))
+        goto cleanup;
+    if (prepare_ib_res(&ib_res)) {
+        perror("prepare_ib_res failed");
+        goto cleanup;
+    }
+
+    printf("%d buffers of %zu B, %d ops, pinned cap %zu B\n", nbufs, size, iters, max_pinned);
+    if (run_direct(&ib_res, bufs, nbufs, size, iters, &acq, &rel))
+        goto cleanup;
+    lat_stats_summarize(&acq, &sum);
+    lat_summary_print(stdout, "direct reg", &sum);
+    lat_stats_summarize(&rel, &sum);
+    lat_summary_print(stdout, "direct dereg", &sum);
+    lat_stats_reset(&acq);
+    lat_stats_reset(&rel);
+
+    if (reg_cache_init(&cache, ib_res.pd, max_pinned))
+        goto cleanup;
+    cache_ready = 1;
+    if (run_cached(&cache, bufs, nbufs, size, iters, free_every, &acq, &rel))
+        goto cleanup;
+    lat_stats_summarize(&acq, &sum);
+    lat_summary_print(stdout, "cached get", &sum);
+    lat_stats_summarize(&rel, &sum);
+    lat_summary_print(stdout, "cached put", &sum);
+    reg_cache_print_stats(stdout, &cache);
+    ret = 0;
+
+cleanup:
+    if (cache_ready)
+        reg_cache_destroy(&cache);
+    for (int i = 0; bufs && i < nbufs; i++)
+        free(bufs[i]);
+    free(bufs);
+    lat_stats_free(&acq);
+    lat_stats_free(&rel);
+    free_ib_res(&ib_res);
+    return ret;
+}
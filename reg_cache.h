@@ -0,0 +1,395 @@
+#ifndef REG_CACHE_H
+#define REG_CACHE_H
+
+#include <pthread.h>
+#include "gfp.h"
+
+/*
+ * Memory registration cache.
+ *
+ * reg_cache_get() returns an MR covering [addr, addr + len) with at least
+ * the requested access, registering the enclosing pages on a miss; the
+ * entry is referenced until reg_cache_put(). Unreferenced entries stay
+ * registered on an LRU list, so re-sending from the same buffers costs a
+ * lookup instead of ibv_reg_mr/ibv_dereg_mr.
+ *
+ * ibv_dereg_mr never runs on the caller's path: a background reclaimer
+ * deregisters LRU entries once the cache pins more than `max_pinned`
+ * bytes, and entries dropped by reg_cache_invalidate().
+ *
+ * Entries are kept in an array sorted by start address. A covering entry
+ * starts at most max_len bytes below `addr` (max_len: the longest entry
+ * ever registered), which bounds the backwards scan after the binary
+ * search. Entries may overlap.
+ *
+ * Memory must be invalidated before it is freed or unmapped, or a later
+ * allocation at the same address would hit a stale MR; reg_cache_free()
+ * does both.
+ */
+
+#define REG_CACHE_INDEX_INIT 64
+
+struct reg_entry {
+    uintptr_t start;
+    size_t len;
+    int access;
+    int refcnt;
+    int stale;                  /* invalidated while referenced */
+    struct ibv_mr *mr;
+    struct reg_entry *prev;     /* LRU, or the reclaimer's list */
+    struct reg_entry *next;
+};
+
+struct reg_cache {
+    struct ibv_pd *pd;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t reclaimer;
+    int running;
+    int stop;
+    struct reg_entry **index;
+    size_t nentries;
+    size_t index_cap;
+    size_t max_len;
+    struct reg_entry *lru_head; /* least recently used */
+    struct reg_entry *lru_tail;
+    struct reg_entry *doomed;
+    size_t max_pinned;
+    size_t pinned;              /* registered bytes, including doomed entries */
+    size_t reclaiming;          /* of which the reclaimer already owns */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+    uint64_t hit_ns;
+    uint64_t miss_ns;
+    uint64_t dereg_ns;
+    uint64_t deregs;
+};
+
+static void reg_lru_unlink(struct reg_cache *c, struct reg_entry *e) {
+    if (e->prev) e->prev->next = e->next;
+    else c->lru_head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else c->lru_tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void reg_lru_append(struct reg_cache *c, struct reg_entry *e) {
+    e->prev = c->lru_tail;
+    e->next = NULL;
+    if (c->lru_tail) c->lru_tail->next = e;
+    else c->lru_head = e;
+    c->lru_tail = e;
+}
+
+// First index whose entry starts above `addr`
+static size_t reg_index_upper(struct reg_cache *c, uintptr_t addr) {
+    size_t lo = 0, hi = c->nentries;
+
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (c->index[mid]->start <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int reg_index_insert(struct reg_cache *c, struct reg_entry *e) {
+    size_t pos;
+
+    if (c->nentries == c->index_cap) {
+        size_t cap = c->index_cap ? c->index_cap * 2 : REG_CACHE_INDEX_INIT;
+        struct reg_entry **index = realloc(c->index, cap * sizeof(*index));
+
+        if (!index)
+            return -1;
+        c->index = index;
+        c->index_cap = cap;
+    }
+    pos = reg_index_upper(c, e->start);
+    memmove(&c->index[pos + 1], &c->index[pos], (c->nentries - pos) * sizeof(*c->index));
+    c->index[pos] = e;
+    c->nentries++;
+    if (e->len > c->max_len)
+        c->max_len = e->len;
+    return 0;
+}
+
+static void reg_index_remove_at(struct reg_cache *c, size_t pos) {
+    memmove(&c->index[pos], &c->index[pos + 1], (c->nentries - pos - 1) * sizeof(*c->index));
+    c->nentries--;
+}
+
+static void reg_index_remove(struct reg_cache *c, struct reg_entry *e) {
+    size_t i = reg_index_upper(c, e->start);
+
+    while (i-- > 0 && c->index[i]->start == e->start) {
+        if (c->index[i] == e) {
+            reg_index_remove_at(c, i);
+            return;
+        }
+    }
+}
+
+static struct reg_entry *reg_index_find(struct reg_cache *c, uintptr_t addr, size_t len, int access) {
+    size_t i = reg_index_upper(c, addr);
+
+    while (i-- > 0) {
+        struct reg_entry *e = c->index[i];
+
+        if (addr - e->start >= c->max_len)
+            break;
+        if (e->start + e->len >= addr + len && (e->access & access) == access)
+            return e;
+    }
+    return NULL;
+}
+
+// Hand an unreferenced entry, already out of the index and LRU, to the reclaimer
+static void reg_doom(struct reg_cache *c, struct reg_entry *e) {
+    e->prev = NULL;
+    e->next = c->doomed;
+    c->doomed = e;
+    pthread_cond_signal(&c->wake);
+}
+
+// Returns the time ibv_dereg_mr took
+static long long reg_dereg(struct reg_entry *e) {
+    long long t0 = gfp_get_time();
+
+    if (ibv_dereg_mr(e->mr))
+        perror("ibv_dereg_mr");
+    t0 = gfp_get_time() - t0;
+    free(e);
+    return t0;
+}
+
+static void *reg_reclaimer(void *arg) {
+    struct reg_cache *c = arg;
+    long long ns;
+    uint64_t n;
+
+    pthread_mutex_lock(&c->lock);
+    while (!c->stop) {
+        struct reg_entry *victims = c->doomed;
+        size_t bytes = 0;
+
+        c->doomed = NULL;
+        // Evict from the cold end until the cap holds again
+        while (c->lru_head && c->pinned - c->reclaiming - bytes > c->max_pinned) {
+            struct reg_entry *e = c->lru_head;
+
+            reg_lru_unlink(c, e);
+            reg_index_remove(c, e);
+            e->next = victims;
+            victims = e;
+            bytes += e->len;
+            c->evictions++;
+        }
+        if (!victims) {
+            pthread_cond_wait(&c->wake, &c->lock);
+            continue;
+        }
+        for (struct reg_entry *e = victims; e; e = e->next)
+            c->reclaiming += e->len;
+        pthread_mutex_unlock(&c->lock);
+
+        // The expensive part, off the callers' path and outside the lock
+        bytes = 0;
+        ns = 0;
+        n = 0;
+        while (victims) {
+            struct reg_entry *e = victims;
+
+            victims = e->next;
+            bytes += e->len;
+            ns += reg_dereg(e);
+            n++;
+        }
+
+        pthread_mutex_lock(&c->lock);
+        c->pinned -= bytes;
+        c->reclaiming -= bytes;
+        c->dereg_ns += ns;
+        c->deregs += n;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+int reg_cache_init(struct reg_cache *c, struct ibv_pd *pd, size_t max_pinned) {
+    memset(c, 0, sizeof(*c));
+    c->pd = pd;
+    c->max_pinned = max_pinned;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->wake, NULL);
+    if (pthread_create(&c->reclaimer, NULL, reg_reclaimer, c)) {
+        perror("pthread_create");
+        return -1;
+    }
+    c->running = 1;
+    return 0;
+}
+
+/*
+ * Look up or register an MR covering [addr, addr + len) with `access`.
+ * Returns a referenced entry (use entry->mr), or NULL.
+ */
+struct reg_entry *reg_cache_get(struct reg_cache *c, void *addr, size_t len, int access) {
+    uintptr_t page = getpagesize();
+    uintptr_t a = (uintptr_t)addr;
+    long long t0 = gfp_get_time();
+    struct reg_entry *e;
+
+    pthread_mutex_lock(&c->lock);
+    e = reg_index_find(c, a, len, access);
+    if (e) {
+        if (e->refcnt++ == 0)
+            reg_lru_unlink(c, e);
+        c->hits++;
+        c->hit_ns += gfp_get_time() - t0;
+        pthread_mutex_unlock(&c->lock);
+        return e;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    // Miss: register whole pages, without holding the lock
+    e = calloc(1, sizeof(*e));
+    if (!e) {
+        perror("calloc");
+        return NULL;
+    }
+    e->start = a & ~(page - 1);
+    e->len = ((a + len + page - 1) & ~(page - 1)) - e->start;
+    e->access = access;
+    e->refcnt = 1;
+    e->mr = ibv_reg_mr(c->pd, (void *)e->start, e->len, access);
+    if (!e->mr) {
+        perror("ibv_reg_mr");
+        free(e);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    if (reg_index_insert(c, e)) {
+        pthread_mutex_unlock(&c->lock);
+        fprintf(stderr, "reg_cache: index allocation failed\n");
+        ibv_dereg_mr(e->mr);
+        free(e);
+        return NULL;
+    }
+    c->pinned += e->len;
+    c->misses++;
+    c->miss_ns += gfp_get_time() - t0;
+    if (c->pinned - c->reclaiming > c->max_pinned)
+        pthread_cond_signal(&c->wake);
+    pthread_mutex_unlock(&c->lock);
+    return e;
+}
+
+void reg_cache_put(struct reg_cache *c, struct reg_entry *e) {
+    pthread_mutex_lock(&c->lock);
+    if (--e->refcnt == 0) {
+        if (e->stale)
+            reg_doom(c, e);
+        else
+            reg_lru_append(c, e);
+        // Eviction may have been waiting for something to become unreferenced
+        if (c->pinned - c->reclaiming > c->max_pinned)
+            pthread_cond_signal(&c->wake);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Invalidation hook: drop every entry overlapping [addr, addr + len).
+ * Call it before the memory is freed or unmapped. Entries still in use
+ * stay valid for their holders and are deregistered on the last put.
+ */
+void reg_cache_invalidate(struct reg_cache *c, void *addr, size_t len) {
+    uintptr_t a = (uintptr_t)addr;
+    size_t i;
+
+    if (len == 0)
+        return;
+    pthread_mutex_lock(&c->lock);
+    i = reg_index_upper(c, a + len - 1);
+    while (i-- > 0) {
+        struct reg_entry *e = c->index[i];
+
+        if (e->start < a && a - e->start >= c->max_len)
+            break;
+        if (e->start + e->len <= a)
+            continue;
+        reg_index_remove_at(c, i);
+        c->invalidations++;
+        if (e->refcnt) {
+            e->stale = 1;
+        } else {
+            reg_lru_unlink(c, e);
+            reg_doom(c, e);
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+// free() that keeps the cache coherent
+void reg_cache_free(struct reg_cache *c, void *ptr, size_t len) {
+    if (ptr)
+        reg_cache_invalidate(c, ptr, len);
+    free(ptr);
+}
+
+void reg_cache_print_stats(FILE *out, struct reg_cache *c) {
+    uint64_t lookups;
+
+    pthread_mutex_lock(&c->lock);
+    lookups = c->hits + c->misses;
+    fprintf(out, "reg_cache: %lu lookups, hit rate %.1f%%, avg hit %.0f ns, avg miss %.0f ns\n",
+            (unsigned long)lookups, lookups ? 100.0 * c->hits / lookups : 0.0,
+            c->hits ? (double)c->hit_ns / c->hits : 0.0,
+            c->misses ? (double)c->miss_ns / c->misses : 0.0);
+    fprintf(out, "reg_cache: %zu entries, %zu bytes pinned (cap %zu), %lu evictions, "
+            "%lu invalidations, %lu deregs avg %.0f ns (background)\n",
+            c->nentries, c->pinned, c->max_pinned, (unsigned long)c->evictions,
+            (unsigned long)c->invalidations, (unsigned long)c->deregs,
+            c->deregs ? (double)c->dereg_ns / c->deregs : 0.0);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Stop the reclaimer and deregister every cached entry, referenced or not.
+ * Stale entries still held by a caller are leaked.
+ */
+void reg_cache_destroy(struct reg_cache *c) {
+    if (c->running) {
+        pthread_mutex_lock(&c->lock);
+        c->stop = 1;
+        pthread_cond_signal(&c->wake);
+        pthread_mutex_unlock(&c->lock);
+        pthread_join(c->reclaimer, NULL);
+        c->running = 0;
+    }
+    for (size_t i = 0; i < c->nentries; i++) {
+        if (c->index[i]->refcnt)
+            fprintf(stderr, "reg_cache: entry at %#lx still referenced\n",
+                    (unsigned long)c->index[i]->start);
+        reg_dereg(c->index[i]);
+    }
+    while (c->doomed) {
+        struct reg_entry *e = c->doomed;
+
+        c->doomed = e->next;
+        reg_dereg(e);
+    }
+    free(c->index);
+    c->index = NULL;
+    c->nentries = 0;
+    pthread_mutex_destroy(&c->lock);
+    pthread_cond_destroy(&c->wake);
+}
+
+#endif /* REG_CACHE_H */
@@ -0,0 +1,180 @@
+#include "gfp.h"
+#include "lat_stats.h"
+
+/*
+ * Per-transfer rkey revocation cost on a self-connected QP.
+ *
+ *   uc-local-inv   UC, type 2 window, server posts IBV_WR_LOCAL_INV
+ *   uc-type1-bind  UC, type 1 window, server rebinds with zero length
+ *   rc-remote-inv  RC, type 2 window, peer sends IBV_WR_SEND_WITH_INV and
+ *                  the responder HCA invalidates on a pre-posted receive
+ *
+ * Each iteration binds the window (untimed) and times the revocation from
+ * post until the revoking side sees its CQE. -R is ignored.
+ */
+
+enum revoke_variant {
+    REVOKE_UC_LOCAL_INV,
+    REVOKE_UC_TYPE1_BIND,
+    REVOKE_RC_REMOTE_INV,
+    REVOKE_NVARIANTS,
+};
+
+static const char *variant_names[] = { "uc-local-inv", "uc-type1-bind", "rc-remote-inv" };
+
+static int revoke_once(struct ib_res *ib_res, int variant, struct ibv_mw *mw, struct ibv_mr *mr) {
+    struct ibv_send_wr wr, *bad_wr;
+    int ret;
+
+    memset(&wr, 0, sizeof(wr));
+    switch (variant) {
+    case REVOKE_UC_LOCAL_INV:
+        if (post_local_inv(ib_res, ib_res->qp, mw->rkey, WRID(WRID_CLASS_INV, 0), 1))
+            return -1;
+        return cq_engine_wait(&ib_res->cq_eng, WRID_CLASS_INV, 1);
+    case REVOKE_UC_TYPE1_BIND: {
+        struct ibv_mw_bind_info bind_info = {
+            .mr = mr,
+            .addr = (uintptr_t)mr->addr,
+            .length = 0,
+            .mw_access_flags = IBV_ACCESS_REMOTE_WRITE,
+        };
+        // Posts the zero-length rebind and waits for its CQE
+        return bind_mw_rkey(ib_res, mw, IBV_MW_TYPE_1, &bind_info);
+    }
+    case REVOKE_RC_REMOTE_INV:
+        wr.wr_id = WRID(WRID_CLASS_SEND, 0);
+        wr.opcode = IBV_WR_SEND_WITH_INV;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        wr.invalidate_rkey = mw->rkey;
+        ret = ib_post_send(ib_res, ib_res->qp, &wr, &bad_wr);
+        if (ret)
+            return ret;
+        // The responder's receive CQE is the point the window is dead
+        return cq_engine_wait(&ib_res->cq_eng, WRID_CLASS_RECV, 1);
+    }
+    return -1;
+}
+
+static int run_variant(const struct ib_res *config, int variant, int iters) {
+    struct ib_res ib_res;
+    struct ibv_mr *mr = NULL;
+    struct ibv_mw *mw = NULL;
+    struct ibv_recv_wr rwr, *rbad_wr;
+    uint8_t mw_type = variant == REVOKE_UC_TYPE1_BIND ? IBV_MW_TYPE_1 : IBV_MW_TYPE_2;
+    char *buffer = NULL;
+    struct lat_stats st;
+    struct lat_summary sum;
+    int ret;
+
+    ib_res = *config;
+    ib_res.qp_type = variant == REVOKE_RC_REMOTE_INV ? IBV_QPT_RC : IBV_QPT_UC;
+
+    if (lat_stats_init(&st, iters))
+        return -1;
+    buffer = memalign(getpagesize(), PKTSZ);
+    if (!buffer) {
+        perror("memalign");
+        lat_stats_free(&st);
+        return -1;
+    }
+    ret = prepare_ib_res(&ib_res);
+    if (ret)
+        goto cleanup;
+    mr = ibv_reg_mr(ib_res.pd, buffer, PKTSZ,
+                    IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_MW_BIND);
+    if (!mr) {
+        perror("ibv_reg_mr");
+        ret = -1;
+        goto cleanup;
+    }
+    ret = connect_qp(&ib_res, &ib_res.local_info);
+    if (ret)
+        goto cleanup;
+    mw = ibv_alloc_mw(ib_res.pd, mw_type);
+    if (!mw) {
+        perror("ibv_alloc_mw");
+        ret = -1;
+        goto cleanup;
+    }
+
+    memset(&rwr, 0, sizeof(rwr));
+    rwr.wr_id = WRID(WRID_CLASS_RECV, 0);
+    rwr.sg_list = NULL;
+    rwr.num_sge = 0;
+
+    for (int i = 0; i < iters; i++) {
+        struct ibv_mw_bind_info bind_info = {
+            .mr = mr,
+            .addr = (uintptr_t)buffer,
+            .length = PKTSZ,
+            .mw_access_flags = IBV_ACCESS_REMOTE_WRITE,
+        };
+        long long start_time, elapsed;
+
+        ret = bind_mw_rkey(&ib_res, mw, mw_type, &bind_info);
+        if (ret)
+            goto cleanup;
+        if (variant == REVOKE_RC_REMOTE_INV) {
+            ret = ibv_post_recv(ib_res.qp, &rwr, &rbad_wr);
+            if (ret) {
+                perror("ibv_post_recv");
+                goto cleanup;
+            }
+        }
+
+        start_time = gfp_get_time();
+        ret = revoke_once(&ib_res, variant, mw, mr);
+        elapsed = gfp_get_time() - start_time;
+        if (ret) {
+            fprintf(stderr, "%s: revocation failed\n", variant_names[variant]);
+            goto cleanup;
+        }
+        if (variant == REVOKE_RC_REMOTE_INV) {
+            ret = cq_engine_wait(&ib_res.cq_eng, WRID_CLASS_SEND, 1);
+            if (ret)
+                goto cleanup;
+        }
+        lat_stats_add(&st, elapsed);
+    }
+    lat_stats_summarize(&st, &sum);
+    printf("%14s %10zu %10lld %10lld %10lld %10.0f %12d\n", variant_names[variant], sum.n,
+           sum.min, sum.p50, sum.p99, sum.avg, variant == REVOKE_RC_REMOTE_INV ? 0 : 1);
+
+cleanup:
+    if (mw) ibv_dealloc_mw(mw);
+    if (mr) ibv_dereg_mr(mr);
+    free(buffer);
+    free_ib_res(&ib_res);
+    lat_stats_free(&st);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    struct ib_res config;
+    int iters = 10000;
+    int opt, ret = 0;
+
+    memset(&config, 0, sizeof(config));
+    while ((opt = getopt(argc, argv, "n:" IB_OPTSTRING)) != -1) {
+        switch (opt) {
+        case 'n':
+            iters = atoi(optarg);
+            break;
+        default:
+            if (parse_ib_opt(&config, opt, optarg) == 0)
+                break;
+            fprintf(stderr, "Usage: %s [-n iterations] %s\n", argv[0], IB_OPTUSAGE);
+            return -1;
+        }
+    }
+    // The SEND_WITH_INV receive is posted on the QP's own RQ
+    config.srq_depth = 0;
+
+    printf("%14s %10s %10s %10s %10s %10s %12s\n", "variant", "iters", "min_ns", "p50_ns", "p99_ns", "avg_ns", "server_wrs");
+    for (int v = 0; v < REVOKE_NVARIANTS; v++) {
+        if (run_variant(&config, v, iters))
+            ret = -1;
+    }
+    return ret;
+}
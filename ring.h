@@ -0,0 +1,357 @@
+#ifndef RING_H
+#define RING_H
+
+#include "gfp.h"
+
+/*
+ * Message ring over plain RDMA write: no receive WRs, no receive CQEs.
+ *
+ * The consumer exposes a ring of `size` bytes (a power of two) through a
+ * window. The producer appends records with IBV_WR_RDMA_WRITE:
+ *
+ *   len u32 | seq u32 | payload | zero padding | valid u8
+ *
+ * A record is padded to a multiple of RING_ALIGN bytes, and its last byte
+ * is RING_VALID(seq). The consumer spins on ring memory at its head. It
+ * waits for the expected seq in the header, then for the valid byte at the
+ * record's end. HCAs place the bytes of one write in increasing address
+ * order, so the payload is complete once the valid byte is there. A record
+ * never wraps: if it does not fit before the end of the ring, the producer
+ * writes a RING_WRAP_LEN header there first and starts again at offset 0.
+ *
+ * The consumer zeroes each record it is done with, so stale bytes never
+ * look valid. It then publishes its head, a byte count that only grows,
+ * with an 8-byte RDMA write into the producer's memory. It does this once
+ * every publish_every bytes, which bounds how much ring it hides from the
+ * producer. The producer may only write up to head + size.
+ *
+ * Both sides post through their own QP and signal one WR in
+ * RING_SIGNAL_EVERY. Records go out with class `cls` and head updates
+ * with WRID_CLASS_CREDIT. Each side keeps at most half the send queue.
+ * Integers are in host byte order: both ends run the same build.
+ */
+
+#define RING_ALIGN 8
+#define RING_HDR_SIZE 8
+#define RING_CTRL_SIZE 64           /* published head + staging for our own */
+#define RING_WRAP_LEN 0xffffffffu
+#define RING_SIGNAL_EVERY 32
+#define RING_VALID(seq) ((uint8_t)(0x80 | ((seq) & 0x7f)))
+
+static inline size_t ring_rec_size(size_t len) {
+    return (RING_HDR_SIZE + len + 1 + RING_ALIGN - 1) & ~(size_t)(RING_ALIGN - 1);
+}
+
+// Smallest power-of-two ring that holds `nrecs` records of `len` bytes
+static inline size_t ring_size_for(size_t len, int nrecs) {
+    size_t size = RING_ALIGN;
+
+    while (size < nrecs * ring_rec_size(len))
+        size <<= 1;
+    return size;
+}
+
+struct ring_tx {
+    struct ib_res *ib_res;
+    struct ibv_qp *qp;
+    struct ibv_mr *mr;
+    char *stage;                /* local mirror of the remote ring, inside mr */
+    volatile uint64_t *head;    /* consumer head, written by the consumer */
+    uint64_t remote_addr;
+    uint32_t rkey;
+    unsigned cls;
+    size_t size;
+    uint64_t tail;
+    uint32_t seq;
+    uint32_t unsignaled;
+    uint64_t signaled;
+    uint64_t cqe_base;
+    uint64_t full_spins;
+};
+
+struct ring_rx {
+    struct ib_res *ib_res;
+    struct ibv_qp *qp;
+    struct ibv_mr *mr;
+    char *ring;
+    uint64_t *stage;            /* 8 bytes inside mr the head is written from */
+    uint64_t head_addr;         /* producer's copy of our head */
+    uint32_t head_rkey;
+    size_t size;
+    size_t publish_every;
+    uint64_t head;
+    uint64_t published;
+    uint32_t seq;
+    uint32_t unsignaled;
+    uint64_t signaled;
+    uint64_t cqe_base;
+    uint64_t publishes;
+};
+
+static inline uint32_t ring_seq_next(uint32_t seq) {
+    // 0 is what a zeroed header holds, never expect it
+    return seq + 1 ? seq + 1 : 1;
+}
+
+static inline uint64_t ring_cqes(const struct cq_engine *eng, unsigned cls) {
+    return eng->done[cls] + eng->failed[cls];
+}
+
+/*
+ * Post `wr` (a chain of `n` WRs), signaling its last WR whenever
+ * RING_SIGNAL_EVERY WRs have gone unsignaled. Keeps at most MAX_SEND_WR / 2
+ * of them in the send queue.
+ */
+static int ring_post(struct ib_res *ib_res, struct ibv_qp *qp, unsigned cls, struct ibv_send_wr *wr,
+                     int n, uint32_t *unsignaled, uint64_t *signaled, uint64_t cqe_base) {
+    struct cq_engine *eng = &ib_res->cq_eng;
+    struct ibv_send_wr *last = wr, *bad_wr;
+
+    while (last->next)
+        last = last->next;
+    while ((*signaled - (ring_cqes(eng, cls) - cqe_base) + 1) * RING_SIGNAL_EVERY > MAX_SEND_WR / 2)
+        if (cq_engine_wait(eng, cls, 1))
+            return -1;
+    *unsignaled += n;
+    if (*unsignaled >= RING_SIGNAL_EVERY) {
+        last->send_flags |= IBV_SEND_SIGNALED;
+        *unsignaled = 0;
+        (*signaled)++;
+    }
+    if (ib_post_send(ib_res, qp, wr, &bad_wr)) {
+        perror("ibv_post_send");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Producer on `qp` into the consumer's ring at remote_addr/rkey. Records
+ * are built in `stage` (size bytes inside `mr`); `head` is where the
+ * consumer writes its head, also inside `mr` and remote writable.
+ */
+int ring_tx_init(struct ring_tx *tx, struct ib_res *ib_res, struct ibv_qp *qp, struct ibv_mr *mr,
+                 char *stage, uint64_t *head, uint64_t remote_addr, uint32_t rkey, size_t size,
+                 unsigned cls) {
+    memset(tx, 0, sizeof(*tx));
+    if (size < RING_ALIGN || (size & (size - 1))) {
+        fprintf(stderr, "ring: size %zu is not a power of two\n", size);
+        return -1;
+    }
+    tx->ib_res = ib_res;
+    tx->qp = qp;
+    tx->mr = mr;
+    tx->stage = stage;
+    tx->head = head;
+    tx->remote_addr = remote_addr;
+    tx->rkey = rkey;
+    tx->cls = cls;
+    tx->size = size;
+    tx->seq = 1;
+    tx->cqe_base = ring_cqes(&ib_res->cq_eng, cls);
+    *head = 0;
+    return 0;
+}
+
+static void ring_fill_write(struct ring_tx *tx, struct ibv_send_wr *wr, struct ibv_sge *sg,
+                            uint64_t off, size_t len) {
+    sg->addr = (uintptr_t)tx->stage + off;
+    sg->length = len;
+    sg->lkey = tx->mr->lkey;
+    memset(wr, 0, sizeof(*wr));
+    wr->wr_id = WRID(tx->cls, 0);
+    wr->sg_list = sg;
+    wr->num_sge = 1;
+    wr->opcode = IBV_WR_RDMA_WRITE;
+    wr->send_flags = len <= tx->ib_res->max_inline ? IBV_SEND_INLINE : 0;
+    wr->wr.rdma.remote_addr = tx->remote_addr + off;
+    wr->wr.rdma.rkey = tx->rkey;
+}
+
+/*
+ * Append one record of `len` bytes. Returns 1 if posted, 0 if the ring
+ * has no room until the consumer publishes a newer head, -1 on error.
+ */
+int ring_tx_post(struct ring_tx *tx, const void *buf, size_t len) {
+    struct ibv_send_wr wrs[2];
+    struct ibv_sge sges[2];
+    size_t total = ring_rec_size(len);
+    uint64_t off = tx->tail & (tx->size - 1);
+    size_t skip = tx->size - off < total ? tx->size - off : 0;
+    char *rec;
+    int n = 0;
+
+    if (total > tx->size / 2) {
+        fprintf(stderr, "ring: %zu byte record exceeds half the %zu byte ring\n", total, tx->size);
+        return -1;
+    }
+    if (tx->tail + skip + total - *tx->head > tx->size) {
+        tx->full_spins++;
+        return 0;
+    }
+    if (skip) {
+        uint32_t *hdr = (uint32_t *)(tx->stage + off);
+
+        hdr[0] = RING_WRAP_LEN;
+        hdr[1] = tx->seq;
+        tx->seq = ring_seq_next(tx->seq);
+        ring_fill_write(tx, &wrs[n], &sges[n], off, RING_HDR_SIZE);
+        n++;
+        tx->tail += skip;
+        off = 0;
+    }
+    rec = tx->stage + off;
+    ((uint32_t *)rec)[0] = len;
+    ((uint32_t *)rec)[1] = tx->seq;
+    memcpy(rec + RING_HDR_SIZE, buf, len);
+    memset(rec + RING_HDR_SIZE + len, 0, total - RING_HDR_SIZE - len - 1);
+    rec[total - 1] = RING_VALID(tx->seq);
+    tx->seq = ring_seq_next(tx->seq);
+    ring_fill_write(tx, &wrs[n], &sges[n], off, total);
+    if (n)
+        wrs[0].next = &wrs[1];
+    n++;
+    tx->tail += total;
+    if (ring_post(tx->ib_res, tx->qp, tx->cls, wrs, n, &tx->unsignaled, &tx->signaled,
+                  tx->cqe_base))
+        return -1;
+    return 1;
+}
+
+// Blocking append: spins until the consumer has made room
+int ring_tx_send(struct ring_tx *tx, const void *buf, size_t len) {
+    int ret;
+
+    while ((ret = ring_tx_post(tx, buf, len)) == 0)
+        if (cq_engine_poll(&tx->ib_res->cq_eng) < 0)
+            return -1;
+    return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Wait until every record posted so far has completed locally. Posts a
+ * signaled zero-length write if the last records went unsignaled.
+ */
+int ring_tx_drain(struct ring_tx *tx) {
+    struct cq_engine *eng = &tx->ib_res->cq_eng;
+
+    if (tx->unsignaled) {
+        struct ibv_send_wr wr, *bad_wr;
+
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = WRID(tx->cls, 0);
+        wr.opcode = IBV_WR_RDMA_WRITE;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        wr.wr.rdma.remote_addr = tx->remote_addr;
+        wr.wr.rdma.rkey = tx->rkey;
+        if (ib_post_send(tx->ib_res, tx->qp, &wr, &bad_wr)) {
+            perror("ibv_post_send");
+            return -1;
+        }
+        tx->unsignaled = 0;
+        tx->signaled++;
+    }
+    while (ring_cqes(eng, tx->cls) - tx->cqe_base < tx->signaled)
+        if (cq_engine_wait(eng, tx->cls, 1))
+            return -1;
+    return eng->failed[tx->cls] ? -1 : 0;
+}
+
+/*
+ * Consumer of the `size` byte ring at `ring`, which must be zeroed before
+ * the producer may write to it. Its head is written from `stage` (8 bytes
+ * inside `mr`) to head_addr/head_rkey on the producer whenever
+ * publish_every more bytes have been consumed.
+ */
+int ring_rx_init(struct ring_rx *rx, struct ib_res *ib_res, struct ibv_qp *qp, struct ibv_mr *mr,
+                 char *ring, uint64_t *stage, uint64_t head_addr, uint32_t head_rkey, size_t size,
+                 size_t publish_every) {
+    memset(rx, 0, sizeof(*rx));
+    if (size < RING_ALIGN || (size & (size - 1)) || publish_every < 1 ||
+        publish_every > size / 2) {
+        fprintf(stderr, "ring: need a power-of-two size and 1 <= publish_every <= size / 2\n");
+        return -1;
+    }
+    rx->ib_res = ib_res;
+    rx->qp = qp;
+    rx->mr = mr;
+    rx->ring = ring;
+    rx->stage = stage;
+    rx->head_addr = head_addr;
+    rx->head_rkey = head_rkey;
+    rx->size = size;
+    rx->publish_every = publish_every;
+    rx->seq = 1;
+    rx->cqe_base = ring_cqes(&ib_res->cq_eng, WRID_CLASS_CREDIT);
+    return 0;
+}
+
+/*
+ * The record at the head, or NULL if it has not fully arrived yet. Its
+ * payload stays valid until ring_rx_release().
+ */
+static inline char *ring_rx_peek(struct ring_rx *rx, uint32_t *len) {
+    for (;;) {
+        char *rec = rx->ring + (rx->head & (rx->size - 1));
+        volatile uint32_t *hdr = (volatile uint32_t *)rec;
+        uint32_t l;
+
+        if (hdr[1] != rx->seq)
+            return NULL;
+        l = hdr[0];
+        if (l == RING_WRAP_LEN) {
+            // Wrap marker: the rest of the ring is skipped
+            hdr[0] = 0;
+            hdr[1] = 0;
+            rx->head += rx->size - (rx->head & (rx->size - 1));
+            rx->seq = ring_seq_next(rx->seq);
+            continue;
+        }
+        if (ring_rec_size(l) > rx->size / 2 ||
+            ((volatile uint8_t *)rec)[ring_rec_size(l) - 1] != RING_VALID(rx->seq))
+            return NULL;
+        // Do not let payload reads move ahead of the valid byte
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        *len = l;
+        return rec + RING_HDR_SIZE;
+    }
+}
+
+// Tell the producer how far we got
+int ring_rx_publish(struct ring_rx *rx) {
+    struct ibv_send_wr wr;
+    struct ibv_sge sg;
+
+    *rx->stage = rx->head;
+    sg.addr = (uintptr_t)rx->stage;
+    sg.length = sizeof(*rx->stage);
+    sg.lkey = rx->mr->lkey;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = WRID(WRID_CLASS_CREDIT, 0);
+    wr.sg_list = &sg;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.send_flags = sizeof(*rx->stage) <= rx->ib_res->max_inline ? IBV_SEND_INLINE : 0;
+    wr.wr.rdma.remote_addr = rx->head_addr;
+    wr.wr.rdma.rkey = rx->head_rkey;
+    if (ring_post(rx->ib_res, rx->qp, WRID_CLASS_CREDIT, &wr, 1, &rx->unsignaled, &rx->signaled,
+                  rx->cqe_base))
+        return -1;
+    rx->published = rx->head;
+    rx->publishes++;
+    return 0;
+}
+
+// Done with the record ring_rx_peek() returned: zero it and move on
+int ring_rx_release(struct ring_rx *rx, uint32_t len) {
+    size_t total = ring_rec_size(len);
+
+    memset(rx->ring + (rx->head & (rx->size - 1)), 0, total);
+    rx->head += total;
+    rx->seq = ring_seq_next(rx->seq);
+    if (rx->head - rx->published >= rx->publish_every)
+        return ring_rx_publish(rx);
+    return 0;
+}
+
+#endif /* RING_H */
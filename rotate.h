@@ -0,0 +1,350 @@
+#ifndef ROTATE_H
+#define ROTATE_H
+
+#include "gfp.h"
+
+/*
+ * Epoch-based rkey rotation of a memory window.
+ *
+ * Revoking a window with invalidate_mw_rkey() drops every write still on
+ * its way under the old rkey. Here the owner of a region exposes it
+ * through two type 2 windows and rotates between them. The current epoch's
+ * window stays bound while the idle one is bound over the same region
+ * under a fresh rkey (ibv_inc_rkey). Its descriptor is then pushed to the
+ * peer, and the old window is invalidated once the peer acknowledges the
+ * switch or `grace_ns` has passed. Writes already under way keep landing
+ * in between.
+ *
+ * A push is a write-with-imm of ROTATE_DESC_SIZE bytes, inline, into slot
+ * epoch % ROTATE_MBOX_SLOTS of the peer's mailbox. Its immediate is the
+ * epoch:
+ *
+ *   epoch u32 | region (wire.h layout) | epoch u32        (big-endian)
+ *
+ * The peer drops a record whose two epochs differ from the immediate: it
+ * was overwritten by a later push, whose CQE is still to come. It switches
+ * its writes to the new rkey and acks with a zero-length write-with-imm
+ * whose immediate is the epoch. A QP executes its WRs in order, so when
+ * the ack arrives every write the peer posted under the old rkey has
+ * arrived before it.
+ *
+ * With a single window (nwin 1) the same messages give a stop-the-world
+ * rotation to compare against. The owner pushes a zero-length region, the
+ * peer stops writing and acks, and only then is the window invalidated,
+ * rebound and pushed again.
+ *
+ * If the grace period runs out first, the old window goes anyway. A write
+ * still using it is then dropped on UC, and on RC it moves the peer's QP
+ * to the error state, so the grace period has to cover the peer's reaction
+ * time. Pushes should travel over RC: a push lost on UC leaves the peer on
+ * the revoked rkey.
+ *
+ * CQE handlers only record what arrived. Binds, pushes, acks and
+ * invalidations are posted from rotate_owner_poll()/rotate_peer_poll(),
+ * which the application calls after polling the CQ. Control messages and
+ * their receives use WRID_CLASS_ROTATE and WRID_CLASS_RECV.
+ */
+
+#define ROTATE_DESC_SIZE (8 + WIRE_REGION_SIZE)
+#define ROTATE_MBOX_SLOTS 2
+#define ROTATE_MBOX_SIZE (ROTATE_MBOX_SLOTS * ROTATE_DESC_SIZE)
+#define ROTATE_RECV_DEPTH 8         /* receives each side keeps posted */
+#define ROTATE_GRACE_NS 10000000LL
+#define ROTATE_EPOCH_FIRST 1
+
+enum rotate_state {
+    ROTATE_IDLE = 0,
+    ROTATE_QUIESCE,             /* nwin 1: waiting for the peer to stop writing */
+    ROTATE_BINDING,             /* the next window's bind is posted */
+    ROTATE_SWITCHING,           /* new descriptor pushed, old window still bound */
+    ROTATE_RETIRING,            /* the old window's LOCAL_INV is posted */
+};
+
+struct rotate_owner {
+    struct ib_res *ib_res;
+    struct ibv_qp *qp;
+    struct ibv_mw *mws[2];
+    int nwin;
+    int cur;                    /* window of the advertised epoch */
+    int state;
+    struct ibv_mw_bind_info bind;
+    uint32_t epoch;             /* advertised to the peer */
+    uint32_t acked;             /* newest epoch the peer acknowledged */
+    uint32_t next_rkey;
+    uint64_t mbox_addr;
+    uint32_t mbox_rkey;
+    long long grace_ns;
+    long long started;          /* the current rotation began */
+    long long pushed;           /* the current epoch went out */
+    unsigned wait_cls;
+    uint64_t wait_count;        /* done + failed of wait_cls that ends the step */
+    long long last_ns;          /* duration of the newest finished rotation */
+    uint64_t rotations;
+    uint64_t acks;
+    uint64_t expiries;
+};
+
+struct rotate_peer {
+    struct ib_res *ib_res;
+    struct ibv_qp *qp;
+    const uint8_t *mbox;        /* ROTATE_MBOX_SIZE bytes, remote writable */
+    uint64_t ack_addr;
+    uint32_t ack_rkey;
+    struct wire_region region;  /* what writes use now */
+    uint32_t epoch;
+    uint32_t pushed;            /* newest epoch whose push arrived */
+    int paused;                 /* the current epoch revokes the region */
+    uint64_t switches;
+    uint64_t torn;              /* polls that found the slot overwritten by a later push */
+};
+
+static inline uint64_t rotate_completions(const struct cq_engine *eng, unsigned cls) {
+    return eng->done[cls] + eng->failed[cls];
+}
+
+static int rotate_push(struct rotate_owner *o, const struct wire_region *r) {
+    uint8_t desc[ROTATE_DESC_SIZE];
+    uint64_t slot = o->epoch % ROTATE_MBOX_SLOTS;
+
+    wire_put32(desc, o->epoch);
+    wire_put_region(desc + 4, r);
+    wire_put32(desc + 4 + WIRE_REGION_SIZE, o->epoch);
+    o->pushed = gfp_get_time();
+    return post_write_imm(o->ib_res, o->qp, NULL, desc, sizeof(desc),
+                          o->mbox_addr + slot * ROTATE_DESC_SIZE, o->mbox_rkey, o->epoch,
+                          WRID(WRID_CLASS_ROTATE, 0), 1);
+}
+
+// The step in flight ends with the next completion of `cls`
+static inline void rotate_expect(struct rotate_owner *o, unsigned cls) {
+    o->wait_cls = cls;
+    o->wait_count = rotate_completions(&o->ib_res->cq_eng, cls) + 1;
+}
+
+/*
+ * Owner of `length` bytes at `addr` inside `mr` (registered with
+ * IBV_ACCESS_MW_BIND), exposed to the peer behind `qp` with `access`
+ * through `nwin` (1 or 2) type 2 windows. `qp` must be connected: the first
+ * window is bound before this returns. Pushes go to the peer's mailbox at
+ * mbox_addr/mbox_rkey; acks are received on `qp`.
+ */
+int rotate_owner_init(struct rotate_owner *o, struct ib_res *ib_res, struct ibv_qp *qp,
+                      struct ibv_mr *mr, uint64_t addr, uint64_t length, uint32_t access, int nwin,
+                      long long grace_ns, uint64_t mbox_addr, uint32_t mbox_rkey) {
+    memset(o, 0, sizeof(*o));
+    if (nwin < 1 || nwin > 2) {
+        fprintf(stderr, "rotate: 1 or 2 windows, not %d\n", nwin);
+        return -1;
+    }
+    if (ib_res->max_inline < ROTATE_DESC_SIZE) {
+        fprintf(stderr, "rotate: descriptors go inline, need %d bytes, QP has %u\n",
+                ROTATE_DESC_SIZE, ib_res->max_inline);
+        return -1;
+    }
+    o->ib_res = ib_res;
+    o->qp = qp;
+    o->nwin = nwin;
+    o->bind.mr = mr;
+    o->bind.addr = addr;
+    o->bind.length = length;
+    o->bind.mw_access_flags = access;
+    o->grace_ns = grace_ns > 0 ? grace_ns : ROTATE_GRACE_NS;
+    o->mbox_addr = mbox_addr;
+    o->mbox_rkey = mbox_rkey;
+    o->epoch = ROTATE_EPOCH_FIRST;
+    o->acked = ROTATE_EPOCH_FIRST;
+    for (int i = 0; i < nwin; i++) {
+        o->mws[i] = ibv_alloc_mw(ib_res->pd, IBV_MW_TYPE_2);
+        if (!o->mws[i]) {
+            perror("ibv_alloc_mw");
+            return -1;
+        }
+    }
+    if (bind_mw_rkey_qp(ib_res, qp, o->mws[0], IBV_MW_TYPE_2, &o->bind))
+        return -1;
+    return post_zero_recvs_qp(ib_res, qp, ROTATE_RECV_DEPTH);
+}
+
+void rotate_owner_destroy(struct rotate_owner *o) {
+    for (int i = 0; i < 2; i++)
+        if (o->mws[i])
+            ibv_dealloc_mw(o->mws[i]);
+    memset(o, 0, sizeof(*o));
+}
+
+// Descriptor of the current epoch, to advertise at connection setup
+void rotate_owner_region(const struct rotate_owner *o, struct wire_region *r) {
+    r->addr = o->bind.addr;
+    r->length = o->bind.length;
+    r->rkey = o->mws[o->cur]->rkey;
+    r->access = o->bind.mw_access_flags;
+}
+
+static inline int rotate_owner_busy(const struct rotate_owner *o) {
+    return o->state != ROTATE_IDLE;
+}
+
+// RECV CQE on the owner's QP: an ack
+void rotate_owner_on_recv(struct rotate_owner *o, const struct ibv_wc *wc) {
+    uint32_t epoch;
+
+    if (wc->status != IBV_WC_SUCCESS || !(wc->wc_flags & IBV_WC_WITH_IMM))
+        return;
+    epoch = ntohl(wc->imm_data);
+    if ((int32_t)(epoch - o->acked) > 0)
+        o->acked = epoch;
+    o->acks++;
+    post_zero_recvs_qp(o->ib_res, o->qp, 1);
+}
+
+/*
+ * Start a rotation. Returns 1 if one started, 0 if the previous one is
+ * still in progress, -1 on error.
+ */
+int rotate_owner_begin(struct rotate_owner *o) {
+    struct wire_region quiesce = { 0 };
+    struct ibv_mw *next;
+
+    if (rotate_owner_busy(o))
+        return 0;
+    o->started = gfp_get_time();
+    if (o->nwin == 1) {
+        o->epoch++;
+        if (rotate_push(o, &quiesce))
+            return -1;
+        o->state = ROTATE_QUIESCE;
+        return 1;
+    }
+    next = o->mws[o->cur ^ 1];
+    o->next_rkey = ibv_inc_rkey(next->rkey);
+    if (post_bind_mw(o->ib_res, o->qp, next, o->next_rkey, &o->bind, WRID(WRID_CLASS_BIND, 0), 1))
+        return -1;
+    rotate_expect(o, WRID_CLASS_BIND);
+    o->state = ROTATE_BINDING;
+    return 1;
+}
+
+static inline int rotate_acked(const struct rotate_owner *o, long long now) {
+    return (int32_t)(o->acked - o->epoch) >= 0 || now - o->pushed > o->grace_ns;
+}
+
+/*
+ * Advance a rotation in progress. Returns 1 when one finished in this
+ * call, 0 otherwise, -1 on error.
+ */
+int rotate_owner_poll(struct rotate_owner *o) {
+    struct cq_engine *eng = &o->ib_res->cq_eng;
+    long long now = gfp_get_time();
+    struct wire_region r;
+    struct ibv_mw *mw;
+
+    if (eng->failed[WRID_CLASS_BIND] || eng->failed[WRID_CLASS_INV] ||
+        eng->failed[WRID_CLASS_ROTATE])
+        return -1;
+    switch (o->state) {
+    case ROTATE_QUIESCE:
+        if (!rotate_acked(o, now))
+            return 0;
+        o->expiries += (int32_t)(o->acked - o->epoch) < 0;
+        // The same window, revoked and rebound; the SQ runs them in order
+        mw = o->mws[o->cur];
+        o->next_rkey = ibv_inc_rkey(mw->rkey);
+        if (post_local_inv(o->ib_res, o->qp, mw->rkey, WRID(WRID_CLASS_INV, 0), 0) ||
+            post_bind_mw(o->ib_res, o->qp, mw, o->next_rkey, &o->bind, WRID(WRID_CLASS_BIND, 0), 1))
+            return -1;
+        rotate_expect(o, WRID_CLASS_BIND);
+        o->state = ROTATE_BINDING;
+        return 0;
+    case ROTATE_BINDING:
+        if (rotate_completions(eng, o->wait_cls) < o->wait_count)
+            return 0;
+        if (o->nwin == 2)
+            o->cur ^= 1;
+        o->mws[o->cur]->rkey = o->next_rkey;
+        o->epoch++;
+        rotate_owner_region(o, &r);
+        if (rotate_push(o, &r))
+            return -1;
+        if (o->nwin == 1)
+            break;
+        o->state = ROTATE_SWITCHING;
+        return 0;
+    case ROTATE_SWITCHING:
+        if (!rotate_acked(o, now))
+            return 0;
+        o->expiries += (int32_t)(o->acked - o->epoch) < 0;
+        if (post_local_inv(o->ib_res, o->qp, o->mws[o->cur ^ 1]->rkey, WRID(WRID_CLASS_INV, 0), 1))
+            return -1;
+        rotate_expect(o, WRID_CLASS_INV);
+        o->state = ROTATE_RETIRING;
+        return 0;
+    case ROTATE_RETIRING:
+        if (rotate_completions(eng, o->wait_cls) < o->wait_count)
+            return 0;
+        break;
+    default:
+        return 0;
+    }
+    o->state = ROTATE_IDLE;
+    o->last_ns = gfp_get_time() - o->started;
+    o->rotations++;
+    return 1;
+}
+
+/*
+ * Peer writing into a rotated region first advertised as `region` (epoch
+ * ROTATE_EPOCH_FIRST). Pushes land in `mbox`; acks are zero-length writes
+ * to ack_addr/ack_rkey on the owner.
+ */
+int rotate_peer_init(struct rotate_peer *p, struct ib_res *ib_res, struct ibv_qp *qp,
+                     const uint8_t *mbox, const struct wire_region *region, uint64_t ack_addr,
+                     uint32_t ack_rkey) {
+    memset(p, 0, sizeof(*p));
+    p->ib_res = ib_res;
+    p->qp = qp;
+    p->mbox = mbox;
+    p->ack_addr = ack_addr;
+    p->ack_rkey = ack_rkey;
+    p->region = *region;
+    p->epoch = ROTATE_EPOCH_FIRST;
+    p->pushed = ROTATE_EPOCH_FIRST;
+    return post_zero_recvs_qp(ib_res, qp, ROTATE_RECV_DEPTH);
+}
+
+// RECV CQE on the peer's QP: a push
+void rotate_peer_on_recv(struct rotate_peer *p, const struct ibv_wc *wc) {
+    uint32_t epoch;
+
+    if (wc->status != IBV_WC_SUCCESS || !(wc->wc_flags & IBV_WC_WITH_IMM))
+        return;
+    epoch = ntohl(wc->imm_data);
+    if ((int32_t)(epoch - p->pushed) > 0)
+        p->pushed = epoch;
+    post_zero_recvs_qp(p->ib_res, p->qp, 1);
+}
+
+/*
+ * Switch to the newest pushed descriptor and ack it. Every write under the
+ * old rkey has to be posted before this is called, none may sit in a send
+ * batch. Returns 1 on a switch, 0 if there was none, -1 on error.
+ */
+int rotate_peer_poll(struct rotate_peer *p) {
+    const uint8_t *desc = p->mbox + (p->pushed % ROTATE_MBOX_SLOTS) * ROTATE_DESC_SIZE;
+
+    if (p->pushed == p->epoch)
+        return 0;
+    if (wire_get32(desc) != p->pushed || wire_get32(desc + 4 + WIRE_REGION_SIZE) != p->pushed) {
+        p->torn++;
+        return 0;
+    }
+    wire_get_region(desc + 4, &p->region);
+    p->epoch = p->pushed;
+    p->paused = p->region.length == 0;
+    p->switches++;
+    if (post_write_imm(p->ib_res, p->qp, NULL, NULL, 0, p->ack_addr, p->ack_rkey, p->epoch,
+                       WRID(WRID_CLASS_ROTATE, 0), 1))
+        return -1;
+    return 1;
+}
+
+#endif /* ROTATE_H */
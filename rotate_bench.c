@@ -0,0 +1,362 @@
+#include "gfp.h"
+#include "lat_stats.h"
+#include "rotate.h"
+
+/*
+ * Write traffic across rkey rotations, on one device.
+ *
+ * QP A keeps `-d` RDMA writes of `-l` bytes in flight into a `-w` byte
+ * region owned by QP B. Every `-i` us, B rotates the region's rkey with
+ * rotate.h, once with two windows (double) and once with a single one that
+ * the writer must stop using first (stop). The transport defaults to RC,
+ * so each write completes only once it has landed.
+ *
+ * Completed bytes are counted in `-b` us bins. A bin that overlaps a
+ * rotation counts as a rotation bin; the lowest of those, relative to the
+ * mean of the other bins, is the throughput dip. Write latency is post to
+ * CQE, split by whether the write was posted while a rotation was in
+ * progress.
+ */
+
+#define BENCH_SAMPLES (1 << 22)
+
+enum bench_mode {
+    BENCH_DOUBLE = 0,
+    BENCH_STOP,
+    BENCH_NMODES,
+};
+
+static const char *bench_mode_str(int mode) {
+    static const char *names[BENCH_NMODES] = { "double", "stop" };
+    return names[mode];
+}
+
+struct bench_cfg {
+    long long duration_ns;
+    long long interval_ns;
+    long long bin_ns;
+    long long grace_ns;
+    uint32_t len;
+    uint64_t region_size;
+    uint32_t depth;
+};
+
+struct bench_slot {
+    long long posted;
+    int rotating;
+};
+
+struct bench {
+    struct ib_res *ib_res;
+    struct ibv_qp *qp_owner;
+    struct rotate_owner owner;
+    struct rotate_peer peer;
+    struct ibv_mr *src_mr;
+    const char *src;
+    const struct bench_cfg *cfg;
+    struct bench_slot *slots;
+    uint32_t inflight;
+    uint64_t posted;
+    uint64_t completed;
+    long long start;
+    uint64_t *bin_bytes;
+    uint8_t *bin_rotating;
+    size_t nbins;
+    struct lat_stats steady;
+    struct lat_stats rotating;
+};
+
+static inline size_t bench_bin(const struct bench *b, long long t) {
+    size_t bin = (size_t)((t - b->start) / b->cfg->bin_ns);
+
+    return bin < b->nbins ? bin : b->nbins - 1;
+}
+
+// Acks land on the owner's QP, pushes on the writer's
+static void bench_recv(void *arg, const struct ibv_wc *wc) {
+    struct bench *b = arg;
+
+    if (wc->qp_num == b->qp_owner->qp_num)
+        rotate_owner_on_recv(&b->owner, wc);
+    else
+        rotate_peer_on_recv(&b->peer, wc);
+}
+
+static void bench_send(void *arg, const struct ibv_wc *wc) {
+    struct bench *b = arg;
+    struct bench_slot *slot = &b->slots[WRID_IDX(wc->wr_id)];
+    long long now = gfp_get_time();
+
+    b->inflight--;
+    if (wc->status != IBV_WC_SUCCESS)
+        return;
+    b->completed++;
+    b->bin_bytes[bench_bin(b, now)] += b->cfg->len;
+    lat_stats_add(slot->rotating ? &b->rotating : &b->steady, now - slot->posted);
+}
+
+static int bench_post_write(struct bench *b) {
+    const struct bench_cfg *cfg = b->cfg;
+    uint64_t nslots = b->peer.region.length / cfg->len;
+    uint32_t idx = b->posted % cfg->depth;
+    struct ibv_send_wr wr, *bad_wr;
+    struct ibv_sge sg;
+
+    sg.addr = (uintptr_t)b->src;
+    sg.length = cfg->len;
+    sg.lkey = b->src_mr->lkey;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = WRID(WRID_CLASS_SEND, idx);
+    wr.sg_list = &sg;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.wr.rdma.remote_addr = b->peer.region.addr + b->posted % nslots * cfg->len;
+    wr.wr.rdma.rkey = b->peer.region.rkey;
+    b->slots[idx].posted = gfp_get_time();
+    b->slots[idx].rotating = rotate_owner_busy(&b->owner);
+    if (ib_post_send(b->ib_res, b->ib_res->qp, &wr, &bad_wr)) {
+        perror("ibv_post_send");
+        return -1;
+    }
+    b->inflight++;
+    b->posted++;
+    return 0;
+}
+
+static int bench_step(struct bench *b) {
+    struct cq_engine *eng = &b->ib_res->cq_eng;
+
+    if (cq_engine_poll(eng) < 0 || eng->failed[WRID_CLASS_SEND])
+        return -1;
+    if (rotate_peer_poll(&b->peer) < 0)
+        return -1;
+    return rotate_owner_poll(&b->owner);
+}
+
+static int run_traffic(struct bench *b) {
+    const struct bench_cfg *cfg = b->cfg;
+    long long now, next_rotation, rotation_start = 0, end;
+    long long max_rotation = 0, total_rotation = 0;
+    double steady_bytes = 0, worst = -1, mean;
+    size_t steady_bins = 0;
+    struct lat_summary s_steady, s_rot;
+    int ret;
+
+    b->start = gfp_get_time();
+    end = b->start + cfg->duration_ns;
+    next_rotation = b->start + cfg->interval_ns;
+    for (now = b->start; now < end; now = gfp_get_time()) {
+        while (b->inflight < cfg->depth && !b->peer.paused)
+            if (bench_post_write(b))
+                return -1;
+        if (now >= next_rotation && !rotate_owner_busy(&b->owner)) {
+            if (rotate_owner_begin(&b->owner) < 0)
+                return -1;
+            rotation_start = now;
+            next_rotation += cfg->interval_ns;
+        }
+        ret = bench_step(b);
+        if (ret < 0)
+            return -1;
+        if (ret) {
+            for (size_t i = bench_bin(b, rotation_start); i <= bench_bin(b, now); i++)
+                b->bin_rotating[i] = 1;
+            if (b->owner.last_ns > max_rotation)
+                max_rotation = b->owner.last_ns;
+            total_rotation += b->owner.last_ns;
+        }
+    }
+    // Let a rotation in progress finish, then drain the writes
+    while (rotate_owner_busy(&b->owner) || b->inflight)
+        if (bench_step(b) < 0)
+            return -1;
+
+    // The last bin is cut short by the end of the run
+    for (size_t i = 0; i + 1 < b->nbins; i++) {
+        if (!b->bin_rotating[i]) {
+            steady_bytes += b->bin_bytes[i];
+            steady_bins++;
+        } else if (worst < 0 || b->bin_bytes[i] < worst) {
+            worst = b->bin_bytes[i];
+        }
+    }
+    mean = steady_bins ? steady_bytes / steady_bins : 0;
+    lat_stats_summarize(&b->steady, &s_steady);
+    lat_stats_summarize(&b->rotating, &s_rot);
+    printf("%-6s %5lu %9.1f %9.1f %5lu %9.1f %7.1f %8.2f %8.2f %8.2f %8.2f %8.2f\n",
+           bench_mode_str(b->owner.nwin == 2 ? BENCH_DOUBLE : BENCH_STOP),
+           (unsigned long)b->owner.rotations,
+           b->owner.rotations ? total_rotation / 1e3 / b->owner.rotations : 0.0,
+           max_rotation / 1e3, (unsigned long)b->owner.expiries,
+           b->completed * (double)cfg->len * 1e3 / cfg->duration_ns,
+           worst >= 0 && mean > 0 ? 100.0 * worst / mean : 100.0,
+           s_steady.p50 / 1e3, s_steady.p99 / 1e3, s_rot.p50 / 1e3, s_rot.p99 / 1e3,
+           s_rot.p999 / 1e3);
+    return 0;
+}
+
+static int run_mode(const struct ib_res *res_cfg, const struct bench_cfg *cfg, int mode) {
+    struct ib_res ib_res = *res_cfg;
+    size_t src_size = cfg->len + ROTATE_MBOX_SIZE;
+    struct ibv_mr *src_mr = NULL, *region_mr = NULL, *ack_mr = NULL;
+    struct ibv_qp *qp_owner = NULL;
+    struct wire_region region;
+    struct bench b;
+    char *src = NULL, *region_buf = NULL, ack_buf[64];
+    int ret = -1;
+
+    memset(&b, 0, sizeof(b));
+    b.cfg = cfg;
+    b.ib_res = &ib_res;
+    b.nbins = cfg->duration_ns / cfg->bin_ns + 1;
+    b.slots = calloc(cfg->depth, sizeof(*b.slots));
+    b.bin_bytes = calloc(b.nbins, sizeof(*b.bin_bytes));
+    b.bin_rotating = calloc(b.nbins, 1);
+    src = memalign(getpagesize(), src_size);
+    region_buf = memalign(getpagesize(), cfg->region_size);
+    if (!b.slots || !b.bin_bytes || !b.bin_rotating || !src || !region_buf) {
+        perror("alloc");
+        goto cleanup;
+    }
+    if (lat_stats_init(&b.steady, BENCH_SAMPLES) || lat_stats_init(&b.rotating, BENCH_SAMPLES))
+        goto cleanup;
+    memset(src, 0xa5, src_size);
+    memset(region_buf, 0, cfg->region_size);
+    if (prepare_ib_res(&ib_res)) {
+        perror("prepare_ib_res failed");
+        goto cleanup;
+    }
+    qp_owner = create_qp(&ib_res);
+    if (!qp_owner)
+        goto cleanup;
+    b.qp_owner = qp_owner;
+    // The writer's source data, then its mailbox
+    src_mr = ibv_reg_mr(ib_res.pd, src, src_size, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    region_mr = ibv_reg_mr(ib_res.pd, region_buf, cfg->region_size,
+                           IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_MW_BIND);
+    ack_mr = ibv_reg_mr(ib_res.pd, ack_buf, sizeof(ack_buf),
+                        IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    if (!src_mr || !region_mr || !ack_mr) {
+        perror("ibv_reg_mr");
+        goto cleanup;
+    }
+    b.src_mr = src_mr;
+    b.src = src;
+    if (connect_qp_pair(&ib_res, ib_res.qp, &ib_res, qp_owner))
+        goto cleanup;
+
+    cq_engine_register(&ib_res.cq_eng, WRID_CLASS_RECV, bench_recv, &b);
+    cq_engine_register(&ib_res.cq_eng, WRID_CLASS_SEND, bench_send, &b);
+    if (rotate_owner_init(&b.owner, &ib_res, qp_owner, region_mr, (uintptr_t)region_buf,
+                          cfg->region_size, IBV_ACCESS_REMOTE_WRITE,
+                          mode == BENCH_DOUBLE ? 2 : 1, cfg->grace_ns,
+                          (uintptr_t)src + cfg->len, src_mr->rkey))
+        goto cleanup;
+    rotate_owner_region(&b.owner, &region);
+    if (rotate_peer_init(&b.peer, &ib_res, ib_res.qp, (uint8_t *)src + cfg->len, &region,
+                         (uintptr_t)ack_buf, ack_mr->rkey))
+        goto cleanup;
+    ret = run_traffic(&b);
+
+cleanup:
+    rotate_owner_destroy(&b.owner);
+    lat_stats_free(&b.steady);
+    lat_stats_free(&b.rotating);
+    if (src_mr) ibv_dereg_mr(src_mr);
+    if (region_mr) ibv_dereg_mr(region_mr);
+    if (ack_mr) ibv_dereg_mr(ack_mr);
+    if (qp_owner)
+        ibv_destroy_qp(qp_owner);
+    free_ib_res(&ib_res);
+    free(b.slots);
+    free(b.bin_bytes);
+    free(b.bin_rotating);
+    free(src);
+    free(region_buf);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    struct ib_res res_cfg;
+    struct bench_cfg cfg = {
+        .duration_ns = 2000000000LL,
+        .interval_ns = 100000000LL,
+        .bin_ns = 1000000LL,
+        .grace_ns = ROTATE_GRACE_NS,
+        .len = 4096,
+        .region_size = 1 << 20,
+        .depth = 32,
+    };
+    int only_mode = -1;
+    int opt;
+
+    memset(&res_cfg, 0, sizeof(res_cfg));
+    res_cfg.qp_type = IBV_QPT_RC;
+    while ((opt = getopt(argc, argv, "r:i:b:g:l:w:d:f:" IB_OPTSTRING)) != -1) {
+        switch (opt) {
+        case 'r':
+            cfg.duration_ns = strtoll(optarg, NULL, 0) * 1000000LL;
+            break;
+        case 'i':
+            cfg.interval_ns = strtoll(optarg, NULL, 0) * 1000LL;
+            break;
+        case 'b':
+            cfg.bin_ns = strtoll(optarg, NULL, 0) * 1000LL;
+            break;
+        case 'g':
+            cfg.grace_ns = strtoll(optarg, NULL, 0) * 1000LL;
+            break;
+        case 'l':
+            cfg.len = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            cfg.region_size = strtoull(optarg, NULL, 0);
+            break;
+        case 'd':
+            cfg.depth = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            for (only_mode = 0; only_mode < BENCH_NMODES; only_mode++)
+                if (strcmp(optarg, bench_mode_str(only_mode)) == 0)
+                    break;
+            if (only_mode == BENCH_NMODES)
+                goto usage;
+            break;
+        default:
+            if (parse_ib_opt(&res_cfg, opt, optarg))
+                goto usage;
+        }
+    }
+    if (cfg.duration_ns <= 0 || cfg.interval_ns <= 0 || cfg.bin_ns <= 0 || cfg.len < 1 ||
+        cfg.region_size < cfg.len || cfg.depth < 1 ||
+        cfg.depth + 2 * ROTATE_RECV_DEPTH > MAX_SEND_WR) {
+        fprintf(stderr, "need positive times, 1 <= len <= region size and depth in [1, %d]\n",
+                MAX_SEND_WR - 2 * ROTATE_RECV_DEPTH);
+        return -1;
+    }
+    // Pushes and acks must not take each other's receives
+    res_cfg.srq_depth = 0;
+
+    printf("%u B writes, depth %u, into %lu B, rotating every %lld us, %s\n", cfg.len, cfg.depth,
+           (unsigned long)cfg.region_size, cfg.interval_ns / 1000,
+           res_cfg.qp_type == IBV_QPT_RC ? "rc" : "uc");
+    printf("%-6s %5s %9s %9s %5s %9s %7s %8s %8s %8s %8s %8s\n", "mode", "rots", "rot_us",
+           "rot_max", "exp", "MB/s", "dip_%", "p50_us", "p99_us", "rp50_us", "rp99_us",
+           "rp999_us");
+    for (int mode = 0; mode < BENCH_NMODES; mode++) {
+        if (only_mode >= 0 && mode != only_mode)
+            continue;
+        if (run_mode(&res_cfg, &cfg, mode)) {
+            fprintf(stderr, "%s run failed\n", bench_mode_str(mode));
+            return -1;
+        }
+    }
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: %s [-r duration_ms] [-i rotate_every_us] [-b bin_us] [-g grace_us] "
+            "[-l write_len] [-w region_size] [-d depth] [-f double|stop] %s\n",
+            argv[0], IB_OPTUSAGE);
+    return -1;
+}
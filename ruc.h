@@ -0,0 +1,483 @@
+#ifndef RUC_H
+#define RUC_H
+
+#include "gfp.h"
+#include "sq_batch.h"
+
+/*
+ * Reliable delivery over UC write-with-imm.
+ *
+ * UC drops a write that loses any of its packets and tells nobody. This
+ * layer numbers the messages of a flow and repairs losses in software, so
+ * the QP keeps UC's small responder state.
+ *
+ * Message k of flow f is copied into slot k % window of the sender's
+ * registered ring and written to slot k % window of the receiver's window.
+ * Its immediate is RUC_IMM(f, k): 8 bits of flow and the low 24 bits of k,
+ * which the receiver widens against the sequence it expects next.
+ *
+ * The receiver answers with feedback records of RUC_FB_SIZE bytes, written
+ * inline into the sender's ring of RUC_FB_SLOTS feedback slots:
+ *
+ *   seq u32 | cum u32 | limit u32 | nak u64 | seq u32      (big-endian)
+ *
+ * cum is the cumulative ACK: every message below it has arrived. Bit i of
+ * nak is a selective NAK for message cum + i, set when a later message has
+ * arrived; UC never reorders on a QP, so the missing one was lost. limit is
+ * one past the last message the sender may write, because the application
+ * has released the slots below it. A record goes out when ack_every more
+ * messages have completed in order, on a new gap, on a duplicate, once half
+ * the window has been released, and ack_delay after an arrival otherwise.
+ * Records are cumulative, so the next one repairs a lost one. The sender
+ * drops a record whose two seq copies differ: it was overwritten while
+ * being read.
+ *
+ * The sender retransmits from its ring. A NAKed message goes out again at
+ * once, at most once per smoothed RTT. The oldest unacknowledged message
+ * goes out when the retransmit timer expires. The timer follows RFC 6298:
+ * srtt + 4 * rttvar, sampled only from messages sent once (Karn's rule),
+ * clamped to [rto_min, rto_max] and doubled on each expiry until the next
+ * sample.
+ *
+ * CQE handlers only record what arrived. Posting happens in
+ * ruc_tx_poll()/ruc_rx_poll(), which the application calls after polling
+ * the CQ, so no handler posts or waits from inside the CQ engine.
+ */
+
+#define RUC_FB_SIZE 24
+#define RUC_FB_SLOTS 64
+#define RUC_FB_DEPTH 64             /* feedback writes in the receiver's SQ */
+#define RUC_WINDOW_MAX (1u << 22)   /* well inside the 24-bit immediate */
+#define RUC_RECV_SLACK 32           /* receives beyond the window, for retransmits */
+#define RUC_RTO_INIT_NS 1000000LL
+#define RUC_RTO_MIN_NS 200000LL
+#define RUC_RTO_MAX_NS 200000000LL
+#define RUC_ACK_DELAY_NS 20000LL
+#define RUC_IMM(flow, seq) ((uint32_t)(flow) << 24 | ((seq) & 0xffffff))
+#define RUC_IMM_FLOW(imm) ((imm) >> 24)
+#define RUC_IMM_SEQ(imm) ((imm) & 0xffffff)
+
+struct ruc_entry {
+    uint32_t len;
+    uint32_t sends;             /* 1 + retransmissions */
+    long long sent_ns;          /* last (re)transmission */
+};
+
+struct ruc_tx {
+    struct ib_res *ib_res;
+    struct ibv_qp *qp;
+    struct sq_batch sq;
+    struct ibv_mr *mr;
+    char *ring;                 /* window x slot_size inside mr */
+    const uint8_t *fb;          /* RUC_FB_SLOTS x RUC_FB_SIZE, remote writable */
+    uint64_t remote_addr;
+    uint32_t rkey;
+    uint8_t flow;
+    uint32_t window;
+    size_t slot_size;
+    uint32_t una;               /* oldest unacknowledged message */
+    uint32_t next;              /* next new message */
+    uint32_t limit;
+    uint32_t fb_seq;            /* newest feedback applied */
+    uint64_t nak;               /* NAKs of the newest feedback, relative to una */
+    struct ruc_entry *entries;
+    long long srtt;
+    long long rttvar;
+    long long rto;
+    long long rto_min;
+    long long rto_max;
+    long long timer;            /* when the retransmit timer was armed, 0: idle */
+    uint64_t retransmits;
+    uint64_t timeouts;
+    uint64_t naks;
+    uint64_t feedbacks;
+    uint64_t torn;
+    uint64_t rtt_samples;
+};
+
+struct ruc_rx {
+    struct ib_res *ib_res;
+    struct ibv_qp *qp;
+    char *slots;
+    uint8_t flow;
+    uint32_t window;
+    size_t slot_size;
+    uint64_t fb_addr;
+    uint32_t fb_rkey;
+    uint32_t expected;          /* cumulative ACK: next in-order message */
+    uint32_t highest;           /* one past the newest arrival */
+    uint32_t consumed;          /* released by the application */
+    uint32_t acked;             /* cum of the last feedback */
+    uint32_t limit_sent;
+    uint32_t ack_every;
+    long long ack_delay;
+    long long ack_due;          /* oldest unacknowledged arrival, 0: none */
+    int need_fb;
+    uint32_t fb_seq;
+    uint8_t *have;              /* per slot: message arrived and not released */
+    uint32_t *lens;
+    uint64_t feedbacks;
+    uint64_t fb_base;
+    uint64_t dups;
+    uint64_t out_of_order;
+};
+
+/*
+ * Sender of flow `flow` on `qp`. Messages are staged in `ring` (window x
+ * slot_size bytes inside `mr`) and written to the receiver's window at
+ * remote_addr/rkey. Feedback lands in `fb` (RUC_FB_SLOTS x RUC_FB_SIZE bytes
+ * inside `mr`, which needs remote write). WRs go through a send queue
+ * batcher (WRID_CLASS_SEND).
+ */
+int ruc_tx_init(struct ruc_tx *tx, struct ib_res *ib_res, struct ibv_qp *qp, struct ibv_mr *mr,
+                char *ring, const uint8_t *fb, uint64_t remote_addr, uint32_t rkey, uint8_t flow,
+                uint32_t window, size_t slot_size, int batch, int signal_every) {
+    memset(tx, 0, sizeof(*tx));
+    if (window < 1 || window > RUC_WINDOW_MAX) {
+        fprintf(stderr, "ruc: window must be in [1, %u]\n", RUC_WINDOW_MAX);
+        return -1;
+    }
+    tx->entries = calloc(window, sizeof(*tx->entries));
+    if (!tx->entries) {
+        perror("calloc");
+        return -1;
+    }
+    tx->ib_res = ib_res;
+    tx->qp = qp;
+    tx->mr = mr;
+    tx->ring = ring;
+    tx->fb = fb;
+    tx->remote_addr = remote_addr;
+    tx->rkey = rkey;
+    tx->flow = flow;
+    tx->window = window;
+    tx->slot_size = slot_size;
+    tx->limit = window;
+    tx->rto = RUC_RTO_INIT_NS;
+    tx->rto_min = RUC_RTO_MIN_NS;
+    tx->rto_max = RUC_RTO_MAX_NS;
+    if (sq_batch_init(&tx->sq, ib_res, qp, WRID_CLASS_SEND, batch, signal_every, MAX_SEND_WR))
+        return -1;
+    return post_zero_recvs_qp(ib_res, qp, RUC_FB_SLOTS);
+}
+
+void ruc_tx_free(struct ruc_tx *tx) {
+    sq_batch_release(&tx->sq);
+    free(tx->entries);
+    tx->entries = NULL;
+}
+
+static inline int ruc_tx_done(const struct ruc_tx *tx) {
+    return tx->una == tx->next;
+}
+
+// Queue message `seq` from its ring slot
+static int ruc_tx_write(struct ruc_tx *tx, uint32_t seq, long long now) {
+    struct ruc_entry *e = &tx->entries[seq % tx->window];
+    char *slot = tx->ring + (size_t)(seq % tx->window) * tx->slot_size;
+    struct ibv_send_wr wr;
+    struct ibv_sge sg;
+
+    sg.addr = (uintptr_t)slot;
+    sg.length = e->len;
+    sg.lkey = tx->mr->lkey;
+    memset(&wr, 0, sizeof(wr));
+    wr.sg_list = &sg;
+    wr.num_sge = e->len ? 1 : 0;
+    wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+    wr.imm_data = htonl(RUC_IMM(tx->flow, seq));
+    wr.send_flags = e->len && e->len <= tx->ib_res->max_inline ? IBV_SEND_INLINE : 0;
+    wr.wr.rdma.remote_addr = tx->remote_addr + (uint64_t)(seq % tx->window) * tx->slot_size;
+    wr.wr.rdma.rkey = tx->rkey;
+    if (sq_batch_add(&tx->sq, &wr))
+        return -1;
+    e->sends++;
+    e->sent_ns = now;
+    if (!tx->timer)
+        tx->timer = now;
+    return 0;
+}
+
+/*
+ * Queue one message of `len` <= slot_size bytes, copied into the ring.
+ * Returns 1 if queued, 0 if the window or the receiver's limit is full
+ * (everything queued has been flushed), -1 on error.
+ */
+int ruc_tx_post(struct ruc_tx *tx, const void *buf, size_t len) {
+    struct ruc_entry *e;
+
+    if (len > tx->slot_size) {
+        fprintf(stderr, "ruc: %zu byte message exceeds %zu byte slots\n", len, tx->slot_size);
+        return -1;
+    }
+    if (tx->next - tx->una >= tx->window || (int32_t)(tx->limit - tx->next) <= 0)
+        return sq_batch_flush(&tx->sq) ? -1 : 0;
+    e = &tx->entries[tx->next % tx->window];
+    memcpy(tx->ring + (size_t)(tx->next % tx->window) * tx->slot_size, buf, len);
+    e->len = len;
+    e->sends = 0;
+    if (ruc_tx_write(tx, tx->next, gfp_get_time()))
+        return -1;
+    tx->next++;
+    return 1;
+}
+
+// RFC 6298 estimator, `r` is one RTT sample in ns
+static void ruc_tx_rtt(struct ruc_tx *tx, long long r) {
+    if (!tx->rtt_samples++) {
+        tx->srtt = r;
+        tx->rttvar = r / 2;
+    } else {
+        long long err = tx->srtt > r ? tx->srtt - r : r - tx->srtt;
+
+        tx->rttvar = (3 * tx->rttvar + err) / 4;
+        tx->srtt = (7 * tx->srtt + r) / 8;
+    }
+    tx->rto = tx->srtt + 4 * tx->rttvar;
+    if (tx->rto < tx->rto_min)
+        tx->rto = tx->rto_min;
+    if (tx->rto > tx->rto_max)
+        tx->rto = tx->rto_max;
+}
+
+// RECV CQE on the sender's QP: a feedback record
+void ruc_tx_on_recv(struct ruc_tx *tx, const struct ibv_wc *wc) {
+    uint32_t imm = ntohl(wc->imm_data);
+    const uint8_t *p;
+    uint32_t seq, cum, limit;
+
+    if (wc->status != IBV_WC_SUCCESS)
+        return;
+    post_zero_recvs_qp(tx->ib_res, tx->qp, 1);
+    if (!(wc->wc_flags & IBV_WC_WITH_IMM) || RUC_IMM_FLOW(imm) != tx->flow)
+        return;
+    p = tx->fb + (RUC_IMM_SEQ(imm) % RUC_FB_SLOTS) * RUC_FB_SIZE;
+    seq = wire_get32(p);
+    if (seq != wire_get32(p + 20)) {
+        tx->torn++;
+        return;
+    }
+    // A later record may already have been applied through an overwritten slot
+    if ((int32_t)(seq - tx->fb_seq) <= 0)
+        return;
+    tx->fb_seq = seq;
+    tx->feedbacks++;
+    cum = wire_get32(p + 4);
+    limit = wire_get32(p + 8);
+    if ((int32_t)(cum - tx->una) > 0 && (int32_t)(tx->next - cum) >= 0) {
+        struct ruc_entry *e = &tx->entries[(cum - 1) % tx->window];
+        long long now = gfp_get_time();
+
+        if (e->sends == 1)
+            ruc_tx_rtt(tx, now - e->sent_ns);
+        tx->una = cum;
+        tx->timer = tx->una == tx->next ? 0 : now;
+    }
+    if ((int32_t)(limit - tx->limit) > 0)
+        tx->limit = limit;
+    // The NAK bitmap is relative to cum, which is una now unless it is stale
+    tx->nak = cum == tx->una ? wire_get64(p + 12) : 0;
+    tx->naks += __builtin_popcountll(tx->nak);
+}
+
+/*
+ * Retransmit what the newest feedback NAKed and what the timer says is
+ * overdue. Call after every CQ poll. Returns 0 or -1.
+ */
+int ruc_tx_poll(struct ruc_tx *tx) {
+    long long now = gfp_get_time();
+    uint64_t nak = tx->nak;
+    uint32_t base = tx->una;
+    int queued = 0;
+
+    // Posting can reap CQEs and apply newer feedback, so work on a snapshot
+    tx->nak = 0;
+    for (int i = 0; nak && i < 64; i++) {
+        uint32_t seq = base + i;
+        struct ruc_entry *e;
+
+        if (!(nak & (1ULL << i)))
+            continue;
+        if ((int32_t)(tx->next - seq) <= 0)
+            break;
+        if ((int32_t)(seq - tx->una) < 0)
+            continue;
+        e = &tx->entries[seq % tx->window];
+        // A retransmission less than an RTT old may still be on its way
+        if (e->sends > 1 && now - e->sent_ns < tx->srtt)
+            continue;
+        if (ruc_tx_write(tx, seq, now))
+            return -1;
+        tx->retransmits++;
+        queued = 1;
+    }
+    if (tx->timer && now - tx->timer >= tx->rto) {
+        if (ruc_tx_write(tx, tx->una, now))
+            return -1;
+        tx->retransmits++;
+        tx->timeouts++;
+        tx->timer = now;
+        tx->rto = tx->rto * 2 > tx->rto_max ? tx->rto_max : tx->rto * 2;
+        queued = 1;
+    }
+    return queued ? sq_batch_flush(&tx->sq) : 0;
+}
+
+// Push out anything queued and wait until the send queue is empty
+int ruc_tx_drain(struct ruc_tx *tx) {
+    return sq_batch_drain(&tx->sq);
+}
+
+/*
+ * Receiver of flow `flow` on `qp` over window x slot_size bytes at `slots`.
+ * Feedback is written inline to the sender's slots at fb_addr/fb_rkey,
+ * once ack_every messages complete in order or ack_delay after the oldest
+ * unacknowledged arrival. The QP needs RUC_FB_SIZE bytes of inline space
+ * and its own RQ.
+ */
+int ruc_rx_init(struct ruc_rx *rx, struct ib_res *ib_res, struct ibv_qp *qp, char *slots,
+                uint8_t flow, uint32_t window, size_t slot_size, uint64_t fb_addr,
+                uint32_t fb_rkey, uint32_t ack_every, long long ack_delay) {
+    memset(rx, 0, sizeof(*rx));
+    if (window < 1 || window + RUC_RECV_SLACK > MAX_RECV_WR || ack_every < 1 ||
+        ack_every > window) {
+        fprintf(stderr, "ruc: need window <= %d and 1 <= ack_every <= window\n",
+                MAX_RECV_WR - RUC_RECV_SLACK);
+        return -1;
+    }
+    if (ib_res->srq.srq || ib_res->max_inline < RUC_FB_SIZE) {
+        fprintf(stderr, "ruc: receiver needs its own RQ and %d bytes of inline data\n",
+                RUC_FB_SIZE);
+        return -1;
+    }
+    rx->have = calloc(window, sizeof(*rx->have));
+    rx->lens = calloc(window, sizeof(*rx->lens));
+    if (!rx->have || !rx->lens) {
+        perror("calloc");
+        return -1;
+    }
+    rx->ib_res = ib_res;
+    rx->qp = qp;
+    rx->slots = slots;
+    rx->flow = flow;
+    rx->window = window;
+    rx->slot_size = slot_size;
+    rx->fb_addr = fb_addr;
+    rx->fb_rkey = fb_rkey;
+    rx->limit_sent = window;
+    rx->ack_every = ack_every;
+    rx->ack_delay = ack_delay;
+    rx->fb_base = ib_res->cq_eng.done[WRID_CLASS_ACK] + ib_res->cq_eng.failed[WRID_CLASS_ACK];
+    return post_zero_recvs_qp(ib_res, qp, window + RUC_RECV_SLACK);
+}
+
+void ruc_rx_free(struct ruc_rx *rx) {
+    free(rx->have);
+    free(rx->lens);
+    rx->have = NULL;
+    rx->lens = NULL;
+}
+
+// RECV CQE on the receiver's QP: a message or a retransmission of one
+void ruc_rx_on_recv(struct ruc_rx *rx, const struct ibv_wc *wc) {
+    uint32_t imm = ntohl(wc->imm_data), seq, idx;
+    int32_t d;
+
+    if (wc->status != IBV_WC_SUCCESS)
+        return;
+    // Every arrival uses up a receive, duplicates included
+    post_zero_recvs_qp(rx->ib_res, rx->qp, 1);
+    if (!(wc->wc_flags & IBV_WC_WITH_IMM) || RUC_IMM_FLOW(imm) != rx->flow)
+        return;
+    // Sign-extend the 24-bit distance from the expected sequence
+    d = (int32_t)((RUC_IMM_SEQ(imm) - rx->expected) << 8) >> 8;
+    seq = rx->expected + d;
+    idx = seq % rx->window;
+    if (d < 0 || seq - rx->consumed >= rx->window || rx->have[idx]) {
+        // Our feedback got lost or came too late: repeat it
+        rx->dups++;
+        rx->need_fb = 1;
+        return;
+    }
+    rx->have[idx] = 1;
+    rx->lens[idx] = wc->byte_len;
+    if (d == 0) {
+        while (rx->expected - rx->consumed < rx->window && rx->have[rx->expected % rx->window])
+            rx->expected++;
+        if (!rx->ack_due)
+            rx->ack_due = gfp_get_time();
+        if (rx->expected - rx->acked >= rx->ack_every)
+            rx->need_fb = 1;
+    } else {
+        rx->out_of_order++;
+        // Messages in [highest, seq) just went missing
+        if ((int32_t)(seq - rx->highest) > 0)
+            rx->need_fb = 1;
+    }
+    if ((int32_t)(seq + 1 - rx->highest) > 0)
+        rx->highest = seq + 1;
+}
+
+static int ruc_rx_feedback(struct ruc_rx *rx) {
+    struct cq_engine *eng = &rx->ib_res->cq_eng;
+    uint8_t rec[RUC_FB_SIZE];
+    uint64_t nak = 0;
+    uint32_t seq;
+
+    // Feedback is signaled; skip a round rather than wait inside the poll loop
+    if (rx->feedbacks - (eng->done[WRID_CLASS_ACK] + eng->failed[WRID_CLASS_ACK] - rx->fb_base) >=
+        RUC_FB_DEPTH)
+        return 0;
+    for (uint32_t i = 0; i < 64 && (int32_t)(rx->highest - (rx->expected + i)) > 0; i++)
+        if (!rx->have[(rx->expected + i) % rx->window])
+            nak |= 1ULL << i;
+    seq = ++rx->fb_seq;
+    wire_put32(rec, seq);
+    wire_put32(rec + 4, rx->expected);
+    wire_put32(rec + 8, rx->consumed + rx->window);
+    wire_put64(rec + 12, nak);
+    wire_put32(rec + 20, seq);
+    if (post_write_imm(rx->ib_res, rx->qp, NULL, rec, RUC_FB_SIZE,
+                       rx->fb_addr + (seq % RUC_FB_SLOTS) * RUC_FB_SIZE, rx->fb_rkey,
+                       RUC_IMM(rx->flow, seq), WRID(WRID_CLASS_ACK, 0), 1))
+        return -1;
+    rx->feedbacks++;
+    rx->acked = rx->expected;
+    rx->limit_sent = rx->consumed + rx->window;
+    rx->ack_due = 0;
+    rx->need_fb = 0;
+    return 0;
+}
+
+// Send the feedback that arrivals and releases called for. Call after every CQ poll.
+int ruc_rx_poll(struct ruc_rx *rx) {
+    if (!rx->need_fb && !(rx->ack_due && gfp_get_time() - rx->ack_due >= rx->ack_delay))
+        return 0;
+    return ruc_rx_feedback(rx);
+}
+
+// Messages delivered in order and not released yet
+static inline uint32_t ruc_rx_pending(const struct ruc_rx *rx) {
+    return rx->expected - rx->consumed;
+}
+
+// The i-th pending message and its length
+static inline char *ruc_rx_slot(const struct ruc_rx *rx, uint32_t i, uint32_t *len) {
+    uint32_t idx = (rx->consumed + i) % rx->window;
+
+    *len = rx->lens[idx];
+    return rx->slots + (size_t)idx * rx->slot_size;
+}
+
+// The application is done with the oldest `n` pending messages
+void ruc_rx_release(struct ruc_rx *rx, uint32_t n) {
+    if (n > ruc_rx_pending(rx))
+        n = ruc_rx_pending(rx);
+    for (uint32_t i = 0; i < n; i++)
+        rx->have[(rx->consumed + i) % rx->window] = 0;
+    rx->consumed += n;
+    if (rx->consumed + rx->window - rx->limit_sent >= rx->window / 2)
+        rx->need_fb = 1;
+}
+
+#endif /* RUC_H */
@@ -0,0 +1,355 @@
+#include "gfp.h"
+#include "lat_stats.h"
+#include "sq_batch.h"
+#include "credit.h"
+#include "ruc.h"
+
+/*
+ * Reliable-UC goodput benchmark.
+ *
+ * QP A streams `-n` messages of `-l` bytes into QP B's `-w` slots through
+ * one of three stacks (-f picks just one):
+ *
+ *   uc  - UC with credit flow control only: lost messages stay lost;
+ *   ruc - UC with the software reliability layer of ruc.h;
+ *   rc  - RC with credit flow control, the HCA retransmits.
+ *
+ * Without `-P`, A and B live on the same device. With `-P <ib_dev>`, B is
+ * opened on a second device, so traffic crosses the wire between the two.
+ * Soft-RoCE on a veth pair with netem on the link gives controlled loss,
+ * see scripts/ruc_netem.sh. Loopback inside one device never loses a
+ * packet.
+ *
+ * The receiver consumes every message as soon as it is delivered. Reported
+ * are delivered and lost messages, goodput, retransmissions (timer-driven
+ * ones separately) and the final smoothed RTT and RTO of the ruc sender.
+ */
+
+#define BENCH_IDLE_NS 200000000LL     /* uc/rc: no arrival for this long ends a run */
+#define BENCH_STALL_NS 10000000000LL  /* ruc: no delivery for this long fails it */
+
+enum bench_mode {
+    BENCH_UC = 0,
+    BENCH_RUC,
+    BENCH_RC,
+    BENCH_NMODES,
+};
+
+static const char *bench_mode_str(int mode) {
+    static const char *names[BENCH_NMODES] = { "uc", "ruc", "rc" };
+    return names[mode];
+}
+
+struct bench_cfg {
+    uint64_t msgs;
+    uint32_t len;
+    uint32_t window;
+    uint32_t ack_every;
+    int batch;
+    int signal_every;
+    const char *peer_dev;
+};
+
+struct bench {
+    int mode;
+    struct ibv_qp *qp_a;
+    struct credit_tx ctx;
+    struct credit_rx crx;
+    struct ruc_tx rtx;
+    struct ruc_rx rrx;
+    long long last_arrival;
+    uint64_t checksum;
+};
+
+// Receives of both QPs land in the RECV class; the QP tells feedback from data
+static void bench_recv(void *arg, const struct ibv_wc *wc) {
+    struct bench *b = arg;
+
+    if (wc->qp_num == b->qp_a->qp_num) {
+        if (b->mode == BENCH_RUC)
+            ruc_tx_on_recv(&b->rtx, wc);
+        else
+            credit_tx_on_recv(&b->ctx, wc);
+        return;
+    }
+    if (b->mode == BENCH_RUC)
+        ruc_rx_on_recv(&b->rrx, wc);
+    else
+        credit_rx_on_recv(&b->crx, wc);
+    b->last_arrival = gfp_get_time();
+}
+
+static uint64_t bench_delivered(const struct bench *b) {
+    return b->mode == BENCH_RUC ? b->rrx.consumed : b->crx.consumed;
+}
+
+// Consume everything delivered so far
+static int bench_consume(struct bench *b) {
+    uint32_t len;
+
+    if (b->mode == BENCH_RUC) {
+        uint32_t n = ruc_rx_pending(&b->rrx);
+
+        for (uint32_t i = 0; i < n; i++)
+            b->checksum += (uint8_t)ruc_rx_slot(&b->rrx, i, &len)[0] + len;
+        ruc_rx_release(&b->rrx, n);
+        return 0;
+    }
+    for (uint32_t i = 0; i < credit_rx_pending(&b->crx); i++)
+        b->checksum += (uint8_t)credit_rx_slot(&b->crx, i, &len)[0] + len;
+    return credit_rx_release(&b->crx, credit_rx_pending(&b->crx));
+}
+
+static int bench_post(struct bench *b, const char *src, uint32_t len) {
+    return b->mode == BENCH_RUC ? ruc_tx_post(&b->rtx, src, len) :
+           credit_tx_post(&b->ctx, src, len);
+}
+
+static int bench_poll(struct ib_res *ra, struct ib_res *rb) {
+    if (cq_engine_poll(&ra->cq_eng) < 0 || ra->cq_eng.failed[WRID_CLASS_SEND])
+        return -1;
+    if (rb != ra && cq_engine_poll(&rb->cq_eng) < 0)
+        return -1;
+    return rb->cq_eng.failed[WRID_CLASS_CREDIT] || rb->cq_eng.failed[WRID_CLASS_ACK] ? -1 : 0;
+}
+
+static int run_stream(struct ib_res *ra, struct ib_res *rb, struct bench *b,
+                      const struct bench_cfg *cfg, const char *src) {
+    long long start_time = gfp_get_time(), last_delivery = start_time, now, elapsed;
+    uint64_t sent = 0, delivered = 0;
+    int flushed = 0;
+
+    b->last_arrival = start_time;
+    for (;;) {
+        if (bench_consume(b))
+            return -1;
+        while (sent < cfg->msgs) {
+            int ret = bench_post(b, src, cfg->len);
+
+            if (ret < 0)
+                return -1;
+            if (ret == 0)
+                break;
+            sent++;
+        }
+        if (sent == cfg->msgs && !flushed) {
+            if (sq_batch_flush(b->mode == BENCH_RUC ? &b->rtx.sq : &b->ctx.sq))
+                return -1;
+            flushed = 1;
+        }
+        if (bench_poll(ra, rb))
+            return -1;
+        now = gfp_get_time();
+        if (b->mode == BENCH_RUC) {
+            if (ruc_rx_poll(&b->rrx) || ruc_tx_poll(&b->rtx))
+                return -1;
+            if (bench_delivered(b) != delivered) {
+                delivered = bench_delivered(b);
+                last_delivery = now;
+            }
+            if (delivered == cfg->msgs)
+                break;
+            if (now - last_delivery > BENCH_STALL_NS) {
+                fprintf(stderr, "ruc stream stalled at %lu of %lu messages\n",
+                        (unsigned long)delivered, (unsigned long)cfg->msgs);
+                return -1;
+            }
+            continue;
+        }
+        if (credit_rx_pending(&b->crx))
+            continue;
+        // Everything arrived, or the rest was lost and nothing more is coming
+        if (b->crx.next == cfg->msgs && sent == cfg->msgs)
+            break;
+        if (now - b->last_arrival > BENCH_IDLE_NS) {
+            if (sent < cfg->msgs)
+                fprintf(stderr, "%s stream stalled after %lu messages\n", bench_mode_str(b->mode),
+                        (unsigned long)sent);
+            break;
+        }
+    }
+    elapsed = b->last_arrival - start_time;
+    if (elapsed <= 0)
+        elapsed = 1;
+    delivered = bench_delivered(b);
+    if (b->mode == BENCH_RUC ? ruc_tx_drain(&b->rtx) : credit_tx_drain(&b->ctx))
+        return -1;
+    printf("%-4s %10lu %10lu %10lu %10.1f %10lu %8lu %9.1f %9.1f\n", bench_mode_str(b->mode),
+           (unsigned long)sent, (unsigned long)delivered, (unsigned long)(sent - delivered),
+           delivered * (double)cfg->len * 1e3 / elapsed, (unsigned long)b->rtx.retransmits,
+           (unsigned long)b->rtx.timeouts, b->rtx.srtt / 1e3, b->rtx.rto / 1e3);
+    return 0;
+}
+
+static int run_mode(const struct ib_res *res_cfg, const struct bench_cfg *cfg, int mode) {
+    struct ib_res ra = *res_cfg, rb_own = *res_cfg, *rb = &ra;
+    size_t ring_size = (size_t)cfg->window * cfg->len;
+    size_t a_size = ring_size + RUC_FB_SLOTS * RUC_FB_SIZE;
+    struct ibv_mr *mr_a = NULL, *mr_b = NULL;
+    struct ibv_qp *qp_b = NULL;
+    struct bench b;
+    char *buf_a, *buf_b = NULL;
+    int ret = -1;
+
+    memset(&b, 0, sizeof(b));
+    b.mode = mode;
+    ra.qp_type = mode == BENCH_RC ? IBV_QPT_RC : IBV_QPT_UC;
+    rb_own.qp_type = ra.qp_type;
+    rb_own.dev_name = cfg->peer_dev;
+    buf_a = memalign(getpagesize(), a_size);
+    if (!buf_a) {
+        perror("memalign");
+        return -1;
+    }
+    memset(buf_a, 0xa5, a_size);
+    if (prepare_ib_res(&ra)) {
+        perror("prepare_ib_res failed");
+        goto cleanup;
+    }
+    if (cfg->peer_dev) {
+        rb = &rb_own;
+        if (prepare_ib_res(rb)) {
+            perror("prepare_ib_res failed");
+            rb = &ra;
+            goto cleanup;
+        }
+        qp_b = rb->qp;
+    } else {
+        qp_b = create_qp(&ra);
+        if (!qp_b)
+            goto cleanup;
+    }
+    buf_b = memalign(getpagesize(), ring_size);
+    if (!buf_b) {
+        perror("memalign");
+        goto cleanup;
+    }
+    memset(buf_b, 0, ring_size);
+    mr_a = ibv_reg_mr(ra.pd, buf_a, a_size, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    mr_b = ibv_reg_mr(rb->pd, buf_b, ring_size, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    if (!mr_a || !mr_b) {
+        perror("ibv_reg_mr");
+        goto cleanup;
+    }
+    b.qp_a = ra.qp;
+    if (connect_qp_pair(&ra, ra.qp, rb, qp_b))
+        goto cleanup;
+
+    cq_engine_register(&ra.cq_eng, WRID_CLASS_RECV, bench_recv, &b);
+    cq_engine_register(&rb->cq_eng, WRID_CLASS_RECV, bench_recv, &b);
+    if (mode == BENCH_RUC) {
+        if (ruc_rx_init(&b.rrx, rb, qp_b, buf_b, 0, cfg->window, cfg->len,
+                        (uintptr_t)buf_a + ring_size, mr_a->rkey, cfg->ack_every,
+                        RUC_ACK_DELAY_NS) ||
+            ruc_tx_init(&b.rtx, &ra, ra.qp, mr_a, buf_a, (uint8_t *)buf_a + ring_size,
+                        (uintptr_t)buf_b, mr_b->rkey, 0, cfg->window, cfg->len, cfg->batch,
+                        cfg->signal_every))
+            goto cleanup;
+    } else {
+        if (credit_rx_init(&b.crx, rb, qp_b, buf_b, cfg->window, cfg->len, cfg->ack_every,
+                           (uintptr_t)buf_a, mr_a->rkey) ||
+            credit_tx_init(&b.ctx, &ra, ra.qp, mr_a, (uintptr_t)buf_b, mr_b->rkey, cfg->window,
+                           cfg->len, cfg->ack_every, cfg->batch, cfg->signal_every))
+            goto cleanup;
+    }
+    ret = run_stream(&ra, rb, &b, cfg, buf_a);
+
+cleanup:
+    ruc_tx_free(&b.rtx);
+    ruc_rx_free(&b.rrx);
+    credit_tx_release(&b.ctx);
+    credit_rx_free(&b.crx);
+    if (mr_a) ibv_dereg_mr(mr_a);
+    if (mr_b) ibv_dereg_mr(mr_b);
+    if (rb != &ra)
+        free_ib_res(rb);
+    else if (qp_b)
+        ibv_destroy_qp(qp_b);
+    free(buf_a);
+    free(buf_b);
+    free_ib_res(&ra);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    struct ib_res res_cfg;
+    struct bench_cfg cfg = {
+        .msgs = 200000,
+        .len = 1024,
+        .window = 128,
+        .batch = 16,
+        .signal_every = 16,
+    };
+    int only_mode = -1;
+    int opt;
+
+    memset(&res_cfg, 0, sizeof(res_cfg));
+    while ((opt = getopt(argc, argv, "n:l:w:a:B:e:f:P:" IB_OPTSTRING)) != -1) {
+        switch (opt) {
+        case 'n':
+            cfg.msgs = strtoull(optarg, NULL, 0);
+            break;
+        case 'l':
+            cfg.len = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            cfg.window = strtoul(optarg, NULL, 0);
+            break;
+        case 'a':
+            cfg.ack_every = strtoul(optarg, NULL, 0);
+            break;
+        case 'B':
+            cfg.batch = atoi(optarg);
+            break;
+        case 'e':
+            cfg.signal_every = atoi(optarg);
+            break;
+        case 'f':
+            for (only_mode = 0; only_mode < BENCH_NMODES; only_mode++)
+                if (strcmp(optarg, bench_mode_str(only_mode)) == 0)
+                    break;
+            if (only_mode == BENCH_NMODES)
+                goto usage;
+            break;
+        case 'P':
+            cfg.peer_dev = optarg;
+            break;
+        case 't':
+            // The transport is what -f compares
+            goto usage;
+        default:
+            if (parse_ib_opt(&res_cfg, opt, optarg))
+                goto usage;
+        }
+    }
+    if (!cfg.ack_every)
+        cfg.ack_every = cfg.window / 8 ? cfg.window / 8 : 1;
+    if (cfg.msgs < 1 || cfg.msgs > UINT32_MAX || cfg.len < 1 || cfg.window < 1 ||
+        cfg.window + RUC_RECV_SLACK > MAX_RECV_WR || cfg.ack_every > cfg.window) {
+        fprintf(stderr, "need 1 <= msgs < 2^32, len >= 1, window in [1, %d] and "
+                "ack_every <= window\n", MAX_RECV_WR - RUC_RECV_SLACK);
+        return -1;
+    }
+    // Feedback and data must not take each other's receives
+    res_cfg.srq_depth = 0;
+
+    printf("%lu messages of %u B, window %u, ack every %u, %s\n", (unsigned long)cfg.msgs,
+           cfg.len, cfg.window, cfg.ack_every, cfg.peer_dev ? "two devices" : "loopback");
+    printf("%-4s %10s %10s %10s %10s %10s %8s %9s %9s\n", "mode", "sent", "delivered", "lost",
+           "MB/s", "retx", "timeouts", "srtt_us", "rto_us");
+    for (int mode = 0; mode < BENCH_NMODES; mode++) {
+        if (only_mode >= 0 && mode != only_mode)
+            continue;
+        if (run_mode(&res_cfg, &cfg, mode)) {
+            fprintf(stderr, "%s run failed\n", bench_mode_str(mode));
+            return -1;
+        }
+    }
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: %s [-n msgs] [-l msg_len] [-w window] [-a ack_every] "
+            "[-B wrs_per_doorbell] [-e signal_every] [-f uc|ruc|rc] [-P peer_ib_dev] %s\n",
+            argv[0], IB_OPTUSAGE);
+    return -1;
+}
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Push many times the slot count through credit_bench's credit mode, with
+# small and default windows, on the rxe device of rxe_setup.sh:
+#
+#   sudo scripts/rxe_setup.sh
+#   scripts/credit_check.sh                     # WINDOWS="1 8 128" to pick sizes
+#   sudo scripts/rxe_setup.sh down
+#
+# Credit mode must deliver every message; a stalled stream fails the run.
+# Extra arguments go to credit_bench.
+set -e
+
+RXE=${RXE:-rxe0}
+GID=${GID:-1}
+WINDOWS=${WINDOWS:-1 4 32 128}
+MSGS=${MSGS:-20000}
+BENCH=${BENCH:-./credit_bench}
+
+for w in $WINDOWS; do
+    echo "== $w slots, $MSGS messages"
+    out=$("$BENCH" -D "$RXE" -G "$GID" -f credit -w "$w" -n "$MSGS" "$@")
+    echo "$out" | tail -n 1
+done
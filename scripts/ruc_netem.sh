@@ -0,0 +1,35 @@
+#!/bin/sh
+# Goodput of RC and reliable UC under packet loss on Soft-RoCE. Needs the
+# two-device setup of rxe_setup.sh, and root for tc:
+#
+#   sudo PEER_RXE=rxe1 scripts/rxe_setup.sh
+#   sudo scripts/ruc_netem.sh                   # LOSSES="0 0.1 1" to pick rates
+#   sudo PEER_RXE=rxe1 scripts/rxe_setup.sh down
+#
+# netem drops packets on both directions of the veth pair, so data and
+# ACKs/feedback are lost alike. Extra arguments go to ruc_bench.
+set -e
+
+RXE=${RXE:-rxe0}
+PEER_RXE=${PEER_RXE:-rxe1}
+VETH=${VETH:-veth0}
+PEER=${PEER:-veth1}
+NETNS=${NETNS:-gfp-peer}
+GID=${GID:-1}
+LOSSES=${LOSSES:-0 0.01 0.1 0.5 1 2}
+BENCH=${BENCH:-./ruc_bench}
+
+clear_loss() {
+    tc qdisc del dev "$VETH" root 2>/dev/null || true
+    ip netns exec "$NETNS" tc qdisc del dev "$PEER" root 2>/dev/null || true
+}
+trap clear_loss EXIT
+
+for loss in $LOSSES; do
+    tc qdisc replace dev "$VETH" root netem loss "$loss%"
+    ip netns exec "$NETNS" tc qdisc replace dev "$PEER" root netem loss "$loss%"
+    for mode in rc ruc; do
+        echo "== loss $loss% $mode"
+        "$BENCH" -D "$RXE" -P "$PEER_RXE" -G "$GID" -f "$mode" "$@" | tail -n 1
+    done
+done
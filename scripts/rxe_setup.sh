@@ -0,0 +1,49 @@
+#!/bin/sh
+# Create a Soft-RoCE (rxe) device on a veth pair so the benchmarks can run
+# without an RDMA NIC. Needs root, iproute2 with the `rdma` tool and the
+# rdma_rxe kernel module.
+#
+#   scripts/rxe_setup.sh        # create rxe0 on veth0 (10.77.0.1/24)
+#   scripts/rxe_setup.sh down   # remove it again
+#   ./mw_bench -D rxe0 -o mw_bench.json
+#
+# With PEER_RXE set (e.g. PEER_RXE=rxe1) a second device is created on the
+# peer end, which is first moved into network namespace $NETNS. With both
+# addresses in one namespace the kernel delivers between them locally and
+# netem on the veth pair never sees the traffic.
+set -e
+
+RXE=${RXE:-rxe0}
+VETH=${VETH:-veth0}
+PEER=${PEER:-veth1}
+ADDR=${ADDR:-10.77.0.1/24}
+PEER_ADDR=${PEER_ADDR:-10.77.0.2/24}
+PEER_RXE=${PEER_RXE:-}
+NETNS=${NETNS:-gfp-peer}
+
+if [ "$1" = "down" ]; then
+    rdma link delete "$RXE" 2>/dev/null || true
+    if [ -n "$PEER_RXE" ]; then
+        ip netns exec "$NETNS" rdma link delete "$PEER_RXE" 2>/dev/null || true
+        ip netns delete "$NETNS" 2>/dev/null || true
+    fi
+    ip link delete "$VETH" 2>/dev/null || true
+    exit 0
+fi
+
+modprobe rdma_rxe
+ip link add "$VETH" type veth peer name "$PEER"
+ip addr add "$ADDR" dev "$VETH"
+ip link set "$VETH" up
+if [ -n "$PEER_RXE" ]; then
+    ip netns add "$NETNS"
+    ip link set "$PEER" netns "$NETNS"
+    ip -n "$NETNS" addr add "$PEER_ADDR" dev "$PEER"
+    ip -n "$NETNS" link set "$PEER" up
+    ip netns exec "$NETNS" rdma link add "$PEER_RXE" type rxe netdev "$PEER"
+else
+    ip addr add "$PEER_ADDR" dev "$PEER"
+    ip link set "$PEER" up
+fi
+rdma link add "$RXE" type rxe netdev "$VETH"
+rdma link show
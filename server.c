@@ -1,46 +1,97 @@
 #include "gfp.h"
+#include "bw.h"
+#include "pingpong.h"
+#include "frag.h"
+#include "ctrl.h"
 
 
-int main() {
+int main(int argc, char *argv[]) {
     struct ib_res ib_res;
     char *buffer = NULL;
     char *prebuffer = NULL;
     struct ibv_mr *mr = NULL;
     struct ibv_mr *premr = NULL;
     struct ib_info client_info;
-    struct ibv_qp_attr qp_attr;
+    struct wire_region region;
     struct ibv_sge sg;
     struct ibv_recv_wr rwr, *rbad_wr;
-    struct ibv_wc wc;
     struct ibv_mw *mw = NULL;
     uint8_t mw_type = IBV_MW_TYPE_2;
-    int pagesize = getpagesize();
+    int listen_fd = -1, fd = -1;
     int ret;
     long long start_time, end_time;
+    struct setup_times setup;
+    struct bw_opts bw;
+    struct pp_opts pp;
+    struct frag_opts frag;
+    struct ctrl_opts ctrl;
+    size_t buf_size;
+    int nrecv;
+    int opt;
 
     memset(&client_info, 0, sizeof(struct ib_info));
+    memset(&setup, 0, sizeof(setup));
     memset(&ib_res, 0, sizeof(struct ib_res));
+    bw_opts_init(&bw);
+    pp_opts_init(&pp);
+    frag_opts_init(&frag);
+    ctrl_opts_init(&ctrl);
+    // Receives come from an SRQ ring unless -R 0 asks for the QP's own RQ
+    ib_res.srq_depth = SRQ_DEPTH_DEFAULT;
 
-    buffer = memalign(pagesize, PKTSZ);
-    if (!buffer) {
-        perror("memalign");
-        goto cleanup;
+    while ((opt = getopt(argc, argv, IB_OPTSTRING BW_OPTSTRING PP_OPTSTRING FRAG_OPTSTRING
+                         CTRL_OPTSTRING)) != -1) {
+        if (parse_ib_opt(&ib_res, opt, optarg) && parse_bw_opt(&bw, opt, optarg) &&
+            parse_pp_opt(&pp, opt, optarg) && parse_frag_opt(&frag, opt, optarg) &&
+            parse_ctrl_opt(&ctrl, opt, optarg)) {
+            fprintf(stderr, "Usage: %s %s %s %s %s %s\n", argv[0], IB_OPTUSAGE, BW_OPTUSAGE,
+                    PP_OPTUSAGE, FRAG_OPTUSAGE, CTRL_OPTUSAGE);
+            return -1;
+        }
     }
-    memset(buffer, 0, PKTSZ);
-    prebuffer = memalign(pagesize, PKTSZ);
-    if (!prebuffer) {
-        perror("memalign");
-        goto cleanup;
+    // Ring ping-pong polls memory and posts no receives at all
+    if (pp.enabled && pp.ring)
+        ib_res.srq_depth = 0;
+    buf_size = bw_buf_size(&bw);
+    if (pp_buf_size(&pp) > buf_size)
+        buf_size = pp_buf_size(&pp);
+    if (frag.obj_size > buf_size)
+        buf_size = frag.obj_size;
+
+    // Listen before the (slow) resource setup so an early client is not refused
+    if (!ctrl.max_peers) {
+        listen_fd = hs_listen(PORT);
+        if (listen_fd < 0)
+            goto cleanup;
     }
-    memset(prebuffer, 0, PKTSZ);
 
     ret = prepare_ib_res(&ib_res);
     if (ret) {
         perror("prepare_ib_res failed");
         goto cleanup;
     }
+    // Registered memory goes on the NIC's node, whichever core touches it
+    buffer = topo_alloc(buf_size, ib_res.numa_node);
+    prebuffer = topo_alloc(PKTSZ, ib_res.numa_node);
+    if (!buffer || !prebuffer)
+        goto cleanup;
+    memset(buffer, 0, buf_size);
+    memset(prebuffer, 0, PKTSZ);
+
+    // Many peers, each with its own QP and window, on one listener
+    if (ctrl.max_peers) {
+        struct ctrl_server srv;
+
+        ret = ctrl_server_init(&srv, &ib_res, ctrl.max_peers, PORT);
+        if (ret == 0)
+            ret = ctrl_server_run(&srv, ctrl.max_peers);
+        if (ret == 0)
+            ctrl_server_report(&srv);
+        ctrl_server_destroy(&srv);
+        goto cleanup;
+    }
 
-    mr = ibv_reg_mr(ib_res.pd, buffer, PKTSZ, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_MW_BIND);
+    mr = ibv_reg_mr(ib_res.pd, buffer, buf_size, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_MW_BIND);
     if (!mr) {
         perror("ibv_reg_mr");
         ret = -1;
@@ -52,78 +103,31 @@ int main() {
         ret = -1;
         goto cleanup;
     }
-    // Server and client exchange info
-    ret = exchange_info_server(&ib_res.local_info, &client_info, 28515);
-    if (ret) {
-        perror("server exchange info failed\n");
-        goto cleanup;
-    }
-
-    // Modify QP to RTR
-    memset(&qp_attr, 0, sizeof(qp_attr));
-    qp_attr.qp_state = IBV_QPS_RTR;
-    qp_attr.path_mtu = IBV_MTU_4096;
-    /* require peer info: qpn, psn, lid */ 
-    qp_attr.dest_qp_num	= client_info.qpn;
-    qp_attr.rq_psn = client_info.psn;
-    qp_attr.ah_attr.dlid = client_info.lid;
-    qp_attr.ah_attr.is_global = 0;
-    qp_attr.ah_attr.src_path_bits = 0;
-    qp_attr.ah_attr.port_num = 1;
-
-    if (ib_res.gidx > 0) {
-        qp_attr.ah_attr.is_global = 1;
-        qp_attr.ah_attr.grh.hop_limit = 1;
-        qp_attr.ah_attr.grh.dgid = client_info.gid;
-        qp_attr.ah_attr.grh.sgid_index = ib_res.gidx;
-    }
-    ret = ibv_modify_qp(ib_res.qp, &qp_attr, IBV_QP_STATE |
-			                                 IBV_QP_AV    |
-			                                 IBV_QP_PATH_MTU |
-			                                 IBV_QP_DEST_QPN |
-			                                 IBV_QP_RQ_PSN);
-    if (ret) {
-        perror("ibv_modify_qp to RTR\n");
-        goto cleanup;
-    }
-
-    // Modify QP to RTS
-    memset(&qp_attr, 0, sizeof(qp_attr));
-    qp_attr.qp_state = IBV_QPS_RTS;
-    qp_attr.sq_psn = ib_res.local_info.psn;
-    ret = ibv_modify_qp(ib_res.qp, &qp_attr, IBV_QP_STATE | IBV_QP_SQ_PSN);
-    if (ret) {
-        perror("ibv_modify_qp");
-        goto cleanup;
-    }
-
     // Create a memory window (MW) of type 1 or 2
     mw = ibv_alloc_mw(ib_res.pd, mw_type);
     if (!mw) {
         perror("Couldn't allocate memory window");
         goto cleanup;
     }
-    struct ibv_mw_bind_info bind_info = {
-    		.mr = mr,
-    		.addr = (uintptr_t)buffer,
-    	    .length = 4096,
-    	    .mw_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE
-    };
-    ret = bind_mw_rkey(&ib_res, mw, mw_type, &bind_info);
-    if (ret) {
-        perror("bind_mw and get rkey failed");
-        goto cleanup;
-    }
-    
+
     // Pre-post receive buffers
     memset(&sg, 0, sizeof(sg));
     memset(&rwr, 0, sizeof(rwr));
 
-    for (int i = 10; i < 12; i++) {
+    // The third receive absorbs the client's SEND_WITH_INV in RC mode;
+    // bandwidth mode takes one write-with-imm per message size, ping-pong
+    // keeps a ring that is replenished as pings arrive (none with -r). The
+    // SRQ ring is already full and refills itself.
+    nrecv = bw.enabled ? bw_nsizes(&bw) : pp.enabled ? (pp.ring ? 0 : PP_RECV_DEPTH) : 3;
+    if (frag.obj_size)
+        nrecv = FRAG_RECV_DEPTH;
+    if (ib_res.srq.srq)
+        nrecv = 0;
+    for (int i = 10; i < 10 + nrecv; i++) {
         sg.addr = (uintptr_t)prebuffer;
         sg.length = PKTSZ;
         sg.lkey = premr->lkey;
-        rwr.wr_id = i;
+        rwr.wr_id = WRID(WRID_CLASS_RECV, i);
         rwr.sg_list = &sg;
         rwr.num_sge = 1;
 
@@ -134,51 +138,156 @@ int main() {
         }
     }
 
-    // Server/client exchange MW rkey and buffer addr
-    ib_res.local_info.buf_rkey = mw->rkey;
+    // Advertise the window with the rkey its bind is about to install
+    ib_res.local_info.buf_rkey = bw.use_mr_rkey ? mr->rkey : mw_next_rkey(mw);
     ib_res.local_info.buf_va = (uintptr_t)buffer;
-    printf("mr's rkey %d, mw's rkey %d\n", mr->rkey, mw->rkey);
+    region.addr = (uintptr_t)buffer;
+    region.length = buf_size;
+    region.rkey = ib_res.local_info.buf_rkey;
+    region.access = IBV_ACCESS_REMOTE_WRITE;
 
-    ret = exchange_info_server(&ib_res.local_info, &client_info, 28517);
+    fd = hs_accept(listen_fd);
+    listen_fd = -1;
+    if (fd < 0) {
+        ret = -1;
+        goto cleanup;
+    }
+    setup.start = gfp_get_time();
+    ret = hs_exchange(fd, 1, &ib_res.local_info, &region, 1, &client_info, NULL);
     if (ret) {
-        perror("server exchange info failed\n");
+        fprintf(stderr, "server exchange info failed\n");
+        goto cleanup;
+    }
+    setup.info = gfp_get_time();
+
+    // Modify QP to RTR and then RTS
+    ret = connect_qp(&ib_res, &client_info);
+    if (ret) {
+        perror("connect_qp failed");
+        goto cleanup;
+    }
+    struct ibv_mw_bind_info bind_info = {
+    		.mr = mr,
+    		.addr = (uintptr_t)buffer,
+    	    .length = buf_size,
+    	    .mw_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE
+    };
+    ret = bind_mw_rkey(&ib_res, mw, mw_type, &bind_info);
+    if (ret) {
+        perror("bind_mw and get rkey failed");
+        goto cleanup;
+    }
+    if (!bw.use_mr_rkey && mw->rkey != ib_res.local_info.buf_rkey) {
+        fprintf(stderr, "window bound to rkey %#x, advertised %#x\n", mw->rkey,
+                ib_res.local_info.buf_rkey);
+        ret = -1;
+        goto cleanup;
+    }
+    printf("mr's rkey %d, mw's rkey %d\n", mr->rkey, mw->rkey);
+    setup.rts = gfp_get_time();
+
+    // Receives are posted and the window is live: let the client start
+    ret = hs_ready(fd);
+    if (ret)
+        goto cleanup;
+    setup.ready = gfp_get_time();
+    setup_times_print("server", &setup);
+
+    if (bw.enabled) {
+        ret = run_bw_server(&ib_res, &bw);
+        goto cleanup;
+    }
+    if (pp.enabled) {
+        ret = run_pp_server(&ib_res, mr, buffer, mw, &client_info, &pp);
+        goto cleanup;
+    }
+    if (frag.obj_size) {
+        struct frag_rx rx;
+        uint16_t missing[16];
+        uint32_t nmissing;
+
+        ret = frag_rx_init(&rx, 1, frag.obj_size, frag.chunk_size);
+        if (ret)
+            goto cleanup;
+        start_time = gfp_get_time();
+        ret = frag_recv(&ib_res, &rx, FRAG_IDLE_TIMEOUT_NS);
+        end_time = gfp_get_time();
+        if (ret == 0) {
+            printf("object of %zu bytes complete: %u chunks in %lld ns\n",
+                   frag.obj_size, rx.nchunks, end_time - start_time);
+        } else if (ret == 1) {
+            nmissing = frag_rx_missing(&rx, missing, 16);
+            printf("object incomplete: %u of %u chunks missing, first:", nmissing, rx.nchunks);
+            for (uint32_t i = 0; i < nmissing && i < 16; i++)
+                printf(" %u", missing[i]);
+            printf("\n");
+        }
+        frag_rx_free(&rx);
         goto cleanup;
     }
 
     // Poll RDMA Write with Immediate message
-    ret = poll_cq(ib_res.cq, &wc);
+    ret = cq_engine_wait(&ib_res.cq_eng, WRID_CLASS_RECV, 1);
     if (ret < 0) {
-        perror("poll cq failed\n");
+        fprintf(stderr, "poll cq failed\n");
         goto cleanup;
     }
+    printf("Received imm %d\n", ntohl(ib_res.cq_eng.last[WRID_CLASS_RECV].imm_data));
     printf("buffer: %s\n", buffer);
 
     // Invalidate MW's rkey
-    ret = invalidate_mw_rkey(&ib_res, mw, mw_type, mr);
+    if (ib_res.qp_type == IBV_QPT_RC) {
+        /*
+         * RC: the client revokes the window with IBV_WR_SEND_WITH_INV and
+         * our HCA invalidates it while consuming a pre-posted receive,
+         * so no server-side WR is needed.
+         */
+        struct ibv_wc *wc = &ib_res.cq_eng.last[WRID_CLASS_RECV];
+
+        ret = cq_engine_wait(&ib_res.cq_eng, WRID_CLASS_RECV, 1);
+        if (ret < 0) {
+            fprintf(stderr, "poll cq failed\n");
+            goto cleanup;
+        }
+        if (!(wc->wc_flags & IBV_WC_WITH_INV) || wc->invalidated_rkey != mw->rkey)
+            fprintf(stderr, "expected remote invalidation of rkey %#x\n", mw->rkey);
+        else
+            printf("Client invalidated Type %d MW's rkey %#x remotely\n", mw_type, wc->invalidated_rkey);
+    } else {
+        ret = invalidate_mw_rkey(&ib_res, mw, mw_type, mr);
+    }
+    // The client holds its last write until the window is gone
+    if (hs_notify(fd, HS_REVOKED))
+        goto cleanup;
 
     // Poll RDMA Write with Immediate message after rkey invalidation
     // It's expected to be hanging here as rkey invalidated
-    ret = poll_cq(ib_res.cq, &wc);
+    ret = cq_engine_wait(&ib_res.cq_eng, WRID_CLASS_RECV, 1);
     if (ret < 0) {
-        perror("poll cq failed\n");
+        fprintf(stderr, "poll cq failed\n");
         goto cleanup;
     }
+    printf("Received imm %d\n", ntohl(ib_res.cq_eng.last[WRID_CLASS_RECV].imm_data));
     printf("buffer: %s\n", buffer);
 
 cleanup:
+    if (ib_res.cq_eng.ts)
+        cq_ts_report(stdout, &ib_res.ts);
+    if (ib_res.srq.srq)
+        printf("srq: %u deep, %lu refills, %lu limit events\n", ib_res.srq.depth,
+               (unsigned long)ib_res.srq.refills, (unsigned long)ib_res.srq.limit_events);
     if (mw) ibv_dealloc_mw(mw);
-    if (buffer) free(buffer);
-    if (prebuffer) free(prebuffer);
     start_time = gfp_get_time();
     if (mr) ibv_dereg_mr(mr);
     end_time = gfp_get_time();
     printf("ibv_dereg_mr takes %lld ns\n", (end_time - start_time));
     if (premr) ibv_dereg_mr(premr);
-    if (ib_res.qp) ibv_destroy_qp(ib_res.qp);
-    if (ib_res.cq) ibv_destroy_cq(ib_res.cq);
-    if (ib_res.pd) ibv_dealloc_pd(ib_res.pd);
-    if (ib_res.context) ibv_close_device(ib_res.context);
-    if (ib_res.dev_list) ibv_free_device_list(ib_res.dev_list);
+    // Unmap only once no MR covers the pages any more
+    topo_free(buffer, buf_size);
+    topo_free(prebuffer, PKTSZ);
+    if (fd >= 0) close(fd);
+    if (listen_fd >= 0) close(listen_fd);
+    free_ib_res(&ib_res);
 
     return 0;
 }
@@ -0,0 +1,199 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <sys/mman.h>
+#include "gfp.h"
+
+/*
+ * Registered slab allocator.
+ *
+ * One large region, backed by hugetlbfs pages (MAP_HUGETLB) when the
+ * system has them reserved, otherwise by transparent huge pages
+ * (MADV_HUGEPAGE), is registered with a single MR and cut into
+ * fixed-size slots. Thousands of buffers then cost one MPT entry and a
+ * handful of MTT entries instead of one MR each.
+ *
+ * The free list is a Treiber stack of slot indices. The head packs a
+ * generation tag next to the index so a pop racing with pop+push of the
+ * same slot (ABA) fails its compare-and-swap; slab_alloc() and
+ * slab_free() are safe from any thread without a lock.
+ *
+ * Every slot can carry its own type 2 window (slab_bind_slot()), so a
+ * remote peer is handed an rkey that reaches its slot and nothing else.
+ */
+
+#define SLAB_HUGE_PAGE (2UL << 20)
+#define SLAB_HEAD(tag, idx) (((uint64_t)(tag) << 32) | (uint32_t)(idx))
+#define SLAB_HEAD_TAG(h) ((uint32_t)((h) >> 32))
+#define SLAB_HEAD_IDX(h) ((uint32_t)(h))
+#define SLAB_NONE 0xffffffffu
+
+enum slab_backing {
+    SLAB_BACKING_HUGETLB,
+    SLAB_BACKING_THP,
+};
+
+struct slab {
+    char *base;
+    size_t region_size;
+    size_t slot_size;
+    uint32_t nslots;
+    int backing;
+    struct ibv_mr *mr;
+    struct ibv_mw **mws;
+    uint32_t *next;
+    uint64_t head;
+};
+
+static const char *slab_backing_str(int backing) {
+    return backing == SLAB_BACKING_HUGETLB ? "hugetlb" : "thp";
+}
+
+/*
+ * Map, touch and register nslots * slot_size bytes (rounded up to whole
+ * 2 MiB pages) with `access`, which should include IBV_ACCESS_MW_BIND if
+ * slots are to get windows.
+ */
+int slab_create(struct slab *slab, struct ibv_pd *pd, size_t slot_size, uint32_t nslots, int access) {
+    memset(slab, 0, sizeof(*slab));
+    if (slot_size == 0 || nslots == 0 || nslots == SLAB_NONE) {
+        fprintf(stderr, "slab: bad geometry %zu x %u\n", slot_size, nslots);
+        return -1;
+    }
+    slab->slot_size = slot_size;
+    slab->nslots = nslots;
+    slab->region_size = (slot_size * nslots + SLAB_HUGE_PAGE - 1) & ~(SLAB_HUGE_PAGE - 1);
+
+    slab->base = mmap(NULL, slab->region_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    slab->backing = SLAB_BACKING_HUGETLB;
+    if (slab->base == MAP_FAILED) {
+        // No reserved hugetlbfs pages: ask for THP on a 2 MiB aligned range
+        char *raw = mmap(NULL, slab->region_size + SLAB_HUGE_PAGE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        uintptr_t aligned;
+
+        if (raw == MAP_FAILED) {
+            perror("mmap");
+            slab->base = NULL;
+            return -1;
+        }
+        aligned = ((uintptr_t)raw + SLAB_HUGE_PAGE - 1) & ~(SLAB_HUGE_PAGE - 1);
+        if (aligned > (uintptr_t)raw)
+            munmap(raw, aligned - (uintptr_t)raw);
+        munmap((char *)aligned + slab->region_size,
+               (uintptr_t)raw + SLAB_HUGE_PAGE - aligned);
+        slab->base = (char *)aligned;
+        if (madvise(slab->base, slab->region_size, MADV_HUGEPAGE))
+            perror("madvise(MADV_HUGEPAGE)");
+        slab->backing = SLAB_BACKING_THP;
+    }
+    // Fault everything in before the one registration pins it
+    memset(slab->base, 0, slab->region_size);
+
+    slab->mr = ibv_reg_mr(pd, slab->base, slab->region_size, access);
+    if (!slab->mr) {
+        perror("ibv_reg_mr");
+        goto cleanup;
+    }
+    slab->next = malloc(nslots * sizeof(*slab->next));
+    slab->mws = calloc(nslots, sizeof(*slab->mws));
+    if (!slab->next || !slab->mws) {
+        perror("malloc");
+        goto cleanup;
+    }
+    for (uint32_t i = 0; i < nslots; i++)
+        slab->next[i] = i + 1 < nslots ? i + 1 : SLAB_NONE;
+    slab->head = SLAB_HEAD(0, 0);
+    return 0;
+
+cleanup:
+    if (slab->mr) ibv_dereg_mr(slab->mr);
+    munmap(slab->base, slab->region_size);
+    free(slab->next);
+    free(slab->mws);
+    memset(slab, 0, sizeof(*slab));
+    return -1;
+}
+
+void slab_destroy(struct slab *slab) {
+    for (uint32_t i = 0; slab->mws && i < slab->nslots; i++)
+        if (slab->mws[i]) ibv_dealloc_mw(slab->mws[i]);
+    if (slab->mr) ibv_dereg_mr(slab->mr);
+    if (slab->base) munmap(slab->base, slab->region_size);
+    free(slab->next);
+    free(slab->mws);
+    memset(slab, 0, sizeof(*slab));
+}
+
+static inline char *slab_slot(const struct slab *slab, uint32_t idx) {
+    return slab->base + (size_t)idx * slab->slot_size;
+}
+
+static inline uint32_t slab_index(const struct slab *slab, const void *ptr) {
+    return ((const char *)ptr - slab->base) / slab->slot_size;
+}
+
+// Pop a free slot; returns its index or SLAB_NONE when the slab is full
+uint32_t slab_alloc(struct slab *slab) {
+    uint64_t head = __atomic_load_n(&slab->head, __ATOMIC_ACQUIRE);
+
+    while (SLAB_HEAD_IDX(head) != SLAB_NONE) {
+        uint32_t idx = SLAB_HEAD_IDX(head);
+        uint32_t next = __atomic_load_n(&slab->next[idx], __ATOMIC_RELAXED);
+        uint64_t nh = SLAB_HEAD(SLAB_HEAD_TAG(head) + 1, next);
+
+        if (__atomic_compare_exchange_n(&slab->head, &head, nh, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return idx;
+    }
+    return SLAB_NONE;
+}
+
+void slab_free(struct slab *slab, uint32_t idx) {
+    uint64_t head = __atomic_load_n(&slab->head, __ATOMIC_RELAXED);
+    uint64_t nh;
+
+    do {
+        __atomic_store_n(&slab->next[idx], SLAB_HEAD_IDX(head), __ATOMIC_RELAXED);
+        nh = SLAB_HEAD(SLAB_HEAD_TAG(head) + 1, idx);
+    } while (!__atomic_compare_exchange_n(&slab->head, &head, nh, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Bind the slot's own type 2 window through `qp` (allocated on first use)
+ * and return its fresh rkey in *rkey. Only this slot is reachable with it.
+ */
+int slab_bind_slot(struct slab *slab, struct ib_res *ib_res, struct ibv_qp *qp, uint32_t idx,
+                   int mw_access, uint32_t *rkey) {
+    struct ibv_mw_bind_info bind_info = {
+        .mr = slab->mr,
+        .addr = (uintptr_t)slab_slot(slab, idx),
+        .length = slab->slot_size,
+        .mw_access_flags = mw_access,
+    };
+
+    if (!slab->mws[idx]) {
+        slab->mws[idx] = ibv_alloc_mw(ib_res->pd, IBV_MW_TYPE_2);
+        if (!slab->mws[idx]) {
+            perror("ibv_alloc_mw");
+            return -1;
+        }
+    }
+    if (bind_mw_rkey_qp(ib_res, qp, slab->mws[idx], IBV_MW_TYPE_2, &bind_info))
+        return -1;
+    *rkey = slab->mws[idx]->rkey;
+    return 0;
+}
+
+// Revoke the slot's window before the slot goes back to the free list
+int slab_unbind_slot(struct slab *slab, struct ib_res *ib_res, struct ibv_qp *qp, uint32_t idx) {
+    if (!slab->mws[idx])
+        return 0;
+    if (post_local_inv(ib_res, qp, slab->mws[idx]->rkey, WRID(WRID_CLASS_INV, 0), 1))
+        return -1;
+    return cq_engine_wait(&ib_res->cq_eng, WRID_CLASS_INV, 1);
+}
+
+#endif /* SLAB_H */
@@ -0,0 +1,282 @@
+#include <pthread.h>
+#include "gfp.h"
+#include "lat_stats.h"
+#include "slab.h"
+
+/*
+ * Slab allocator benchmark: `nbufs` buffers of `size` bytes, set up as one
+ * memalign() + ibv_reg_mr() per buffer versus one registered hugepage slab.
+ *
+ * Reported are the time to allocate, touch and register all buffers (and
+ * to deregister and free them), and the latency of small loopback RDMA
+ * writes to a random buffer. The NIC's translation cache has no portable
+ * miss counter, so the write latency stands in for it: with one MR per
+ * buffer every write needs a different MPT entry and 4 KiB MTT entries,
+ * with the slab all writes share 2 MiB translations.
+ *
+ * Every slab slot is written through its own type 2 window, the rkey a
+ * peer would be handed, and the binds and invalidations are timed too.
+ * The slots then go back to the free list from `-t` threads at once, and
+ * the list is checked to hold each of them exactly once.
+ */
+
+#define BENCH_MSG_SZ 64
+#define BENCH_MAX_THREADS 64
+
+struct bench_freer {
+    pthread_t tid;
+    struct slab *slab;
+    uint32_t first;
+    uint32_t step;
+};
+
+static void *bench_free_slots(void *arg) {
+    struct bench_freer *f = arg;
+
+    for (uint32_t i = f->first; i < f->slab->nslots; i += f->step)
+        slab_free(f->slab, i);
+    return NULL;
+}
+
+// Free every slot from `nthreads` threads, then pop them all back
+static int free_concurrently(struct slab *slab, int nthreads) {
+    struct bench_freer freers[BENCH_MAX_THREADS];
+    uint8_t *seen;
+    uint32_t n = 0, idx;
+    int started, ret = 0;
+
+    for (started = 0; started < nthreads; started++) {
+        freers[started].slab = slab;
+        freers[started].first = started;
+        freers[started].step = nthreads;
+        if (pthread_create(&freers[started].tid, NULL, bench_free_slots, &freers[started])) {
+            perror("pthread_create");
+            ret = -1;
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(freers[i].tid, NULL);
+    if (ret)
+        return -1;
+    seen = calloc(slab->nslots, 1);
+    if (!seen) {
+        perror("calloc");
+        return -1;
+    }
+    while ((idx = slab_alloc(slab)) != SLAB_NONE) {
+        if (idx >= slab->nslots || seen[idx]++) {
+            fprintf(stderr, "slab free list returned slot %u twice\n", idx);
+            ret = -1;
+            break;
+        }
+        n++;
+    }
+    if (!ret && n != slab->nslots) {
+        fprintf(stderr, "slab free list holds %u of %u slots\n", n, slab->nslots);
+        ret = -1;
+    }
+    free(seen);
+    return ret;
+}
+
+static int timed_write(struct ib_res *ib_res, struct ibv_sge *sg, uint64_t addr, uint32_t rkey,
+                       struct lat_stats *st) {
+    struct ibv_send_wr wr, *bad_wr;
+    long long t0 = gfp_get_time();
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = WRID(WRID_CLASS_SEND, 0);
+    wr.sg_list = sg;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    wr.wr.rdma.remote_addr = addr;
+    wr.wr.rdma.rkey = rkey;
+    if (ib_post_send(ib_res, ib_res->qp, &wr, &bad_wr)) {
+        perror("ibv_post_send");
+        return -1;
+    }
+    if (cq_engine_wait(&ib_res->cq_eng, WRID_CLASS_SEND, 1))
+        return -1;
+    lat_stats_add(st, gfp_get_time() - t0);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct ib_res ib_res;
+    struct slab slab;
+    struct lat_stats st;
+    struct lat_summary sum;
+    struct ibv_mr **mrs = NULL;
+    struct ibv_mr *src_mr = NULL;
+    struct ibv_sge sg;
+    char **bufs = NULL;
+    char *src = NULL;
+    uint32_t nbufs = 4096;
+    size_t size = PKTSZ;
+    int writes = 100000, nthreads = 4;
+    int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_MW_BIND;
+    long long t0, reg_ns, dereg_ns, bind_ns, unbind_ns;
+    uint32_t *rkeys = NULL;
+    unsigned seed = 1;
+    int opt, ret = -1;
+
+    memset(&ib_res, 0, sizeof(struct ib_res));
+    memset(&slab, 0, sizeof(slab));
+    memset(&st, 0, sizeof(st));
+    while ((opt = getopt(argc, argv, "n:S:w:t:" IB_OPTSTRING)) != -1) {
+        switch (opt) {
+        case 'n':
+            nbufs = strtoul(optarg, NULL, 0);
+            break;
+        case 'S':
+            size = strtoull(optarg, NULL, 0);
+            break;
+        case 'w':
+            writes = atoi(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        default:
+            if (parse_ib_opt(&ib_res, opt, optarg) == 0)
+                break;
+            fprintf(stderr, "Usage: %s [-n nbufs] [-S buf_size] [-w writes] [-t free_threads] %s\n",
+                    argv[0], IB_OPTUSAGE);
+            return -1;
+        }
+    }
+    if (nbufs < 1 || size < BENCH_MSG_SZ || writes < 1 || nthreads < 1 ||
+        nthreads > BENCH_MAX_THREADS) {
+        fprintf(stderr, "need nbufs >= 1, buf_size >= %d, writes >= 1 and 1..%d threads\n",
+                BENCH_MSG_SZ, BENCH_MAX_THREADS);
+        return -1;
+    }
+
+    bufs = calloc(nbufs, sizeof(*bufs));
+    mrs = calloc(nbufs, sizeof(*mrs));
+    rkeys = calloc(nbufs, sizeof(*rkeys));
+    src = memalign(getpagesize(), BENCH_MSG_SZ);
+    if (!bufs || !mrs || !rkeys || !src) {
+        perror("malloc");
+        goto cleanup;
+    }
+    memset(src, 0xab, BENCH_MSG_SZ);
+    if (lat_stats_init(&st, writes))
+        goto cleanup;
+    if (prepare_ib_res(&ib_res)) {
+        perror("prepare_ib_res failed");
+        goto cleanup;
+    }
+    src_mr = ibv_reg_mr(ib_res.pd, src, BENCH_MSG_SZ, IBV_ACCESS_LOCAL_WRITE);
+    if (!src_mr) {
+        perror("ibv_reg_mr");
+        goto cleanup;
+    }
+    // Loopback: the QP's peer is itself
+    if (connect_qp(&ib_res, &ib_res.local_info))
+        goto cleanup;
+    sg.addr = (uintptr_t)src;
+    sg.length = BENCH_MSG_SZ;
+    sg.lkey = src_mr->lkey;
+
+    // Per-buffer: what client.c and server.c do today; allocate, touch, register
+    t0 = gfp_get_time();
+    for (uint32_t i = 0; i < nbufs; i++) {
+        bufs[i] = memalign(getpagesize(), size);
+        if (!bufs[i]) {
+            perror("memalign");
+            goto cleanup;
+        }
+        memset(bufs[i], 0, size);
+        mrs[i] = ibv_reg_mr(ib_res.pd, bufs[i], size, access);
+        if (!mrs[i]) {
+            perror("ibv_reg_mr");
+            goto cleanup;
+        }
+    }
+    reg_ns = gfp_get_time() - t0;
+    for (int i = 0; i < writes; i++) {
+        uint32_t b = rand_r(&seed) % nbufs;
+
+        if (timed_write(&ib_res, &sg, (uintptr_t)bufs[b], mrs[b]->rkey, &st))
+            goto cleanup;
+    }
+    t0 = gfp_get_time();
+    for (uint32_t i = 0; i < nbufs; i++) {
+        ibv_dereg_mr(mrs[i]);
+        mrs[i] = NULL;
+        free(bufs[i]);
+        bufs[i] = NULL;
+    }
+    dereg_ns = gfp_get_time() - t0;
+    printf("%u buffers of %zu B\n", nbufs, size);
+    printf("per-buffer MRs: alloc+register %.3f ms, deregister+free %.3f ms\n", reg_ns / 1e6,
+           dereg_ns / 1e6);
+    lat_stats_summarize(&st, &sum);
+    lat_summary_print(stdout, "per-buffer write", &sum);
+    lat_stats_reset(&st);
+
+    // Slab: map, touch and register once
+    t0 = gfp_get_time();
+    if (slab_create(&slab, ib_res.pd, size, nbufs, access))
+        goto cleanup;
+    reg_ns = gfp_get_time() - t0;
+    // Hand every slot out with a window of its own
+    t0 = gfp_get_time();
+    for (uint32_t i = 0; i < nbufs; i++) {
+        uint32_t b = slab_alloc(&slab);
+
+        if (b == SLAB_NONE) {
+            fprintf(stderr, "slab ran out of slots\n");
+            goto cleanup;
+        }
+        if (slab_bind_slot(&slab, &ib_res, ib_res.qp, b, IBV_ACCESS_REMOTE_WRITE, &rkeys[b]))
+            goto cleanup;
+    }
+    bind_ns = gfp_get_time() - t0;
+    for (int i = 0; i < writes; i++) {
+        uint32_t b = rand_r(&seed) % nbufs;
+
+        if (timed_write(&ib_res, &sg, (uintptr_t)slab_slot(&slab, b), rkeys[b], &st))
+            goto cleanup;
+    }
+    t0 = gfp_get_time();
+    for (uint32_t i = 0; i < nbufs; i++)
+        if (slab_unbind_slot(&slab, &ib_res, ib_res.qp, i))
+            goto cleanup;
+    unbind_ns = gfp_get_time() - t0;
+    if (free_concurrently(&slab, nthreads))
+        goto cleanup;
+    // The per-buffer side has no windows: leave their teardown out of the timing
+    for (uint32_t i = 0; i < nbufs; i++) {
+        ibv_dealloc_mw(slab.mws[i]);
+        slab.mws[i] = NULL;
+    }
+    printf("slab (%s, %zu B region): ", slab_backing_str(slab.backing), slab.region_size);
+    t0 = gfp_get_time();
+    slab_destroy(&slab);
+    dereg_ns = gfp_get_time() - t0;
+    printf("alloc+register %.3f ms, deregister+free %.3f ms\n", reg_ns / 1e6, dereg_ns / 1e6);
+    printf("slot windows: bind %.3f ms, invalidate %.3f ms; freed from %d threads\n",
+           bind_ns / 1e6, unbind_ns / 1e6, nthreads);
+    lat_stats_summarize(&st, &sum);
+    lat_summary_print(stdout, "slab write", &sum);
+    ret = 0;
+
+cleanup:
+    slab_destroy(&slab);
+    for (uint32_t i = 0; mrs && i < nbufs; i++)
+        if (mrs[i]) ibv_dereg_mr(mrs[i]);
+    for (uint32_t i = 0; bufs && i < nbufs; i++)
+        free(bufs[i]);
+    free(bufs);
+    free(mrs);
+    free(rkeys);
+    if (src_mr) ibv_dereg_mr(src_mr);
+    free(src);
+    lat_stats_free(&st);
+    free_ib_res(&ib_res);
+    return ret;
+}
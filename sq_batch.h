@@ -0,0 +1,195 @@
+#ifndef SQ_BATCH_H
+#define SQ_BATCH_H
+
+#include "gfp.h"
+
+/*
+ * Send queue batcher.
+ *
+ * The application hands WRs to sq_batch_add() one at a time. They are
+ * copied into a WR chain and the doorbell (ib_post_send) is rung once per
+ * `batch` WRs instead of once per WR. Only every `signal_every`-th WR is
+ * signaled: its wr_id is WRID(cls, k), where k counts the WRs that
+ * CQE retires, so the batcher owns wr_id of everything it posts.
+ *
+ * SQ occupancy is posted - retired. Before a WR is queued the batcher
+ * makes sure it still fits into `depth` slots, ringing the doorbell for
+ * whatever is pending and reaping CQEs until it does. signal_every <= depth
+ * guarantees there is always a signaled WR in flight to wait for.
+ *
+ * A full batch is only posted when the next WR arrives (or on
+ * sq_batch_flush()), so an unsignaled tail is always still pending when
+ * the application flushes; sq_batch_flush() signals the last WR of the
+ * chain and every WR handed in so far then retires.
+ *
+ * One batcher per (QP, class): it registers itself as the CQ engine
+ * handler of `cls`. WRs other code posts on the same QP are not counted,
+ * so `depth` has to leave room for them.
+ */
+
+#define SQ_BATCH_MAX 64
+#define SQ_BATCH_MAX_SGE MAX_SEND_SGE
+
+struct sq_batch {
+    struct ib_res *ib_res;
+    struct cq_engine *eng;
+    struct ibv_qp *qp;
+    unsigned cls;
+    int batch;
+    int signal_every;
+    uint32_t depth;
+    int n;
+    int unsignaled;
+    uint64_t posted;
+    uint64_t retired;
+    uint64_t failed_base;
+    uint64_t doorbells;
+    uint64_t signaled;
+    uint64_t full_waits;
+    struct ibv_send_wr wrs[SQ_BATCH_MAX];
+    struct ibv_sge sges[SQ_BATCH_MAX][SQ_BATCH_MAX_SGE];
+};
+
+static void sq_batch_retire(void *arg, const struct ibv_wc *wc) {
+    struct sq_batch *b = arg;
+
+    // A signaled CQE retires itself and the unsignaled WRs before it
+    b->retired += WRID_IDX(wc->wr_id);
+}
+
+/*
+ * Set up a batcher for `qp`, ringing the doorbell every `batch` WRs,
+ * signaling every `signal_every`-th one and keeping at most `depth` WRs
+ * in the send queue (capped at MAX_SEND_WR, the QP's size).
+ */
+int sq_batch_init(struct sq_batch *b, struct ib_res *ib_res, struct ibv_qp *qp, unsigned cls,
+                  int batch, int signal_every, uint32_t depth) {
+    memset(b, 0, sizeof(*b));
+    if (depth > MAX_SEND_WR)
+        depth = MAX_SEND_WR;
+    if (batch < 1 || batch > SQ_BATCH_MAX || depth < 1 || signal_every < 1 ||
+        (uint32_t)signal_every > depth) {
+        fprintf(stderr, "sq_batch: need 1 <= batch <= %d and 1 <= signal_every <= depth (%u)\n",
+                SQ_BATCH_MAX, depth);
+        return -1;
+    }
+    b->ib_res = ib_res;
+    b->eng = &ib_res->cq_eng;
+    b->qp = qp;
+    b->cls = cls & (WRID_MAX_CLASS - 1);
+    b->batch = batch;
+    b->signal_every = signal_every;
+    b->depth = depth;
+    b->failed_base = b->eng->failed[b->cls];
+    cq_engine_register(b->eng, b->cls, sq_batch_retire, b);
+    return 0;
+}
+
+void sq_batch_release(struct sq_batch *b) {
+    if (b->eng)
+        cq_engine_register(b->eng, b->cls, NULL, NULL);
+    b->eng = NULL;
+}
+
+// WRs in the send queue that no reaped CQE has retired yet
+static inline uint64_t sq_batch_inflight(const struct sq_batch *b) {
+    return b->posted - b->retired;
+}
+
+static inline int sq_batch_failed(const struct sq_batch *b) {
+    return b->eng->failed[b->cls] != b->failed_base;
+}
+
+static void sq_batch_signal(struct sq_batch *b, struct ibv_send_wr *wr) {
+    wr->wr_id = WRID(b->cls, b->unsignaled);
+    wr->send_flags |= IBV_SEND_SIGNALED;
+    b->unsignaled = 0;
+    b->signaled++;
+}
+
+// Post the pending chain with one doorbell
+static int sq_batch_ring(struct sq_batch *b) {
+    struct ibv_send_wr *bad_wr;
+    int ret;
+
+    if (b->n == 0)
+        return 0;
+    ret = ib_post_send(b->ib_res, b->qp, b->wrs, &bad_wr);
+    if (ret) {
+        fprintf(stderr, "ibv_post_send failed: %s\n", strerror(ret));
+        return -1;
+    }
+    b->posted += b->n;
+    b->doorbells++;
+    b->n = 0;
+    return 0;
+}
+
+/*
+ * Queue a copy of `wr` (its next and wr_id are ignored). Rings the
+ * doorbell when a batch is full and blocks, reaping CQEs in the engine's
+ * mode, while the send queue has no room. Returns 0 or -1.
+ */
+int sq_batch_add(struct sq_batch *b, const struct ibv_send_wr *wr) {
+    struct ibv_send_wr *dst;
+    int waited = 0;
+
+    if (wr->num_sge > SQ_BATCH_MAX_SGE) {
+        fprintf(stderr, "sq_batch: %d SGEs, max %d\n", wr->num_sge, SQ_BATCH_MAX_SGE);
+        return -1;
+    }
+    if (b->n == b->batch && sq_batch_ring(b))
+        return -1;
+    while (sq_batch_inflight(b) + b->n >= b->depth) {
+        // Let the NIC see what is queued before waiting on it
+        if (sq_batch_ring(b))
+            return -1;
+        waited = 1;
+        if (cq_engine_wait(b->eng, b->cls, 1) || sq_batch_failed(b))
+            return -1;
+    }
+    b->full_waits += waited;
+
+    dst = &b->wrs[b->n];
+    *dst = *wr;
+    if (wr->num_sge) {
+        memcpy(b->sges[b->n], wr->sg_list, wr->num_sge * sizeof(*wr->sg_list));
+        dst->sg_list = b->sges[b->n];
+    }
+    dst->next = NULL;
+    dst->wr_id = WRID(b->cls, 0);
+    dst->send_flags &= ~IBV_SEND_SIGNALED;
+    if (b->n)
+        b->wrs[b->n - 1].next = dst;
+    b->n++;
+    if (++b->unsignaled == b->signal_every)
+        sq_batch_signal(b, dst);
+    return 0;
+}
+
+// Post whatever is pending, signaling its last WR so all of it retires
+int sq_batch_flush(struct sq_batch *b) {
+    if (b->n && b->unsignaled)
+        sq_batch_signal(b, &b->wrs[b->n - 1]);
+    return sq_batch_ring(b);
+}
+
+// Flush and wait until every WR handed in has completed
+int sq_batch_drain(struct sq_batch *b) {
+    if (sq_batch_flush(b))
+        return -1;
+    while (sq_batch_inflight(b)) {
+        if (cq_engine_wait(b->eng, b->cls, 1) || sq_batch_failed(b))
+            return -1;
+    }
+    return 0;
+}
+
+void sq_batch_print_stats(FILE *out, const struct sq_batch *b) {
+    fprintf(out, "sq_batch: %lu WRs, %lu doorbells (%.1f WRs each), %lu signaled, "
+            "%lu waits on a full SQ\n", (unsigned long)b->posted, (unsigned long)b->doorbells,
+            b->doorbells ? (double)b->posted / b->doorbells : 0.0, (unsigned long)b->signaled,
+            (unsigned long)b->full_waits);
+}
+
+#endif /* SQ_BATCH_H */
@@ -0,0 +1,161 @@
+#include "gfp.h"
+#include "lat_stats.h"
+#include "sq_batch.h"
+
+/*
+ * Send queue batching benchmark.
+ *
+ * The QP is connected to itself and `-n` small RDMA writes are pushed
+ * through it, first the way client.c and bind_mw_rkey() post today (one
+ * signaled WR, one doorbell, then wait for its CQE), then through the
+ * send queue batcher for every combination of WRs per doorbell and
+ * signal interval, with at most `-d` WRs in the send queue.
+ *
+ * -B and -e replace the sweep with a single batch size or signal interval.
+ */
+
+#define BENCH_MSG_SZ 8
+
+static void print_row(const char *name, int batch, int signal_every, uint64_t writes,
+                      long long elapsed, long long cpu, uint64_t doorbells, uint64_t cqes) {
+    printf("%-10s %6d %7d %14.0f %10.1f %7.1f%% %10lu %10lu\n", name, batch, signal_every,
+           writes * 1e9 / elapsed, (double)elapsed / writes, 100.0 * cpu / elapsed,
+           (unsigned long)doorbells, (unsigned long)cqes);
+}
+
+static int run_post_wait(struct ib_res *ib_res, struct ibv_send_wr *wr, uint64_t writes) {
+    long long start_time = gfp_get_time(), cpu_start = cpu_time_ns();
+    struct ibv_send_wr *bad_wr;
+
+    wr->wr_id = WRID(WRID_CLASS_SEND, 1);
+    wr->send_flags = IBV_SEND_SIGNALED;
+    for (uint64_t i = 0; i < writes; i++) {
+        if (ib_post_send(ib_res, ib_res->qp, wr, &bad_wr)) {
+            perror("ibv_post_send");
+            return -1;
+        }
+        if (cq_engine_wait(&ib_res->cq_eng, WRID_CLASS_SEND, 1))
+            return -1;
+    }
+    print_row("post+wait", 1, 1, writes, gfp_get_time() - start_time, cpu_time_ns() - cpu_start,
+              writes, writes);
+    return 0;
+}
+
+static int run_batched(struct ib_res *ib_res, struct ibv_send_wr *wr, uint64_t writes, int batch,
+                       int signal_every, int depth) {
+    struct sq_batch b;
+    long long start_time, cpu_start;
+    int ret = -1;
+
+    if (sq_batch_init(&b, ib_res, ib_res->qp, WRID_CLASS_SEND, batch, signal_every, depth))
+        return -1;
+    start_time = gfp_get_time();
+    cpu_start = cpu_time_ns();
+    for (uint64_t i = 0; i < writes; i++) {
+        if (sq_batch_add(&b, wr))
+            goto cleanup;
+    }
+    if (sq_batch_drain(&b))
+        goto cleanup;
+    print_row("batched", batch, signal_every, writes, gfp_get_time() - start_time,
+              cpu_time_ns() - cpu_start, b.doorbells, b.signaled);
+    ret = 0;
+
+cleanup:
+    sq_batch_release(&b);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    struct ib_res ib_res;
+    struct ibv_mr *mr = NULL;
+    struct ibv_sge sg;
+    struct ibv_send_wr wr;
+    char *buffer = NULL;
+    uint64_t writes = 1000000;
+    int depth = 256;
+    int batches[] = { 1, 4, 16, 64 }, nbatches = 4;
+    int signals[] = { 1, 4, 16, 64, 256 }, nsignals = 5;
+    int opt, ret = -1;
+
+    memset(&ib_res, 0, sizeof(struct ib_res));
+    while ((opt = getopt(argc, argv, "n:d:B:e:" IB_OPTSTRING)) != -1) {
+        switch (opt) {
+        case 'n':
+            writes = strtoull(optarg, NULL, 0);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'B':
+            batches[0] = atoi(optarg);
+            nbatches = 1;
+            break;
+        case 'e':
+            signals[0] = atoi(optarg);
+            nsignals = 1;
+            break;
+        default:
+            if (parse_ib_opt(&ib_res, opt, optarg) == 0)
+                break;
+            fprintf(stderr, "Usage: %s [-n writes] [-d sq_depth] [-B wrs_per_doorbell] "
+                    "[-e signal_every] %s\n", argv[0], IB_OPTUSAGE);
+            return -1;
+        }
+    }
+    if (writes < 1 || depth < 1 || depth > MAX_SEND_WR) {
+        fprintf(stderr, "need writes >= 1 and depth in [1, %d]\n", MAX_SEND_WR);
+        return -1;
+    }
+
+    buffer = memalign(getpagesize(), PKTSZ);
+    if (!buffer) {
+        perror("memalign");
+        return -1;
+    }
+    memset(buffer, 0, PKTSZ);
+    if (prepare_ib_res(&ib_res)) {
+        perror("prepare_ib_res failed");
+        goto cleanup;
+    }
+    mr = ibv_reg_mr(ib_res.pd, buffer, PKTSZ, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    if (!mr) {
+        perror("ibv_reg_mr");
+        goto cleanup;
+    }
+    // Loopback: the QP's peer is itself
+    if (connect_qp(&ib_res, &ib_res.local_info))
+        goto cleanup;
+
+    sg.addr = (uintptr_t)buffer;
+    sg.length = BENCH_MSG_SZ;
+    sg.lkey = mr->lkey;
+    memset(&wr, 0, sizeof(wr));
+    wr.sg_list = &sg;
+    wr.num_sge = 1;
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.wr.rdma.remote_addr = (uintptr_t)buffer + PKTSZ / 2;
+    wr.wr.rdma.rkey = mr->rkey;
+
+    printf("%lu writes of %d B, send queue depth %d\n", (unsigned long)writes, BENCH_MSG_SZ, depth);
+    printf("%-10s %6s %7s %14s %10s %8s %10s %10s\n", "mode", "batch", "signal", "msgs/s",
+           "ns/msg", "cpu", "doorbells", "cqes");
+    if (run_post_wait(&ib_res, &wr, writes))
+        goto cleanup;
+    for (int i = 0; i < nbatches; i++) {
+        for (int k = 0; k < nsignals; k++) {
+            if (signals[k] > depth)
+                continue;
+            if (run_batched(&ib_res, &wr, writes, batches[i], signals[k], depth))
+                goto cleanup;
+        }
+    }
+    ret = 0;
+
+cleanup:
+    if (mr) ibv_dereg_mr(mr);
+    free(buffer);
+    free_ib_res(&ib_res);
+    return ret;
+}
@@ -0,0 +1,168 @@
+#ifndef TOPO_H
+#define TOPO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <infiniband/verbs.h>
+
+/*
+ * Device, port and GID selection by topology.
+ *
+ * Without `-D`, prepare_ib_res() takes the first device with an active
+ * port whose PCIe function sits on the calling thread's NUMA node
+ * (/sys/class/infiniband/<dev>/device/numa_node), and any device with an
+ * active port if none is local. Without a port set, the first active one
+ * is used. Without `-G`, RoCE ports use a RoCE v2 GID: the one carrying
+ * the local address the kernel would route to ib_res->peer_addr, or the
+ * first IPv4-mapped one when there is no peer address yet. IB ports keep
+ * GID index 0.
+ *
+ * Buffers from topo_alloc() are placed on the given node with mbind(), so
+ * registered memory sits next to the NIC rather than next to whichever
+ * core touched it first.
+ */
+
+#define TOPO_NODE_ANY (-1)
+#define TOPO_MPOL_PREFERRED 1       /* linux/mempolicy.h, no libnuma needed */
+#define TOPO_MAX_NODES 1024
+
+// NUMA node of the calling thread's current CPU
+static inline int topo_thread_node(void) {
+    unsigned cpu, node;
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL))
+        return TOPO_NODE_ANY;
+    return node;
+}
+
+// NUMA node the device's PCIe function is attached to, or TOPO_NODE_ANY
+int topo_dev_node(struct ibv_device *dev) {
+    char path[256];
+    FILE *f;
+    int node = TOPO_NODE_ANY;
+
+    snprintf(path, sizeof(path), "/sys/class/infiniband/%s/device/numa_node",
+             ibv_get_device_name(dev));
+    f = fopen(path, "r");
+    if (!f)
+        return TOPO_NODE_ANY;
+    if (fscanf(f, "%d", &node) != 1 || node < 0)
+        node = TOPO_NODE_ANY;
+    fclose(f);
+    return node;
+}
+
+// First ACTIVE port of `context` (1-based), or 0 if none is
+int topo_active_port(struct ibv_context *context) {
+    struct ibv_device_attr dev_attr;
+    struct ibv_port_attr port_attr;
+
+    if (ibv_query_device(context, &dev_attr))
+        return 0;
+    for (int p = 1; p <= dev_attr.phys_port_cnt; p++)
+        if (!ibv_query_port(context, p, &port_attr) && port_attr.state == IBV_PORT_ACTIVE)
+            return p;
+    return 0;
+}
+
+/*
+ * The local address a datagram to `peer` would leave from, as a GID
+ * (IPv4 addresses IPv4-mapped). Returns 0 or -1.
+ */
+static int topo_route_gid(const char *peer, union ibv_gid *gid) {
+    struct addrinfo hints = { .ai_socktype = SOCK_DGRAM, .ai_flags = AI_NUMERICSERV };
+    struct addrinfo *res = NULL;
+    struct sockaddr_storage local;
+    socklen_t len = sizeof(local);
+    int fd, ret = -1;
+
+    if (getaddrinfo(peer, "4791", &hints, &res) || !res)
+        return -1;
+    // connect() on a UDP socket only routes, nothing is sent
+    fd = socket(res->ai_family, SOCK_DGRAM, 0);
+    if (fd >= 0 && !connect(fd, res->ai_addr, res->ai_addrlen) &&
+        !getsockname(fd, (struct sockaddr *)&local, &len)) {
+        memset(gid, 0, sizeof(*gid));
+        if (local.ss_family == AF_INET) {
+            gid->raw[10] = 0xff;
+            gid->raw[11] = 0xff;
+            memcpy(&gid->raw[12], &((struct sockaddr_in *)&local)->sin_addr, 4);
+        } else {
+            memcpy(gid->raw, &((struct sockaddr_in6 *)&local)->sin6_addr, 16);
+        }
+        ret = 0;
+    }
+    if (fd >= 0)
+        close(fd);
+    freeaddrinfo(res);
+    return ret;
+}
+
+static inline int topo_gid_v4mapped(const union ibv_gid *gid) {
+    static const uint8_t prefix[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+    return !memcmp(gid->raw, prefix, sizeof(prefix));
+}
+
+/*
+ * RoCE v2 GID index of `port` for talking to `peer` (may be NULL).
+ * Returns -1 if the port has no RoCE v2 GID or the GID table cannot be
+ * read.
+ */
+int topo_roce_v2_gid(struct ibv_context *context, int port, int gid_tbl_len, const char *peer) {
+    union ibv_gid want;
+    int have_want = peer && !topo_route_gid(peer, &want);
+    int first = -1, first_v4 = -1;
+
+    for (int i = 0; i < gid_tbl_len; i++) {
+        struct ibv_gid_entry entry;
+
+        // Unused entries fail with ENODATA
+        if (ibv_query_gid_ex(context, port, i, &entry, 0) || entry.gid_type != IBV_GID_TYPE_ROCE_V2)
+            continue;
+        if (have_want && !memcmp(entry.gid.raw, want.raw, sizeof(want.raw)))
+            return i;
+        if (first < 0)
+            first = i;
+        if (first_v4 < 0 && topo_gid_v4mapped(&entry.gid))
+            first_v4 = i;
+    }
+    if (have_want)
+        fprintf(stderr, "no RoCE v2 GID carries the address routed to %s\n", peer);
+    return first_v4 >= 0 ? first_v4 : first;
+}
+
+/*
+ * `size` bytes of page-aligned memory preferring NUMA node `node`
+ * (TOPO_NODE_ANY: first touch decides). Free with topo_free().
+ */
+void *topo_alloc(size_t size, int node) {
+    unsigned long mask[TOPO_MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    if (node >= 0 && node < TOPO_MAX_NODES) {
+        mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+        // Only a preference: falling back to another node beats failing
+        if (syscall(SYS_mbind, p, size, TOPO_MPOL_PREFERRED, mask, TOPO_MAX_NODES, 0))
+            perror("mbind");
+    }
+    return p;
+}
+
+void topo_free(void *p, size_t size) {
+    if (p)
+        munmap(p, size);
+}
+
+#endif /* TOPO_H */
@@ -0,0 +1,245 @@
+#include "gfp.h"
+#include "lat_stats.h"
+
+/*
+ * Legacy vs extended verbs benchmark.
+ *
+ * The same loopback workload runs once per posting backend (-V picks just
+ * one), each on its own freshly opened device context:
+ *
+ *   write   - `-n` 8 B RDMA writes posted in chains of BENCH_CHAIN, the
+ *             last one signaled, at most `-d` WRs in flight. The legacy
+ *             path fills a struct ibv_send_wr chain for ibv_post_send();
+ *             the extended path emits every WR with ibv_wr_rdma_write() /
+ *             ibv_wr_set_sge() between one ibv_wr_start()/ibv_wr_complete()
+ *             pair. CQEs are reaped with ibv_poll_cq() or
+ *             ibv_start_poll()/ibv_next_poll() respectively.
+ *   bind    - type 2 window bind through bind_mw_rkey(), post to CQE;
+ *   inv     - LOCAL_INV of that window through post_local_inv(), post to CQE.
+ *
+ * Reported are writes/sec, CPU ns per write and bind/invalidate latency
+ * percentiles per backend.
+ */
+
+#define BENCH_MSG_SZ 8
+#define BENCH_CHAIN 16
+
+struct bench_tx {
+    uint64_t posted;
+    uint64_t retired;
+};
+
+static void bench_retire(void *arg, const struct ibv_wc *wc) {
+    ((struct bench_tx *)arg)->retired += WRID_IDX(wc->wr_id);
+}
+
+static int post_chain(struct ib_res *ib_res, struct ibv_mr *mr, int n) {
+    uint64_t dst = (uintptr_t)mr->addr + PKTSZ / 2;
+
+    if (ib_res->post_api == POST_API_EX) {
+        struct ibv_qp_ex *qpx = ibv_qp_to_qp_ex(ib_res->qp);
+
+        ibv_wr_start(qpx);
+        for (int k = 0; k < n; k++) {
+            qpx->wr_id = WRID(WRID_CLASS_SEND, k == n - 1 ? n : 0);
+            qpx->wr_flags = k == n - 1 ? IBV_SEND_SIGNALED : 0;
+            ibv_wr_rdma_write(qpx, mr->rkey, dst);
+            ibv_wr_set_sge(qpx, mr->lkey, (uintptr_t)mr->addr, BENCH_MSG_SZ);
+        }
+        return ibv_wr_complete(qpx);
+    } else {
+        struct ibv_send_wr wrs[BENCH_CHAIN], *bad_wr;
+        struct ibv_sge sg = {
+            .addr = (uintptr_t)mr->addr,
+            .length = BENCH_MSG_SZ,
+            .lkey = mr->lkey,
+        };
+
+        for (int k = 0; k < n; k++) {
+            memset(&wrs[k], 0, sizeof(wrs[k]));
+            wrs[k].wr_id = WRID(WRID_CLASS_SEND, k == n - 1 ? n : 0);
+            wrs[k].sg_list = &sg;
+            wrs[k].num_sge = 1;
+            wrs[k].opcode = IBV_WR_RDMA_WRITE;
+            wrs[k].send_flags = k == n - 1 ? IBV_SEND_SIGNALED : 0;
+            wrs[k].wr.rdma.remote_addr = dst;
+            wrs[k].wr.rdma.rkey = mr->rkey;
+            wrs[k].next = k + 1 < n ? &wrs[k + 1] : NULL;
+        }
+        return ibv_post_send(ib_res->qp, wrs, &bad_wr);
+    }
+}
+
+static int run_writes(struct ib_res *ib_res, struct ibv_mr *mr, uint64_t writes, int depth) {
+    struct cq_engine *eng = &ib_res->cq_eng;
+    struct bench_tx tx = { 0 };
+    long long start_time, cpu_start, elapsed, cpu;
+    int ret;
+
+    cq_engine_register(eng, WRID_CLASS_SEND, bench_retire, &tx);
+    start_time = gfp_get_time();
+    cpu_start = cpu_time_ns();
+    while (tx.retired < writes) {
+        uint64_t left = writes - tx.posted;
+        int n = left < BENCH_CHAIN ? left : BENCH_CHAIN;
+
+        if (n && tx.posted - tx.retired + n <= (uint64_t)depth) {
+            ret = post_chain(ib_res, mr, n);
+            if (ret) {
+                fprintf(stderr, "posting writes failed: %s\n", strerror(ret));
+                return -1;
+            }
+            tx.posted += n;
+            continue;
+        }
+        if (cq_engine_poll(eng) < 0 || eng->failed[WRID_CLASS_SEND])
+            return -1;
+    }
+    elapsed = gfp_get_time() - start_time;
+    cpu = cpu_time_ns() - cpu_start;
+    cq_engine_register(eng, WRID_CLASS_SEND, NULL, NULL);
+    printf("%-8s write: %.0f writes/s, %.1f cpu ns/write\n", post_api_str(ib_res->post_api),
+           writes * 1e9 / elapsed, (double)cpu / writes);
+    return 0;
+}
+
+static int run_bind_inv(struct ib_res *ib_res, struct ibv_mr *mr, int iters) {
+    struct ibv_mw_bind_info bind_info = {
+        .mr = mr,
+        .addr = (uintptr_t)mr->addr,
+        .length = PKTSZ,
+        .mw_access_flags = IBV_ACCESS_REMOTE_WRITE,
+    };
+    struct lat_stats bind, inv;
+    struct lat_summary sum;
+    struct ibv_mw *mw;
+    char label[32];
+    int ret = -1;
+
+    memset(&inv, 0, sizeof(inv));
+    if (lat_stats_init(&bind, iters) || lat_stats_init(&inv, iters))
+        goto cleanup;
+    mw = ibv_alloc_mw(ib_res->pd, IBV_MW_TYPE_2);
+    if (!mw) {
+        perror("ibv_alloc_mw");
+        goto cleanup;
+    }
+    for (int i = 0; i < iters; i++) {
+        long long t0 = gfp_get_time(), t1;
+
+        if (bind_mw_rkey(ib_res, mw, IBV_MW_TYPE_2, &bind_info))
+            break;
+        t1 = gfp_get_time();
+        if (post_local_inv(ib_res, ib_res->qp, mw->rkey, WRID(WRID_CLASS_INV, 0), 1) ||
+            cq_engine_wait(&ib_res->cq_eng, WRID_CLASS_INV, 1))
+            break;
+        lat_stats_add(&bind, t1 - t0);
+        lat_stats_add(&inv, gfp_get_time() - t1);
+    }
+    ibv_dealloc_mw(mw);
+    // An iteration that failed cut the loop short
+    if (inv.n < (size_t)iters)
+        goto cleanup;
+    lat_stats_summarize(&bind, &sum);
+    snprintf(label, sizeof(label), "%s bind", post_api_str(ib_res->post_api));
+    lat_summary_print(stdout, label, &sum);
+    lat_stats_summarize(&inv, &sum);
+    snprintf(label, sizeof(label), "%s local_inv", post_api_str(ib_res->post_api));
+    lat_summary_print(stdout, label, &sum);
+    ret = 0;
+
+cleanup:
+    lat_stats_free(&bind);
+    lat_stats_free(&inv);
+    return ret;
+}
+
+static int run_api(const struct ib_res *cfg, int api, uint64_t writes, int depth, int iters) {
+    struct ib_res ib_res = *cfg;
+    struct ibv_mr *mr = NULL;
+    char *buffer;
+    int ret = -1;
+
+    ib_res.post_api = api;
+    buffer = memalign(getpagesize(), PKTSZ);
+    if (!buffer) {
+        perror("memalign");
+        return -1;
+    }
+    memset(buffer, 0, PKTSZ);
+    if (prepare_ib_res(&ib_res)) {
+        perror("prepare_ib_res failed");
+        goto cleanup;
+    }
+    mr = ibv_reg_mr(ib_res.pd, buffer, PKTSZ,
+                    IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_MW_BIND);
+    if (!mr) {
+        perror("ibv_reg_mr");
+        goto cleanup;
+    }
+    // Loopback: the QP's peer is itself
+    if (connect_qp(&ib_res, &ib_res.local_info))
+        goto cleanup;
+    if (run_writes(&ib_res, mr, writes, depth) || run_bind_inv(&ib_res, mr, iters))
+        goto cleanup;
+    ret = 0;
+
+cleanup:
+    if (mr) ibv_dereg_mr(mr);
+    free(buffer);
+    free_ib_res(&ib_res);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    struct ib_res cfg;
+    uint64_t writes = 1000000;
+    int depth = 256, iters = 10000;
+    int only_api = -1;
+    int opt;
+
+    memset(&cfg, 0, sizeof(cfg));
+    while ((opt = getopt(argc, argv, "n:d:i:" IB_OPTSTRING)) != -1) {
+        switch (opt) {
+        case 'n':
+            writes = strtoull(optarg, NULL, 0);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'i':
+            iters = atoi(optarg);
+            break;
+        case 'V':
+            // Run one backend only instead of both
+            only_api = parse_post_api(optarg);
+            if (only_api < 0)
+                goto usage;
+            break;
+        default:
+            if (parse_ib_opt(&cfg, opt, optarg))
+                goto usage;
+        }
+    }
+    if (writes < 1 || iters < 1 || depth < BENCH_CHAIN || depth > MAX_SEND_WR) {
+        fprintf(stderr, "need writes, iters >= 1 and depth in [%d, %d]\n", BENCH_CHAIN, MAX_SEND_WR);
+        return -1;
+    }
+    // Only the data path is compared: no SRQ, busy-polled CQ
+    cfg.srq_depth = 0;
+    cfg.cq_mode = CQ_MODE_POLL;
+
+    for (int api = POST_API_LEGACY; api <= POST_API_EX; api++) {
+        if (only_api >= 0 && api != only_api)
+            continue;
+        if (run_api(&cfg, api, writes, depth, iters)) {
+            fprintf(stderr, "%s backend failed\n", post_api_str(api));
+            return -1;
+        }
+    }
+    return 0;
+
+usage:
+    fprintf(stderr, "Usage: %s [-n writes] [-d depth] [-i bind_iters] %s\n", argv[0], IB_OPTUSAGE);
+    return -1;
+}
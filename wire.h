@@ -0,0 +1,285 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+/*
+ * Control-plane wire format.
+ *
+ * Every message is a 12-byte header followed by `length` body bytes. All
+ * integers are big-endian at fixed offsets, nothing depends on the
+ * compiler's struct layout:
+ *
+ *   header  magic u32 | version u16 | type u16 | length u32
+ *   INFO    lid u16 | region_size u16 | qpn u32 | psn u32 | qkey u32 |
+ *           gid[16] | nregions u32 | nregions x region
+ *   region  addr u64 | length u64 | rkey u32 | access u32
+ *
+ * A receiver rejects another magic or major version. region_size lets a
+ * later version append fields to a region descriptor; readers skip what
+ * they do not know, as they do with body bytes after the region array.
+ * The region array is what makes advertising a pool of windows one
+ * message instead of one round trip per window.
+ */
+
+#define WIRE_MAGIC 0x47465057u      /* "GFPW" */
+#define WIRE_VERSION 1
+#define WIRE_HDR_SIZE 12
+#define WIRE_INFO_FIXED 36
+#define WIRE_REGION_SIZE 24
+#define WIRE_MAX_BODY (16u << 20)
+#define WIRE_MAX_REGIONS ((WIRE_MAX_BODY - WIRE_INFO_FIXED) / WIRE_REGION_SIZE)
+
+enum wire_type {
+    WIRE_MSG_INFO = 1,
+};
+
+struct wire_region {
+    uint64_t addr;
+    uint64_t length;
+    uint32_t rkey;
+    uint32_t access;            /* IBV_ACCESS_* the window grants */
+};
+
+// QP endpoint plus the regions it exposes, in host byte order
+struct wire_info {
+    uint16_t lid;
+    uint32_t qpn;
+    uint32_t psn;
+    uint32_t qkey;
+    uint8_t gid[16];
+    uint32_t nregions;
+    struct wire_region *regions;
+};
+
+static inline void wire_put16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline void wire_put32(uint8_t *p, uint32_t v) {
+    wire_put16(p, v >> 16);
+    wire_put16(p + 2, v);
+}
+
+static inline void wire_put64(uint8_t *p, uint64_t v) {
+    wire_put32(p, v >> 32);
+    wire_put32(p + 4, v);
+}
+
+static inline uint16_t wire_get16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t wire_get32(const uint8_t *p) {
+    return (uint32_t)wire_get16(p) << 16 | wire_get16(p + 2);
+}
+
+static inline uint64_t wire_get64(const uint8_t *p) {
+    return (uint64_t)wire_get32(p) << 32 | wire_get32(p + 4);
+}
+
+// One region descriptor, WIRE_REGION_SIZE bytes
+static inline void wire_put_region(uint8_t *p, const struct wire_region *r) {
+    wire_put64(p, r->addr);
+    wire_put64(p + 8, r->length);
+    wire_put32(p + 16, r->rkey);
+    wire_put32(p + 20, r->access);
+}
+
+static inline void wire_get_region(const uint8_t *p, struct wire_region *r) {
+    r->addr = wire_get64(p);
+    r->length = wire_get64(p + 8);
+    r->rkey = wire_get32(p + 16);
+    r->access = wire_get32(p + 20);
+}
+
+static inline size_t wire_info_size(uint32_t nregions) {
+    return WIRE_HDR_SIZE + WIRE_INFO_FIXED + (size_t)nregions * WIRE_REGION_SIZE;
+}
+
+// Header and INFO body into `buf` (wire_info_size() bytes); returns the size
+size_t wire_encode_info(const struct wire_info *info, uint8_t *buf) {
+    size_t size = wire_info_size(info->nregions);
+    uint8_t *p = buf + WIRE_HDR_SIZE;
+
+    wire_put32(buf, WIRE_MAGIC);
+    wire_put16(buf + 4, WIRE_VERSION);
+    wire_put16(buf + 6, WIRE_MSG_INFO);
+    wire_put32(buf + 8, size - WIRE_HDR_SIZE);
+    wire_put16(p, info->lid);
+    wire_put16(p + 2, WIRE_REGION_SIZE);
+    wire_put32(p + 4, info->qpn);
+    wire_put32(p + 8, info->psn);
+    wire_put32(p + 12, info->qkey);
+    memcpy(p + 16, info->gid, 16);
+    wire_put32(p + 32, info->nregions);
+    p += WIRE_INFO_FIXED;
+    for (uint32_t i = 0; i < info->nregions; i++, p += WIRE_REGION_SIZE) {
+        wire_put_region(p, &info->regions[i]);
+    }
+    return size;
+}
+
+// Validate a header; returns the body length or -1
+long wire_decode_hdr(const uint8_t *hdr, uint16_t type) {
+    uint32_t len = wire_get32(hdr + 8);
+
+    if (wire_get32(hdr) != WIRE_MAGIC) {
+        fprintf(stderr, "wire: bad magic %#x\n", wire_get32(hdr));
+        return -1;
+    }
+    if (wire_get16(hdr + 4) != WIRE_VERSION) {
+        fprintf(stderr, "wire: version %u, expected %u\n", wire_get16(hdr + 4), WIRE_VERSION);
+        return -1;
+    }
+    if (wire_get16(hdr + 6) != type) {
+        fprintf(stderr, "wire: message type %u, expected %u\n", wire_get16(hdr + 6), type);
+        return -1;
+    }
+    if (len > WIRE_MAX_BODY) {
+        fprintf(stderr, "wire: %u byte body exceeds %u\n", len, WIRE_MAX_BODY);
+        return -1;
+    }
+    return len;
+}
+
+/*
+ * Parse an INFO body of `len` bytes. info->regions is allocated (NULL if
+ * there are none); release it with wire_info_free(). Returns 0 or -1.
+ */
+int wire_decode_info(const uint8_t *body, size_t len, struct wire_info *info) {
+    uint16_t region_size;
+    const uint8_t *p;
+
+    memset(info, 0, sizeof(*info));
+    if (len < WIRE_INFO_FIXED) {
+        fprintf(stderr, "wire: %zu byte INFO body is truncated\n", len);
+        return -1;
+    }
+    info->lid = wire_get16(body);
+    region_size = wire_get16(body + 2);
+    info->qpn = wire_get32(body + 4);
+    info->psn = wire_get32(body + 8);
+    info->qkey = wire_get32(body + 12);
+    memcpy(info->gid, body + 16, 16);
+    info->nregions = wire_get32(body + 32);
+    if (region_size < WIRE_REGION_SIZE ||
+        info->nregions > (len - WIRE_INFO_FIXED) / region_size) {
+        fprintf(stderr, "wire: %u regions of %u bytes do not fit a %zu byte body\n",
+                info->nregions, region_size, len);
+        info->nregions = 0;
+        return -1;
+    }
+    if (info->nregions == 0)
+        return 0;
+    info->regions = malloc(info->nregions * sizeof(*info->regions));
+    if (!info->regions) {
+        perror("malloc");
+        info->nregions = 0;
+        return -1;
+    }
+    p = body + WIRE_INFO_FIXED;
+    for (uint32_t i = 0; i < info->nregions; i++, p += region_size) {
+        wire_get_region(p, &info->regions[i]);
+    }
+    return 0;
+}
+
+void wire_info_free(struct wire_info *info) {
+    free(info->regions);
+    info->regions = NULL;
+    info->nregions = 0;
+}
+
+// Blocking socket I/O that only returns once all `len` bytes went through
+int wire_send_all(int fd, const void *buf, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = send(fd, (const char *)buf + done, len - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            perror("send");
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+int wire_recv_all(int fd, void *buf, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = recv(fd, (char *)buf + done, len - done, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0)
+                fprintf(stderr, "peer closed the connection\n");
+            else
+                perror("recv");
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+// The whole message goes out with one send_all, however many regions it has
+int wire_send_info(int fd, const struct wire_info *info) {
+    uint8_t stack[WIRE_HDR_SIZE + WIRE_INFO_FIXED + 4 * WIRE_REGION_SIZE];
+    uint8_t *buf;
+    size_t size;
+    int ret;
+
+    if (info->nregions > WIRE_MAX_REGIONS) {
+        fprintf(stderr, "wire: %u regions, at most %u fit a message\n", info->nregions,
+                (unsigned)WIRE_MAX_REGIONS);
+        return -1;
+    }
+    size = wire_info_size(info->nregions);
+    buf = size <= sizeof(stack) ? stack : malloc(size);
+    if (!buf) {
+        perror("malloc");
+        return -1;
+    }
+    wire_encode_info(info, buf);
+    ret = wire_send_all(fd, buf, size);
+    if (buf != stack)
+        free(buf);
+    return ret;
+}
+
+int wire_recv_info(int fd, struct wire_info *info) {
+    uint8_t hdr[WIRE_HDR_SIZE];
+    uint8_t *body;
+    long len;
+    int ret;
+
+    memset(info, 0, sizeof(*info));
+    if (wire_recv_all(fd, hdr, sizeof(hdr)))
+        return -1;
+    len = wire_decode_hdr(hdr, WIRE_MSG_INFO);
+    if (len < 0)
+        return -1;
+    body = malloc(len ? len : 1);
+    if (!body) {
+        perror("malloc");
+        return -1;
+    }
+    ret = wire_recv_all(fd, body, len);
+    if (ret == 0)
+        ret = wire_decode_info(body, len, info);
+    free(body);
+    return ret;
+}
+
+#endif /* WIRE_H */